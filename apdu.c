@@ -0,0 +1,367 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_TRANSPORT
+
+#include "apdu.h"
+#include "context.h"
+#include "logging.h"
+#include "recovery.h"
+#include "ticks.h"
+
+#include <string.h>
+
+#include <winscard.h>
+
+// bIns is that of the command being sent, which a chained block or GET
+// RESPONSE is part of; the trace redacts by it.
+static DWORD transmit_raw(PCARD_DATA pCardData, BYTE bIns, const BYTE *pbCmd, DWORD cbCmd, BYTE *pbResp,
+                          DWORD *pcbResp) {
+  LONG lRet = SCardTransmit(pCardData->hScard, SCARD_PCI_T1, pbCmd, cbCmd, NULL, pbResp, pcbResp);
+  if (lRet != SCARD_S_SUCCESS) {
+    CMD_ERROR("SCardTransmit failed with %x\n", lRet);
+    return (DWORD)lRet;
+  }
+  CMD_TRACE_APDU(bIns, pbCmd, cbCmd, pbResp, *pcbResp);
+  if (*pcbResp < 2) {
+    CMD_ERROR("Response too short (%d bytes)\n", *pcbResp);
+    return SCARD_E_COMM_DATA_LOST;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_apdu_transmit(PCARD_DATA pCardData, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2, const BYTE *pbData,
+                        DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw) {
+  return cmd_apdu_transmit_until(pCardData, bCla, bIns, bP1, bP2, pbData, cbData, pbResp, pcbResp, pwSw, NULL, NULL);
+}
+
+// Append Le to a command; extended Le needs the extended length marker
+// unless an extended Lc already carries it.
+static DWORD put_le(BYTE *pbCmd, DWORD cbLe, BOOL fExtendedLc) {
+  DWORD cb = 0;
+  if (cbLe <= CMD_APDU_MAX_SHORT_RESP) {
+    pbCmd[cb++] = (BYTE)cbLe;
+    return cb;
+  }
+  if (!fExtendedLc) {
+    pbCmd[cb++] = 0x00;
+  }
+  pbCmd[cb++] = (BYTE)(cbLe >> 8);
+  pbCmd[cb++] = (BYTE)cbLe;
+  return cb;
+}
+
+// cbLe is the Le of every response round trip; above 256 the last command
+// block and GET RESPONSE use extended length. cmd and resp are the staging
+// buffers of CMD_APDU_CMD_LEN and CMD_APDU_RESP_LEN bytes.
+static DWORD transmit_staged(PCARD_DATA pCardData, DWORD cbLe, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2,
+                             const BYTE *pbData, DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw,
+                             CMD_APDU_DONE_FN pfnDone, void *pvArg, BYTE *cmd, BYTE *resp) {
+  DWORD cbResp, cbOut = 0, cbCap = pbResp ? *pcbResp : 0;
+  BOOL fExtended = cbLe > CMD_APDU_MAX_SHORT_RESP;
+  DWORD dwRet;
+  WORD sw;
+
+  // command chaining: every block but the last carries the chaining bit
+  for (;;) {
+    DWORD chunk = cbData > CMD_APDU_MAX_SHORT_DATA ? CMD_APDU_MAX_SHORT_DATA : cbData;
+    BOOL last = chunk == cbData;
+    DWORD cbCmd = 0;
+
+    cmd[cbCmd++] = last ? bCla : (BYTE)(bCla | CMD_APDU_CLA_CHAINING);
+    cmd[cbCmd++] = bIns;
+    cmd[cbCmd++] = bP1;
+    cmd[cbCmd++] = bP2;
+    if (chunk > 0) {
+      if (last && pbResp && fExtended) {
+        cmd[cbCmd++] = 0x00;
+        cmd[cbCmd++] = 0x00;
+      }
+      cmd[cbCmd++] = (BYTE)chunk;
+      memcpy(cmd + cbCmd, pbData, chunk);
+      cbCmd += chunk;
+    }
+    if (last && pbResp) {
+      cbCmd += put_le(cmd + cbCmd, fExtended ? cbLe : 0, chunk > 0);
+    }
+
+    cbResp = CMD_APDU_RESP_LEN;
+    dwRet = transmit_raw(pCardData, bIns, cmd, cbCmd, resp, &cbResp);
+    if (dwRet != SCARD_S_SUCCESS) {
+      return dwRet;
+    }
+    sw = (WORD)((resp[cbResp - 2] << 8) | resp[cbResp - 1]);
+    if (last) {
+      break;
+    }
+    if (sw != CMD_SW_OK) {
+      CMD_ERROR("Chained command %02X failed with SW %04X\n", bIns, sw);
+      *pwSw = sw;
+      return SCARD_S_SUCCESS;
+    }
+    pbData += chunk;
+    cbData -= chunk;
+  }
+
+  // response chaining
+  for (;;) {
+    DWORD cbChunk = cbResp - 2;
+    if (cbChunk > 0 && pbResp) {
+      if (cbOut + cbChunk > cbCap) {
+        CMD_ERROR("Response of %02X exceeds buffer of %d bytes\n", bIns, cbCap);
+        return SCARD_E_INSUFFICIENT_BUFFER;
+      }
+      memcpy(pbResp + cbOut, resp, cbChunk);
+    }
+    cbOut += cbChunk;
+
+    if ((sw >> 8) != CMD_SW_MORE_DATA) {
+      break;
+    }
+    if (pfnDone && pbResp && pfnDone(pbResp, cbOut, pvArg)) {
+      CMD_DEBUG("Stopped reading response of %02X after %d bytes\n", bIns, cbOut);
+      sw = CMD_SW_OK;
+      break;
+    }
+    cmd[0] = 0x00;
+    cmd[1] = CMD_APDU_INS_GET_RESPONSE;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+    DWORD cbCmd = 4 + put_le(cmd + 4, fExtended ? cbLe : (BYTE)sw, FALSE);
+    cbResp = CMD_APDU_RESP_LEN;
+    dwRet = transmit_raw(pCardData, bIns, cmd, cbCmd, resp, &cbResp);
+    if (dwRet != SCARD_S_SUCCESS) {
+      return dwRet;
+    }
+    sw = (WORD)((resp[cbResp - 2] << 8) | resp[cbResp - 1]);
+  }
+
+  CMD_DEBUG("APDU %02X %02X %02X %02X returned %d bytes with SW %04X\n", bCla, bIns, bP1, bP2, cbOut, sw);
+  if (pcbResp) {
+    *pcbResp = pbResp ? cbOut : 0;
+  }
+  *pwSw = sw;
+  return SCARD_S_SUCCESS;
+}
+
+// The staging buffers see PINs and agreed secrets in the clear, so they are
+// taken from the locked memory of the context, which wipes them on release.
+// Commands are serialized by the card transaction, so one pair is enough.
+static DWORD transmit_command(PCARD_DATA pCardData, DWORD cbLe, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2,
+                              const BYTE *pbData, DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw,
+                              CMD_APDU_DONE_FN pfnDone, void *pvArg) {
+  CMD_SECMEM *pSecure = CMD_CONTEXT_OF(pCardData)->pSecure;
+  BYTE *cmd = (BYTE *)cmd_secmem_acquire_span(pSecure, CMD_APDU_CMD_LEN);
+  BYTE *resp = (BYTE *)cmd_secmem_acquire_span(pSecure, CMD_APDU_RESP_LEN);
+  DWORD dwRet = SCARD_E_NO_MEMORY;
+
+  if (cmd && resp) {
+    dwRet = transmit_staged(pCardData, cbLe, bCla, bIns, bP1, bP2, pbData, cbData, pbResp, pcbResp, pwSw, pfnDone,
+                            pvArg, cmd, resp);
+  } else {
+    CMD_ERROR("No locked memory left to stage command %02X\n", bIns);
+  }
+  cmd_secmem_release_span(pSecure, resp, CMD_APDU_RESP_LEN);
+  cmd_secmem_release_span(pSecure, cmd, CMD_APDU_CMD_LEN);
+  return dwRet;
+}
+
+DWORD cmd_sw_to_error(WORD wSw) {
+  if (wSw == CMD_SW_OK) {
+    return SCARD_S_SUCCESS;
+  }
+  if ((wSw & 0xFFF0) == CMD_SW_VERIFY_FAIL) {
+    return (wSw & 0x000F) ? SCARD_W_WRONG_CHV : SCARD_W_CHV_BLOCKED;
+  }
+  switch (wSw) {
+  case CMD_SW_AUTH_BLOCKED:
+    return SCARD_W_CHV_BLOCKED;
+  case CMD_SW_SECURITY_NOT_SATISFIED:
+    return SCARD_W_SECURITY_VIOLATION;
+  case CMD_SW_FILE_NOT_FOUND:
+  case CMD_SW_REF_NOT_FOUND:
+    return SCARD_E_FILE_NOT_FOUND;
+  case CMD_SW_INS_NOT_SUPPORTED:
+    return SCARD_E_UNSUPPORTED_FEATURE;
+  default:
+    CMD_WARN("Unexpected SW %04X\n", wSw);
+    return SCARD_E_UNEXPECTED;
+  }
+}
+
+// A reset loses any chaining state on the card, so after reconnecting the
+// whole command is sent again. Commands that need the PIN then fail with
+// SCARD_W_SECURITY_VIOLATION, and the CSP authenticates again from its cache.
+DWORD cmd_apdu_transmit_sized(PCARD_DATA pCardData, DWORD cbChunk, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2,
+                              const BYTE *pbData, DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw,
+                              CMD_APDU_DONE_FN pfnDone, void *pvArg) {
+  DWORD dwRet = transmit_command(pCardData, cbChunk, bCla, bIns, bP1, bP2, pbData, cbData, pbResp, pcbResp, pwSw,
+                                 pfnDone, pvArg);
+  if (!cmd_recovery_needed(dwRet) || CMD_CONTEXT_OF(pCardData)->fRecovering) {
+    return dwRet;
+  }
+  dwRet = cmd_recovery_reconnect(pCardData);
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_recovery_verify(pCardData);
+  }
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  return transmit_command(pCardData, cbChunk, bCla, bIns, bP1, bP2, pbData, cbData, pbResp, pcbResp, pwSw, pfnDone,
+                          pvArg);
+}
+
+// Full reads use the chunk size calibrated for the reader. Prefix reads stay
+// at 256 bytes so that they can stop early.
+DWORD cmd_apdu_transmit_until(PCARD_DATA pCardData, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2, const BYTE *pbData,
+                              DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw, CMD_APDU_DONE_FN pfnDone,
+                              void *pvArg) {
+  DWORD cbChunk = CMD_CONTEXT_OF(pCardData)->cbRespChunk;
+  if (pfnDone || cbChunk == 0) {
+    cbChunk = CMD_APDU_MAX_SHORT_RESP;
+  }
+  return cmd_apdu_transmit_sized(pCardData, cbChunk, bCla, bIns, bP1, bP2, pbData, cbData, pbResp, pcbResp, pwSw,
+                                 pfnDone, pvArg);
+}
+
+static void end_held_transaction(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  pContext->fTransactionHeld = FALSE;
+  LONG lRet = SCardEndTransaction(pCardData->hScard, SCARD_LEAVE_CARD);
+  if (lRet != SCARD_S_SUCCESS) {
+    CMD_WARN("SCardEndTransaction failed with %x\n", lRet);
+  }
+}
+
+static void arm_idle_timer(PTP_TIMER pTimer, DWORD dwMs) {
+  ULARGE_INTEGER due;
+  FILETIME ftDue;
+
+  // negative due times are relative, in 100 ns units
+  due.QuadPart = (ULONGLONG)(-(LONGLONG)dwMs * 10000);
+  ftDue.dwLowDateTime = due.u.LowPart;
+  ftDue.dwHighDateTime = due.u.HighPart;
+  SetThreadpoolTimer(pTimer, &ftDue, 0, 0);
+}
+
+static VOID CALLBACK release_idle_transaction(PTP_CALLBACK_INSTANCE pInstance, PVOID pvContext, PTP_TIMER pTimer) {
+  PCARD_DATA pCardData = (PCARD_DATA)pvContext;
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  (void)pInstance;
+  CMD_BEGIN_CALL(pCardData);
+  EnterCriticalSection(&pContext->csCard);
+  if (pContext->fTransactionHeld && pContext->dwTransactionDepth == 0) {
+    // a call may have used the transaction while this callback waited for
+    // csCard, starting a new idle period
+    ULONGLONG ullIdleMs = cmd_ticks_to_us(cmd_ticks() - pContext->ullTransactionIdle) / 1000;
+    if (ullIdleMs >= CMD_TRANSACTION_IDLE_MS) {
+      end_held_transaction(pCardData);
+    } else {
+      arm_idle_timer(pTimer, CMD_TRANSACTION_IDLE_MS - (DWORD)ullIdleMs);
+    }
+  }
+  LeaveCriticalSection(&pContext->csCard);
+}
+
+// Keep the transaction for CMD_TRANSACTION_IDLE_MS, re-arming the timer if it
+// is pending, but not past CMD_TRANSACTION_MAX_HOLD_MS after it began. Must be
+// called in csCard.
+static BOOL hold_transaction(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  if (CMD_TRANSACTION_IDLE_MS == 0) {
+    return FALSE;
+  }
+  pContext->ullTransactionIdle = cmd_ticks();
+  ULONGLONG ullHeldMs = cmd_ticks_to_us(pContext->ullTransactionIdle - pContext->ullTransactionBegun) / 1000;
+  if (ullHeldMs + CMD_TRANSACTION_IDLE_MS > CMD_TRANSACTION_MAX_HOLD_MS) {
+    CMD_DEBUG("Card transaction held for %llu ms, giving it up\n", ullHeldMs);
+    return FALSE;
+  }
+  if (pContext->pTransactionTimer == NULL) {
+    pContext->pTransactionTimer = CreateThreadpoolTimer(release_idle_transaction, pCardData, NULL);
+    if (pContext->pTransactionTimer == NULL) {
+      return FALSE;
+    }
+  }
+  arm_idle_timer(pContext->pTransactionTimer, CMD_TRANSACTION_IDLE_MS);
+  return TRUE;
+}
+
+// The prefetch worker shares the card handle with the caller's thread. Both
+// take csCard around a card transaction; the worker only when nobody else is
+// waiting for it, so a caller never waits for more than one unit of its work.
+// A transaction left open by the previous call is reused.
+DWORD cmd_begin_transaction(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  // a nested call already holds csCard, even on the worker with callers waiting
+  if (pContext->dwTransactionOwner == GetCurrentThreadId()) {
+    EnterCriticalSection(&pContext->csCard);
+    pContext->dwTransactionDepth++;
+    return SCARD_S_SUCCESS;
+  }
+  if (pContext->prefetch.dwThreadId == GetCurrentThreadId()) {
+    if (pContext->lForegroundWaiting > 0 || !TryEnterCriticalSection(&pContext->csCard)) {
+      return SCARD_E_TIMEOUT;
+    }
+  } else {
+    InterlockedIncrement(&pContext->lForegroundWaiting);
+    EnterCriticalSection(&pContext->csCard);
+    InterlockedDecrement(&pContext->lForegroundWaiting);
+  }
+
+  if (pContext->fTransactionHeld) {
+    pContext->dwTransactionDepth = 1;
+    pContext->dwTransactionOwner = GetCurrentThreadId();
+    return SCARD_S_SUCCESS;
+  }
+  LONG lRet = SCardBeginTransaction(pCardData->hScard);
+  if (cmd_recovery_needed((DWORD)lRet) && cmd_recovery_reconnect(pCardData) == SCARD_S_SUCCESS) {
+    lRet = SCardBeginTransaction(pCardData->hScard);
+  }
+  if (lRet != SCARD_S_SUCCESS) {
+    CMD_ERROR("SCardBeginTransaction failed with %x\n", lRet);
+    LeaveCriticalSection(&pContext->csCard);
+    return (DWORD)lRet;
+  }
+  pContext->fTransactionHeld = TRUE;
+  pContext->dwTransactionDepth = 1;
+  pContext->dwTransactionOwner = GetCurrentThreadId();
+  pContext->ullTransactionBegun = cmd_ticks();
+  pContext->dwTransactionsBegun++;
+
+  DWORD dwRet = cmd_recovery_verify(pCardData);
+  if (dwRet != SCARD_S_SUCCESS) {
+    cmd_end_transaction(pCardData);
+  }
+  return dwRet;
+}
+
+void cmd_end_transaction(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  if (--pContext->dwTransactionDepth == 0) {
+    pContext->dwTransactionOwner = 0;
+    if (!hold_transaction(pCardData)) {
+      end_held_transaction(pCardData);
+    }
+  }
+  LeaveCriticalSection(&pContext->csCard);
+}
+
+void cmd_release_transaction(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  // ended first, so that a callback already running does not re-arm the timer
+  EnterCriticalSection(&pContext->csCard);
+  if (pContext->fTransactionHeld && pContext->dwTransactionDepth == 0) {
+    end_held_transaction(pCardData);
+  }
+  LeaveCriticalSection(&pContext->csCard);
+  if (pContext->pTransactionTimer) {
+    SetThreadpoolTimer(pContext->pTransactionTimer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(pContext->pTransactionTimer, TRUE);
+    CloseThreadpoolTimer(pContext->pTransactionTimer);
+    pContext->pTransactionTimer = NULL;
+  }
+}
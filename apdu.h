@@ -0,0 +1,73 @@
+#pragma once
+#ifndef __APDU__H__
+#define __APDU__H__
+
+#include "cardmod.h"
+
+#define CMD_APDU_MAX_SHORT_DATA 255
+#define CMD_APDU_MAX_SHORT_RESP 256
+#define CMD_APDU_MAX_EXT_RESP 2048
+#define CMD_APDU_CLA_CHAINING 0x10
+#define CMD_APDU_INS_GET_RESPONSE 0xC0
+// Staging buffers of a command block and a response, both in locked memory
+#define CMD_APDU_CMD_LEN (7 + CMD_APDU_MAX_SHORT_DATA + 2)
+#define CMD_APDU_RESP_LEN (CMD_APDU_MAX_EXT_RESP + 2)
+
+#define CMD_SW_OK 0x9000
+#define CMD_SW_MORE_DATA 0x61
+#define CMD_SW_VERIFY_FAIL 0x63C0
+#define CMD_SW_SECURITY_NOT_SATISFIED 0x6982
+#define CMD_SW_AUTH_BLOCKED 0x6983
+#define CMD_SW_FILE_NOT_FOUND 0x6A82
+#define CMD_SW_REF_NOT_FOUND 0x6A88
+#define CMD_SW_INS_NOT_SUPPORTED 0x6D00
+
+// Send a command to the card, using command chaining when cbData does not fit
+// into a short APDU and collecting 61xx continuations with GET RESPONSE.
+// pbResp may be NULL if the caller is not interested in response data;
+// otherwise *pcbResp is its capacity on input and the data length on output.
+DWORD cmd_apdu_transmit(PCARD_DATA pCardData, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2, const BYTE *pbData,
+                        DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw);
+
+// Called after each response chunk with the data received so far; return
+// TRUE to stop collecting further 61xx continuations.
+typedef BOOL (*CMD_APDU_DONE_FN)(const BYTE *pbResp, DWORD cbResp, void *pvArg);
+
+// Like cmd_apdu_transmit, but stop early once pfnDone is satisfied. The
+// status word is then reported as 9000 and the remaining response is
+// discarded by the card on the next command.
+DWORD cmd_apdu_transmit_until(PCARD_DATA pCardData, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2, const BYTE *pbData,
+                              DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw, CMD_APDU_DONE_FN pfnDone,
+                              void *pvArg);
+
+// Like cmd_apdu_transmit_until, with an explicit Le for each response round
+// trip. Above CMD_APDU_MAX_SHORT_RESP (up to CMD_APDU_MAX_EXT_RESP) extended
+// length APDUs are used.
+DWORD cmd_apdu_transmit_sized(PCARD_DATA pCardData, DWORD cbChunk, BYTE bCla, BYTE bIns, BYTE bP1, BYTE bP2,
+                              const BYTE *pbData, DWORD cbData, BYTE *pbResp, DWORD *pcbResp, WORD *pwSw,
+                              CMD_APDU_DONE_FN pfnDone, void *pvArg);
+
+// Map a status word other than 9000 to a SCARD error code.
+DWORD cmd_sw_to_error(WORD wSw);
+
+// Milliseconds a card transaction is kept open after cmd_end_transaction, so
+// that a burst of Card* calls pays for SCardBeginTransaction only once. Other
+// processes wait at most this long for the card; 0 disables the reuse.
+#ifndef CMD_TRANSACTION_IDLE_MS
+#define CMD_TRANSACTION_IDLE_MS 50
+#endif
+
+// Milliseconds a reused transaction may stay open in total. Nothing tells
+// whether another process is waiting for the card, so a steady stream of
+// calls gives it up this often anyway.
+#ifndef CMD_TRANSACTION_MAX_HOLD_MS
+#define CMD_TRANSACTION_MAX_HOLD_MS 1000
+#endif
+
+DWORD cmd_begin_transaction(PCARD_DATA pCardData);
+void cmd_end_transaction(PCARD_DATA pCardData);
+// End a transaction kept open for the idle window right away. Must be called
+// before the card handle goes away.
+void cmd_release_transaction(PCARD_DATA pCardData);
+
+#endif // __APDU__H__
@@ -0,0 +1,78 @@
+#include "arena.h"
+#include "logging.h"
+
+// Fiber-local slot holding the arena of each thread. Unlike a thread_local
+// arena, it costs nothing on threads that never enter the driver, and the
+// callback frees the arena when its thread exits.
+static DWORD g_dwSlot = FLS_OUT_OF_INDEXES;
+static INIT_ONCE g_once = INIT_ONCE_STATIC_INIT;
+
+static VOID CALLBACK free_arena(PVOID pv) {
+  if (pv) {
+    HeapFree(GetProcessHeap(), 0, pv);
+  }
+}
+
+static BOOL CALLBACK alloc_slot(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+  g_dwSlot = FlsAlloc(free_arena);
+  return TRUE;
+}
+
+PCMD_ARENA cmd_arena_of(PCARD_DATA pCardData) {
+  (void)pCardData;
+  InitOnceExecuteOnce(&g_once, alloc_slot, NULL, NULL);
+  if (g_dwSlot == FLS_OUT_OF_INDEXES) {
+    return NULL;
+  }
+  PCMD_ARENA pArena = (PCMD_ARENA)FlsGetValue(g_dwSlot);
+  if (pArena) {
+    return pArena;
+  }
+  pArena = (PCMD_ARENA)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(CMD_ARENA));
+  if (pArena && !FlsSetValue(g_dwSlot, pArena)) {
+    HeapFree(GetProcessHeap(), 0, pArena);
+    pArena = NULL;
+  }
+  if (!pArena) {
+    CMD_ERROR("Failed to allocate the scratch arena of thread %d\n", GetCurrentThreadId());
+  }
+  return pArena;
+}
+
+void *cmd_arena_alloc(PCMD_ARENA pArena, DWORD cb) {
+  DWORD cbAligned = (cb + CMD_ARENA_ALIGN - 1) & ~(DWORD)(CMD_ARENA_ALIGN - 1);
+
+  if (!pArena) {
+    return NULL;
+  }
+  if (cbAligned < cb || cbAligned > CMD_ARENA_SIZE - pArena->cbUsed) {
+    CMD_ERROR("Scratch arena exhausted: %d bytes requested, %d in use\n", cb, pArena->cbUsed);
+    pArena->cFailures++;
+    return NULL;
+  }
+  void *pv = pArena->u.rgb + pArena->cbUsed;
+  pArena->cbUsed += cbAligned;
+  if (pArena->cbUsed > pArena->cbPeak) {
+    pArena->cbPeak = pArena->cbUsed;
+  }
+  pArena->cAllocs++;
+  return pv;
+}
+
+DWORD cmd_arena_mark(const CMD_ARENA *pArena) {
+  return pArena ? pArena->cbUsed : 0;
+}
+
+void cmd_arena_release(PCMD_ARENA pArena, DWORD dwMark) {
+  if (pArena) {
+    pArena->cbUsed = dwMark;
+  }
+}
+
+void cmd_arena_shutdown(void) {
+  // runs the callback for the arena of every thread still alive
+  if (g_dwSlot != FLS_OUT_OF_INDEXES) {
+    FlsFree(g_dwSlot);
+    g_dwSlot = FLS_OUT_OF_INDEXES;
+  }
+}
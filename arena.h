@@ -0,0 +1,45 @@
+#pragma once
+#ifndef __ARENA__H__
+#define __ARENA__H__
+
+#include "cardmod.h"
+#include "piv.h"
+
+// Scratch memory for data objects, TLV and APDU buffers that never leave the
+// driver. pfnCspAlloc is reserved for memory handed back to the CSP.
+// Allocation bumps a pointer; callers take a mark first and release back to
+// it when they are done, so the arena is empty between calls.
+#define CMD_ARENA_SIZE (4 * CMD_PIV_MAX_OBJECT_LEN)
+// Allocations are rounded to the alignment the heap guarantees (16 bytes on
+// 64-bit Windows, 8 on 32-bit), which the arena itself is allocated with.
+#define CMD_ARENA_ALIGN MEMORY_ALLOCATION_ALIGNMENT
+
+typedef struct _CMD_ARENA {
+  DWORD cbUsed;
+  // Instrumentation of the thread, not of any one context
+  DWORD cbPeak;
+  DWORD cAllocs;
+  DWORD cFailures;
+  // four DWORDs above keep the buffer at the heap alignment; the union
+  // keeps it at least 8-byte aligned should a field be added
+  union {
+    ULONGLONG ullAlign;
+    BYTE rgb[CMD_ARENA_SIZE];
+  } u;
+} CMD_ARENA, *PCMD_ARENA;
+
+// The arena of the calling thread. Every thread that enters the driver (the
+// caller's threads, the prefetch worker, the signing pool workers) gets its
+// own on first use, so scratch memory is never shared, whatever context the
+// call is for; it is freed when the thread exits. NULL if it could not be
+// allocated, in which case every allocation below fails.
+PCMD_ARENA cmd_arena_of(PCARD_DATA pCardData);
+// Returns NULL once the arena is exhausted.
+void *cmd_arena_alloc(PCMD_ARENA pArena, DWORD cb);
+DWORD cmd_arena_mark(const CMD_ARENA *pArena);
+void cmd_arena_release(PCMD_ARENA pArena, DWORD dwMark);
+
+// Free the arenas of all threads; called when the DLL is unloaded.
+void cmd_arena_shutdown(void);
+
+#endif // __ARENA__H__
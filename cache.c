@@ -0,0 +1,156 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_CACHE
+
+#include "cache.h"
+#include "cardid.h"
+#include "context.h"
+#include "crc32.h"
+#include "image.h"
+#include "logging.h"
+#include "shm.h"
+
+#include <string.h>
+
+#define CMD_CACHE_SECTION_NAME "CanoKeyMinidriverCache"
+// Card images are only kept if an administrator created this directory. It
+// must not be writable by users, as its content is trusted by every process.
+#define CMD_CACHE_IMAGE_DIR "%ProgramData%\\CanoKey\\MinidriverCache"
+
+static CMD_SHM_CACHE *volatile g_shm_cache;
+static char g_image_dir[MAX_PATH];
+static BOOL g_image_enabled;
+static volatile LONG g_init_state; // 0: not initialized, 1: initializing, 2: done
+
+static BOOL init_once(void) {
+  if (g_init_state == 2) {
+    return TRUE;
+  }
+  if (InterlockedCompareExchange(&g_init_state, 1, 0) != 0) {
+    // another thread is initializing; skip the caches this time
+    return FALSE;
+  }
+  g_shm_cache = cmd_shm_open(CMD_CACHE_SECTION_NAME);
+  if (!g_shm_cache) {
+    CMD_WARN("Shared cache unavailable, continuing without it\n");
+  }
+  DWORD cch = ExpandEnvironmentStringsA(CMD_CACHE_IMAGE_DIR, g_image_dir, sizeof(g_image_dir));
+  DWORD dwAttr = cch && cch <= sizeof(g_image_dir) ? GetFileAttributesA(g_image_dir) : INVALID_FILE_ATTRIBUTES;
+  g_image_enabled = dwAttr != INVALID_FILE_ATTRIBUTES && (dwAttr & FILE_ATTRIBUTE_DIRECTORY);
+  if (g_image_enabled) {
+    CMD_INFO("Card images are kept in %s\n", g_image_dir);
+  }
+  InterlockedExchange(&g_init_state, 2);
+  return TRUE;
+}
+
+// Cards without a serial number cannot be told apart and are never cached.
+static const CMD_CARD_ID *get_card_id(PCARD_DATA pCardData) {
+  const CMD_CARD_ID *pId;
+  if (cmd_card_id_get(pCardData, &pId) != SCARD_S_SUCCESS || pId->cbSerial == 0 ||
+      pId->cbSerial > CMD_SHM_MAX_SERIAL || pId->cbSerial > CMD_IMAGE_MAX_SERIAL) {
+    return NULL;
+  }
+  return pId;
+}
+
+// Shared entries and image records are keyed by the content stamp of their
+// container, or a digest of all of them for cmapfile. Fails while the stamps
+// are unknown, as nothing then proves the data is still on the card.
+static BOOL get_stamp(PCARD_DATA pCardData, BYTE bType, BYTE bIndex, uint32_t *pStamp) {
+  const CMD_STAMPS *pStamps = &CMD_CONTEXT_OF(pCardData)->stamps;
+
+  if (!pStamps->fValid) {
+    return FALSE;
+  }
+  if (bType == CMD_CACHE_TYPE_CMAPFILE) {
+    *pStamp = cmd_crc32((const uint8_t *)pStamps->rgdwContainers, sizeof(pStamps->rgdwContainers));
+    return TRUE;
+  }
+  if (bIndex < CMD_PIV_NUM_SLOTS) {
+    *pStamp = pStamps->rgdwContainers[bIndex];
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static BOOL make_shm_key(PCARD_DATA pCardData, const CMD_CARD_ID *pId, BYTE bType, BYTE bIndex, uint32_t stamp,
+                         CMD_SHM_KEY *pKey) {
+  if (pCardData->cbAtr > CMD_SHM_MAX_ATR) {
+    return FALSE;
+  }
+  memset(pKey, 0, sizeof(*pKey));
+  memcpy(pKey->serial, pId->rgbSerial, pId->cbSerial);
+  pKey->serial_len = (uint8_t)pId->cbSerial;
+  memcpy(pKey->atr, pCardData->pbAtr, pCardData->cbAtr);
+  pKey->atr_len = (uint8_t)pCardData->cbAtr;
+  pKey->type = bType;
+  pKey->index = bIndex;
+  pKey->stamp = stamp;
+  return TRUE;
+}
+
+static void make_image_id(const CMD_CARD_ID *pId, CMD_IMAGE_ID *pImageId) {
+  memset(pImageId, 0, sizeof(*pImageId));
+  memcpy(pImageId->serial, pId->rgbSerial, pId->cbSerial);
+  pImageId->serial_len = (uint8_t)pId->cbSerial;
+  pImageId->chuid_crc = pId->dwChuidCrc;
+}
+
+BOOL cmd_cache_get(PCARD_DATA pCardData, BYTE bType, BYTE bIndex, BYTE *pbData, DWORD *pcbData) {
+  const CMD_CARD_ID *pId;
+  CMD_SHM_KEY key;
+  uint32_t stamp;
+  size_t len = *pcbData;
+
+  if (!init_once() || (pId = get_card_id(pCardData)) == NULL || !get_stamp(pCardData, bType, bIndex, &stamp)) {
+    return FALSE;
+  }
+
+  BOOL fShm = g_shm_cache && make_shm_key(pCardData, pId, bType, bIndex, stamp, &key);
+  if (fShm && cmd_shm_get(g_shm_cache, &key, pbData, &len)) {
+    CMD_DEBUG("Shared cache hit for type %d index %d, %d bytes\n", bType, bIndex, (DWORD)len);
+    *pcbData = (DWORD)len;
+    return TRUE;
+  }
+
+  if (g_image_enabled) {
+    CMD_IMAGE_ID imageId;
+    make_image_id(pId, &imageId);
+    len = *pcbData;
+    if (cmd_image_read(g_image_dir, &imageId, bType, bIndex, stamp, pbData, &len)) {
+      CMD_DEBUG("Card image hit for type %d index %d, %d bytes\n", bType, bIndex, (DWORD)len);
+      if (fShm) {
+        cmd_shm_put(g_shm_cache, &key, pbData, len);
+      }
+      *pcbData = (DWORD)len;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+void cmd_cache_put(PCARD_DATA pCardData, BYTE bType, BYTE bIndex, const BYTE *pbData, DWORD cbData) {
+  const CMD_CARD_ID *pId;
+  CMD_SHM_KEY key;
+  uint32_t stamp;
+
+  if (!init_once() || (pId = get_card_id(pCardData)) == NULL || !get_stamp(pCardData, bType, bIndex, &stamp)) {
+    return;
+  }
+  if (g_shm_cache && make_shm_key(pCardData, pId, bType, bIndex, stamp, &key)) {
+    cmd_shm_put(g_shm_cache, &key, pbData, cbData);
+  }
+  if (g_image_enabled) {
+    CMD_IMAGE_ID imageId;
+    make_image_id(pId, &imageId);
+    if (!cmd_image_update(g_image_dir, &imageId, bType, bIndex, stamp, pbData, cbData)) {
+      CMD_WARN("Failed to update the card image\n");
+    }
+  }
+}
+
+void cmd_cache_shutdown(void) {
+  if (g_init_state == 2 && g_shm_cache) {
+    cmd_shm_close(g_shm_cache);
+    g_shm_cache = NULL;
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#ifndef __CACHE__H__
+#define __CACHE__H__
+
+#include "cardmod.h"
+
+// Kinds of data kept in the cross-process cache and the card image
+#define CMD_CACHE_TYPE_CMAPFILE 1
+#define CMD_CACHE_TYPE_CERT 2   // indexed by container
+#define CMD_CACHE_TYPE_PUBKEY 3 // CMD_PUBKEY, indexed by container
+
+// Look up data shared by other processes of the logon session for the card
+// in pCardData, then in the on-disk image of the card if images are enabled.
+// Entries are keyed by the card serial number, the ATR (shared memory) or
+// CHUID (image) and the content stamps of the card. Cards without a serial
+// number are never cached, and neither cache is used while the stamps are
+// unknown. *pcbData is the capacity on input and the data size on output;
+// pbData is clobbered on a miss as well. Must not be called inside a card
+// transaction, as the serial number may need to be read first.
+BOOL cmd_cache_get(PCARD_DATA pCardData, BYTE bType, BYTE bIndex, BYTE *pbData, DWORD *pcbData);
+// Store data in the shared cache and, if enabled, the card image.
+void cmd_cache_put(PCARD_DATA pCardData, BYTE bType, BYTE bIndex, const BYTE *pbData, DWORD cbData);
+
+// Unmap the shared section; called when the DLL is unloaded.
+void cmd_cache_shutdown(void);
+
+#endif // __CACHE__H__
@@ -5,8 +5,22 @@
  * based on the Windows Smart Card Minidriver specification.
  */
 
+#include "apdu.h"
+#include "arena.h"
+#include "cache.h"
+#include "canokey_minidriver_ext.h"
+#include "cardid.h"
 #include "cardmod.h"
+#include "context.h"
+#include "kdf.h"
 #include "logging.h"
+#include "negcache.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "profile.h"
+#include "pubkey.h"
+#include "sign.h"
+#include "stamps.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -29,34 +43,21 @@ PFN_CSP_FREE g_pfnCspFree = NULL;
 // Global function pointer for padding removal
 PFN_CSP_UNPAD_DATA g_pfnCspUnpadData = NULL;
 
-static void init_logging_file(int level) {
-  CreateDirectory("C:\\Logs", NULL); // ignore errors
-  char log_file_name[64], time[16];
-  SYSTEMTIME st;
-  GetLocalTime(&st);
-  sprintf_s(time, sizeof(time), "%04d%02d%02d_%02d%02d%02d", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute,
-            st.wSecond);
-  sprintf_s(log_file_name, sizeof(log_file_name), "C:\\Logs\\canokey_minidriver_%s_%d.log", time,
-            (int32_t)GetCurrentProcessId());
-  cmd_init_logging(log_file_name, level);
-  CMD_INFO("Start logging to file %s...\n", log_file_name);
-}
-
 // DllMain function
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
 
   switch (fdwReason) {
   case DLL_PROCESS_ATTACH:
-    // Initialize the DLL
-    init_logging_file(CMD_LOG_LEVEL_DEBUG);
-    CMD_INFO("CanoKey Smart Card Minidriver compiled at %s %s\n", __DATE__, __TIME__);
-    CMD_INFO("DLL loaded with handle %p\n", hinstDLL);
-    FUNC_TRACE(DisableThreadLibraryCalls(hinstDLL));
+    // Logging and the caches start on first use; loading the DLL costs nothing
+    DisableThreadLibraryCalls(hinstDLL);
     break;
   case DLL_PROCESS_DETACH:
-    // Clean up resources
-    CMD_INFO("DLL unloaded with handle %p, stop logging...\n", hinstDLL);
-    CMD_INFO("========================================\n");
+    // Clean up resources; at process exit the pool threads are gone already
+    if (lpvReserved == NULL) {
+      cmd_logcfg_shutdown();
+      cmd_arena_shutdown();
+    }
+    cmd_cache_shutdown();
     cmd_stop_logging();
     break;
   case DLL_THREAD_ATTACH:
@@ -88,9 +89,6 @@ X(CardWriteFile) \
 X(CardDeleteFile) \
 X(CardSetContainerProperty) \
 X(CardRSADecrypt) \
-X(CardConstructDHAgreement) \
-X(CardDeriveKey) \
-X(CardDestroyDHAgreement) \
 X(CardGetChallengeEx) \
 X(CardChangeAuthenticatorEx) \
 X(MDImportSessionKey) \
@@ -106,6 +104,7 @@ X(CardCreateContainerEx)
 
 #define CMD_NO_IMPL_FUNC_NAME(NAME) __cmd_noimpl__ ## NAME
 #define CMD_GEN_NO_IMPL_FUNC(NAME) DWORD WINAPI CMD_NO_IMPL_FUNC_NAME(NAME)(__inout PCARD_DATA pCardData, ...) { \
+  CMD_BEGIN_CALL(pCardData); \
   CMD_ERROR(#NAME " is not meant to be supported but called with pCardData %p\n", pCardData); \
   CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "not meant to be supported (generated by macro)"); \
 }
@@ -120,6 +119,8 @@ INVOKE_X_ON_NO_IMPL_FUNCS(CMD_GEN_NO_IMPL_FUNC);
  *          the CSP to interact with a specific card.
  */
 DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags) {
+  // the context does not exist yet; cmd_create_context fills in its ID
+  cmd_corr_begin(0);
   DWORD dwReturn = 0;
 
   CMD_DEBUG("CardAcquireContext called with pCardData %p, dwFlags %x\n", pCardData, dwFlags);
@@ -159,7 +160,19 @@ DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags
     CMD_RETURN(ERROR_INVALID_PARAMETER, "No pwszCardName");
   }
 
-  // TODO: check pbAtr content
+  const CMD_CARD_PROFILE *pProfile = cmd_profile_from_atr(pCardData->pbAtr, pCardData->cbAtr);
+  if (!pProfile) {
+    CMD_RETURN(SCARD_E_UNKNOWN_CARD, "Unknown ATR");
+  }
+
+  dwReturn = cmd_create_context(pCardData);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Failed to allocate context");
+  }
+  CMD_CONTEXT_OF(pCardData)->pProfile = pProfile;
+  // skip probing for GET METADATA on firmware known to lack it
+  CMD_CONTEXT_OF(pCardData)->fNoMetadata = !pProfile->fMetadata;
+  CMD_DEBUG("Card profile: %s\n", pProfile->pszName);
 
   // Import the data caching functions
   g_pfnCspCacheAddFile = pCardData->pfnCspCacheAddFile;
@@ -201,11 +214,11 @@ DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags
 
   pCardData->pfnCardSignData = CardSignData;     // Yes
   pCardData->pfnCardRSADecrypt = NULL;           // Yes (opt)
-  pCardData->pfnCardConstructDHAgreement = NULL; // Yes (opt)
+  pCardData->pfnCardConstructDHAgreement = CardConstructDHAgreement; // Yes (opt)
 
   // New functions in version five.
-  pCardData->pfnCardDeriveKey = NULL;          // Yes (opt)
-  pCardData->pfnCardDestroyDHAgreement = NULL; // Yes (opt)
+  pCardData->pfnCardDeriveKey = CardDeriveKey;                   // Yes (opt)
+  pCardData->pfnCardDestroyDHAgreement = CardDestroyDHAgreement; // Yes (opt)
   // pCardData->pfnCspGetDHAgreement;
 
   // version 6 additions below here
@@ -260,6 +273,10 @@ INVOKE_X_ON_NO_IMPL_FUNCS(CMD_SET_CARD_DATA_PFN);
 
 #pragma clang diagnostic pop
 
+  // Warm the container map and the default certificate while CryptoAPI is
+  // still setting up; the foreground adopts whatever is ready.
+  cmd_prefetch_start(pCardData);
+
   CMD_RET_OK;
 }
 
@@ -271,6 +288,7 @@ INVOKE_X_ON_NO_IMPL_FUNCS(CMD_SET_CARD_DATA_PFN);
  * Purpose: Free resources consumed by the CARD_DATA structure.
  */
 DWORD WINAPI CardDeleteContext(__inout PCARD_DATA pCardData) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardDeleteContext called with pCardData %p\n", pCardData);
   if (!pCardData) {
     CMD_RETURN(ERROR_INVALID_PARAMETER, "pCardData is NULL");
@@ -278,9 +296,10 @@ DWORD WINAPI CardDeleteContext(__inout PCARD_DATA pCardData) {
 
   // Free vendor specific data
   if (pCardData->pvVendorSpecific) {
-    pCardData->pfnCspFree(pCardData->pvVendorSpecific);
-    pCardData->pvVendorSpecific = NULL;
+    cmd_prefetch_stop(pCardData);
+    cmd_release_transaction(pCardData);
   }
+  cmd_free_context(pCardData);
 
   CMD_RET_OK;
 }
@@ -293,6 +312,7 @@ DWORD WINAPI CardDeleteContext(__inout PCARD_DATA pCardData) {
 DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData, __in LPCWSTR wszProperty,
                              __out_bcount_part_opt(cbData, *pdwDataLen) PBYTE pbData, __in DWORD cbData,
                              __out PDWORD pdwDataLen, __in DWORD dwFlags) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardGetProperty called with pCardData: %p, wszProperty: %S, pbData: %p, cbData: %d, pdwDataLen: %p, "
             "dwFlags: %x\n",
             pCardData, wszProperty, pbData, cbData, pdwDataLen, dwFlags);
@@ -302,14 +322,19 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData, __in LPCWSTR wszProperty
   }
 
   // Handle different property requests
-  if (wcscmp(wszProperty, CP_CARD_GUID) == 0) {
-    // Card GUID - TODO should be the same as cardid, currently a placeholder
-    BYTE cardGuid[16] = {0};
-    *pdwDataLen = sizeof(cardGuid);
-    if (cbData < sizeof(cardGuid)) {
+  if (wcscmp(wszProperty, CP_CARD_GUID) == 0 || wcscmp(wszProperty, CP_CARD_SERIAL_NO) == 0) {
+    // Card GUID, the same as cardid, and serial number
+    const CMD_CARD_ID *pId;
+    DWORD dwReturn = cmd_card_id_get(pCardData, &pId);
+    if (dwReturn != SCARD_S_SUCCESS) {
+      CMD_RETURN(dwReturn, "Failed to read the card identity");
+    }
+    BOOL fGuid = wcscmp(wszProperty, CP_CARD_GUID) == 0;
+    *pdwDataLen = fGuid ? sizeof(pId->rgbGuid) : pId->cbSerial;
+    if (cbData < *pdwDataLen) {
       CMD_RETURN(ERROR_INSUFFICIENT_BUFFER, "cbData is too small");
     }
-    memcpy(pbData, cardGuid, sizeof(cardGuid));
+    memcpy(pbData, fGuid ? pId->rgbGuid : pId->rgbSerial, *pdwDataLen);
     CMD_RET_OK;
   } else if (wcscmp(wszProperty, CP_CARD_READ_ONLY) == 0) {
     // Card read-only property
@@ -369,6 +394,7 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData, __in LPCWSTR wszProperty
  */
 DWORD WINAPI CardSetProperty(__in PCARD_DATA pCardData, __in LPCWSTR wszProperty, __in_bcount(cbData) PBYTE pbData,
                              __in DWORD cbData, __in DWORD dwFlags) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardSetProperty called with pCardData %p, wszProperty %S, pbData "
             "%p, cbData %d, dwFlags %x\n",
             pCardData, wszProperty, pbData, cbData, dwFlags);
@@ -387,15 +413,129 @@ DWORD WINAPI CardSetProperty(__in PCARD_DATA pCardData, __in LPCWSTR wszProperty
  */
 DWORD WINAPI CardAuthenticatePin(__in PCARD_DATA pCardData, __in LPWSTR pwszUserId, __in_bcount(cbPin) PBYTE pbPin,
                                  __in DWORD cbPin, __out_opt PDWORD pcAttemptsRemaining) {
-  CMD_DEBUG("CardAuthenticatePin called with pCardData %p, pwszUserId %S, "
-            "pbPin %p, cbPin %d, pcAttemptsRemaining %p\n",
-            pCardData, pwszUserId, pbPin, cbPin, pcAttemptsRemaining);
+  CMD_BEGIN_CALL(pCardData);
+  CMD_LOGF(CMD_LOG_SUB_PIN, CMD_LOG_LEVEL_DEBUG,
+           "CardAuthenticatePin called with pCardData %p, pwszUserId %S, "
+           "pbPin %p, cbPin %d, pcAttemptsRemaining %p\n",
+           pCardData, pwszUserId, pbPin, cbPin, pcAttemptsRemaining);
 
   if (!pCardData || !pwszUserId || !pbPin) {
     return ERROR_INVALID_PARAMETER;
   }
 
-  CMD_RET_UNIMPL;
+  if (wcscmp(pwszUserId, wszCARD_USER_USER) != 0) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "Only the user PIN is supported");
+  }
+
+  DWORD dwReturn = cmd_piv_select_and_verify_pin(pCardData, pbPin, cbPin, pcAttemptsRemaining);
+  CMD_RETURN(dwReturn, "VERIFY completed");
+}
+
+// Build the container map from the keys discovered in the PIV slots. Every
+// slot gets a record so that container indexes match slot positions.
+static DWORD read_container_map(PCARD_DATA pCardData, PBYTE *ppbData, PDWORD pcbData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  DWORD cbMap = CMD_PIV_NUM_SLOTS * sizeof(CONTAINER_MAP_RECORD), cbShared = cbMap;
+  PCONTAINER_MAP_RECORD pRecords = (PCONTAINER_MAP_RECORD)g_pfnCspAlloc(cbMap);
+  if (pRecords == NULL) {
+    CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+  }
+  if (cmd_cache_get(pCardData, CMD_CACHE_TYPE_CMAPFILE, 0, (BYTE *)pRecords, &cbShared) && cbShared == cbMap) {
+    *ppbData = (PBYTE)pRecords;
+    *pcbData = cbMap;
+    CMD_RET_OK;
+  }
+
+  DWORD dwReturn = cmd_pubkey_refresh_all(pCardData);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    g_pfnCspFree(pRecords);
+    CMD_RETURN(dwReturn, "Failed to discover the key slots");
+  }
+  memset(pRecords, 0, cbMap);
+
+  BOOL fDefault = FALSE;
+  for (BYTE i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    const CMD_PUBKEY *pKey = &pContext->rgPubKeys[i];
+    BYTE bSlot;
+    if (!pKey->fPresent) {
+      continue;
+    }
+    cmd_piv_container_to_slot(i, &bSlot);
+    swprintf(pRecords[i].wszGuid, MAX_CONTAINER_NAME_LEN + 1, L"CanoKey PIV %02X", bSlot);
+    pRecords[i].bFlags = CONTAINER_MAP_VALID_CONTAINER;
+    if (!fDefault) {
+      pRecords[i].bFlags |= CONTAINER_MAP_DEFAULT_CONTAINER;
+      fDefault = TRUE;
+    }
+    if (pKey->fKeyExchange) {
+      pRecords[i].wKeyExchangeKeySizeBits = (WORD)pKey->dwBits;
+    } else {
+      pRecords[i].wSigKeySizeBits = (WORD)pKey->dwBits;
+    }
+  }
+
+  cmd_cache_put(pCardData, CMD_CACHE_TYPE_CMAPFILE, 0, (const BYTE *)pRecords, cbMap);
+  *ppbData = (PBYTE)pRecords;
+  *pcbData = cbMap;
+  CMD_RET_OK;
+}
+
+// Serve kscXX / kxcXX from the certificate object of container XX (one or two
+// hex digits), inflated if it is stored compressed.
+static DWORD read_container_cert(PCARD_DATA pCardData, LPCSTR pszFileName, PBYTE *ppbData, PDWORD pcbData) {
+  BOOL fKeyExchange = strncmp(pszFileName, szUSER_KEYEXCHANGE_CERT_PREFIX, 3) == 0;
+  char *pszEnd;
+  unsigned long ulIndex = strtoul(pszFileName + 3, &pszEnd, 16);
+  BYTE bSlot;
+
+  if (pszEnd == pszFileName + 3 || pszEnd > pszFileName + 5 || *pszEnd != '\0' ||
+      !cmd_piv_container_to_slot((BYTE)ulIndex, &bSlot) || cmd_piv_slot_is_key_exchange(bSlot) != fKeyExchange) {
+    CMD_RETURN(SCARD_E_FILE_NOT_FOUND, "No such certificate file");
+  }
+  if (cmd_negcache_cert_missing(pCardData, (BYTE)ulIndex)) {
+    CMD_RETURN(SCARD_E_FILE_NOT_FOUND, "Certificate known to be absent");
+  }
+
+  PCMD_ARENA pArena = cmd_arena_of(pCardData);
+  DWORD dwMark = cmd_arena_mark(pArena), cbShared = CMD_PIV_MAX_OBJECT_LEN;
+  PBYTE pbShared = (PBYTE)cmd_arena_alloc(pArena, cbShared);
+  BOOL fCached = pbShared && cmd_cache_get(pCardData, CMD_CACHE_TYPE_CERT, (BYTE)ulIndex, pbShared, &cbShared);
+  if (fCached) {
+    *ppbData = (PBYTE)g_pfnCspAlloc(cbShared);
+    if (*ppbData != NULL) {
+      memcpy(*ppbData, pbShared, cbShared);
+      *pcbData = cbShared;
+    }
+  }
+  cmd_arena_release(pArena, dwMark);
+  if (fCached) {
+    if (*ppbData == NULL) {
+      CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+    }
+    CMD_RET_OK;
+  }
+  if (cmd_prefetch_take_cert(pCardData, (BYTE)ulIndex, ppbData, pcbData)) {
+    cmd_cache_put(pCardData, CMD_CACHE_TYPE_CERT, (BYTE)ulIndex, *ppbData, *pcbData);
+    CMD_RET_OK;
+  }
+
+  DWORD dwReturn = cmd_begin_transaction(pCardData);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Failed to begin transaction");
+  }
+  dwReturn = cmd_piv_select(pCardData);
+  if (dwReturn == SCARD_S_SUCCESS) {
+    dwReturn = cmd_piv_read_cert(pCardData, bSlot, ppbData, pcbData);
+  }
+  cmd_end_transaction(pCardData);
+  if (dwReturn == SCARD_E_FILE_NOT_FOUND) {
+    cmd_negcache_set_cert_missing(pCardData, (BYTE)ulIndex);
+  }
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Failed to read the certificate");
+  }
+  cmd_cache_put(pCardData, CMD_CACHE_TYPE_CERT, (BYTE)ulIndex, *ppbData, *pcbData);
+  CMD_RET_OK;
 }
 
 /*
@@ -405,27 +545,47 @@ DWORD WINAPI CardAuthenticatePin(__in PCARD_DATA pCardData, __in LPWSTR pwszUser
  */
 DWORD WINAPI CardReadFile(__in PCARD_DATA pCardData, __in LPSTR pszDirectoryName, __in LPSTR pszFileName,
                           __in DWORD dwFlags, __deref_out_bcount_opt(*pcbData) PBYTE *ppbData, __out PDWORD pcbData) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardReadFile called with pCardData %p, pszDirectoryName %s, pszFileName %s, dwFlags %x\n", pCardData,
             pszDirectoryName, pszFileName, dwFlags);
 
   if (pszDirectoryName == NULL) { // Root directory
     if (strcmp(pszFileName, szCACHE_FILE) == 0) {
-      // TODO: Return cached data
-      // now we return 6 bytes of zeros
-      *ppbData = (PBYTE)g_pfnCspAlloc(6);
+      PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+      // the CSP reads cardcf to detect changes, so pick up the card's stamps
+      DWORD dwReturn = cmd_stamps_refresh(pCardData);
+      if (dwReturn != SCARD_S_SUCCESS) {
+        CMD_RETURN(dwReturn, "Failed to check the card content");
+      }
+      *ppbData = (PBYTE)g_pfnCspAlloc(sizeof(pContext->cardcf));
       if (*ppbData == NULL) {
         CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
       }
-      memset(*ppbData, 0, 6);
-      *pcbData = 6;
+      memcpy(*ppbData, &pContext->cardcf, sizeof(pContext->cardcf));
+      *pcbData = sizeof(pContext->cardcf);
+      CMD_RET_OK;
+    }
+    if (strcmp(pszFileName, szCARD_IDENTIFIER_FILE) == 0) {
+      const CMD_CARD_ID *pId;
+      DWORD dwReturn = cmd_card_id_get(pCardData, &pId);
+      if (dwReturn != SCARD_S_SUCCESS) {
+        CMD_RETURN(dwReturn, "Failed to read the card identity");
+      }
+      *ppbData = (PBYTE)g_pfnCspAlloc(sizeof(pId->rgbGuid));
+      if (*ppbData == NULL) {
+        CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+      }
+      memcpy(*ppbData, pId->rgbGuid, sizeof(pId->rgbGuid));
+      *pcbData = sizeof(pId->rgbGuid);
       CMD_RET_OK;
     }
   } else if (strcmp(pszDirectoryName, szBASE_CSP_DIR) == 0) {
     if (strcmp(pszFileName, szCONTAINER_MAP_FILE) == 0) {
-      // TODO: Return container map
-      *ppbData = NULL;
-      *pcbData = 0;
-      CMD_RET_OK;
+      return read_container_map(pCardData, ppbData, pcbData);
+    }
+    if (strncmp(pszFileName, szUSER_SIGNATURE_CERT_PREFIX, 3) == 0 ||
+        strncmp(pszFileName, szUSER_KEYEXCHANGE_CERT_PREFIX, 3) == 0) {
+      return read_container_cert(pCardData, pszFileName, ppbData, pcbData);
     }
   }
 
@@ -439,6 +599,7 @@ DWORD WINAPI CardReadFile(__in PCARD_DATA pCardData, __in LPSTR pszDirectoryName
  */
 DWORD WINAPI CardGetFileInfo(__in PCARD_DATA pCardData, __in LPSTR pszDirectoryName, __in LPSTR pszFileName,
                              __in PCARD_FILE_INFO pCardFileInfo) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardGetFileInfo called with pCardData %p, pszDirectoryName %s, "
             "pszFileName %s, pCardFileInfo %p\n",
             pCardData, pszDirectoryName, pszFileName, pCardFileInfo);
@@ -458,6 +619,7 @@ DWORD WINAPI CardGetFileInfo(__in PCARD_DATA pCardData, __in LPSTR pszDirectoryN
 DWORD WINAPI CardEnumFiles(__in PCARD_DATA pCardData, __in_opt LPSTR pszDirectoryName,
                            __deref_out_ecount(*pdwcbFileName) LPSTR *pmszFileNames, __out LPDWORD pdwcbFileName,
                            __in DWORD dwFlags) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardEnumFiles called with pCardData %p, pszDirectoryName %s, "
             "pmszFileNames %p, pdwcbFileName %p, dwFlags %x\n",
             pCardData, pszDirectoryName, pmszFileNames, pdwcbFileName, dwFlags);
@@ -476,6 +638,7 @@ DWORD WINAPI CardEnumFiles(__in PCARD_DATA pCardData, __in_opt LPSTR pszDirector
  */
 DWORD WINAPI CardQueryFreeSpace(__in PCARD_DATA pCardData, __in DWORD dwFlags,
                                 __inout PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardQueryFreeSpace called with pCardData %p, dwFlags %x, "
             "pCardFreeSpaceInfo %p\n",
             pCardData, dwFlags, pCardFreeSpaceInfo);
@@ -492,6 +655,7 @@ DWORD WINAPI CardQueryFreeSpace(__in PCARD_DATA pCardData, __in DWORD dwFlags,
  * Purpose: Query the capabilities of the card.
  */
 DWORD WINAPI CardQueryCapabilities(__in PCARD_DATA pCardData, __inout PCARD_CAPABILITIES pCardCapabilities) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardQueryCapabilities called with pCardData %p, pCardCapabilities %p\n", pCardData, pCardCapabilities);
 
   if (!pCardData || !pCardCapabilities) {
@@ -503,7 +667,8 @@ DWORD WINAPI CardQueryCapabilities(__in PCARD_DATA pCardData, __inout PCARD_CAPA
   }
 
   // Set capabilities
-  pCardCapabilities->fCertificateCompression = FALSE;
+  // certificates are inflated by the driver when the CertInfo asks for it
+  pCardCapabilities->fCertificateCompression = TRUE;
   pCardCapabilities->fKeyGen = TRUE;
 
   CMD_RET_OK;
@@ -516,6 +681,7 @@ DWORD WINAPI CardQueryCapabilities(__in PCARD_DATA pCardData, __inout PCARD_CAPA
  */
 DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwFlags,
                                   __inout PCONTAINER_INFO pContainerInfo) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardGetContainerInfo called with pCardData %p, bContainerIndex "
             "%d, dwFlags %x, pContainerInfo %p\n",
             pCardData, bContainerIndex, dwFlags, pContainerInfo);
@@ -524,7 +690,40 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
     return ERROR_INVALID_PARAMETER;
   }
 
-  CMD_RET_UNIMPL;
+  if (dwFlags) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "dwFlags must be 0");
+  }
+
+  if (pContainerInfo->dwVersion > CONTAINER_INFO_CURRENT_VERSION) {
+    CMD_RETURN(ERROR_REVISION_MISMATCH, "Invalid CONTAINER_INFO version");
+  }
+
+  const CMD_PUBKEY *pKey;
+  DWORD dwReturn = cmd_pubkey_get(pCardData, bContainerIndex, &pKey);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Failed to get public key");
+  }
+
+  PBYTE pbBlob = (PBYTE)pCardData->pfnCspAlloc(pKey->cbBlob);
+  if (!pbBlob) {
+    CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+  }
+  memcpy(pbBlob, pKey->rgbBlob, pKey->cbBlob);
+
+  pContainerInfo->dwReserved = 0;
+  pContainerInfo->cbSigPublicKey = 0;
+  pContainerInfo->pbSigPublicKey = NULL;
+  pContainerInfo->cbKeyExPublicKey = 0;
+  pContainerInfo->pbKeyExPublicKey = NULL;
+  if (pKey->fKeyExchange) {
+    pContainerInfo->cbKeyExPublicKey = pKey->cbBlob;
+    pContainerInfo->pbKeyExPublicKey = pbBlob;
+  } else {
+    pContainerInfo->cbSigPublicKey = pKey->cbBlob;
+    pContainerInfo->pbSigPublicKey = pbBlob;
+  }
+
+  CMD_RET_OK;
 }
 
 /*
@@ -533,13 +732,140 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
  * Purpose: Sign data using a key on the card.
  */
 DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pCardSigningInfo) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardSignData called with pCardData %p, pCardSigningInfo %p\n", pCardData, pCardSigningInfo);
 
-  if (!pCardData || !pCardSigningInfo) {
+  if (!pCardData || !pCardSigningInfo || !pCardSigningInfo->pbData) {
     return ERROR_INVALID_PARAMETER;
   }
 
-  CMD_RET_UNIMPL;
+  if (pCardSigningInfo->dwVersion < CARD_SIGNING_INFO_BASIC_VERSION ||
+      pCardSigningInfo->dwVersion > CARD_SIGNING_INFO_CURRENT_VERSION) {
+    CMD_RETURN(ERROR_REVISION_MISMATCH, "Invalid CARD_SIGNING_INFO version");
+  }
+
+  CMD_SIGN_KEY key;
+  DWORD dwReturn =
+      cmd_sign_resolve_key(pCardData, pCardSigningInfo->bContainerIndex, pCardSigningInfo->dwKeySpec, &key);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Invalid container or key spec");
+  }
+
+  // Select the DigestInfo for PKCS #1 padding
+  ALG_ID aiHashAlg = 0;
+  LPCWSTR pwszHashAlg = NULL;
+  if (pCardSigningInfo->dwVersion >= CARD_SIGNING_INFO_CURRENT_VERSION &&
+      (pCardSigningInfo->dwSigningFlags & CARD_PADDING_INFO_PRESENT)) {
+    if (!key.fEcc) {
+      if (pCardSigningInfo->dwPaddingType != CARD_PADDING_PKCS1 || !pCardSigningInfo->pPaddingInfo) {
+        CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "Only PKCS #1 v1.5 padding is supported");
+      }
+      pwszHashAlg = ((BCRYPT_PKCS1_PADDING_INFO *)pCardSigningInfo->pPaddingInfo)->pszAlgId;
+    }
+  } else if (!(pCardSigningInfo->dwSigningFlags & CRYPT_NOHASHOID)) {
+    aiHashAlg = pCardSigningInfo->aiHashAlg;
+  }
+
+  pCardSigningInfo->cbSignedData = CMD_SIGN_SIGNATURE_LEN(&key);
+  if (pCardSigningInfo->dwSigningFlags & CARD_BUFFER_SIZE_ONLY) {
+    CMD_RET_OK;
+  }
+
+  pCardSigningInfo->pbSignedData = (PBYTE)pCardData->pfnCspAlloc(pCardSigningInfo->cbSignedData);
+  if (!pCardSigningInfo->pbSignedData) {
+    CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+  }
+
+  dwReturn = cmd_begin_transaction(pCardData);
+  if (dwReturn == SCARD_S_SUCCESS) {
+    dwReturn = cmd_piv_select(pCardData);
+    if (dwReturn == SCARD_S_SUCCESS) {
+      dwReturn = cmd_sign_digest(pCardData, &key, aiHashAlg, pwszHashAlg, pCardSigningInfo->pbData,
+                                 pCardSigningInfo->cbData, pCardSigningInfo->pbSignedData,
+                                 &pCardSigningInfo->cbSignedData);
+    }
+    cmd_end_transaction(pCardData);
+  }
+
+  if (dwReturn != SCARD_S_SUCCESS) {
+    pCardData->pfnCspFree(pCardSigningInfo->pbSignedData);
+    pCardSigningInfo->pbSignedData = NULL;
+    pCardSigningInfo->cbSignedData = 0;
+    CMD_RETURN(dwReturn, "Signing failed");
+  }
+
+  CMD_RET_OK;
+}
+
+/*
+ * Function: CardSignDataBatch
+ *
+ * Purpose: Sign many digests within a single card transaction.
+ *          See canokey_minidriver_ext.h.
+ */
+DWORD WINAPI CardSignDataBatch(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwKeySpec,
+                               __in ALG_ID aiHashAlg, __in DWORD cItems,
+                               __inout_ecount(cItems) PCMD_SIGN_BATCH_ITEM rgItems) {
+  CMD_BEGIN_CALL(pCardData);
+  CMD_DEBUG("CardSignDataBatch called with pCardData %p, bContainerIndex %d, dwKeySpec %x, aiHashAlg %x, cItems %d\n",
+            pCardData, bContainerIndex, dwKeySpec, aiHashAlg, cItems);
+
+  if (!pCardData || (cItems > 0 && !rgItems)) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  CMD_SIGN_KEY key;
+  DWORD dwReturn = cmd_sign_resolve_key(pCardData, bContainerIndex, dwKeySpec, &key);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Invalid container or key spec");
+  }
+
+  DWORD i;
+  for (i = 0; i < cItems; i++) {
+    rgItems[i].pbSignature = NULL;
+  }
+  for (i = 0; i < cItems; i++) {
+    rgItems[i].cbSignature = CMD_SIGN_SIGNATURE_LEN(&key);
+    rgItems[i].pbSignature = (PBYTE)pCardData->pfnCspAlloc(rgItems[i].cbSignature);
+    if (!rgItems[i].pbSignature) {
+      dwReturn = ERROR_OUTOFMEMORY;
+      break;
+    }
+  }
+
+  if (dwReturn == SCARD_S_SUCCESS) {
+    dwReturn = cmd_begin_transaction(pCardData);
+  }
+  if (dwReturn == SCARD_S_SUCCESS) {
+    // SELECT once; the verified PIN state holds for the whole transaction
+    dwReturn = cmd_piv_select(pCardData);
+    for (i = 0; i < cItems && dwReturn == SCARD_S_SUCCESS; i++) {
+      if (!rgItems[i].pbDigest) {
+        dwReturn = ERROR_INVALID_PARAMETER;
+        break;
+      }
+      dwReturn = cmd_sign_digest(pCardData, &key, aiHashAlg, NULL, rgItems[i].pbDigest, rgItems[i].cbDigest,
+                                 rgItems[i].pbSignature, &rgItems[i].cbSignature);
+      if (dwReturn != SCARD_S_SUCCESS) {
+        break; // i names the failed item in the log below
+      }
+    }
+    cmd_end_transaction(pCardData);
+  }
+
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_ERROR("Batch signing failed at item %d of %d\n", i, cItems);
+    for (i = 0; i < cItems; i++) {
+      if (rgItems[i].pbSignature) {
+        pCardData->pfnCspFree(rgItems[i].pbSignature);
+      }
+      rgItems[i].pbSignature = NULL;
+      rgItems[i].cbSignature = 0;
+    }
+    CMD_RETURN(dwReturn, "Batch signing failed");
+  }
+
+  CMD_RET_OK;
 }
 
 /*
@@ -549,6 +875,7 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pCa
  */
 DWORD WINAPI CardQueryKeySizes(__in PCARD_DATA pCardData, __in DWORD dwKeySpec, __in DWORD dwFlags,
                                __inout PCARD_KEY_SIZES pKeySizes) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardQueryKeySizes called with pCardData %p, dwKeySpec %x, dwFlags "
             "%x, pKeySizes %p\n",
             pCardData, dwKeySpec, dwFlags, pKeySizes);
@@ -556,8 +883,49 @@ DWORD WINAPI CardQueryKeySizes(__in PCARD_DATA pCardData, __in DWORD dwKeySpec,
   if (!pCardData || !pKeySizes) {
     return ERROR_INVALID_PARAMETER;
   }
+  if (dwFlags != 0) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "dwFlags must be 0");
+  }
+  if (pKeySizes->dwVersion > CARD_KEY_SIZES_CURRENT_VERSION) {
+    CMD_RETURN(ERROR_REVISION_MISMATCH, "Unsupported version");
+  }
 
-  CMD_RET_UNIMPL;
+  DWORD dwAlgorithms = CMD_CONTEXT_OF(pCardData)->pProfile->dwAlgorithms;
+  switch (dwKeySpec) {
+  case AT_SIGNATURE:
+  case AT_KEYEXCHANGE:
+    if (!(dwAlgorithms & (CMD_PROFILE_ALG_RSA2048 | CMD_PROFILE_ALG_RSA3072 | CMD_PROFILE_ALG_RSA4096))) {
+      CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "RSA is not supported by the card");
+    }
+    pKeySizes->dwMinimumBitlen = (dwAlgorithms & CMD_PROFILE_ALG_RSA2048)   ? 2048
+                                 : (dwAlgorithms & CMD_PROFILE_ALG_RSA3072) ? 3072
+                                                                            : 4096;
+    pKeySizes->dwDefaultBitlen = pKeySizes->dwMinimumBitlen;
+    pKeySizes->dwMaximumBitlen = (dwAlgorithms & CMD_PROFILE_ALG_RSA4096)   ? 4096
+                                 : (dwAlgorithms & CMD_PROFILE_ALG_RSA3072) ? 3072
+                                                                            : 2048;
+    pKeySizes->dwIncrementalBitlen = 1024;
+    break;
+  case AT_ECDSA_P256:
+  case AT_ECDHE_P256:
+    if (!(dwAlgorithms & CMD_PROFILE_ALG_P256)) {
+      CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "P-256 is not supported by the card");
+    }
+    pKeySizes->dwMinimumBitlen = pKeySizes->dwDefaultBitlen = pKeySizes->dwMaximumBitlen = 256;
+    pKeySizes->dwIncrementalBitlen = 0;
+    break;
+  case AT_ECDSA_P384:
+  case AT_ECDHE_P384:
+    if (!(dwAlgorithms & CMD_PROFILE_ALG_P384)) {
+      CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "P-384 is not supported by the card");
+    }
+    pKeySizes->dwMinimumBitlen = pKeySizes->dwDefaultBitlen = pKeySizes->dwMaximumBitlen = 384;
+    pKeySizes->dwIncrementalBitlen = 0;
+    break;
+  default:
+    CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "Unsupported key spec");
+  }
+  CMD_RET_OK;
 }
 
 /*
@@ -569,15 +937,30 @@ DWORD WINAPI CardAuthenticateEx(__in PCARD_DATA pCardData, __in PIN_ID PinId, __
                                 __in_bcount(cbPinData) PBYTE pbPinData, __in DWORD cbPinData,
                                 __deref_opt_out_bcount(*pcbSessionPin) PBYTE *ppbSessionPin,
                                 __out_opt PDWORD pcbSessionPin, __out_opt PDWORD pcAttemptsRemaining) {
-  CMD_DEBUG("CardAuthenticateEx called with pCardData %p, PinId %d, dwFlags "
-            "%x, pbPinData %p, cbPinData %d\n",
-            pCardData, PinId, dwFlags, pbPinData, cbPinData);
+  CMD_BEGIN_CALL(pCardData);
+  CMD_LOGF(CMD_LOG_SUB_PIN, CMD_LOG_LEVEL_DEBUG,
+           "CardAuthenticateEx called with pCardData %p, PinId %d, dwFlags "
+           "%x, pbPinData %p, cbPinData %d\n",
+           pCardData, PinId, dwFlags, pbPinData, cbPinData);
 
   if (!pCardData) {
     return ERROR_INVALID_PARAMETER;
   }
 
-  CMD_RET_UNIMPL;
+  if (PinId != ROLE_USER) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "Only the user PIN is supported");
+  }
+
+  if (dwFlags & (CARD_AUTHENTICATE_GENERATE_SESSION_PIN | CARD_AUTHENTICATE_SESSION_PIN)) {
+    CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "Session PINs are not supported");
+  }
+
+  if (!pbPinData) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  DWORD dwReturn = cmd_piv_select_and_verify_pin(pCardData, pbPinData, cbPinData, pcAttemptsRemaining);
+  CMD_RETURN(dwReturn, "VERIFY completed");
 }
 
 /*
@@ -586,6 +969,7 @@ DWORD WINAPI CardAuthenticateEx(__in PCARD_DATA pCardData, __in PIN_ID PinId, __
  * Purpose: Deauthenticate from the card with extended parameters.
  */
 DWORD WINAPI CardDeauthenticateEx(__in PCARD_DATA pCardData, __in PIN_SET PinId, __in DWORD dwFlags) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardDeauthenticateEx called with pCardData %p, PinId %d, dwFlags %x\n", pCardData, PinId, dwFlags);
 
   if (!pCardData) {
@@ -603,6 +987,7 @@ DWORD WINAPI CardDeauthenticateEx(__in PCARD_DATA pCardData, __in PIN_SET PinId,
 DWORD WINAPI CardGetContainerProperty(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in LPCWSTR wszProperty,
                                       __out_bcount_part_opt(cbData, *pdwDataLen) PBYTE pbData, __in DWORD cbData,
                                       __out PDWORD pdwDataLen, __in DWORD dwFlags) {
+  CMD_BEGIN_CALL(pCardData);
   CMD_DEBUG("CardGetContainerProperty called with pCardData %p, "
             "bContainerIndex %d, wszProperty %S, dwFlags %x\n",
             pCardData, bContainerIndex, wszProperty, dwFlags);
@@ -613,3 +998,239 @@ DWORD WINAPI CardGetContainerProperty(__in PCARD_DATA pCardData, __in BYTE bCont
 
   CMD_RET_UNIMPL;
 }
+
+/*
+ * Function: CardConstructDHAgreement
+ *
+ * Purpose: Compute an ECDH secret agreement with a key on the card and
+ *          keep it in the context for later use by CardDeriveKey.
+ */
+DWORD WINAPI CardConstructDHAgreement(__in PCARD_DATA pCardData, __inout PCARD_DH_AGREEMENT_INFO pAgreementInfo) {
+  CMD_BEGIN_CALL(pCardData);
+  CMD_DEBUG("CardConstructDHAgreement called with pCardData %p, pAgreementInfo %p\n", pCardData, pAgreementInfo);
+
+  if (!pCardData || !pAgreementInfo || !pAgreementInfo->pbPublicKey) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  if (pAgreementInfo->dwVersion != CARD_DH_AGREEMENT_INFO_VERSION) {
+    CMD_RETURN(ERROR_REVISION_MISMATCH, "Invalid CARD_DH_AGREEMENT_INFO version");
+  }
+
+  // ECDH is only available on the key management and retired slots
+  BYTE bSlot;
+  if (!cmd_piv_container_to_slot(pAgreementInfo->bContainerIndex, &bSlot)) {
+    CMD_RETURN(SCARD_E_NO_KEY_CONTAINER, "Invalid container index");
+  }
+  if (bSlot != CMD_PIV_SLOT_KEY_MANAGEMENT &&
+      (bSlot < CMD_PIV_SLOT_RETIRED_FIRST || bSlot > CMD_PIV_SLOT_RETIRED_LAST)) {
+    CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "Container does not hold a key agreement key");
+  }
+
+  // The peer public key is a BCRYPT_ECCKEY_BLOB followed by X and Y
+  PBCRYPT_ECCKEY_BLOB pBlob = (PBCRYPT_ECCKEY_BLOB)pAgreementInfo->pbPublicKey;
+  if (pAgreementInfo->dwPublicKey < sizeof(BCRYPT_ECCKEY_BLOB) ||
+      pAgreementInfo->dwPublicKey != sizeof(BCRYPT_ECCKEY_BLOB) + 2 * pBlob->cbKey) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "Malformed public key blob");
+  }
+  BYTE bAlg;
+  if (pBlob->cbKey == 32) {
+    bAlg = CMD_PIV_ALG_ECC_P256;
+  } else if (pBlob->cbKey == 48) {
+    bAlg = CMD_PIV_ALG_ECC_P384;
+  } else {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "Unsupported curve");
+  }
+
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  BYTE bIndex;
+  for (bIndex = 0; bIndex < CMD_MAX_DH_AGREEMENTS; bIndex++) {
+    if (!pContext->rgAgreements[bIndex].fUsed) {
+      break;
+    }
+  }
+  if (bIndex == CMD_MAX_DH_AGREEMENTS) {
+    CMD_RETURN(SCARD_E_NO_MEMORY, "No free agreement slot");
+  }
+  PCMD_DH_AGREEMENT pAgreement = &pContext->rgAgreements[bIndex];
+
+  BYTE point[1 + 2 * CMD_MAX_DH_SECRET_LEN];
+  DWORD cbPoint = 1 + 2 * pBlob->cbKey;
+  point[0] = 0x04; // uncompressed
+  memcpy(point + 1, pBlob + 1, 2 * pBlob->cbKey);
+
+  pAgreement->pbSecret = (PBYTE)cmd_secmem_acquire(pContext->pSecure);
+  if (!pAgreement->pbSecret) {
+    CMD_RETURN(SCARD_E_NO_MEMORY, "No free secure memory slot");
+  }
+  pAgreement->cbSecret = CMD_MAX_DH_SECRET_LEN;
+  DWORD dwReturn = cmd_piv_select_and_general_authenticate(pCardData, bAlg, bSlot, CMD_PIV_TAG_EXPONENTIATION, point,
+                                                           cbPoint, pAgreement->pbSecret, &pAgreement->cbSecret);
+
+  if (dwReturn != SCARD_S_SUCCESS) {
+    cmd_secmem_release(pContext->pSecure, pAgreement->pbSecret);
+    SecureZeroMemory(pAgreement, sizeof(*pAgreement));
+    CMD_RETURN(dwReturn, "GENERAL AUTHENTICATE failed");
+  }
+
+  pAgreement->fUsed = TRUE;
+  pAgreementInfo->bSecretAgreementIndex = bIndex;
+  CMD_RET_OK;
+}
+
+/*
+ * Function: CardDeriveKey
+ *
+ * Purpose: Derive a session key from a secret agreement.
+ */
+DWORD WINAPI CardDeriveKey(__in PCARD_DATA pCardData, __inout PCARD_DERIVE_KEY pAgreementInfo) {
+  CMD_BEGIN_CALL(pCardData);
+  CMD_DEBUG("CardDeriveKey called with pCardData %p, pAgreementInfo %p\n", pCardData, pAgreementInfo);
+
+  if (!pCardData || !pAgreementInfo || !pAgreementInfo->pwszKDF) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  if (pAgreementInfo->dwVersion < CARD_DERIVE_KEY_VERSION ||
+      pAgreementInfo->dwVersion > CARD_DERIVE_KEY_CURRENT_VERSION) {
+    CMD_RETURN(ERROR_REVISION_MISMATCH, "Invalid CARD_DERIVE_KEY version");
+  }
+
+  if (pAgreementInfo->dwFlags & CARD_RETURN_KEY_HANDLE) {
+    CMD_RETURN(SCARD_E_UNSUPPORTED_FEATURE, "Key handles are not supported");
+  }
+
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  if (pAgreementInfo->bSecretAgreementIndex >= CMD_MAX_DH_AGREEMENTS ||
+      !pContext->rgAgreements[pAgreementInfo->bSecretAgreementIndex].fUsed) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "Invalid secret agreement index");
+  }
+  PCMD_DH_AGREEMENT pAgreement = &pContext->rgAgreements[pAgreementInfo->bSecretAgreementIndex];
+  const BCryptBufferDesc *pParameters = (const BCryptBufferDesc *)pAgreementInfo->pParameterList;
+
+  DWORD cbDerivedKey;
+  DWORD dwReturn = cmd_kdf_derive(pAgreementInfo->pwszKDF, pParameters, pAgreement->pbSecret, pAgreement->cbSecret,
+                                  NULL, &cbDerivedKey);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Invalid KDF parameters");
+  }
+
+  pAgreementInfo->cbDerivedKey = cbDerivedKey;
+  if (pAgreementInfo->dwFlags & CARD_BUFFER_SIZE_ONLY) {
+    CMD_RET_OK;
+  }
+
+  pAgreementInfo->pbDerivedKey = (PBYTE)pCardData->pfnCspAlloc(cbDerivedKey);
+  if (!pAgreementInfo->pbDerivedKey) {
+    CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+  }
+  dwReturn = cmd_kdf_derive(pAgreementInfo->pwszKDF, pParameters, pAgreement->pbSecret, pAgreement->cbSecret,
+                            pAgreementInfo->pbDerivedKey, &cbDerivedKey);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    SecureZeroMemory(pAgreementInfo->pbDerivedKey, cbDerivedKey);
+    pCardData->pfnCspFree(pAgreementInfo->pbDerivedKey);
+    pAgreementInfo->pbDerivedKey = NULL;
+    CMD_RETURN(dwReturn, "Key derivation failed");
+  }
+
+  CMD_RET_OK;
+}
+
+/*
+ * Function: CardDestroyDHAgreement
+ *
+ * Purpose: Wipe a secret agreement.
+ */
+DWORD WINAPI CardDestroyDHAgreement(__in PCARD_DATA pCardData, __in BYTE bSecretAgreementIndex, __in DWORD dwFlags) {
+  CMD_BEGIN_CALL(pCardData);
+  CMD_DEBUG("CardDestroyDHAgreement called with pCardData %p, bSecretAgreementIndex %d, dwFlags %x\n", pCardData,
+            bSecretAgreementIndex, dwFlags);
+
+  if (!pCardData) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  if (bSecretAgreementIndex >= CMD_MAX_DH_AGREEMENTS || !pContext->rgAgreements[bSecretAgreementIndex].fUsed) {
+    CMD_RETURN(SCARD_E_INVALID_PARAMETER, "Invalid secret agreement index");
+  }
+
+  cmd_secmem_release(pContext->pSecure, pContext->rgAgreements[bSecretAgreementIndex].pbSecret);
+  SecureZeroMemory(&pContext->rgAgreements[bSecretAgreementIndex], sizeof(CMD_DH_AGREEMENT));
+  CMD_RET_OK;
+}
+
+// Signing pool token backed by one container on one card.
+typedef struct _POOL_BINDING {
+  PCARD_DATA pCardData;
+  CMD_SIGN_KEY key;
+  ALG_ID aiHashAlg;
+} POOL_BINDING;
+
+static uint32_t pool_sign(void *token_ctx, const uint8_t *digest, size_t digest_len, uint8_t *sig, size_t *sig_len) {
+  POOL_BINDING *pBinding = (POOL_BINDING *)token_ctx;
+  DWORD cbSignature = (DWORD)*sig_len;
+
+  // runs on a pool thread, one call per signature
+  CMD_BEGIN_CALL(pBinding->pCardData);
+  DWORD dwReturn = cmd_begin_transaction(pBinding->pCardData);
+
+  if (dwReturn != SCARD_S_SUCCESS) {
+    return dwReturn;
+  }
+  dwReturn = cmd_piv_select(pBinding->pCardData);
+  if (dwReturn == SCARD_S_SUCCESS) {
+    dwReturn = cmd_sign_digest(pBinding->pCardData, &pBinding->key, pBinding->aiHashAlg, NULL, digest,
+                               (DWORD)digest_len, sig, &cbSignature);
+  }
+  cmd_end_transaction(pBinding->pCardData);
+  *sig_len = cbSignature;
+  return dwReturn;
+}
+
+static void pool_free(void *token_ctx) {
+  POOL_BINDING *pBinding = (POOL_BINDING *)token_ctx;
+  pBinding->pCardData->pfnCspFree(pBinding);
+}
+
+/*
+ * Function: CardSignPoolAddContainer
+ *
+ * Purpose: Add a container of this card to a signing pool.
+ *          See canokey_minidriver_ext.h.
+ */
+DWORD WINAPI CardSignPoolAddContainer(__in CMD_POOL *pPool, __in PCARD_DATA pCardData, __in BYTE bContainerIndex,
+                                      __in DWORD dwKeySpec, __in ALG_ID aiHashAlg, __out_opt int *piToken) {
+  CMD_BEGIN_CALL(pCardData);
+  CMD_DEBUG("CardSignPoolAddContainer called with pPool %p, pCardData %p, bContainerIndex %d, dwKeySpec %x\n", pPool,
+            pCardData, bContainerIndex, dwKeySpec);
+
+  if (!pPool || !pCardData) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  CMD_SIGN_KEY key;
+  DWORD dwReturn = cmd_sign_resolve_key(pCardData, bContainerIndex, dwKeySpec, &key);
+  if (dwReturn != SCARD_S_SUCCESS) {
+    CMD_RETURN(dwReturn, "Invalid container or key spec");
+  }
+
+  POOL_BINDING *pBinding = (POOL_BINDING *)pCardData->pfnCspAlloc(sizeof(POOL_BINDING));
+  if (!pBinding) {
+    CMD_RETURN(ERROR_OUTOFMEMORY, "Failed to allocate memory");
+  }
+  pBinding->pCardData = pCardData;
+  pBinding->key = key;
+  pBinding->aiHashAlg = aiHashAlg;
+
+  int iToken = cmd_pool_add_token(pPool, pool_sign, pool_free, pBinding);
+  if (iToken < 0) {
+    pCardData->pfnCspFree(pBinding);
+    CMD_RETURN(SCARD_E_NO_MEMORY, "Pool is full");
+  }
+  if (piToken) {
+    *piToken = iToken;
+  }
+
+  CMD_RET_OK;
+}
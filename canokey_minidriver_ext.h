@@ -0,0 +1,54 @@
+#pragma once
+#ifndef __CANOKEY_MINIDRIVER_EXT__H__
+#define __CANOKEY_MINIDRIVER_EXT__H__
+
+/*
+ * Vendor extensions exported by the CanoKey minidriver in addition to the
+ * Card* entry points of the minidriver specification. They take a CARD_DATA
+ * previously initialized with CardAcquireContext.
+ */
+
+#include "cardmod.h"
+#include "pool.h"
+
+typedef struct _CMD_SIGN_BATCH_ITEM {
+  // Digest to be signed, supplied by the caller
+  PBYTE pbDigest;
+  DWORD cbDigest;
+
+  // Signature in the same format as CardSignData returns it, allocated with
+  // pfnCspAlloc; the caller frees it with pfnCspFree
+  PBYTE pbSignature;
+  DWORD cbSignature;
+} CMD_SIGN_BATCH_ITEM, *PCMD_SIGN_BATCH_ITEM;
+
+//
+// Function: CardSignDataBatch
+//
+// Purpose: Sign cItems digests with the key in bContainerIndex, holding one
+//          card transaction for the whole batch. aiHashAlg selects the
+//          PKCS #1 DigestInfo for RSA keys (0 for none) and is ignored for
+//          ECDSA. The user PIN must already be verified, e.g. with
+//          CardAuthenticateEx. On failure no signatures are returned.
+//
+typedef DWORD(WINAPI *PFN_CARD_SIGN_DATA_BATCH)(__in PCARD_DATA pCardData, __in BYTE bContainerIndex,
+                                                __in DWORD dwKeySpec, __in ALG_ID aiHashAlg, __in DWORD cItems,
+                                                __inout_ecount(cItems) PCMD_SIGN_BATCH_ITEM rgItems);
+
+DWORD WINAPI CardSignDataBatch(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwKeySpec,
+                               __in ALG_ID aiHashAlg, __in DWORD cItems,
+                               __inout_ecount(cItems) PCMD_SIGN_BATCH_ITEM rgItems);
+
+//
+// Function: CardSignPoolAddContainer
+//
+// Purpose: Register the key in bContainerIndex of an acquired card context
+//          as a token of a signing pool (see pool.h), so that requests
+//          submitted with cmd_pool_sign are balanced across all cards
+//          holding the same key. pCardData must outlive the pool and the
+//          user PIN must already be verified on the card.
+//
+DWORD WINAPI CardSignPoolAddContainer(__in CMD_POOL *pPool, __in PCARD_DATA pCardData, __in BYTE bContainerIndex,
+                                      __in DWORD dwKeySpec, __in ALG_ID aiHashAlg, __out_opt int *piToken);
+
+#endif // __CANOKEY_MINIDRIVER_EXT__H__
@@ -0,0 +1,121 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_TRANSPORT
+
+#include "cardid.h"
+#include "apdu.h"
+#include "arena.h"
+#include "context.h"
+#include "crc32.h"
+#include "logging.h"
+#include "tlv.h"
+
+#include <string.h>
+
+static BOOL is_zero(const BYTE *pb, DWORD cb) {
+  BYTE acc = 0;
+  for (DWORD i = 0; i < cb; i++) {
+    acc |= pb[i];
+  }
+  return acc == 0;
+}
+
+DWORD cmd_card_id_from_chuid(const BYTE *pbChuid, DWORD cbChuid, PCMD_CARD_ID pId) {
+  const BYTE *pbGuid, *pbFascn;
+  DWORD cbGuid, cbFascn;
+
+  memset(pId, 0, sizeof(*pId));
+  if (cmd_tlv_find(pbChuid, cbChuid, CMD_PIV_TAG_CHUID_GUID, &pbGuid, &cbGuid) && cbGuid == CMD_PIV_GUID_LEN &&
+      !is_zero(pbGuid, cbGuid)) {
+    memcpy(pId->rgbGuid, pbGuid, CMD_PIV_GUID_LEN);
+    memcpy(pId->rgbSerial, pbGuid, CMD_PIV_GUID_LEN);
+    pId->cbSerial = CMD_PIV_GUID_LEN;
+  } else if (cmd_tlv_find(pbChuid, cbChuid, CMD_PIV_TAG_CHUID_FASCN, &pbFascn, &cbFascn) &&
+             cbFascn == CMD_PIV_FASCN_LEN && !is_zero(pbFascn, cbFascn)) {
+    // fold the 25-byte FASC-N into the 16 bytes of cardid
+    for (DWORD i = 0; i < CMD_PIV_FASCN_LEN; i++) {
+      pId->rgbGuid[i % CMD_PIV_GUID_LEN] ^= pbFascn[i];
+    }
+    memcpy(pId->rgbSerial, pbFascn, CMD_PIV_FASCN_LEN);
+    pId->cbSerial = CMD_PIV_FASCN_LEN;
+  } else {
+    return SCARD_E_FILE_NOT_FOUND;
+  }
+  pId->dwChuidCrc = cmd_crc32(pbChuid, cbChuid);
+  pId->fValid = TRUE;
+  return SCARD_S_SUCCESS;
+}
+
+// The serial number is unique per CanoKey; the GUID prefix keeps the derived
+// identities apart from CHUID GUIDs of other cards.
+static void card_id_from_serial(const BYTE *pbSerial, PCMD_CARD_ID pId) {
+  static const BYTE rgbPrefix[CMD_PIV_GUID_LEN - CMD_PIV_SERIAL_LEN] = "CanoKey PIV ";
+
+  memset(pId, 0, sizeof(*pId));
+  memcpy(pId->rgbGuid, rgbPrefix, sizeof(rgbPrefix));
+  memcpy(pId->rgbGuid + sizeof(rgbPrefix), pbSerial, CMD_PIV_SERIAL_LEN);
+  memcpy(pId->rgbSerial, pbSerial, CMD_PIV_SERIAL_LEN);
+  pId->cbSerial = CMD_PIV_SERIAL_LEN;
+  pId->dwChuidCrc = cmd_crc32(pbSerial, CMD_PIV_SERIAL_LEN);
+  pId->fValid = TRUE;
+}
+
+DWORD cmd_card_id_read(PCARD_DATA pCardData, PCMD_CARD_ID pId) {
+  PCMD_ARENA pArena = cmd_arena_of(pCardData);
+  DWORD dwMark = cmd_arena_mark(pArena), cbChuid = CMD_PIV_MAX_OBJECT_LEN;
+  BYTE rgbSerial[CMD_PIV_SERIAL_LEN];
+
+  memset(pId, 0, sizeof(*pId));
+  BYTE *pbChuid = (BYTE *)cmd_arena_alloc(pArena, cbChuid);
+  if (!pbChuid) {
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  DWORD dwRet = cmd_piv_get_data(pCardData, CMD_PIV_OBJ_CHUID, pbChuid, &cbChuid);
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_card_id_from_chuid(pbChuid, cbChuid, pId);
+  }
+  cmd_arena_release(pArena, dwMark);
+  if (dwRet != SCARD_E_FILE_NOT_FOUND) {
+    return dwRet;
+  }
+
+  dwRet = cmd_piv_get_serial(pCardData, rgbSerial);
+  if (dwRet == SCARD_S_SUCCESS) {
+    CMD_INFO("The card has no usable CHUID, using its serial number\n");
+    card_id_from_serial(rgbSerial, pId);
+  } else if (dwRet == SCARD_E_FILE_NOT_FOUND || dwRet == SCARD_E_UNSUPPORTED_FEATURE) {
+    // Keep the all-zero identity rather than failing the CSP; cbSerial stays
+    // zero so nothing is cached for the card.
+    CMD_WARN("The card has neither a usable CHUID nor a serial number\n");
+    memset(pId, 0, sizeof(*pId));
+    pId->fValid = TRUE;
+  } else {
+    return dwRet;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_card_id_get(PCARD_DATA pCardData, const CMD_CARD_ID **ppId) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  CMD_CARD_ID id;
+
+  if (pContext->cardId.fValid) {
+    *ppId = &pContext->cardId;
+    return SCARD_S_SUCCESS;
+  }
+
+  DWORD dwRet = cmd_begin_transaction(pCardData);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  dwRet = cmd_piv_select(pCardData);
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_card_id_read(pCardData, &id);
+  }
+  cmd_end_transaction(pCardData);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  pContext->cardId = id;
+  *ppId = &pContext->cardId;
+  return SCARD_S_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#ifndef __CARDID__H__
+#define __CARDID__H__
+
+#include "cardmod.h"
+#include "piv.h"
+
+// Identity of the card, derived from its CHUID or, on cards without one,
+// from its serial number. It backs the cardid file, CP_CARD_GUID and
+// CP_CARD_SERIAL_NO, which the Base CSP uses to key its per-card caches.
+typedef struct _CMD_CARD_ID {
+  BOOL fValid; // the identity has been read
+  BYTE rgbGuid[CMD_PIV_GUID_LEN];
+  // Zero if the card has neither a CHUID nor a serial number; such a card
+  // cannot be told apart from others and its data is never cached.
+  DWORD cbSerial;
+  BYTE rgbSerial[CMD_PIV_FASCN_LEN];
+  DWORD dwChuidCrc; // CRC-32 of the CHUID, or of the serial number without one
+} CMD_CARD_ID, *PCMD_CARD_ID;
+
+// Parse the content of a CHUID object. The GUID is used when it is set;
+// otherwise the identity is derived from the FASC-N. Fails with
+// SCARD_E_FILE_NOT_FOUND if neither is set.
+DWORD cmd_card_id_from_chuid(const BYTE *pbChuid, DWORD cbChuid, PCMD_CARD_ID pId);
+
+// Read the identity from the card. Falls back to the serial number only if
+// there is no usable CHUID; any other error is returned. Must be called
+// inside a card transaction with the PIV application selected.
+DWORD cmd_card_id_read(PCARD_DATA pCardData, PCMD_CARD_ID pId);
+
+// Return the card identity, reading it at most once per context. Errors are
+// not remembered, the next call reads again.
+DWORD cmd_card_id_get(PCARD_DATA pCardData, const CMD_CARD_ID **ppId);
+
+#endif // __CARDID__H__
@@ -0,0 +1,41 @@
+#include "context.h"
+#include "logging.h"
+
+#include <string.h>
+
+DWORD cmd_create_context(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = (PCMD_CONTEXT)pCardData->pfnCspAlloc(sizeof(CMD_CONTEXT));
+  if (!pContext) {
+    return ERROR_OUTOFMEMORY;
+  }
+  memset(pContext, 0, sizeof(CMD_CONTEXT));
+  pContext->pSecure = cmd_secmem_create(CMD_SECURE_SLOTS);
+  if (!pContext->pSecure) {
+    pCardData->pfnCspFree(pContext);
+    return ERROR_OUTOFMEMORY;
+  }
+  if (!cmd_secmem_locked(pContext->pSecure)) {
+    // still wiped and fenced, but the pages may be swapped out
+    CMD_WARN("Failed to lock the memory for PINs and secrets\n");
+  }
+  InitializeCriticalSection(&pContext->csCard);
+  pContext->dwCorrId = cmd_corr_new_context();
+  pCardData->pvVendorSpecific = pContext;
+  // the rest of CardAcquireContext belongs to the new context
+  g_corr.context = pContext->dwCorrId;
+  CMD_DEBUG("Created context %p for pCardData %p\n", pContext, pCardData);
+  return SCARD_S_SUCCESS;
+}
+
+void cmd_free_context(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  if (!pContext) {
+    return;
+  }
+  DeleteCriticalSection(&pContext->csCard);
+  // wipes the secrets of agreements that were never destroyed
+  cmd_secmem_destroy(pContext->pSecure);
+  SecureZeroMemory(pContext->rgAgreements, sizeof(pContext->rgAgreements));
+  pCardData->pfnCspFree(pContext);
+  pCardData->pvVendorSpecific = NULL;
+}
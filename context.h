@@ -0,0 +1,90 @@
+#pragma once
+#ifndef __CONTEXT__H__
+#define __CONTEXT__H__
+
+#include "cardid.h"
+#include "cardmod.h"
+#include "corr.h"
+#include "negcache.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "profile.h"
+#include "pubkey.h"
+#include "secmem.h"
+#include "stamps.h"
+
+// Agreed secrets are kept on the host after CardConstructDHAgreement and
+// addressed by bSecretAgreementIndex. P-384 gives the largest x-coordinate.
+#define CMD_MAX_DH_AGREEMENTS 8
+#define CMD_MAX_DH_SECRET_LEN 48
+// One slot per agreement, one for the padded PIN during VERIFY, a span for
+// the GENERAL AUTHENTICATE response and the APDU staging buffers under it.
+// 56 slots, within CMD_SECMEM_MAX_SLOTS.
+#define CMD_SECURE_SLOTS                                                                                               \
+  (CMD_MAX_DH_AGREEMENTS + 1 + CMD_SECMEM_SLOTS(CMD_PIV_AUTH_RESP_LEN) + CMD_SECMEM_SLOTS(CMD_APDU_CMD_LEN) +          \
+   CMD_SECMEM_SLOTS(CMD_APDU_RESP_LEN))
+
+typedef struct _CMD_DH_AGREEMENT {
+  BOOL fUsed;
+  DWORD cbSecret;
+  // CMD_SECMEM_SLOT_SIZE bytes from pSecure
+  PBYTE pbSecret;
+} CMD_DH_AGREEMENT, *PCMD_DH_AGREEMENT;
+
+// Per-context driver state, stored in pCardData->pvVendorSpecific.
+typedef struct _CMD_CONTEXT {
+  // Serializes card transactions between the caller and the prefetch worker
+  CRITICAL_SECTION csCard;
+  // Callers waiting for csCard; the worker backs off while non-zero
+  volatile LONG lForegroundWaiting;
+  CMD_PREFETCH prefetch;
+  // Card transaction kept open across calls until its idle timer fires
+  BOOL fTransactionHeld;
+  DWORD dwTransactionDepth;
+  // Thread inside the transaction while dwTransactionDepth > 0
+  volatile DWORD dwTransactionOwner;
+  PTP_TIMER pTransactionTimer;
+  // cmd_ticks when SCardBeginTransaction succeeded and when the depth last
+  // dropped to 0
+  ULONGLONG ullTransactionBegun;
+  ULONGLONG ullTransactionIdle;
+  // Successful SCardBeginTransaction calls; reusing a held transaction does
+  // not count. Tells the stamps read in the current transaction apart.
+  DWORD dwTransactionsBegun;
+  // The handle was reconnected after a reset and the card not checked yet
+  BOOL fReconnected;
+  BOOL fRecovering;
+  // Capabilities of the card, from its ATR
+  const CMD_CARD_PROFILE *pProfile;
+  // Le of full reads, chosen by cmd_throughput_calibrate; 0 until then.
+  // Only used inside card transactions, so guarded by csCard.
+  DWORD cbRespChunk;
+  // Content of the cardcf file; its freshness counters key the caches below
+  CARD_CACHE_FILE_FORMAT cardcf;
+  CMD_CARD_ID cardId;
+  // Version stamps the freshness counters above were derived from
+  CMD_STAMPS stamps;
+  // Public keys by container index
+  CMD_PUBKEY rgPubKeys[CMD_PIV_NUM_SLOTS];
+  CMD_NEGCACHE negCache;
+  // The card rejected GET METADATA; fall back to reading certificates. Only
+  // used inside card transactions; the prefetch worker keeps its own copy.
+  BOOL fNoMetadata;
+  CMD_DH_AGREEMENT rgAgreements[CMD_MAX_DH_AGREEMENTS];
+  // Locked memory for PINs and agreed secrets
+  CMD_SECMEM *pSecure;
+  // Stamped into the log records of its calls, see corr.h
+  DWORD dwCorrId;
+} CMD_CONTEXT, *PCMD_CONTEXT;
+
+DWORD cmd_create_context(PCARD_DATA pCardData);
+void cmd_free_context(PCARD_DATA pCardData);
+
+#define CMD_CONTEXT_OF(pCardData) ((PCMD_CONTEXT)(pCardData)->pvVendorSpecific)
+
+// First statement of an entry point, so that all of its log records carry
+// the correlation ID of the context and a new one for the call.
+#define CMD_BEGIN_CALL(pCardData)                                                                                    \
+  cmd_corr_begin((pCardData) && (pCardData)->pvVendorSpecific ? CMD_CONTEXT_OF(pCardData)->dwCorrId : 0)
+
+#endif // __CONTEXT__H__
@@ -0,0 +1,31 @@
+#include "corr.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define corr_next(p) ((uint32_t)InterlockedIncrement((volatile LONG *)(p)))
+#else
+#define corr_next(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#endif
+
+CMD_THREAD_LOCAL CMD_CORR g_corr;
+
+static volatile uint32_t g_last_context;
+static volatile uint32_t g_last_op;
+
+// 0 means none, so it is skipped when a counter wraps
+static uint32_t next_id(volatile uint32_t *counter) {
+  uint32_t id;
+  do {
+    id = corr_next(counter);
+  } while (id == 0);
+  return id;
+}
+
+uint32_t cmd_corr_new_context(void) {
+  return next_id(&g_last_context);
+}
+
+void cmd_corr_begin(uint32_t context) {
+  g_corr.context = context;
+  g_corr.op = next_id(&g_last_op);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#ifndef __CORR__H__
+#define __CORR__H__
+
+/*
+ * Correlation IDs tying log records to the context and the call they come
+ * from. Every entry point takes a fresh operation ID and records it, with the
+ * ID of its context, in thread-local state; log statements copy both from
+ * there, so passing them down costs one thread-local read. Like pool.c, this
+ * file builds on Linux as well.
+ */
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#define CMD_THREAD_LOCAL __declspec(thread)
+#else
+#define CMD_THREAD_LOCAL __thread
+#endif
+
+typedef struct _CMD_CORR {
+  uint32_t context; // 0 outside of any context
+  uint32_t op;      // 0 on a thread that never entered the driver
+} CMD_CORR;
+
+extern CMD_THREAD_LOCAL CMD_CORR g_corr;
+
+// A new context ID, unique in the process and never 0.
+uint32_t cmd_corr_new_context(void);
+// Start an operation of context on the calling thread, with a new operation
+// ID. It lasts until the thread starts the next one.
+void cmd_corr_begin(uint32_t context);
+
+#endif // __CORR__H__
@@ -0,0 +1,11 @@
+#pragma once
+#ifndef __CRC32__H__
+#define __CRC32__H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as used by gzip and zip (reflected, polynomial 0xEDB88320).
+uint32_t cmd_crc32(const uint8_t *data, size_t len);
+
+#endif // __CRC32__H__
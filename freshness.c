@@ -0,0 +1,38 @@
+#include "freshness.h"
+#include "crc32.h"
+
+static uint16_t fold(uint32_t v) {
+  return (uint16_t)(v ^ (v >> 16));
+}
+
+uint32_t cmd_freshness_update(CMD_FRESHNESS *freshness, const uint32_t *old_containers, uint32_t old_files,
+                              const uint32_t *containers, uint32_t files, unsigned slots) {
+  uint32_t all = slots >= 32 ? 0xFFFFFFFFU : (1U << slots) - 1, changed = 0;
+
+  if (!containers) {
+    freshness->containers++;
+    freshness->files++;
+    return all;
+  }
+  if (!old_containers) {
+    changed = all;
+  } else {
+    for (unsigned i = 0; i < slots; i++) {
+      if (old_containers[i] != containers[i]) {
+        changed |= 1U << i;
+      }
+    }
+  }
+
+  // the counters are folded digests; a change must move them all the same,
+  // while unchanged stamps keep them where they are, even if bumped before
+  if (changed) {
+    uint16_t counter = fold(cmd_crc32((const uint8_t *)containers, slots * sizeof(uint32_t)));
+    freshness->containers = counter == freshness->containers ? (uint16_t)(counter + 1) : counter;
+  }
+  if (!old_containers || old_files != files) {
+    uint16_t counter = fold(files);
+    freshness->files = counter == freshness->files ? (uint16_t)(counter + 1) : counter;
+  }
+  return changed;
+}
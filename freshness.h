@@ -0,0 +1,28 @@
+#pragma once
+#ifndef __FRESHNESS__H__
+#define __FRESHNESS__H__
+
+/*
+ * The cardcf freshness counters, derived from digests of the card content
+ * (see stamps.h). Kept apart from the card access so that it builds on Linux
+ * as well, like pool.c.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+  uint16_t containers;
+  uint16_t files;
+} CMD_FRESHNESS;
+
+// Move the counters from the stamps they were derived from (old_containers,
+// old_files) to new ones. Each counter is a folded digest of its stamps, and
+// moves whenever they changed, even if the fold did not. NULL old_containers
+// means the old stamps are unknown, NULL containers that the new ones are;
+// the latter moves both counters. Unchanged stamps leave the counters as they
+// are. Returns the mask of the slots whose stamp changed, all of them when
+// either side is unknown.
+uint32_t cmd_freshness_update(CMD_FRESHNESS *freshness, const uint32_t *old_containers, uint32_t old_files,
+                              const uint32_t *containers, uint32_t files, unsigned slots);
+
+#endif // __FRESHNESS__H__
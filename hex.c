@@ -0,0 +1,54 @@
+#include "hex.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEX_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define HEX_NEON
+#endif
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+// A nibble n becomes '0' + n, plus 7 more above 9 to land on 'A'.
+#if defined(HEX_SSE2)
+static void encode_block(char *out, const uint8_t *in) {
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  __m128i v = _mm_loadu_si128((const __m128i *)in);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+  __m128i lo = _mm_and_si128(v, mask);
+  __m128i nine = _mm_set1_epi8(9);
+  hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), _mm_set1_epi8(7)));
+  lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), _mm_set1_epi8(7)));
+  _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(hi, lo));
+  _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#elif defined(HEX_NEON)
+static void encode_block(char *out, const uint8_t *in) {
+  uint8x16_t v = vld1q_u8(in);
+  uint8x16x2_t digits;
+  digits.val[0] = vshrq_n_u8(v, 4);
+  digits.val[1] = vandq_u8(v, vdupq_n_u8(0x0F));
+  for (int i = 0; i < 2; i++) {
+    uint8x16_t letter = vandq_u8(vcgtq_u8(digits.val[i], vdupq_n_u8(9)), vdupq_n_u8(7));
+    digits.val[i] = vaddq_u8(vaddq_u8(digits.val[i], vdupq_n_u8('0')), letter);
+  }
+  // interleaves the high and low digits of each byte
+  vst2q_u8((uint8_t *)out, digits);
+}
+#endif
+
+size_t cmd_hex_encode(char *out, const uint8_t *in, size_t len) {
+  size_t i = 0;
+
+#if defined(HEX_SSE2) || defined(HEX_NEON)
+  for (; i + 16 <= len; i += 16) {
+    encode_block(out + 2 * i, in + i);
+  }
+#endif
+  for (; i < len; i++) {
+    out[2 * i] = HEX_DIGITS[in[i] >> 4];
+    out[2 * i + 1] = HEX_DIGITS[in[i] & 0x0F];
+  }
+  return 2 * len;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#ifndef __HEX__H__
+#define __HEX__H__
+
+/*
+ * Hex encoding for APDU traces, 16 bytes at a time with SSE2 or NEON where
+ * the compiler targets them. A trace of a certificate read is a few
+ * kilobytes, which a "%02X" loop formats a byte at a time. Like pool.c, this
+ * file only depends on the C runtime, so it builds on Linux as well.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Write the 2 * len upper-case hex digits of in to out, without a
+// terminator. Returns the number of characters written.
+size_t cmd_hex_encode(char *out, const uint8_t *in, size_t len);
+
+#endif // __HEX__H__
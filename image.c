@@ -0,0 +1,263 @@
+#include "image.h"
+#include "crc32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define IMG_MAGIC 0x49444D43U // "CMDI"
+#define IMG_VERSION 2
+// Upper bound on an image; certificates are at most a few kilobytes each
+#define IMG_MAX_SIZE (1024 * 1024)
+
+// File layout: header, record table, record data. All fields little-endian
+// on the platforms the driver runs on.
+typedef struct _IMG_RECORD {
+  uint8_t type;
+  uint8_t index;
+  uint16_t reserved;
+  uint32_t offset; // from the start of the file
+  uint32_t len;
+  uint32_t crc;
+  uint32_t stamp; // content stamp of the card the data was read at
+} IMG_RECORD;
+
+typedef struct _IMG_HEADER {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t file_size;
+  uint32_t record_count;
+  CMD_IMAGE_ID id;
+  // CRC of the header (with this field zero) and the record table
+  uint32_t crc;
+} IMG_HEADER;
+
+typedef struct _IMG_MAP {
+  const uint8_t *base;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file, mapping;
+#endif
+} IMG_MAP;
+
+static void image_path(char *path, size_t cap, const char *dir, const CMD_IMAGE_ID *id) {
+  int n = snprintf(path, cap, "%s/", dir);
+  for (uint8_t i = 0; i < id->serial_len && n > 0 && (size_t)n + 3 < cap; i++) {
+    n += snprintf(path + n, cap - n, "%02x", id->serial[i]);
+  }
+  if (n > 0 && (size_t)n < cap) {
+    snprintf(path + n, cap - n, ".img");
+  }
+}
+
+static int map_file(const char *path, IMG_MAP *map) {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+  map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, NULL);
+  if (map->file == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  if (!GetFileSizeEx(map->file, &size) || size.QuadPart < (LONGLONG)sizeof(IMG_HEADER) ||
+      size.QuadPart > IMG_MAX_SIZE) {
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->size = (size_t)size.QuadPart;
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  map->base = map->mapping ? (const uint8_t *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (!map->base) {
+    if (map->mapping) {
+      CloseHandle(map->mapping);
+    }
+    CloseHandle(map->file);
+    return 0;
+  }
+  return 1;
+#else
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IMG_HEADER) || st.st_size > IMG_MAX_SIZE) {
+    close(fd);
+    return 0;
+  }
+  map->size = (size_t)st.st_size;
+  void *p = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  map->base = p == MAP_FAILED ? NULL : (const uint8_t *)p;
+  return map->base != NULL;
+#endif
+}
+
+static void unmap_file(IMG_MAP *map) {
+#ifdef _WIN32
+  UnmapViewOfFile(map->base);
+  CloseHandle(map->mapping);
+  CloseHandle(map->file);
+#else
+  munmap((void *)map->base, map->size);
+#endif
+}
+
+static uint32_t header_crc(const IMG_HEADER *header, const IMG_RECORD *records) {
+  IMG_HEADER copy = *header;
+  copy.crc = 0;
+  uint32_t crc = cmd_crc32((const uint8_t *)&copy, sizeof(copy));
+  return crc ^ cmd_crc32((const uint8_t *)records, header->record_count * sizeof(IMG_RECORD));
+}
+
+// Check the header and record table of a mapped image against id. Returns
+// the record table, or NULL if the image is unusable.
+static const IMG_RECORD *validate(const IMG_MAP *map, const CMD_IMAGE_ID *id) {
+  const IMG_HEADER *header = (const IMG_HEADER *)map->base;
+  if (header->magic != IMG_MAGIC || header->version != IMG_VERSION || header->header_size != sizeof(IMG_HEADER) ||
+      header->file_size != map->size || header->record_count > CMD_IMAGE_MAX_RECORDS ||
+      sizeof(IMG_HEADER) + header->record_count * sizeof(IMG_RECORD) > map->size) {
+    return NULL;
+  }
+  const IMG_RECORD *records = (const IMG_RECORD *)(header + 1);
+  if (header_crc(header, records) != header->crc || memcmp(&header->id, id, sizeof(*id)) != 0) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < header->record_count; i++) {
+    if (records[i].offset > map->size || records[i].len > map->size - records[i].offset) {
+      return NULL;
+    }
+  }
+  return records;
+}
+
+int cmd_image_read(const char *dir, const CMD_IMAGE_ID *id, uint8_t type, uint8_t index, uint32_t stamp,
+                   uint8_t *data, size_t *len) {
+  char path[512];
+  IMG_MAP map;
+  int hit = 0;
+
+  image_path(path, sizeof(path), dir, id);
+  if (!map_file(path, &map)) {
+    return 0;
+  }
+  const IMG_RECORD *records = validate(&map, id);
+  uint32_t count = records ? ((const IMG_HEADER *)map.base)->record_count : 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (records[i].type != type || records[i].index != index) {
+      continue;
+    }
+    const uint8_t *p = map.base + records[i].offset;
+    if (records[i].stamp == stamp && records[i].len <= *len && cmd_crc32(p, records[i].len) == records[i].crc) {
+      memcpy(data, p, records[i].len);
+      *len = records[i].len;
+      hit = 1;
+    }
+    break;
+  }
+  unmap_file(&map);
+  return hit;
+}
+
+static int write_file(const char *path, const uint8_t *data, size_t len) {
+  char tmp[540];
+  // unique per thread, so that concurrent updates never share a file
+#ifdef _WIN32
+  snprintf(tmp, sizeof(tmp), "%s.%lu.%lu", path, GetCurrentProcessId(), GetCurrentThreadId());
+#else
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%lu", path, (long)getpid(), (unsigned long)pthread_self());
+#endif
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    return 0;
+  }
+  int ok = fwrite(data, 1, len, f) == len;
+  ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+  // fails while another process has the old image mapped; the update is
+  // then simply retried on a later miss
+  ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && rename(tmp, path) == 0;
+#endif
+  if (!ok) {
+    remove(tmp);
+  }
+  return ok;
+}
+
+int cmd_image_update(const char *dir, const CMD_IMAGE_ID *id, uint8_t type, uint8_t index, uint32_t stamp,
+                     const uint8_t *data, size_t len) {
+  char path[512];
+  IMG_MAP map;
+  IMG_RECORD records[CMD_IMAGE_MAX_RECORDS];
+  const uint8_t *sources[CMD_IMAGE_MAX_RECORDS];
+  uint32_t count = 0;
+  size_t size;
+  int mapped, ok = 0;
+
+  image_path(path, sizeof(path), dir, id);
+  mapped = map_file(path, &map);
+
+  // keep the other records of a valid image; one that no longer matches its
+  // checksum would get a fresh one below, so it is dropped instead
+  const IMG_RECORD *old = mapped ? validate(&map, id) : NULL;
+  uint32_t old_count = old ? ((const IMG_HEADER *)map.base)->record_count : 0;
+  for (uint32_t i = 0; i < old_count; i++) {
+    const uint8_t *p = map.base + old[i].offset;
+    if ((old[i].type != type || old[i].index != index) && cmd_crc32(p, old[i].len) == old[i].crc) {
+      records[count] = old[i];
+      sources[count++] = p;
+    }
+  }
+  if (count < CMD_IMAGE_MAX_RECORDS) {
+    memset(&records[count], 0, sizeof(IMG_RECORD));
+    records[count].type = type;
+    records[count].index = index;
+    records[count].len = (uint32_t)len;
+    records[count].stamp = stamp;
+    sources[count++] = data;
+  }
+
+  size = sizeof(IMG_HEADER) + count * sizeof(IMG_RECORD);
+  for (uint32_t i = 0; i < count; i++) {
+    size += records[i].len;
+  }
+  uint8_t *buf = size <= IMG_MAX_SIZE ? (uint8_t *)calloc(1, size) : NULL;
+  if (buf) {
+    IMG_HEADER *header = (IMG_HEADER *)buf;
+    size_t offset = sizeof(IMG_HEADER) + count * sizeof(IMG_RECORD);
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(buf + offset, sources[i], records[i].len);
+      records[i].offset = (uint32_t)offset;
+      records[i].crc = cmd_crc32(buf + offset, records[i].len);
+      offset += records[i].len;
+    }
+    memcpy(header + 1, records, count * sizeof(IMG_RECORD));
+    header->magic = IMG_MAGIC;
+    header->version = IMG_VERSION;
+    header->header_size = sizeof(IMG_HEADER);
+    header->file_size = (uint32_t)size;
+    header->record_count = count;
+    header->id = *id;
+    header->crc = header_crc(header, records);
+  }
+  if (mapped) {
+    unmap_file(&map);
+  }
+  if (buf) {
+    ok = write_file(path, buf, size);
+    free(buf);
+  }
+  return ok;
+}
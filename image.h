@@ -0,0 +1,40 @@
+#pragma once
+#ifndef __IMAGE__H__
+#define __IMAGE__H__
+
+/*
+ * On-disk image of the readable objects of one card, so that the first logon
+ * after a reboot does not have to download every certificate again. There is
+ * one file per card serial number in a cache directory. Files are versioned
+ * and checksummed, read through a read-only memory mapping, and replaced
+ * atomically on update. Like shm.c, this only depends on the C runtime and
+ * the platform file API.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_IMAGE_MAX_SERIAL 32
+#define CMD_IMAGE_MAX_RECORDS 64
+
+// Identity an image is validated against. An image whose serial number or
+// CHUID checksum differ from the card is ignored. Zero-initialize before
+// filling, the identity is compared bytewise.
+typedef struct _CMD_IMAGE_ID {
+  uint8_t serial[CMD_IMAGE_MAX_SERIAL];
+  uint8_t serial_len;
+  uint32_t chuid_crc;
+} CMD_IMAGE_ID;
+
+// Copy the record (type, index) of the card's image into data, if it was
+// stored with the same content stamp. *len is the capacity on input and the
+// record size on output. Returns 1 on a hit.
+int cmd_image_read(const char *dir, const CMD_IMAGE_ID *id, uint8_t type, uint8_t index, uint32_t stamp,
+                   uint8_t *data, size_t *len);
+
+// Add or replace one record, keeping the other intact records of a still
+// valid image. Returns 1 on success.
+int cmd_image_update(const char *dir, const CMD_IMAGE_ID *id, uint8_t type, uint8_t index, uint32_t stamp,
+                     const uint8_t *data, size_t len);
+
+#endif // __IMAGE__H__
@@ -0,0 +1,353 @@
+#include "inflate.h"
+#include "crc32.h"
+
+#include <string.h>
+
+// The decoder follows the structure of zlib's contrib/puff: canonical
+// Huffman tables are decoded one bit at a time, which is plenty fast for
+// objects of a few kilobytes.
+
+#define MAX_BITS 15
+#define MAX_LCODES 286
+#define MAX_DCODES 30
+#define FIX_LCODES 288
+
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+
+typedef struct _INFLATE_STATE {
+  const uint8_t *pbIn;
+  uint32_t cbIn;
+  uint32_t posIn;
+  uint32_t bitBuf;
+  uint32_t bitCnt;
+  uint8_t *pbOut;
+  uint32_t cbOut;
+  uint32_t posOut;
+  uint32_t dwError;
+} INFLATE_STATE;
+
+typedef struct _HUFFMAN {
+  int16_t count[MAX_BITS + 1];
+  int16_t symbol[FIX_LCODES];
+} HUFFMAN;
+
+static const int16_t g_len_base[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,  15,  17,  19,  23, 27,
+                                     31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int16_t g_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int16_t g_dist_base[30] = {1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                      33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                      1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const int16_t g_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                       6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t bits(INFLATE_STATE *s, uint32_t need) {
+  uint32_t val = s->bitBuf;
+  while (s->bitCnt < need) {
+    if (s->posIn >= s->cbIn) {
+      s->dwError = CMD_INFLATE_E_DATA;
+      return 0;
+    }
+    val |= (uint32_t)s->pbIn[s->posIn++] << s->bitCnt;
+    s->bitCnt += 8;
+  }
+  s->bitBuf = need < 32 ? val >> need : 0;
+  s->bitCnt -= need;
+  return need < 32 ? val & ((1UL << need) - 1) : val;
+}
+
+static int put(INFLATE_STATE *s, uint8_t b) {
+  if (s->posOut >= s->cbOut) {
+    s->dwError = CMD_INFLATE_E_SPACE;
+    return 0;
+  }
+  s->pbOut[s->posOut++] = b;
+  return 1;
+}
+
+static int decode(INFLATE_STATE *s, const HUFFMAN *h) {
+  int code = 0, first = 0, index = 0;
+  for (int len = 1; len <= MAX_BITS; len++) {
+    code |= (int)bits(s, 1);
+    if (s->dwError != 0) {
+      return -1;
+    }
+    int count = h->count[len];
+    if (code - count < first) {
+      return h->symbol[index + (code - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  s->dwError = CMD_INFLATE_E_DATA;
+  return -1;
+}
+
+// Build a canonical Huffman table. Incomplete codes are accepted, as
+// RFC 1951 allows them for single-symbol distance codes.
+static int construct(HUFFMAN *h, const int16_t *length, int n) {
+  int16_t offs[MAX_BITS + 1];
+  int left = 1;
+
+  for (int len = 0; len <= MAX_BITS; len++) {
+    h->count[len] = 0;
+  }
+  for (int sym = 0; sym < n; sym++) {
+    h->count[length[sym]]++;
+  }
+  for (int len = 1; len <= MAX_BITS; len++) {
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0) {
+      return 0; // over-subscribed
+    }
+  }
+  offs[1] = 0;
+  for (int len = 1; len < MAX_BITS; len++) {
+    offs[len + 1] = offs[len] + h->count[len];
+  }
+  for (int sym = 0; sym < n; sym++) {
+    if (length[sym] != 0) {
+      h->symbol[offs[length[sym]]++] = (int16_t)sym;
+    }
+  }
+  return 1;
+}
+
+static uint32_t inflate_stored(INFLATE_STATE *s) {
+  s->bitBuf = 0;
+  s->bitCnt = 0;
+  if (s->cbIn - s->posIn < 4) {
+    return CMD_INFLATE_E_DATA;
+  }
+  uint32_t len = s->pbIn[s->posIn] | (s->pbIn[s->posIn + 1] << 8);
+  uint32_t nlen = s->pbIn[s->posIn + 2] | (s->pbIn[s->posIn + 3] << 8);
+  s->posIn += 4;
+  if (len != (~nlen & 0xFFFF) || s->cbIn - s->posIn < len) {
+    return CMD_INFLATE_E_DATA;
+  }
+  if (s->cbOut - s->posOut < len) {
+    return CMD_INFLATE_E_SPACE;
+  }
+  memcpy(s->pbOut + s->posOut, s->pbIn + s->posIn, len);
+  s->posIn += len;
+  s->posOut += len;
+  return 0;
+}
+
+static uint32_t inflate_codes(INFLATE_STATE *s, const HUFFMAN *lencode, const HUFFMAN *distcode) {
+  for (;;) {
+    int sym = decode(s, lencode);
+    if (sym < 0) {
+      return s->dwError;
+    }
+    if (sym < 256) {
+      if (!put(s, (uint8_t)sym)) {
+        return s->dwError;
+      }
+    } else if (sym == 256) {
+      return 0;
+    } else {
+      sym -= 257;
+      if (sym >= 29) {
+        return CMD_INFLATE_E_DATA;
+      }
+      uint32_t len = g_len_base[sym] + bits(s, g_len_extra[sym]);
+      int dsym = decode(s, distcode);
+      if (dsym < 0 || dsym >= 30) {
+        return CMD_INFLATE_E_DATA;
+      }
+      uint32_t dist = g_dist_base[dsym] + bits(s, g_dist_extra[dsym]);
+      if (s->dwError != 0) {
+        return s->dwError;
+      }
+      if (dist > s->posOut) {
+        return CMD_INFLATE_E_DATA;
+      }
+      while (len--) {
+        if (!put(s, s->pbOut[s->posOut - dist])) {
+          return s->dwError;
+        }
+      }
+    }
+  }
+}
+
+static uint32_t inflate_fixed(INFLATE_STATE *s) {
+  int16_t lengths[FIX_LCODES];
+  HUFFMAN lencode, distcode;
+  int sym;
+
+  for (sym = 0; sym < 144; sym++) {
+    lengths[sym] = 8;
+  }
+  for (; sym < 256; sym++) {
+    lengths[sym] = 9;
+  }
+  for (; sym < 280; sym++) {
+    lengths[sym] = 7;
+  }
+  for (; sym < FIX_LCODES; sym++) {
+    lengths[sym] = 8;
+  }
+  construct(&lencode, lengths, FIX_LCODES);
+  for (sym = 0; sym < MAX_DCODES; sym++) {
+    lengths[sym] = 5;
+  }
+  construct(&distcode, lengths, MAX_DCODES);
+  return inflate_codes(s, &lencode, &distcode);
+}
+
+static uint32_t inflate_dynamic(INFLATE_STATE *s) {
+  static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+  int16_t lengths[MAX_LCODES + MAX_DCODES];
+  HUFFMAN lencode, distcode;
+  int index;
+
+  int nlen = (int)bits(s, 5) + 257;
+  int ndist = (int)bits(s, 5) + 1;
+  int ncode = (int)bits(s, 4) + 4;
+  if (s->dwError != 0 || nlen > MAX_LCODES || ndist > MAX_DCODES) {
+    return CMD_INFLATE_E_DATA;
+  }
+
+  for (index = 0; index < ncode; index++) {
+    lengths[order[index]] = (int16_t)bits(s, 3);
+  }
+  for (; index < 19; index++) {
+    lengths[order[index]] = 0;
+  }
+  if (s->dwError != 0 || !construct(&lencode, lengths, 19)) {
+    return CMD_INFLATE_E_DATA;
+  }
+
+  index = 0;
+  while (index < nlen + ndist) {
+    int sym = decode(s, &lencode);
+    if (sym < 0) {
+      return CMD_INFLATE_E_DATA;
+    }
+    if (sym < 16) {
+      lengths[index++] = (int16_t)sym;
+      continue;
+    }
+    int16_t len = 0;
+    uint32_t rep;
+    if (sym == 16) {
+      if (index == 0) {
+        return CMD_INFLATE_E_DATA;
+      }
+      len = lengths[index - 1];
+      rep = 3 + bits(s, 2);
+    } else if (sym == 17) {
+      rep = 3 + bits(s, 3);
+    } else {
+      rep = 11 + bits(s, 7);
+    }
+    if (s->dwError != 0 || index + rep > (uint32_t)(nlen + ndist)) {
+      return CMD_INFLATE_E_DATA;
+    }
+    while (rep--) {
+      lengths[index++] = len;
+    }
+  }
+
+  // the end-of-block code must be present
+  if (lengths[256] == 0 || !construct(&lencode, lengths, nlen) || !construct(&distcode, lengths + nlen, ndist)) {
+    return CMD_INFLATE_E_DATA;
+  }
+  return inflate_codes(s, &lencode, &distcode);
+}
+
+static uint32_t inflate_raw(INFLATE_STATE *s) {
+  uint32_t last, dwRet;
+  do {
+    last = bits(s, 1);
+    uint32_t type = bits(s, 2);
+    if (s->dwError != 0) {
+      return s->dwError;
+    }
+    switch (type) {
+    case 0:
+      dwRet = inflate_stored(s);
+      break;
+    case 1:
+      dwRet = inflate_fixed(s);
+      break;
+    case 2:
+      dwRet = inflate_dynamic(s);
+      break;
+    default:
+      dwRet = CMD_INFLATE_E_DATA;
+    }
+    if (dwRet != 0) {
+      return dwRet;
+    }
+  } while (!last);
+  return 0;
+}
+
+static uint32_t get_le32(const uint8_t *pb) {
+  return pb[0] | ((uint32_t)pb[1] << 8) | ((uint32_t)pb[2] << 16) | ((uint32_t)pb[3] << 24);
+}
+
+uint32_t cmd_gzip_size(const uint8_t *pbIn, uint32_t cbIn, uint32_t cbMax) {
+  if (cbIn < 18 || pbIn[0] != 0x1F || pbIn[1] != 0x8B) {
+    return 0;
+  }
+  // the trailer comes from the card; never let it size an allocation alone
+  uint32_t cbSize = get_le32(pbIn + cbIn - 4);
+  return cbSize <= cbMax ? cbSize : 0;
+}
+
+uint32_t cmd_gzip_inflate(const uint8_t *pbIn, uint32_t cbIn, uint8_t *pbOut, uint32_t *pcbOut) {
+  uint32_t pos = 10;
+
+  // header: ID1 ID2 CM FLG MTIME(4) XFL OS, then optional fields
+  if (cbIn < 18 || pbIn[0] != 0x1F || pbIn[1] != 0x8B || pbIn[2] != 8) {
+    return CMD_INFLATE_E_DATA;
+  }
+  uint8_t flags = pbIn[3];
+  if (flags & GZIP_FEXTRA) {
+    if (cbIn - pos < 2) {
+      return CMD_INFLATE_E_DATA;
+    }
+    pos += 2 + (pbIn[pos] | (pbIn[pos + 1] << 8));
+  }
+  for (uint8_t flag = GZIP_FNAME; flag <= GZIP_FCOMMENT; flag <<= 1) {
+    if (flags & flag) {
+      while (pos < cbIn && pbIn[pos] != 0) {
+        pos++;
+      }
+      pos++;
+    }
+  }
+  if (flags & GZIP_FHCRC) {
+    pos += 2;
+  }
+  if (pos > cbIn - 8) {
+    return CMD_INFLATE_E_DATA;
+  }
+
+  INFLATE_STATE s = {0};
+  s.pbIn = pbIn + pos;
+  s.cbIn = cbIn - 8 - pos;
+  s.pbOut = pbOut;
+  s.cbOut = *pcbOut;
+  uint32_t dwRet = inflate_raw(&s);
+  if (dwRet != 0) {
+    return dwRet;
+  }
+
+  const uint8_t *pbTrailer = pbIn + cbIn - 8;
+  if (get_le32(pbTrailer) != cmd_crc32(pbOut, s.posOut) || get_le32(pbTrailer + 4) != s.posOut) {
+    return CMD_INFLATE_E_DATA;
+  }
+  *pcbOut = s.posOut;
+  return 0;
+}
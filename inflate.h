@@ -0,0 +1,29 @@
+#pragma once
+#ifndef __INFLATE__H__
+#define __INFLATE__H__
+
+/*
+ * Minimal gzip (RFC 1952) / DEFLATE (RFC 1951) decoder for compressed PIV
+ * certificates. Output is written straight into the caller's buffer, so a
+ * certificate can be inflated into its final allocation without a copy.
+ * Like pool.c, this file only depends on the C runtime, so it builds and is
+ * tested on Linux as well.
+ */
+
+#include <stdint.h>
+
+// Malformed input or CRC mismatch (same value as SCARD_E_UNEXPECTED)
+#define CMD_INFLATE_E_DATA 0x8010001FU
+// Output buffer too small (same value as SCARD_E_INSUFFICIENT_BUFFER)
+#define CMD_INFLATE_E_SPACE 0x80100008U
+
+// Uncompressed size recorded in the gzip trailer (ISIZE), or 0 on error or
+// if it exceeds cbMax.
+uint32_t cmd_gzip_size(const uint8_t *pbIn, uint32_t cbIn, uint32_t cbMax);
+
+// Decompress a gzip member into pbOut. *pcbOut is the capacity of pbOut on
+// input and the number of bytes written on output, which matches ISIZE.
+// Returns 0 on success, CMD_INFLATE_E_DATA or CMD_INFLATE_E_SPACE.
+uint32_t cmd_gzip_inflate(const uint8_t *pbIn, uint32_t cbIn, uint8_t *pbOut, uint32_t *pcbOut);
+
+#endif // __INFLATE__H__
@@ -0,0 +1,342 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_CRYPTO
+
+#include "kdf.h"
+#include "logging.h"
+
+#include <string.h>
+
+// Hashing is delegated to CNG, which dispatches to SHA-NI / AVX2 code paths
+// on capable CPUs. Provider handles are expensive to open, so they are opened
+// once per process and shared by all contexts.
+typedef struct _KDF_HASH_ALG {
+  LPCWSTR pwszName;
+  DWORD cbDigest;
+  BCRYPT_ALG_HANDLE hHash;
+  BCRYPT_ALG_HANDLE hHmac;
+} KDF_HASH_ALG;
+
+static KDF_HASH_ALG g_hash_algs[] = {
+    {BCRYPT_SHA1_ALGORITHM, 20, NULL, NULL},   {BCRYPT_SHA256_ALGORITHM, 32, NULL, NULL},
+    {BCRYPT_SHA384_ALGORITHM, 48, NULL, NULL}, {BCRYPT_SHA512_ALGORITHM, 64, NULL, NULL},
+    {BCRYPT_MD5_ALGORITHM, 16, NULL, NULL},
+};
+static SRWLOCK g_hash_lock = SRWLOCK_INIT;
+
+#define KDF_MAX_DIGEST 64
+#define KDF_TLS_MASTER_SECRET_LEN 48
+#define KDF_TLS_SEED_LEN 64
+
+typedef struct _KDF_PART {
+  const BYTE *pb;
+  DWORD cb;
+} KDF_PART;
+
+static KDF_HASH_ALG *find_hash_alg(LPCWSTR pwszName) {
+  for (DWORD i = 0; i < ARRAYSIZE(g_hash_algs); i++) {
+    if (_wcsicmp(g_hash_algs[i].pwszName, pwszName) == 0) {
+      return &g_hash_algs[i];
+    }
+  }
+  return NULL;
+}
+
+static BCRYPT_ALG_HANDLE open_provider(KDF_HASH_ALG *pAlg, BOOL fHmac) {
+  BCRYPT_ALG_HANDLE *phAlg = fHmac ? &pAlg->hHmac : &pAlg->hHash;
+  BCRYPT_ALG_HANDLE hAlg;
+
+  AcquireSRWLockShared(&g_hash_lock);
+  hAlg = *phAlg;
+  ReleaseSRWLockShared(&g_hash_lock);
+  if (hAlg) {
+    return hAlg;
+  }
+
+  AcquireSRWLockExclusive(&g_hash_lock);
+  if (!*phAlg) {
+    NTSTATUS status =
+        BCryptOpenAlgorithmProvider(phAlg, pAlg->pwszName, NULL, fHmac ? BCRYPT_ALG_HANDLE_HMAC_FLAG : 0);
+    if (!BCRYPT_SUCCESS(status)) {
+      CMD_ERROR("BCryptOpenAlgorithmProvider(%S) failed with %x\n", pAlg->pwszName, status);
+      *phAlg = NULL;
+    }
+  }
+  hAlg = *phAlg;
+  ReleaseSRWLockExclusive(&g_hash_lock);
+  return hAlg;
+}
+
+// Create a (keyed, if pbKey is given) hash object to be used as a template.
+// Every invocation below duplicates it instead of re-running the HMAC key
+// schedule.
+static DWORD create_template(KDF_HASH_ALG *pAlg, const BYTE *pbKey, DWORD cbKey, BCRYPT_HASH_HANDLE *phHash) {
+  BCRYPT_ALG_HANDLE hAlg = open_provider(pAlg, pbKey != NULL);
+  NTSTATUS status;
+
+  if (!hAlg) {
+    return SCARD_F_INTERNAL_ERROR;
+  }
+  status = BCryptCreateHash(hAlg, phHash, NULL, 0, (PUCHAR)pbKey, cbKey, 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    CMD_ERROR("BCryptCreateHash failed with %x\n", status);
+    return SCARD_F_INTERNAL_ERROR;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+static DWORD hash_parts(BCRYPT_HASH_HANDLE hTemplate, const KDF_PART *pParts, DWORD cParts, BYTE *pbDigest,
+                        DWORD cbDigest) {
+  BCRYPT_HASH_HANDLE hHash;
+  NTSTATUS status = BCryptDuplicateHash(hTemplate, &hHash, NULL, 0, 0);
+
+  if (!BCRYPT_SUCCESS(status)) {
+    CMD_ERROR("BCryptDuplicateHash failed with %x\n", status);
+    return SCARD_F_INTERNAL_ERROR;
+  }
+  for (DWORD i = 0; i < cParts && BCRYPT_SUCCESS(status); i++) {
+    if (pParts[i].cb > 0) {
+      status = BCryptHashData(hHash, (PUCHAR)pParts[i].pb, pParts[i].cb, 0);
+    }
+  }
+  if (BCRYPT_SUCCESS(status)) {
+    status = BCryptFinishHash(hHash, pbDigest, cbDigest, 0);
+  }
+  BCryptDestroyHash(hHash);
+  if (!BCRYPT_SUCCESS(status)) {
+    CMD_ERROR("Hashing failed with %x\n", status);
+    return SCARD_F_INTERNAL_ERROR;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+static const BCryptBuffer *find_param(const BCryptBufferDesc *pParameters, ULONG ulType) {
+  if (!pParameters) {
+    return NULL;
+  }
+  for (ULONG i = 0; i < pParameters->cBuffers; i++) {
+    const BCryptBuffer *p = &((const BCryptBuffer *)pParameters->pBuffers)[i];
+    if (p->BufferType == ulType) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static KDF_PART param_part(const BCryptBufferDesc *pParameters, ULONG ulType) {
+  const BCryptBuffer *p = find_param(pParameters, ulType);
+  KDF_PART part = {NULL, 0};
+  if (p) {
+    part.pb = (const BYTE *)p->pvBuffer;
+    part.cb = p->cbBuffer;
+  }
+  return part;
+}
+
+static KDF_HASH_ALG *param_hash_alg(const BCryptBufferDesc *pParameters, LPCWSTR pwszDefault) {
+  const BCryptBuffer *p = find_param(pParameters, KDF_HASH_ALGORITHM);
+  return find_hash_alg(p && p->pvBuffer ? (LPCWSTR)p->pvBuffer : pwszDefault);
+}
+
+static void put_be32(BYTE *pb, DWORD dw) {
+  pb[0] = (BYTE)(dw >> 24);
+  pb[1] = (BYTE)(dw >> 16);
+  pb[2] = (BYTE)(dw >> 8);
+  pb[3] = (BYTE)dw;
+}
+
+// P_hash from RFC 5246 section 5, XORed into pbOut when fXor is set.
+static DWORD tls_p_hash(KDF_HASH_ALG *pAlg, const BYTE *pbSecret, DWORD cbSecret, KDF_PART label, KDF_PART seed,
+                        BYTE *pbOut, DWORD cbOut, BOOL fXor) {
+  BCRYPT_HASH_HANDLE hTemplate;
+  BYTE a[KDF_MAX_DIGEST], block[KDF_MAX_DIGEST];
+  DWORD dwRet = create_template(pAlg, pbSecret, cbSecret, &hTemplate);
+
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  // A(1) = HMAC(secret, label + seed)
+  KDF_PART first[] = {label, seed};
+  dwRet = hash_parts(hTemplate, first, ARRAYSIZE(first), a, pAlg->cbDigest);
+  for (DWORD off = 0; dwRet == SCARD_S_SUCCESS && off < cbOut; off += pAlg->cbDigest) {
+    KDF_PART out[] = {{a, pAlg->cbDigest}, label, seed};
+    KDF_PART next[] = {{a, pAlg->cbDigest}};
+    DWORD n = min(pAlg->cbDigest, cbOut - off);
+
+    dwRet = hash_parts(hTemplate, out, ARRAYSIZE(out), block, pAlg->cbDigest);
+    if (dwRet != SCARD_S_SUCCESS) {
+      break;
+    }
+    for (DWORD i = 0; i < n; i++) {
+      pbOut[off + i] = fXor ? (BYTE)(pbOut[off + i] ^ block[i]) : block[i];
+    }
+    dwRet = hash_parts(hTemplate, next, ARRAYSIZE(next), a, pAlg->cbDigest);
+  }
+
+  BCryptDestroyHash(hTemplate);
+  SecureZeroMemory(a, sizeof(a));
+  SecureZeroMemory(block, sizeof(block));
+  return dwRet;
+}
+
+static DWORD kdf_tls_prf(const BCryptBufferDesc *pParameters, const BYTE *pbSecret, DWORD cbSecret, BYTE *pbOut,
+                         DWORD cbOut) {
+  const BCryptBuffer *pProtocol = find_param(pParameters, KDF_TLS_PRF_PROTOCOL);
+  KDF_PART label = param_part(pParameters, KDF_TLS_PRF_LABEL);
+  KDF_PART seed = param_part(pParameters, KDF_TLS_PRF_SEED);
+  DWORD dwProtocol = TLS1_PROTOCOL_VERSION;
+
+  if (!label.pb || seed.cb != KDF_TLS_SEED_LEN) {
+    CMD_ERROR("TLS PRF requires a label and a %d byte seed\n", KDF_TLS_SEED_LEN);
+    return SCARD_E_INVALID_PARAMETER;
+  }
+  if (pProtocol && pProtocol->cbBuffer == sizeof(DWORD)) {
+    dwProtocol = *(const DWORD *)pProtocol->pvBuffer;
+  }
+
+  if (dwProtocol == TLS1_2_PROTOCOL_VERSION) {
+    KDF_HASH_ALG *pAlg = param_hash_alg(pParameters, BCRYPT_SHA256_ALGORITHM);
+    if (!pAlg) {
+      return SCARD_E_INVALID_PARAMETER;
+    }
+    return tls_p_hash(pAlg, pbSecret, cbSecret, label, seed, pbOut, cbOut, FALSE);
+  }
+
+  // TLS 1.0/1.1: P_MD5(S1) XOR P_SHA1(S2) over the two (overlapping) halves
+  DWORD cbHalf = (cbSecret + 1) / 2;
+  DWORD dwRet = tls_p_hash(find_hash_alg(BCRYPT_MD5_ALGORITHM), pbSecret, cbHalf, label, seed, pbOut, cbOut, FALSE);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  return tls_p_hash(find_hash_alg(BCRYPT_SHA1_ALGORITHM), pbSecret + cbSecret - cbHalf, cbHalf, label, seed, pbOut,
+                    cbOut, TRUE);
+}
+
+// Counter-mode KDFs: SP 800-108 with HMAC as PRF, and the SP 800-56A
+// concatenation KDF. The fixed-input parts are bound once; only the counter
+// changes per block.
+static DWORD kdf_counter(BOOL fSp800108, const BCryptBufferDesc *pParameters, const BYTE *pbSecret, DWORD cbSecret,
+                         BYTE *pbOut, DWORD cbOut) {
+  KDF_HASH_ALG *pAlg = param_hash_alg(pParameters, BCRYPT_SHA256_ALGORITHM);
+  BCRYPT_HASH_HANDLE hTemplate;
+  BYTE counter[4], bits[4], block[KDF_MAX_DIGEST];
+  static const BYTE zero = 0;
+  DWORD dwRet;
+
+  if (!pAlg) {
+    return SCARD_E_INVALID_PARAMETER;
+  }
+  dwRet = create_template(pAlg, fSp800108 ? pbSecret : NULL, fSp800108 ? cbSecret : 0, &hTemplate);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  put_be32(bits, cbOut * 8);
+  KDF_PART parts108[] = {{counter, 4}, param_part(pParameters, KDF_LABEL), {&zero, 1},
+                         param_part(pParameters, KDF_CONTEXT), {bits, 4}};
+  KDF_PART parts56a[] = {{counter, 4},
+                         {pbSecret, cbSecret},
+                         param_part(pParameters, KDF_ALGORITHMID),
+                         param_part(pParameters, KDF_PARTYUINFO),
+                         param_part(pParameters, KDF_PARTYVINFO),
+                         param_part(pParameters, KDF_SUPPPUBINFO),
+                         param_part(pParameters, KDF_SUPPPRIVINFO)};
+
+  for (DWORD i = 1, off = 0; off < cbOut; i++, off += pAlg->cbDigest) {
+    put_be32(counter, i);
+    dwRet = fSp800108 ? hash_parts(hTemplate, parts108, ARRAYSIZE(parts108), block, pAlg->cbDigest)
+                      : hash_parts(hTemplate, parts56a, ARRAYSIZE(parts56a), block, pAlg->cbDigest);
+    if (dwRet != SCARD_S_SUCCESS) {
+      break;
+    }
+    memcpy(pbOut + off, block, min(pAlg->cbDigest, cbOut - off));
+  }
+
+  BCryptDestroyHash(hTemplate);
+  SecureZeroMemory(block, sizeof(block));
+  return dwRet;
+}
+
+// BCRYPT_KDF_HASH and BCRYPT_KDF_HMAC: H(prepend || Z || append)
+static DWORD kdf_hash(BOOL fHmac, const BCryptBufferDesc *pParameters, const BYTE *pbSecret, DWORD cbSecret,
+                      BYTE *pbOut, DWORD cbOut) {
+  KDF_HASH_ALG *pAlg = param_hash_alg(pParameters, BCRYPT_SHA1_ALGORITHM);
+  KDF_PART key = {NULL, 0};
+  BCRYPT_HASH_HANDLE hTemplate;
+  DWORD dwRet;
+
+  if (!pAlg) {
+    return SCARD_E_INVALID_PARAMETER;
+  }
+  if (fHmac) {
+    key = param_part(pParameters, KDF_HMAC_KEY);
+    if (!key.pb) {
+      key.pb = pbSecret;
+      key.cb = cbSecret;
+    }
+  }
+  dwRet = create_template(pAlg, key.pb, key.cb, &hTemplate);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  KDF_PART parts[] = {param_part(pParameters, KDF_SECRET_PREPEND), {pbSecret, cbSecret},
+                      param_part(pParameters, KDF_SECRET_APPEND)};
+  dwRet = hash_parts(hTemplate, parts, ARRAYSIZE(parts), pbOut, cbOut);
+  BCryptDestroyHash(hTemplate);
+  return dwRet;
+}
+
+DWORD cmd_kdf_derive(LPCWSTR pwszKDF, const BCryptBufferDesc *pParameters, const BYTE *pbSecret, DWORD cbSecret,
+                     BYTE *pbOut, DWORD *pcbOut) {
+  BOOL fHash = wcscmp(pwszKDF, BCRYPT_KDF_HASH) == 0;
+  BOOL fHmac = wcscmp(pwszKDF, BCRYPT_KDF_HMAC) == 0;
+  BOOL fTls = wcscmp(pwszKDF, BCRYPT_KDF_TLS_PRF) == 0;
+  BOOL f108 = wcscmp(pwszKDF, BCRYPT_KDF_SP800108_CTR_HMAC) == 0;
+  BOOL f56a = wcscmp(pwszKDF, BCRYPT_KDF_SP80056A_CONCAT) == 0;
+  BOOL fRaw = wcscmp(pwszKDF, BCRYPT_KDF_RAW_SECRET) == 0;
+  DWORD cbOut;
+
+  // output length
+  if (fTls) {
+    cbOut = KDF_TLS_MASTER_SECRET_LEN;
+  } else if (fRaw) {
+    cbOut = cbSecret;
+  } else if (fHash || fHmac || f108 || f56a) {
+    KDF_HASH_ALG *pAlg = param_hash_alg(pParameters, fHash || fHmac ? BCRYPT_SHA1_ALGORITHM : BCRYPT_SHA256_ALGORITHM);
+    const BCryptBuffer *pBits = find_param(pParameters, KDF_KEYBITLENGTH);
+    if (!pAlg) {
+      CMD_ERROR("Unsupported KDF hash algorithm\n");
+      return SCARD_E_INVALID_PARAMETER;
+    }
+    cbOut = pAlg->cbDigest;
+    if ((f108 || f56a) && pBits && pBits->cbBuffer == sizeof(DWORD)) {
+      cbOut = (*(const DWORD *)pBits->pvBuffer + 7) / 8;
+    }
+  } else {
+    CMD_ERROR("Unsupported KDF %S\n", pwszKDF);
+    return SCARD_E_UNSUPPORTED_FEATURE;
+  }
+  if (cbOut == 0 || cbOut > CMD_KDF_MAX_OUTPUT) {
+    return SCARD_E_INVALID_PARAMETER;
+  }
+
+  *pcbOut = cbOut;
+  if (!pbOut) {
+    return SCARD_S_SUCCESS;
+  }
+
+  if (fTls) {
+    return kdf_tls_prf(pParameters, pbSecret, cbSecret, pbOut, cbOut);
+  }
+  if (f108 || f56a) {
+    return kdf_counter(f108, pParameters, pbSecret, cbSecret, pbOut, cbOut);
+  }
+  if (fRaw) {
+    // CNG returns the raw secret in little-endian order
+    for (DWORD i = 0; i < cbSecret; i++) {
+      pbOut[i] = pbSecret[cbSecret - 1 - i];
+    }
+    return SCARD_S_SUCCESS;
+  }
+  return kdf_hash(fHmac, pParameters, pbSecret, cbSecret, pbOut, cbOut);
+}
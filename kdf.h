@@ -0,0 +1,17 @@
+#pragma once
+#ifndef __KDF__H__
+#define __KDF__H__
+
+#include "cardmod.h"
+
+// Largest output of any single KDF invocation we accept.
+#define CMD_KDF_MAX_OUTPUT 1024
+
+// Derive key material from an agreed secret with one of the CNG KDFs
+// (BCRYPT_KDF_HASH, _HMAC, _TLS_PRF, _SP800108_CTR_HMAC, _SP80056A_CONCAT,
+// _RAW_SECRET), parameterized by a BCryptBufferDesc list as passed to
+// CardDeriveKey. If pbOut is NULL only *pcbOut is computed.
+DWORD cmd_kdf_derive(LPCWSTR pwszKDF, const BCryptBufferDesc *pParameters, const BYTE *pbSecret, DWORD cbSecret,
+                     BYTE *pbOut, DWORD *pcbOut);
+
+#endif // __KDF__H__
@@ -0,0 +1,249 @@
+#include "logcfg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define logcfg_store(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define logcfg_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+// Same order as enum CMD_LOG_LEVEL; "none" disables a subsystem
+static const char *const LEVEL_NAMES[] = {"trace", "debug", "info", "warn", "error", "fatal", "none"};
+static const char *const SUBSYSTEM_NAMES[CMD_LOG_SUB_COUNT] = {"general", "transport", "cache", "crypto", "pin"};
+#define LOGCFG_LEVELS (sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]))
+#define LOGCFG_MAX_SPEC 256
+
+volatile uint32_t g_log_levels = CMD_LOGCFG_UNRESOLVED;
+static int g_default_level;
+
+uint32_t cmd_logcfg_pack(int level) {
+  uint32_t levels = 0;
+  for (int sub = 0; sub < CMD_LOG_SUB_COUNT; sub++) {
+    levels |= (uint32_t)level << (CMD_LOGCFG_BITS * sub);
+  }
+  return levels;
+}
+
+static int find_name(const char *const *names, size_t count, const char *name, size_t len) {
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(names[i]) == len && memcmp(names[i], name, len) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+static int parse_level(const char *name, size_t len) {
+  if (len == 1 && name[0] >= '0' && name[0] < '0' + (int)LOGCFG_LEVELS) {
+    return name[0] - '0';
+  }
+  return find_name(LEVEL_NAMES, LOGCFG_LEVELS, name, len);
+}
+
+int cmd_logcfg_parse(const char *spec, uint32_t *levels) {
+  uint32_t parsed = *levels;
+  const char *p = spec;
+
+  while (*p) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    // trim blanks and a trailing newline from a config file
+    while (len > 0 && (*p == ' ' || *p == '\t')) {
+      p++;
+      len--;
+    }
+    while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t' || p[len - 1] == '\r' || p[len - 1] == '\n')) {
+      len--;
+    }
+    const char *eq = memchr(p, '=', len);
+    if (!eq) {
+      int level = len ? parse_level(p, len) : -1;
+      if (len && level < 0) {
+        return -1;
+      }
+      if (level >= 0) {
+        parsed = cmd_logcfg_pack(level);
+      }
+    } else {
+      int sub = find_name(SUBSYSTEM_NAMES, CMD_LOG_SUB_COUNT, p, (size_t)(eq - p));
+      int level = parse_level(eq + 1, len - (size_t)(eq - p) - 1);
+      if (sub < 0 || level < 0) {
+        return -1;
+      }
+      parsed &= ~((uint32_t)0xF << (CMD_LOGCFG_BITS * sub));
+      parsed |= (uint32_t)level << (CMD_LOGCFG_BITS * sub);
+    }
+    p = end ? end + 1 : p + strlen(p);
+  }
+  *levels = parsed;
+  return 0;
+}
+
+// A spec applied on top of the rest, for turning up the level of one process
+#define LOGCFG_ENV_SPEC "CMD_LOG_LEVELS"
+
+#ifdef _WIN32
+// LogLevel (DWORD) sets the global level, LogLevels (string) is a spec
+// applied on top of it, then CMD_LOG_LEVELS from the environment. Changes to
+// the registry are picked up while the process runs.
+#define LOGCFG_REG_KEY "SOFTWARE\\CanoKey\\Minidriver"
+#define LOGCFG_REG_LEVEL "LogLevel"
+#define LOGCFG_REG_SPEC "LogLevels"
+
+static INIT_ONCE g_once = INIT_ONCE_STATIC_INIT;
+static HKEY g_key;
+static HANDLE g_event;
+static PTP_WAIT g_wait;
+
+static uint32_t load_levels(void) {
+  uint32_t levels = cmd_logcfg_pack(g_default_level);
+  char spec[LOGCFG_MAX_SPEC];
+  DWORD level, cb = sizeof(level);
+
+  if (RegGetValueA(HKEY_LOCAL_MACHINE, LOGCFG_REG_KEY, LOGCFG_REG_LEVEL, RRF_RT_REG_DWORD, NULL, &level, &cb) ==
+          ERROR_SUCCESS &&
+      level < LOGCFG_LEVELS) {
+    levels = cmd_logcfg_pack((int)level);
+  }
+  cb = sizeof(spec);
+  if (RegGetValueA(HKEY_LOCAL_MACHINE, LOGCFG_REG_KEY, LOGCFG_REG_SPEC, RRF_RT_REG_SZ, NULL, spec, &cb) ==
+      ERROR_SUCCESS) {
+    cmd_logcfg_parse(spec, &levels);
+  }
+  DWORD cch = GetEnvironmentVariableA(LOGCFG_ENV_SPEC, spec, sizeof(spec));
+  if (cch > 0 && cch < sizeof(spec)) {
+    cmd_logcfg_parse(spec, &levels);
+  }
+  return levels;
+}
+
+// The notification fires once; it is re-armed before the values are read so
+// that a change made in between is not missed.
+static void arm_watch(void) {
+  if (RegNotifyChangeKeyValue(g_key, FALSE, REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC, g_event,
+                              TRUE) == ERROR_SUCCESS) {
+    SetThreadpoolWait(g_wait, g_event, NULL);
+  }
+}
+
+static VOID CALLBACK config_changed(PTP_CALLBACK_INSTANCE pInstance, PVOID pvContext, PTP_WAIT pWait,
+                                   TP_WAIT_RESULT result) {
+  (void)pInstance;
+  (void)pvContext;
+  (void)pWait;
+  (void)result;
+  arm_watch();
+  logcfg_store(&g_log_levels, load_levels());
+}
+
+static BOOL CALLBACK resolve_once(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+  (void)once;
+  (void)param;
+  (void)ctx;
+  logcfg_store(&g_log_levels, load_levels());
+  // without the key there is nothing to watch until the next process
+  if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, LOGCFG_REG_KEY, 0, KEY_NOTIFY, &g_key) != ERROR_SUCCESS) {
+    return TRUE;
+  }
+  g_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  g_wait = g_event ? CreateThreadpoolWait(config_changed, NULL, NULL) : NULL;
+  if (g_wait) {
+    arm_watch();
+  }
+  return TRUE;
+}
+
+void cmd_logcfg_resolve(int default_level) {
+  g_default_level = default_level;
+  InitOnceExecuteOnce(&g_once, resolve_once, NULL, NULL);
+}
+
+void cmd_logcfg_shutdown(void) {
+  if (g_wait) {
+    SetThreadpoolWait(g_wait, NULL, NULL);
+    WaitForThreadpoolWaitCallbacks(g_wait, TRUE);
+    CloseThreadpoolWait(g_wait);
+    g_wait = NULL;
+  }
+  if (g_event) {
+    CloseHandle(g_event);
+    g_event = NULL;
+  }
+  if (g_key) {
+    RegCloseKey(g_key);
+    g_key = NULL;
+  }
+}
+#else
+// CMD_LOG_LEVELS holds a spec; CMD_LOG_CONFIG names a file holding one,
+// applied on top and polled for changes.
+#define LOGCFG_ENV_FILE "CMD_LOG_CONFIG"
+#define LOGCFG_POLL_SECONDS 1
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static volatile int g_watching;
+
+static uint32_t load_levels(const char *path) {
+  uint32_t levels = cmd_logcfg_pack(g_default_level);
+  const char *spec = getenv(LOGCFG_ENV_SPEC);
+  char buf[LOGCFG_MAX_SPEC];
+
+  if (spec) {
+    cmd_logcfg_parse(spec, &levels);
+  }
+  FILE *f = path ? fopen(path, "r") : NULL;
+  if (f) {
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    cmd_logcfg_parse(buf, &levels);
+  }
+  return levels;
+}
+
+static void *watch_file(void *arg) {
+  const char *path = (const char *)arg;
+  struct timespec last = {0, 0};
+  struct stat st;
+
+  while (g_watching) {
+    if (stat(path, &st) == 0 && (st.st_mtim.tv_sec != last.tv_sec || st.st_mtim.tv_nsec != last.tv_nsec)) {
+      last = st.st_mtim;
+      logcfg_store(&g_log_levels, load_levels(path));
+    }
+    sleep(LOGCFG_POLL_SECONDS);
+  }
+  return NULL;
+}
+
+static void resolve_once(void) {
+  const char *path = getenv(LOGCFG_ENV_FILE);
+  pthread_t thread;
+
+  logcfg_store(&g_log_levels, load_levels(path));
+  if (path) {
+    g_watching = 1;
+    if (pthread_create(&thread, NULL, watch_file, (void *)path) == 0) {
+      pthread_detach(thread);
+    } else {
+      g_watching = 0;
+    }
+  }
+}
+
+void cmd_logcfg_resolve(int default_level) {
+  g_default_level = default_level;
+  pthread_once(&g_once, resolve_once);
+}
+
+void cmd_logcfg_shutdown(void) {
+  g_watching = 0;
+}
+#endif
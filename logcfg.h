@@ -0,0 +1,49 @@
+#pragma once
+#ifndef __LOGCFG__H__
+#define __LOGCFG__H__
+
+/*
+ * Log levels per subsystem, packed into one word so that a log statement is
+ * filtered with a single load. The configuration is a spec such as
+ * "info,transport=trace,pin=none": a global level followed by overrides.
+ * On Windows it is read from the registry, elsewhere from the environment
+ * or a file, and reloaded when it changes. Like pool.c, this file only
+ * depends on the C runtime and the platform API, so it builds on Linux.
+ */
+
+#include <stdint.h>
+
+// Subsystems with their own level. A source file picks one by defining
+// CMD_LOG_SUBSYSTEM before including logging.h.
+enum CMD_LOG_SUBSYSTEM_ID {
+  CMD_LOG_SUB_GENERAL = 0,
+  CMD_LOG_SUB_TRANSPORT, // APDUs and the card connection
+  CMD_LOG_SUB_CACHE,     // caches, prefetch and the data read into them
+  CMD_LOG_SUB_CRYPTO,    // signatures, key agreement and derivation
+  CMD_LOG_SUB_PIN,       // PIN verification
+  CMD_LOG_SUB_COUNT,
+};
+
+// Four bits of level per subsystem. While the top bit is set the
+// configuration has not been read; every statement then reaches
+// cmd_logcfg_resolve, which reads it.
+#define CMD_LOGCFG_BITS 4
+#define CMD_LOGCFG_UNRESOLVED 0x80000000U
+
+extern volatile uint32_t g_log_levels;
+
+#define CMD_LOGCFG_LEVEL(levels, sub) ((int)(((levels) >> (CMD_LOGCFG_BITS * (sub))) & 0xF))
+
+// Every subsystem at level.
+uint32_t cmd_logcfg_pack(int level);
+// Apply a spec on top of *levels. Returns 0 on success; *levels is left
+// unchanged if the spec is malformed.
+int cmd_logcfg_parse(const char *spec, uint32_t *levels);
+
+// Read the configuration once and start watching it for changes.
+// default_level applies where nothing is configured.
+void cmd_logcfg_resolve(int default_level);
+// Stop watching; called when the DLL is unloaded.
+void cmd_logcfg_shutdown(void);
+
+#endif // __LOGCFG__H__
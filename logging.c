@@ -1,9 +1,14 @@
 #include "logging.h"
+#include "corr.h"
+#include "hex.h"
+#include "ringlog.h"
+#include "ticks.h"
 
 #include <stdarg.h>
 #include <fcntl.h>
 #include <io.h>
 #include <assert.h>
+#include <string.h>
 #include <Windows.h>
 
 const char* g_log_level_name[CMD_LOG_LEVEL_SIZE] = {
@@ -16,17 +21,28 @@ const char* g_log_level_name[CMD_LOG_LEVEL_SIZE] = {
 	"NONE",
 };
 
-// default values
-int g_log_level = CMD_LOG_LEVEL_NONE;
-
-int cmd_init_logging(const char* log_file, const int log_level) {
-  static bool is_initialized = false;
-  static int log_fd;
+// Size of the ring log file of a process; 0 keeps a plain text file
+// instead, which grows without limit.
+#ifndef CMD_LOG_RING_SIZE
+#define CMD_LOG_RING_SIZE (1024 * 1024)
+#endif
+// Ring log files kept in C:\Logs, reused oldest first by the processes that
+// log at the same time or after one another
+#ifndef CMD_LOG_RING_FILES
+#define CMD_LOG_RING_FILES 8
+#endif
 
-  if (is_initialized || log_file == NULL) {
-    return 0;
-  }
+// The file is only created by the first statement that passes the level
+static INIT_ONCE g_file_once = INIT_ONCE_STATIC_INIT;
+static BOOL g_log_open = FALSE;
+static CMD_RINGLOG* g_ring = NULL;
+// Local time of day at g_base_ticks, for the plain text file
+static uint64_t g_base_ticks;
+static uint64_t g_base_ms;
 
+#define MS_PER_DAY (24 * 3600 * 1000)
+
+static BOOL open_text_file(const char* log_file) {
   // create log file in shared mode
   HANDLE hFile = CreateFile(
     log_file,
@@ -37,49 +53,177 @@ int cmd_init_logging(const char* log_file, const int log_level) {
     FILE_ATTRIBUTE_NORMAL,
     NULL
   );
+  if (hFile == INVALID_HANDLE_VALUE) {
+    return FALSE;
+  }
 
   // convert file handle to fd
-  assert(hFile != INVALID_HANDLE_VALUE);
-  log_fd = _open_osfhandle((intptr_t)hFile, _O_CREAT | _O_APPEND | _O_BINARY);
-  assert(log_fd != -1);
+  int log_fd = _open_osfhandle((intptr_t)hFile, _O_CREAT | _O_APPEND | _O_BINARY);
+  if (log_fd == -1) {
+    CloseHandle(hFile);
+    return FALSE;
+  }
 
   // redirect stderr to log file
   FILE* old_stderr;
   // stderr might be already closed - open it first
-  assert(freopen_s(&old_stderr, "NUL", "w", stderr) == 0);
-  assert(_dup2(log_fd, _fileno(stderr)) != -1);
-  assert(_close(log_fd) == 0);
-
-  // set global log level
-	if (log_level >= 0 && log_level < CMD_LOG_LEVEL_SIZE) {
-		g_log_level = log_level;
-	}
-	else {
-		g_log_level = CMD_LOG_LEVEL_INFO;
-	}
-  is_initialized = true;
-
-  return 0;
+  if (freopen_s(&old_stderr, "NUL", "w", stderr) != 0 || _dup2(log_fd, _fileno(stderr)) == -1) {
+    _close(log_fd);
+    return FALSE;
+  }
+  _close(log_fd);
+  return TRUE;
+}
+
+// Write a line that is not a log statement
+static void write_text(const int level, const char* text) {
+  if (g_ring) {
+    cmd_ringlog_write(g_ring, level, cmd_ticks(), g_corr.context, g_corr.op, text, strlen(text));
+  } else {
+    fputs(text, stderr);
+    fflush(stderr);
+  }
+}
+
+static BOOL CALLBACK open_log_file(PINIT_ONCE once, PVOID param, PVOID* ctx) {
+  char log_file[64], line[128];
+
+  (void)once;
+  (void)param;
+  (void)ctx;
+  CreateDirectory("C:\\Logs", NULL); // ignore errors
+  if (CMD_LOG_RING_SIZE > 0) {
+    // the header names the process; with every slot taken, nothing is logged
+    g_ring = cmd_ringlog_open_slot("C:\\Logs\\canokey_minidriver_", CMD_LOG_RING_FILES, CMD_LOG_RING_SIZE, log_file,
+                                   sizeof(log_file));
+    g_log_open = g_ring != NULL;
+  } else {
+    char time[16];
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    sprintf_s(time, sizeof(time), "%04d%02d%02d_%02d%02d%02d", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute,
+              st.wSecond);
+    sprintf_s(log_file, sizeof(log_file), "C:\\Logs\\canokey_minidriver_%s_%d.log", time,
+              (int)GetCurrentProcessId());
+    g_log_open = open_text_file(log_file);
+    // the only clock read; lines are stamped relative to it
+    g_base_ticks = cmd_ticks();
+    g_base_ms = ((st.wHour * 60 + st.wMinute) * 60 + st.wSecond) * 1000 + st.wMilliseconds;
+  }
+  if (!g_log_open) {
+    return TRUE; // log statements are dropped
+  }
+
+  // not through cmd_fprintf, which is waiting for this callback
+  sprintf_s(line, sizeof(line), "Start logging to file %s with levels %05X\n", log_file, (unsigned)g_log_levels);
+  write_text(CMD_LOG_LEVEL_INFO, line);
+  sprintf_s(line, sizeof(line), "CanoKey Smart Card Minidriver compiled at %s %s\n", __DATE__, __TIME__);
+  write_text(CMD_LOG_LEVEL_INFO, line);
+  return TRUE;
 }
 
 int cmd_stop_logging() {
-  fclose(stderr);
+  // never create the file just to say goodbye
+  if (!g_log_open) {
+    return 0;
+  }
+  write_text(CMD_LOG_LEVEL_INFO, "DLL unloaded, stop logging...\n");
+  write_text(CMD_LOG_LEVEL_INFO, "========================================\n");
+  if (g_ring) {
+    cmd_ringlog_close(g_ring);
+    g_ring = NULL;
+    return 0;
+  }
+  return fclose(stderr);
 }
 
-void cmd_fprintf(const int level, FILE* const out, const char* const format, ...) {
-	if (level < g_log_level) {
-		return;
-	}
-  // print current time at the beginning of the log line
-  char time[16];
-  SYSTEMTIME st;
-  GetLocalTime(&st);
-  sprintf_s(time, sizeof(time), "%02d:%02d:%02d.%03d", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
-  fprintf(out, "%s - ", time);
-  // print the log line
-	va_list args;
-	va_start(args, format);
-	vfprintf(out, format, args);
-	va_end(args);
-	fflush(out);
+void cmd_fprintf(const int subsystem, const int level, FILE* const out, const char* const format, ...) {
+  // before anything else, so that the time is that of the statement
+  uint64_t ticks = cmd_ticks();
+  CMD_CORR corr = g_corr;
+  uint32_t levels = g_log_levels;
+  if (levels & CMD_LOGCFG_UNRESOLVED) {
+    cmd_logcfg_resolve(CMD_LOG_LEVEL_DEFAULT);
+    levels = g_log_levels;
+  }
+  if (level < CMD_LOGCFG_LEVEL(levels, subsystem)) {
+    return;
+  }
+  InitOnceExecuteOnce(&g_file_once, open_log_file, NULL, NULL);
+  if (!g_log_open) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  if (g_ring) {
+    // format into the record; no system call, and the decoder prints the time
+    char line[CMD_RINGLOG_MAX_TEXT];
+    int cb = vsnprintf(line, sizeof(line), format, args);
+    if (cb > 0) {
+      cmd_ringlog_write(g_ring, level, ticks, corr.context, corr.op, line,
+                        cb < (int)sizeof(line) ? cb : (int)sizeof(line) - 1);
+    }
+  } else {
+    // print current time and the correlation IDs at the beginning of the log line
+    uint64_t elapsed_us = cmd_ticks_to_us(ticks > g_base_ticks ? ticks - g_base_ticks : 0);
+    unsigned ms = (unsigned)((g_base_ms + elapsed_us / 1000) % MS_PER_DAY);
+    fprintf(out, "%02u:%02u:%02u.%03u [%u:%u] - ", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000,
+            (unsigned)corr.context, (unsigned)corr.op);
+    // print the log line
+    vfprintf(out, format, args);
+    fflush(out);
+  }
+  va_end(args);
 }
+
+// Instructions whose data carries PINs or keys. Only the header of such a
+// command is written, or only the status word of such a response: agreed
+// secrets and decrypted keys come back from GENERAL AUTHENTICATE.
+#define APDU_REDACT_COMMAND 1
+#define APDU_REDACT_RESPONSE 2
+static const uint8_t APDU_REDACT[256] = {
+  [0x20] = APDU_REDACT_COMMAND,  // VERIFY
+  [0x24] = APDU_REDACT_COMMAND,  // CHANGE REFERENCE DATA
+  [0x2C] = APDU_REDACT_COMMAND,  // RESET RETRY COUNTER
+  [0x87] = APDU_REDACT_RESPONSE, // GENERAL AUTHENTICATE
+  [0xFE] = APDU_REDACT_COMMAND,  // IMPORT ASYMMETRIC KEY
+};
+
+// Bytes per line, so that a line fits a ring log record
+#define APDU_TRACE_LINE 256
+
+static void trace_hex(uint8_t bIns, char dir, const uint8_t* pb, size_t cb) {
+  char hex[2 * APDU_TRACE_LINE];
+  size_t off = 0;
+
+  do {
+    size_t n = cb - off < APDU_TRACE_LINE ? cb - off : APDU_TRACE_LINE;
+    cmd_hex_encode(hex, pb + off, n);
+    CMD_LOGF(CMD_LOG_SUB_TRANSPORT, CMD_LOG_LEVEL_TRACE, "APDU %02X %c %04X: %.*s\n", bIns, dir, (unsigned)off,
+             (int)(2 * n), hex);
+    off += n;
+  } while (off < cb);
+}
+
+static void trace_redacted(uint8_t bIns, char dir, const uint8_t* pbClear, size_t cbClear, size_t cbHidden) {
+  char hex[8];
+
+  cmd_hex_encode(hex, pbClear, cbClear);
+  CMD_LOGF(CMD_LOG_SUB_TRANSPORT, CMD_LOG_LEVEL_TRACE, "APDU %02X %c %.*s, %u bytes redacted\n", bIns, dir,
+           (int)(2 * cbClear), hex, (unsigned)cbHidden);
+}
+
+void cmd_trace_apdu(uint8_t bIns, const uint8_t* pbCmd, size_t cbCmd, const uint8_t* pbResp, size_t cbResp) {
+  uint8_t redact = APDU_REDACT[bIns];
+
+  if ((redact & APDU_REDACT_COMMAND) && cbCmd > 4) {
+    trace_redacted(bIns, '>', pbCmd, 4, cbCmd - 4);
+  } else {
+    trace_hex(bIns, '>', pbCmd, cbCmd);
+  }
+  if ((redact & APDU_REDACT_RESPONSE) && cbResp > 2) {
+    trace_redacted(bIns, '<', pbResp + cbResp - 2, 2, cbResp - 2);
+  } else {
+    trace_hex(bIns, '<', pbResp, cbResp);
+  }
+}
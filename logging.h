@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 
+#include "logcfg.h"
 #include "third-party/dbg.h"
 
 enum CMD_LOG_LEVEL {
@@ -20,13 +21,37 @@ enum CMD_LOG_LEVEL {
 extern const char* g_log_level_name[CMD_LOG_LEVEL_SIZE];
 
 extern FILE* g_log_file;
-extern int g_log_level;
 
-extern int cmd_init_logging(const char* log_file, const int log_level);
+// Level used where the configuration (see logcfg.h) sets none. Release
+// builds only log warnings and errors unless configured otherwise.
+#ifndef CMD_LOG_LEVEL_DEFAULT
+#ifdef NDEBUG
+#define CMD_LOG_LEVEL_DEFAULT CMD_LOG_LEVEL_WARNING
+#else
+#define CMD_LOG_LEVEL_DEFAULT CMD_LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// Subsystem of the statements in a source file; define it before including
+// this header to pick another one.
+#ifndef CMD_LOG_SUBSYSTEM
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_GENERAL
+#endif
+
+// The configuration is read and the log file created on the first log
+// statement, not when the DLL is loaded, so processes that never use a card
+// leave no file.
 extern int cmd_stop_logging();
-extern void cmd_fprintf(const int level, FILE* const out, const char* format, ...);
+extern void cmd_fprintf(const int subsystem, const int level, FILE* const out, const char* format, ...);
 
-#define CMD_PRINTLOGF(level, format, ...) cmd_fprintf(level, stderr, "%-20s(%-20s:%03d)[%-5s]: " format, __FUNCTION__, __FILE__, __LINE__, g_log_level_name[level], ##__VA_ARGS__);
+// A disabled statement costs one load of g_log_levels; its arguments are not evaluated.
+#define CMD_LOG_ENABLED(subsystem, level) (CMD_LOGCFG_LEVEL(g_log_levels, subsystem) <= (level))
+#define CMD_LOGF(subsystem, level, format, ...) \
+  do { \
+    if (CMD_LOG_ENABLED(subsystem, level)) \
+      cmd_fprintf(subsystem, level, stderr, "%-20s(%-20s:%03d)[%-5s]: " format, __FUNCTION__, __FILE__, __LINE__, g_log_level_name[level], ##__VA_ARGS__); \
+  } while (0)
+#define CMD_PRINTLOGF(level, format, ...) CMD_LOGF(CMD_LOG_SUBSYSTEM, level, format, ##__VA_ARGS__)
 #define CMD_TRACE(format, ...) CMD_PRINTLOGF(CMD_LOG_LEVEL_TRACE, format, ##__VA_ARGS__)
 #define CMD_DEBUG(format, ...) CMD_PRINTLOGF(CMD_LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
 #define CMD_INFO(format, ...) CMD_PRINTLOGF(CMD_LOG_LEVEL_INFO, format, ##__VA_ARGS__)
@@ -34,6 +59,17 @@ extern void cmd_fprintf(const int level, FILE* const out, const char* format, ..
 #define CMD_ERROR(format, ...) CMD_PRINTLOGF(CMD_LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
 #define CMD_FATAL(format, ...) CMD_PRINTLOGF(CMD_LOG_LEVEL_FATAL, format, ##__VA_ARGS__)
 
+// Hex dump of a command and its response, one APDU exchange with the card.
+// bIns is that of the command the exchange belongs to, so that chained blocks
+// and GET RESPONSE are redacted like the command itself: the data of VERIFY,
+// CHANGE REFERENCE DATA and the like is never written.
+extern void cmd_trace_apdu(uint8_t bIns, const uint8_t* pbCmd, size_t cbCmd, const uint8_t* pbResp, size_t cbResp);
+#define CMD_TRACE_APDU(bIns, pbCmd, cbCmd, pbResp, cbResp) \
+  do { \
+    if (CMD_LOG_ENABLED(CMD_LOG_SUB_TRANSPORT, CMD_LOG_LEVEL_TRACE)) \
+      cmd_trace_apdu(bIns, pbCmd, cbCmd, pbResp, cbResp); \
+  } while (0)
+
 
 #ifdef CMD_VERBOSE
 #define FUNC_TRACE(CALL) dbg(CALL)
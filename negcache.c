@@ -0,0 +1,39 @@
+#include "negcache.h"
+#include "context.h"
+
+// Entries recorded at another freshness are void.
+static PCMD_NEGCACHE current_cache(PCMD_CONTEXT pContext) {
+  PCMD_NEGCACHE pCache = &pContext->negCache;
+  if (pCache->wFreshness != pContext->cardcf.wContainersFreshness) {
+    pCache->wFreshness = pContext->cardcf.wContainersFreshness;
+    pCache->dwMissingCerts = 0;
+  }
+  return pCache;
+}
+
+BOOL cmd_negcache_cert_missing(PCARD_DATA pCardData, BYTE bContainerIndex) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  if (bContainerIndex >= CMD_PIV_NUM_SLOTS) {
+    return FALSE;
+  }
+  if (current_cache(pContext)->dwMissingCerts & (1UL << bContainerIndex)) {
+    return TRUE;
+  }
+  const CMD_PUBKEY *pKey = &pContext->rgPubKeys[bContainerIndex];
+  return pKey->fValid && pKey->wFreshness == pContext->cardcf.wContainersFreshness && !pKey->fPresent;
+}
+
+void cmd_negcache_set_cert_missing(PCARD_DATA pCardData, BYTE bContainerIndex) {
+  if (bContainerIndex < CMD_PIV_NUM_SLOTS) {
+    current_cache(CMD_CONTEXT_OF(pCardData))->dwMissingCerts |= 1UL << bContainerIndex;
+  }
+}
+
+void cmd_negcache_rekey(PCMD_NEGCACHE pCache, WORD wOld, WORD wNew, DWORD dwChanged) {
+  if (pCache->wFreshness != wOld) {
+    return;
+  }
+  pCache->wFreshness = wNew;
+  pCache->dwMissingCerts &= ~dwChanged;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef __NEGCACHE__H__
+#define __NEGCACHE__H__
+
+#include "cardmod.h"
+
+// Certificate files the card is known not to have. The Base CSP probes
+// kscXX / kxcXX for containers that may not exist; a miss costs a full GET
+// DATA otherwise. Entries are keyed by the container freshness counter.
+typedef struct _CMD_NEGCACHE {
+  WORD wFreshness;       // wContainersFreshness of cardcf the entries are valid for
+  DWORD dwMissingCerts;  // bit i: container i has no certificate
+} CMD_NEGCACHE, *PCMD_NEGCACHE;
+
+// Whether the certificate of a container is known to be absent, either from a
+// previous read or because the container holds no key.
+BOOL cmd_negcache_cert_missing(PCARD_DATA pCardData, BYTE bContainerIndex);
+void cmd_negcache_set_cert_missing(PCARD_DATA pCardData, BYTE bContainerIndex);
+// Move the entries from wOld to wNew, dropping the containers in dwChanged.
+void cmd_negcache_rekey(PCMD_NEGCACHE pCache, WORD wOld, WORD wNew, DWORD dwChanged);
+
+#endif // __NEGCACHE__H__
@@ -0,0 +1,406 @@
+#include "piv.h"
+#include "apdu.h"
+#include "arena.h"
+#include "context.h"
+#include "inflate.h"
+#include "logging.h"
+#include "program.h"
+#include "throughput.h"
+#include "tlv.h"
+
+#include <string.h>
+
+static const BYTE PIV_AID[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+
+BOOL cmd_piv_container_to_slot(BYTE bContainerIndex, BYTE *pbSlot) {
+  static const BYTE primary[] = {CMD_PIV_SLOT_AUTHENTICATION, CMD_PIV_SLOT_SIGNATURE, CMD_PIV_SLOT_KEY_MANAGEMENT,
+                                 CMD_PIV_SLOT_CARD_AUTHENTICATION};
+
+  if (bContainerIndex < sizeof(primary)) {
+    *pbSlot = primary[bContainerIndex];
+    return TRUE;
+  }
+  if (bContainerIndex < CMD_PIV_NUM_SLOTS) {
+    *pbSlot = (BYTE)(CMD_PIV_SLOT_RETIRED_FIRST + bContainerIndex - sizeof(primary));
+    return TRUE;
+  }
+  return FALSE;
+}
+
+BOOL cmd_piv_slot_is_key_exchange(BYTE bSlot) {
+  return bSlot == CMD_PIV_SLOT_KEY_MANAGEMENT ||
+         (bSlot >= CMD_PIV_SLOT_RETIRED_FIRST && bSlot <= CMD_PIV_SLOT_RETIRED_LAST);
+}
+
+DWORD cmd_piv_cert_object(BYTE bSlot) {
+  switch (bSlot) {
+  case CMD_PIV_SLOT_AUTHENTICATION:
+    return 0x5FC105;
+  case CMD_PIV_SLOT_SIGNATURE:
+    return 0x5FC10A;
+  case CMD_PIV_SLOT_KEY_MANAGEMENT:
+    return 0x5FC10B;
+  case CMD_PIV_SLOT_CARD_AUTHENTICATION:
+    return 0x5FC101;
+  default:
+    // retired key management certificates 5FC10D..5FC120
+    return 0x5FC10D + (bSlot - CMD_PIV_SLOT_RETIRED_FIRST);
+  }
+}
+
+DWORD cmd_piv_select(PCARD_DATA pCardData) {
+  WORD sw;
+  DWORD dwRet = cmd_apdu_transmit(pCardData, 0x00, CMD_PIV_INS_SELECT, 0x04, 0x00, PIV_AID, sizeof(PIV_AID), NULL,
+                                  NULL, &sw);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (sw != CMD_SW_OK) {
+    CMD_ERROR("SELECT PIV failed with SW %04X\n", sw);
+    return SCARD_E_CARD_UNSUPPORTED;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_piv_get_data_prefix(PCARD_DATA pCardData, DWORD dwObject, BYTE *pbData, DWORD *pcbData,
+                              CMD_APDU_DONE_FN pfnDone, void *pvArg) {
+  BYTE cmd[5];
+  DWORD cbCmd = 0;
+  WORD sw;
+
+  cmd[cbCmd++] = CMD_PIV_TAG_TAG_LIST;
+  cmd[cbCmd++] = 3;
+  cbCmd += cmd_tlv_put_tag(cmd + cbCmd, dwObject);
+
+  DWORD dwRet = cmd_apdu_transmit_until(pCardData, 0x00, CMD_PIV_INS_GET_DATA, 0x3F, 0xFF, cmd, cbCmd, pbData, pcbData,
+                                        &sw, pfnDone, pvArg);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  return cmd_sw_to_error(sw);
+}
+
+DWORD cmd_piv_get_data(PCARD_DATA pCardData, DWORD dwObject, BYTE *pbData, DWORD *pcbData) {
+  DWORD cbResp = *pcbData, cbValue;
+  const BYTE *pbValue;
+
+  DWORD dwRet = cmd_piv_get_data_prefix(pCardData, dwObject, pbData, &cbResp, NULL, NULL);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (!cmd_tlv_find(pbData, cbResp, CMD_PIV_TAG_DATA, &pbValue, &cbValue)) {
+    CMD_ERROR("Malformed data object %06X\n", dwObject);
+    return SCARD_E_UNEXPECTED;
+  }
+  memmove(pbData, pbValue, cbValue);
+  *pcbData = cbValue;
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_piv_get_metadata(PCARD_DATA pCardData, BYTE bSlot, BYTE *pbData, DWORD *pcbData) {
+  WORD sw;
+  DWORD dwRet =
+      cmd_apdu_transmit(pCardData, 0x00, CMD_PIV_INS_GET_METADATA, 0x00, bSlot, NULL, 0, pbData, pcbData, &sw);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (sw == 0x6A81 || sw == 0x6E00) {
+    // function or class not supported by older firmware
+    return SCARD_E_UNSUPPORTED_FEATURE;
+  }
+  return cmd_sw_to_error(sw);
+}
+
+DWORD cmd_piv_get_serial(PCARD_DATA pCardData, BYTE *pbSerial) {
+  DWORD cbSerial = CMD_PIV_SERIAL_LEN;
+  WORD sw;
+  DWORD dwRet =
+      cmd_apdu_transmit(pCardData, 0x00, CMD_PIV_INS_GET_SERIAL, 0x00, 0x00, NULL, 0, pbSerial, &cbSerial, &sw);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (sw == 0x6A81 || sw == 0x6E00) {
+    return SCARD_E_UNSUPPORTED_FEATURE;
+  }
+  dwRet = cmd_sw_to_error(sw);
+  if (dwRet == SCARD_S_SUCCESS && cbSerial != CMD_PIV_SERIAL_LEN) {
+    CMD_ERROR("GET SERIAL returned %d bytes\n", cbSerial);
+    return SCARD_E_UNEXPECTED;
+  }
+  return dwRet;
+}
+
+// Find the certificate in the content of a certificate object and the size
+// it will have once extracted.
+static DWORD locate_cert(const BYTE *pbObject, DWORD cbObject, const BYTE **ppbCert, DWORD *pcbCert,
+                         BOOL *pfCompressed, DWORD *pcbOut) {
+  const BYTE *pbInfo;
+  DWORD cbInfo;
+
+  if (!cmd_tlv_find(pbObject, cbObject, CMD_PIV_TAG_CERTIFICATE, ppbCert, pcbCert)) {
+    // an empty object means there is no certificate
+    return SCARD_E_FILE_NOT_FOUND;
+  }
+  *pfCompressed = FALSE;
+  if (cmd_tlv_find(pbObject, cbObject, CMD_PIV_TAG_CERT_INFO, &pbInfo, &cbInfo) && cbInfo == 1) {
+    *pfCompressed = (pbInfo[0] & CMD_PIV_CERT_INFO_GZIP) != 0;
+  }
+  *pcbOut = *pfCompressed ? cmd_gzip_size(*ppbCert, *pcbCert, CMD_PIV_MAX_CERT_LEN) : *pcbCert;
+  if (*pcbOut == 0) {
+    CMD_ERROR("Certificate object is empty or inflates beyond %d bytes\n", CMD_PIV_MAX_CERT_LEN);
+    return SCARD_E_UNEXPECTED;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+// *pcbOut is the size found by locate_cert, which the output must match.
+static DWORD extract_cert(const BYTE *pbCert, DWORD cbCert, BOOL fCompressed, PBYTE pbOut, DWORD *pcbOut) {
+  if (!fCompressed) {
+    memcpy(pbOut, pbCert, cbCert);
+    *pcbOut = cbCert;
+    return SCARD_S_SUCCESS;
+  }
+  uint32_t cbOut = *pcbOut;
+  DWORD dwRet = cmd_gzip_inflate(pbCert, cbCert, pbOut, &cbOut);
+  if (dwRet == SCARD_S_SUCCESS && cbOut != *pcbOut) {
+    dwRet = SCARD_E_UNEXPECTED;
+  }
+  if (dwRet != SCARD_S_SUCCESS) {
+    CMD_ERROR("Failed to inflate the certificate: %x\n", dwRet);
+    return dwRet;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_piv_cert_from_object(PCARD_DATA pCardData, const BYTE *pbObject, DWORD cbObject, PBYTE *ppbCert,
+                               DWORD *pcbCert) {
+  const BYTE *pbCert;
+  DWORD cbCert, cbOut;
+  BOOL fCompressed;
+
+  DWORD dwRet = locate_cert(pbObject, cbObject, &pbCert, &cbCert, &fCompressed, &cbOut);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  PBYTE pbOut = (PBYTE)pCardData->pfnCspAlloc(cbOut);
+  if (!pbOut) {
+    return ERROR_OUTOFMEMORY;
+  }
+  // inflate straight into the buffer handed to the caller
+  dwRet = extract_cert(pbCert, cbCert, fCompressed, pbOut, &cbOut);
+  if (dwRet != SCARD_S_SUCCESS) {
+    pCardData->pfnCspFree(pbOut);
+    return dwRet;
+  }
+  *ppbCert = pbOut;
+  *pcbCert = cbOut;
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_piv_cert_from_object_scratch(PCARD_DATA pCardData, const BYTE *pbObject, DWORD cbObject,
+                                       const BYTE **ppbCert, DWORD *pcbCert) {
+  const BYTE *pbCert;
+  DWORD cbCert, cbOut;
+  BOOL fCompressed;
+
+  DWORD dwRet = locate_cert(pbObject, cbObject, &pbCert, &cbCert, &fCompressed, &cbOut);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (!fCompressed) {
+    *ppbCert = pbCert;
+    *pcbCert = cbCert;
+    return SCARD_S_SUCCESS;
+  }
+  PBYTE pbOut = (PBYTE)cmd_arena_alloc(cmd_arena_of(pCardData), cbOut);
+  if (!pbOut) {
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  dwRet = extract_cert(pbCert, cbCert, TRUE, pbOut, &cbOut);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  *ppbCert = pbOut;
+  *pcbCert = cbOut;
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_piv_read_cert(PCARD_DATA pCardData, BYTE bSlot, PBYTE *ppbCert, DWORD *pcbCert) {
+  PCMD_ARENA pArena = cmd_arena_of(pCardData);
+  DWORD dwMark = cmd_arena_mark(pArena), cbObject = CMD_PIV_MAX_OBJECT_LEN;
+
+  PBYTE pbObject = (PBYTE)cmd_arena_alloc(pArena, cbObject);
+  if (!pbObject) {
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  cmd_throughput_calibrate(pCardData, cmd_piv_cert_object(bSlot));
+  DWORD dwRet = cmd_piv_get_data(pCardData, cmd_piv_cert_object(bSlot), pbObject, &cbObject);
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_piv_cert_from_object(pCardData, pbObject, cbObject, ppbCert, pcbCert);
+  }
+  cmd_arena_release(pArena, dwMark);
+  return dwRet;
+}
+
+static const CMD_APDU_SW_RULE SELECT_RULES[] = {
+    {.wSw = 0x0000, .wMask = 0x0000, .bAction = CMD_APDU_SW_FAIL, .dwResult = SCARD_E_CARD_UNSUPPORTED},
+};
+
+#define SELECT_STEP                                                                                                    \
+  {                                                                                                                    \
+    .pszName = "SELECT PIV", .bIns = CMD_PIV_INS_SELECT, .bP1 = 0x04, .iP1Arg = CMD_APDU_NO_BINDING,                   \
+    .iP2Arg = CMD_APDU_NO_BINDING, .iData = CMD_APDU_NO_BINDING, .pbData = PIV_AID, .cbData = sizeof(PIV_AID),         \
+    .iResp = CMD_APDU_NO_BINDING, .pRules = SELECT_RULES, .cRules = ARRAYSIZE(SELECT_RULES),                           \
+  }
+
+// Binding 0: the padded PIN
+static const CMD_APDU_STEP VERIFY_PIN_STEPS[] = {
+    SELECT_STEP,
+    {
+        .pszName = "VERIFY",
+        .bIns = CMD_PIV_INS_VERIFY,
+        .bP2 = CMD_PIV_PIN_REF,
+        .iP1Arg = CMD_APDU_NO_BINDING,
+        .iP2Arg = CMD_APDU_NO_BINDING,
+        .iData = 0,
+        .iResp = CMD_APDU_NO_BINDING,
+    },
+};
+
+// Arguments: algorithm, slot. Binding 0: the dynamic authentication
+// template, binding 1: the response.
+static const CMD_APDU_STEP GENERAL_AUTHENTICATE_STEPS[] = {
+    SELECT_STEP,
+    {
+        .pszName = "GENERAL AUTHENTICATE",
+        .bIns = CMD_PIV_INS_GENERAL_AUTHENTICATE,
+        .iP1Arg = 0,
+        .iP2Arg = 1,
+        .iData = 0,
+        .iResp = 1,
+    },
+};
+
+// GENERAL AUTHENTICATE also comes without its leading SELECT, for callers
+// that already selected PIV in their transaction.
+static const CMD_APDU_PROGRAM PROGRAM_SELECT_VERIFY_PIN = {"VERIFY PIN", VERIFY_PIN_STEPS, 2};
+static const CMD_APDU_PROGRAM PROGRAM_GENERAL_AUTHENTICATE = {"GENERAL AUTHENTICATE", GENERAL_AUTHENTICATE_STEPS + 1,
+                                                              1};
+static const CMD_APDU_PROGRAM PROGRAM_SELECT_GENERAL_AUTHENTICATE = {"GENERAL AUTHENTICATE",
+                                                                     GENERAL_AUTHENTICATE_STEPS, 2};
+
+static DWORD verify_pin(PCARD_DATA pCardData, const CMD_APDU_PROGRAM *pProgram, const BYTE *pbPin, DWORD cbPin,
+                        PDWORD pcAttemptsRemaining) {
+  CMD_SECMEM *pSecure = CMD_CONTEXT_OF(pCardData)->pSecure;
+  CMD_APDU_RUN run;
+
+  if (cbPin == 0 || cbPin > CMD_PIV_PIN_MAX_LEN) {
+    return SCARD_W_WRONG_CHV;
+  }
+  BYTE *pbPadded = (BYTE *)cmd_secmem_acquire(pSecure);
+  if (!pbPadded) {
+    return SCARD_E_NO_MEMORY;
+  }
+
+  // PIV PINs are padded with 0xFF to 8 bytes
+  memset(pbPadded, 0xFF, CMD_PIV_PIN_MAX_LEN);
+  memcpy(pbPadded, pbPin, cbPin);
+  memset(&run, 0, sizeof(run));
+  run.rgBindings[0].pbIn = pbPadded;
+  run.rgBindings[0].cbIn = CMD_PIV_PIN_MAX_LEN;
+  DWORD dwRet = cmd_apdu_run(pCardData, pProgram, &run);
+  cmd_secmem_release(pSecure, pbPadded);
+  CMD_LOGF(CMD_LOG_SUB_PIN, CMD_LOG_LEVEL_DEBUG, "VERIFY stopped at step %d with SW %04X\n", run.iStep, run.wSw);
+
+  if (pcAttemptsRemaining) {
+    BOOL fVerified = run.iStep == pProgram->cSteps - 1;
+    if (fVerified && (run.wSw & 0xFFF0) == CMD_SW_VERIFY_FAIL) {
+      *pcAttemptsRemaining = run.wSw & 0x000F;
+    } else if (fVerified && run.wSw == CMD_SW_AUTH_BLOCKED) {
+      *pcAttemptsRemaining = 0;
+    } else {
+      *pcAttemptsRemaining = (DWORD)-1;
+    }
+  }
+  return dwRet;
+}
+
+DWORD cmd_piv_select_and_verify_pin(PCARD_DATA pCardData, const BYTE *pbPin, DWORD cbPin,
+                                    PDWORD pcAttemptsRemaining) {
+  return verify_pin(pCardData, &PROGRAM_SELECT_VERIFY_PIN, pbPin, cbPin, pcAttemptsRemaining);
+}
+
+static DWORD general_authenticate(PCARD_DATA pCardData, const CMD_APDU_PROGRAM *pProgram, BYTE bAlg, BYTE bSlot,
+                                  BYTE bInputTag, const BYTE *pbInput, DWORD cbInput, BYTE *pbOutput,
+                                  DWORD *pcbOutput) {
+  // 7C L { 82 00, <tag> L <input> }; inputs are at most a 4096-bit block
+  BYTE cmd[4 + 4 + 512 + 4];
+  CMD_SECMEM *pSecure = CMD_CONTEXT_OF(pCardData)->pSecure;
+  BYTE *resp;
+  DWORD cbInner = 2 + 1 + CMD_TLV_LEN_SIZE(cbInput) + cbInput;
+  DWORD cbCmd = 0, cbValue;
+  const BYTE *pbTemplate, *pbValue;
+  DWORD cbTemplate;
+  CMD_APDU_RUN run;
+  DWORD dwRet;
+
+  if (cbInput > 512) {
+    return SCARD_E_INVALID_PARAMETER;
+  }
+  // carries the signature, the decrypted block or the agreed secret
+  resp = (BYTE *)cmd_secmem_acquire_span(pSecure, CMD_PIV_AUTH_RESP_LEN);
+  if (!resp) {
+    return SCARD_E_NO_MEMORY;
+  }
+
+  cmd[cbCmd++] = CMD_PIV_TAG_DYN_AUTH;
+  cbCmd += cmd_tlv_put_len(cmd + cbCmd, cbInner);
+  cmd[cbCmd++] = CMD_PIV_TAG_RESPONSE;
+  cmd[cbCmd++] = 0x00;
+  cmd[cbCmd++] = bInputTag;
+  cbCmd += cmd_tlv_put_len(cmd + cbCmd, cbInput);
+  memcpy(cmd + cbCmd, pbInput, cbInput);
+  cbCmd += cbInput;
+
+  memset(&run, 0, sizeof(run));
+  run.rgbArgs[0] = bAlg;
+  run.rgbArgs[1] = bSlot;
+  run.rgBindings[0].pbIn = cmd;
+  run.rgBindings[0].cbIn = cbCmd;
+  run.rgBindings[1].pbOut = resp;
+  run.rgBindings[1].cbOut = CMD_PIV_AUTH_RESP_LEN;
+  dwRet = cmd_apdu_run(pCardData, pProgram, &run);
+  SecureZeroMemory(cmd, sizeof(cmd));
+  if (dwRet != SCARD_S_SUCCESS) {
+    goto out;
+  }
+
+  if (!cmd_tlv_find(resp, run.rgBindings[1].cbOut, CMD_PIV_TAG_DYN_AUTH, &pbTemplate, &cbTemplate) ||
+      !cmd_tlv_find(pbTemplate, cbTemplate, CMD_PIV_TAG_RESPONSE, &pbValue, &cbValue)) {
+    CMD_ERROR("Malformed GENERAL AUTHENTICATE response\n");
+    dwRet = SCARD_E_UNEXPECTED;
+    goto out;
+  }
+  if (cbValue > *pcbOutput) {
+    dwRet = SCARD_E_INSUFFICIENT_BUFFER;
+    goto out;
+  }
+  memcpy(pbOutput, pbValue, cbValue);
+  *pcbOutput = cbValue;
+
+out:
+  cmd_secmem_release_span(pSecure, resp, CMD_PIV_AUTH_RESP_LEN);
+  return dwRet;
+}
+
+DWORD cmd_piv_general_authenticate(PCARD_DATA pCardData, BYTE bAlg, BYTE bSlot, BYTE bInputTag, const BYTE *pbInput,
+                                   DWORD cbInput, BYTE *pbOutput, DWORD *pcbOutput) {
+  return general_authenticate(pCardData, &PROGRAM_GENERAL_AUTHENTICATE, bAlg, bSlot, bInputTag, pbInput, cbInput,
+                              pbOutput, pcbOutput);
+}
+
+DWORD cmd_piv_select_and_general_authenticate(PCARD_DATA pCardData, BYTE bAlg, BYTE bSlot, BYTE bInputTag,
+                                              const BYTE *pbInput, DWORD cbInput, BYTE *pbOutput, DWORD *pcbOutput) {
+  return general_authenticate(pCardData, &PROGRAM_SELECT_GENERAL_AUTHENTICATE, bAlg, bSlot, bInputTag, pbInput,
+                              cbInput, pbOutput, pcbOutput);
+}
@@ -0,0 +1,118 @@
+#pragma once
+#ifndef __PIV__H__
+#define __PIV__H__
+
+#include "apdu.h"
+#include "cardmod.h"
+
+#define CMD_PIV_INS_VERIFY 0x20
+#define CMD_PIV_INS_GENERAL_AUTHENTICATE 0x87
+#define CMD_PIV_INS_SELECT 0xA4
+#define CMD_PIV_INS_GET_DATA 0xCB
+#define CMD_PIV_INS_GET_METADATA 0xF7
+#define CMD_PIV_INS_GET_SERIAL 0xF8
+
+#define CMD_PIV_PIN_REF 0x80
+#define CMD_PIV_MAX_OBJECT_LEN 4096
+// Largest certificate inflated from a compressed object
+#define CMD_PIV_MAX_CERT_LEN (2 * CMD_PIV_MAX_OBJECT_LEN)
+#define CMD_PIV_PIN_MAX_LEN 8
+// 7C L { 82 L <output> }, outputs are at most a 4096-bit block
+#define CMD_PIV_AUTH_RESP_LEN (4 + 512 + 4)
+
+#define CMD_PIV_ALG_RSA3072 0x05
+#define CMD_PIV_ALG_RSA1024 0x06
+#define CMD_PIV_ALG_RSA2048 0x07
+#define CMD_PIV_ALG_RSA4096 0x16
+#define CMD_PIV_ALG_ECC_P256 0x11
+#define CMD_PIV_ALG_ECC_P384 0x14
+
+// Dynamic authentication template and its members (SP 800-73-4 Part 2, 3.2.4)
+#define CMD_PIV_TAG_DYN_AUTH 0x7C
+#define CMD_PIV_TAG_RESPONSE 0x82
+#define CMD_PIV_TAG_CHALLENGE 0x81
+#define CMD_PIV_TAG_EXPONENTIATION 0x85
+
+// Data object containers (SP 800-73-4 Part 1, Table 3)
+#define CMD_PIV_TAG_TAG_LIST 0x5C
+#define CMD_PIV_TAG_DATA 0x53
+#define CMD_PIV_TAG_CERTIFICATE 0x70
+#define CMD_PIV_TAG_CERT_INFO 0x71
+// CertInfo bit: the certificate is gzip compressed
+#define CMD_PIV_CERT_INFO_GZIP 0x01
+
+// Card Holder Unique Identifier (SP 800-73-4 Part 1, Table 9)
+#define CMD_PIV_OBJ_CHUID 0x5FC102
+#define CMD_PIV_TAG_CHUID_FASCN 0x30
+#define CMD_PIV_TAG_CHUID_GUID 0x34
+#define CMD_PIV_FASCN_LEN 25
+#define CMD_PIV_GUID_LEN 16
+#define CMD_PIV_SERIAL_LEN 4 // big-endian, from GET SERIAL
+
+// GET METADATA response (vendor extension, INS F7)
+#define CMD_PIV_TAG_META_ALGORITHM 0x01
+#define CMD_PIV_TAG_META_PUBLIC_KEY 0x04
+#define CMD_PIV_TAG_META_RSA_MODULUS 0x81
+#define CMD_PIV_TAG_META_RSA_EXPONENT 0x82
+#define CMD_PIV_TAG_META_EC_POINT 0x86
+
+#define CMD_PIV_SLOT_AUTHENTICATION 0x9A
+#define CMD_PIV_SLOT_SIGNATURE 0x9C
+#define CMD_PIV_SLOT_KEY_MANAGEMENT 0x9D
+#define CMD_PIV_SLOT_CARD_AUTHENTICATION 0x9E
+#define CMD_PIV_SLOT_RETIRED_FIRST 0x82
+#define CMD_PIV_SLOT_RETIRED_LAST 0x95
+
+// Containers map 1:1 to PIV key slots: 9A, 9C, 9D, 9E, then the 20 retired
+// key management slots 82..95.
+#define CMD_PIV_NUM_SLOTS 24
+
+BOOL cmd_piv_container_to_slot(BYTE bContainerIndex, BYTE *pbSlot);
+// Key management and retired slots hold key exchange (decryption / ECDH)
+// keys, the others hold signature keys.
+BOOL cmd_piv_slot_is_key_exchange(BYTE bSlot);
+// Data object holding the certificate of a key slot, e.g. 0x5FC105 for 9A.
+DWORD cmd_piv_cert_object(BYTE bSlot);
+
+// The following must be called inside a card transaction.
+DWORD cmd_piv_select(PCARD_DATA pCardData);
+// Read a data object and return the content of its 53 wrapper.
+DWORD cmd_piv_get_data(PCARD_DATA pCardData, DWORD dwObject, BYTE *pbData, DWORD *pcbData);
+// Like cmd_piv_get_data, but stop reading once pfnDone accepts the prefix
+// received so far. The returned data keeps its 53 wrapper and may be
+// truncated.
+DWORD cmd_piv_get_data_prefix(PCARD_DATA pCardData, DWORD dwObject, BYTE *pbData, DWORD *pcbData,
+                              CMD_APDU_DONE_FN pfnDone, void *pvArg);
+// Read the metadata of a key slot. Fails with SCARD_E_FILE_NOT_FOUND for an
+// empty slot and SCARD_E_UNSUPPORTED_FEATURE if the firmware lacks INS F7.
+DWORD cmd_piv_get_metadata(PCARD_DATA pCardData, BYTE bSlot, BYTE *pbData, DWORD *pcbData);
+// Read the serial number of the card into CMD_PIV_SERIAL_LEN bytes. Fails with
+// SCARD_E_UNSUPPORTED_FEATURE if the firmware lacks INS F8.
+DWORD cmd_piv_get_serial(PCARD_DATA pCardData, BYTE *pbSerial);
+// Extract the DER certificate from the content of a certificate object into a
+// buffer allocated with pfnCspAlloc, inflating it if the CertInfo marks it as
+// compressed. Fails with SCARD_E_FILE_NOT_FOUND if there is no certificate.
+DWORD cmd_piv_cert_from_object(PCARD_DATA pCardData, const BYTE *pbObject, DWORD cbObject, PBYTE *ppbCert,
+                               DWORD *pcbCert);
+// Same, for a certificate only parsed by the driver: an uncompressed one is
+// returned in place inside pbObject, a compressed one is inflated into the
+// scratch arena of the calling thread, which the caller releases back to its
+// mark.
+DWORD cmd_piv_cert_from_object_scratch(PCARD_DATA pCardData, const BYTE *pbObject, DWORD cbObject,
+                                       const BYTE **ppbCert, DWORD *pcbCert);
+// Read the DER certificate of a key slot into a buffer allocated with
+// pfnCspAlloc, to be freed by the caller with pfnCspFree.
+DWORD cmd_piv_read_cert(PCARD_DATA pCardData, BYTE bSlot, PBYTE *ppbCert, DWORD *pcbCert);
+
+// Run GENERAL AUTHENTICATE with a single input element (challenge or
+// exponentiation) and return the content of the response element.
+DWORD cmd_piv_general_authenticate(PCARD_DATA pCardData, BYTE bAlg, BYTE bSlot, BYTE bInputTag, const BYTE *pbInput,
+                                   DWORD cbInput, BYTE *pbOutput, DWORD *pcbOutput);
+
+// The same operations in their own card transaction, selecting PIV first.
+DWORD cmd_piv_select_and_verify_pin(PCARD_DATA pCardData, const BYTE *pbPin, DWORD cbPin,
+                                    PDWORD pcAttemptsRemaining);
+DWORD cmd_piv_select_and_general_authenticate(PCARD_DATA pCardData, BYTE bAlg, BYTE bSlot, BYTE bInputTag,
+                                              const BYTE *pbInput, DWORD cbInput, BYTE *pbOutput, DWORD *pcbOutput);
+
+#endif // __PIV__H__
@@ -0,0 +1,440 @@
+#include "pool.h"
+#include "ticks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK pool_lock_t;
+typedef CONDITION_VARIABLE pool_cond_t;
+typedef HANDLE pool_thread_t;
+#define pool_lock_init(l) InitializeSRWLock(l)
+#define pool_lock(l) AcquireSRWLockExclusive(l)
+#define pool_unlock(l) ReleaseSRWLockExclusive(l)
+#define pool_cond_init(c) InitializeConditionVariable(c)
+#define pool_cond_wait(c, l) SleepConditionVariableSRW(c, l, INFINITE, 0)
+#define pool_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t pool_lock_t;
+typedef pthread_cond_t pool_cond_t;
+typedef pthread_t pool_thread_t;
+#define pool_lock_init(l) pthread_mutex_init(l, NULL)
+#define pool_lock(l) pthread_mutex_lock(l)
+#define pool_unlock(l) pthread_mutex_unlock(l)
+#define pool_cond_init(c) pthread_cond_init(c, NULL)
+#define pool_cond_wait(c, l) pthread_cond_wait(c, l)
+#define pool_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+// Weight of a new sample in the latency moving average
+#define POOL_LATENCY_ALPHA 0.2
+
+typedef struct _POOL_JOB {
+  struct _POOL_JOB *prev, *next;
+  const uint8_t *digest;
+  size_t digest_len;
+  uint8_t *sig;
+  size_t *sig_len;
+  size_t sig_cap;
+  uint32_t status;
+  uint32_t last_status; // of the last failed attempt, 0 before any
+  uint32_t tried;       // bitmask of tokens this job failed on
+  unsigned attempts;
+  int done;
+} POOL_JOB;
+
+typedef struct _POOL_TOKEN {
+  CMD_POOL *pool;
+  CMD_POOL_SIGN_FN sign_fn;
+  CMD_POOL_FREE_FN free_fn;
+  void *ctx;
+  POOL_JOB *head, *tail;
+  unsigned depth;
+  int healthy;
+  unsigned consecutive_failures;
+  uint64_t completed, failed, stolen, samples;
+  double avg_latency_us;
+  uint64_t slow_since_us; // nonzero while ejected for slowness
+  pool_thread_t thread;
+} POOL_TOKEN;
+
+struct _CMD_POOL {
+  CMD_POOL_CONFIG config;
+  pool_lock_t lock;
+  pool_cond_t work_cond; // new work was queued
+  pool_cond_t done_cond; // a job completed
+  int stopping;
+  // threads inside cmd_pool_sign; destroy waits for them to leave
+  int callers;
+  int count;
+  int slow_ejected; // tokens with slow_since_us set
+  POOL_TOKEN tokens[CMD_POOL_MAX_TOKENS];
+};
+
+static const CMD_POOL_CONFIG g_default_config = {
+    .max_failures = 3,
+    .slow_factor = 4.0,
+    .min_samples = 16,
+    .slow_cooldown_ms = 30000,
+    .max_retries = 2,
+};
+
+static uint64_t now_us(void) {
+  return cmd_ticks_to_us(cmd_ticks());
+}
+
+// Queue helpers; all callers hold pool->lock.
+static void queue_push(POOL_TOKEN *token, POOL_JOB *job) {
+  job->next = NULL;
+  job->prev = token->tail;
+  if (token->tail) {
+    token->tail->next = job;
+  } else {
+    token->head = job;
+  }
+  token->tail = job;
+  token->depth++;
+}
+
+static void queue_unlink(POOL_TOKEN *token, POOL_JOB *job) {
+  if (job->prev) {
+    job->prev->next = job->next;
+  } else {
+    token->head = job->next;
+  }
+  if (job->next) {
+    job->next->prev = job->prev;
+  } else {
+    token->tail = job->prev;
+  }
+  job->prev = job->next = NULL;
+  token->depth--;
+}
+
+static void complete_job(CMD_POOL *pool, POOL_JOB *job, uint32_t status) {
+  job->status = status;
+  job->done = 1;
+  pool_cond_broadcast(&pool->done_cond);
+}
+
+static void readmit(CMD_POOL *pool, POOL_TOKEN *token) {
+  token->healthy = 1;
+  token->consecutive_failures = 0;
+  token->samples = 0;
+  if (token->slow_since_us) {
+    token->slow_since_us = 0;
+    pool->slow_ejected--;
+  }
+  pool_cond_broadcast(&pool->work_cond);
+}
+
+// Put tokens ejected for slowness back once their cool-down is over. They
+// keep their latency average, so they only get work while the others are
+// busier, and are ejected again if they are still slow.
+static void readmit_cooled(CMD_POOL *pool) {
+  uint64_t now;
+
+  if (!pool->slow_ejected || pool->config.slow_cooldown_ms == 0) {
+    return;
+  }
+  now = now_us();
+  for (int i = 0; i < pool->count; i++) {
+    POOL_TOKEN *token = &pool->tokens[i];
+    if (token->slow_since_us && now - token->slow_since_us >= (uint64_t)pool->config.slow_cooldown_ms * 1000) {
+      readmit(pool, token);
+    }
+  }
+}
+
+// Queue the job on the healthy token with the lowest expected wait. A job
+// that no token is left to try completes with the status of its last
+// attempt.
+static void dispatch(CMD_POOL *pool, POOL_JOB *job) {
+  uint32_t no_token = job->last_status ? job->last_status : CMD_POOL_E_NO_TOKEN;
+  POOL_TOKEN *best = NULL;
+  double best_cost = 0;
+
+  if (pool->stopping) {
+    complete_job(pool, job, no_token);
+    return;
+  }
+  readmit_cooled(pool);
+  for (int i = 0; i < pool->count; i++) {
+    POOL_TOKEN *token = &pool->tokens[i];
+    if (!token->healthy || (job->tried & (1u << i))) {
+      continue;
+    }
+    double latency = token->avg_latency_us > 1 ? token->avg_latency_us : 1;
+    double cost = (token->depth + 1) * latency;
+    if (!best || cost < best_cost) {
+      best = token;
+      best_cost = cost;
+    }
+  }
+  if (!best) {
+    complete_job(pool, job, no_token);
+    return;
+  }
+  queue_push(best, job);
+  pool_cond_broadcast(&pool->work_cond);
+}
+
+static void eject(CMD_POOL *pool, POOL_TOKEN *token) {
+  token->healthy = 0;
+  // hand the backlog to the remaining tokens
+  while (token->head) {
+    POOL_JOB *job = token->head;
+    queue_unlink(token, job);
+    dispatch(pool, job);
+  }
+}
+
+// Take the next job for a worker: its own queue first, then steal from the
+// tail of the longest other queue.
+static POOL_JOB *next_job(CMD_POOL *pool, POOL_TOKEN *self) {
+  POOL_TOKEN *victim = NULL;
+  int id = (int)(self - pool->tokens);
+
+  if (self->head) {
+    POOL_JOB *job = self->head;
+    queue_unlink(self, job);
+    return job;
+  }
+  for (int i = 0; i < pool->count; i++) {
+    POOL_TOKEN *token = &pool->tokens[i];
+    if (token != self && token->tail && !(token->tail->tried & (1u << id)) &&
+        (!victim || token->depth > victim->depth)) {
+      victim = token;
+    }
+  }
+  if (victim) {
+    POOL_JOB *job = victim->tail;
+    queue_unlink(victim, job);
+    self->stolen++;
+    return job;
+  }
+  return NULL;
+}
+
+static void check_slow(CMD_POOL *pool, POOL_TOKEN *self) {
+  double fastest = 0;
+  int others = 0;
+
+  if (pool->config.slow_factor <= 0 || self->samples < pool->config.min_samples) {
+    return;
+  }
+  for (int i = 0; i < pool->count; i++) {
+    POOL_TOKEN *token = &pool->tokens[i];
+    if (token == self || !token->healthy || token->samples < pool->config.min_samples) {
+      continue;
+    }
+    if (!others || token->avg_latency_us < fastest) {
+      fastest = token->avg_latency_us;
+    }
+    others++;
+  }
+  if (others && self->avg_latency_us > pool->config.slow_factor * fastest) {
+    self->slow_since_us = now_us();
+    pool->slow_ejected++;
+    eject(pool, self);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker(LPVOID arg)
+#else
+static void *worker(void *arg)
+#endif
+{
+  POOL_TOKEN *self = (POOL_TOKEN *)arg;
+  CMD_POOL *pool = self->pool;
+  int id = (int)(self - pool->tokens);
+
+  pool_lock(&pool->lock);
+  while (!pool->stopping) {
+    POOL_JOB *job = self->healthy ? next_job(pool, self) : NULL;
+    if (!job) {
+      pool_cond_wait(&pool->work_cond, &pool->lock);
+      continue;
+    }
+    pool_unlock(&pool->lock);
+
+    uint64_t start = now_us();
+    *job->sig_len = job->sig_cap;
+    uint32_t status = self->sign_fn(self->ctx, job->digest, job->digest_len, job->sig, job->sig_len);
+    double elapsed = (double)(now_us() - start);
+
+    pool_lock(&pool->lock);
+    self->samples++;
+    self->avg_latency_us =
+        self->samples == 1 ? elapsed : self->avg_latency_us + POOL_LATENCY_ALPHA * (elapsed - self->avg_latency_us);
+    if (status == 0) {
+      self->completed++;
+      self->consecutive_failures = 0;
+      complete_job(pool, job, 0);
+      check_slow(pool, self);
+      continue;
+    }
+
+    self->failed++;
+    job->tried |= 1u << id;
+    job->last_status = status;
+    if (++self->consecutive_failures >= pool->config.max_failures && self->healthy) {
+      eject(pool, self);
+    }
+    if (++job->attempts <= pool->config.max_retries) {
+      dispatch(pool, job);
+    } else {
+      complete_job(pool, job, status);
+    }
+  }
+  pool_unlock(&pool->lock);
+  return 0;
+}
+
+CMD_POOL *cmd_pool_create(const CMD_POOL_CONFIG *config) {
+  CMD_POOL *pool = (CMD_POOL *)calloc(1, sizeof(CMD_POOL));
+  if (!pool) {
+    return NULL;
+  }
+  pool->config = config ? *config : g_default_config;
+  if (pool->config.max_failures == 0) {
+    pool->config.max_failures = 1;
+  }
+  pool_lock_init(&pool->lock);
+  pool_cond_init(&pool->work_cond);
+  pool_cond_init(&pool->done_cond);
+  return pool;
+}
+
+void cmd_pool_destroy(CMD_POOL *pool) {
+  if (!pool) {
+    return;
+  }
+
+  pool_lock(&pool->lock);
+  pool->stopping = 1;
+  for (int i = 0; i < pool->count; i++) {
+    POOL_TOKEN *token = &pool->tokens[i];
+    while (token->head) {
+      POOL_JOB *job = token->head;
+      queue_unlink(token, job);
+      complete_job(pool, job, CMD_POOL_E_NO_TOKEN);
+    }
+  }
+  pool_cond_broadcast(&pool->work_cond);
+  // jobs in flight complete when their sign_fn returns; their callers still
+  // need the lock to see it
+  while (pool->callers > 0) {
+    pool_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pool_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->count; i++) {
+    POOL_TOKEN *token = &pool->tokens[i];
+#ifdef _WIN32
+    WaitForSingleObject(token->thread, INFINITE);
+    CloseHandle(token->thread);
+#else
+    pthread_join(token->thread, NULL);
+#endif
+    if (token->free_fn) {
+      token->free_fn(token->ctx);
+    }
+  }
+  free(pool);
+}
+
+int cmd_pool_add_token(CMD_POOL *pool, CMD_POOL_SIGN_FN sign_fn, CMD_POOL_FREE_FN free_fn, void *token_ctx) {
+  int id;
+
+  if (!pool || !sign_fn) {
+    return -1;
+  }
+
+  pool_lock(&pool->lock);
+  if (pool->stopping || pool->count == CMD_POOL_MAX_TOKENS) {
+    pool_unlock(&pool->lock);
+    return -1;
+  }
+  id = pool->count;
+  POOL_TOKEN *token = &pool->tokens[id];
+  memset(token, 0, sizeof(*token));
+  token->pool = pool;
+  token->sign_fn = sign_fn;
+  token->free_fn = free_fn;
+  token->ctx = token_ctx;
+  token->healthy = 1;
+#ifdef _WIN32
+  token->thread = CreateThread(NULL, 0, worker, token, 0, NULL);
+  int started = token->thread != NULL;
+#else
+  int started = pthread_create(&token->thread, NULL, worker, token) == 0;
+#endif
+  if (started) {
+    pool->count++;
+  }
+  pool_unlock(&pool->lock);
+  return started ? id : -1;
+}
+
+void cmd_pool_readmit_token(CMD_POOL *pool, int token) {
+  if (!pool || token < 0) {
+    return;
+  }
+  pool_lock(&pool->lock);
+  if (token < pool->count) {
+    POOL_TOKEN *t = &pool->tokens[token];
+    readmit(pool, t);
+    t->avg_latency_us = 0;
+  }
+  pool_unlock(&pool->lock);
+}
+
+uint32_t cmd_pool_sign(CMD_POOL *pool, const uint8_t *digest, size_t digest_len, uint8_t *sig, size_t *sig_len) {
+  POOL_JOB job;
+
+  if (!pool || !digest || !sig || !sig_len) {
+    return CMD_POOL_E_NO_TOKEN;
+  }
+  memset(&job, 0, sizeof(job));
+  job.digest = digest;
+  job.digest_len = digest_len;
+  job.sig = sig;
+  job.sig_len = sig_len;
+  job.sig_cap = *sig_len;
+
+  pool_lock(&pool->lock);
+  pool->callers++;
+  dispatch(pool, &job);
+  while (!job.done) {
+    pool_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  if (--pool->callers == 0 && pool->stopping) {
+    pool_cond_broadcast(&pool->done_cond);
+  }
+  pool_unlock(&pool->lock);
+  return job.status;
+}
+
+int cmd_pool_token_stats(CMD_POOL *pool, int token, CMD_POOL_TOKEN_STATS *stats) {
+  if (!pool || !stats || token < 0) {
+    return -1;
+  }
+  pool_lock(&pool->lock);
+  if (token >= pool->count) {
+    pool_unlock(&pool->lock);
+    return -1;
+  }
+  POOL_TOKEN *t = &pool->tokens[token];
+  stats->healthy = t->healthy;
+  stats->queue_depth = t->depth;
+  stats->completed = t->completed;
+  stats->failed = t->failed;
+  stats->stolen = t->stolen;
+  stats->avg_latency_us = t->avg_latency_us;
+  pool_unlock(&pool->lock);
+  return 0;
+}
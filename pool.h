@@ -0,0 +1,72 @@
+#pragma once
+#ifndef __POOL__H__
+#define __POOL__H__
+
+/*
+ * Signing pool that spreads requests over several tokens holding the same
+ * key. This file and pool.c only depend on the C runtime and the platform
+ * threading API, so the pool can be built into host tools on Linux as well.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_POOL_MAX_TOKENS 16
+
+// Returned when no healthy token is left and no token was tried (same value
+// as SCARD_E_NO_SMARTCARD); a request that failed returns the status of its
+// last attempt instead
+#define CMD_POOL_E_NO_TOKEN 0x8010000CU
+#define CMD_POOL_E_NO_MEMORY 0x80100006U
+
+// Sign a digest on one token. *sig_len is the capacity of sig on input and
+// the signature length on output. Returns 0 on success.
+typedef uint32_t (*CMD_POOL_SIGN_FN)(void *token_ctx, const uint8_t *digest, size_t digest_len, uint8_t *sig,
+                                     size_t *sig_len);
+typedef void (*CMD_POOL_FREE_FN)(void *token_ctx);
+
+typedef struct _CMD_POOL_CONFIG {
+  // Eject a token after this many consecutive failures
+  unsigned max_failures;
+  // Eject a token whose average latency exceeds slow_factor times that of
+  // the fastest healthy token, once it has min_samples samples
+  double slow_factor;
+  unsigned min_samples;
+  // A token ejected for slowness is put back into rotation this long after,
+  // on probation: it is judged again once it has min_samples new samples.
+  // 0 keeps it out until cmd_pool_readmit_token.
+  unsigned slow_cooldown_ms;
+  // How many times a request is retried on another token
+  unsigned max_retries;
+} CMD_POOL_CONFIG;
+
+typedef struct _CMD_POOL_TOKEN_STATS {
+  int healthy;
+  unsigned queue_depth;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t stolen;
+  double avg_latency_us;
+} CMD_POOL_TOKEN_STATS;
+
+typedef struct _CMD_POOL CMD_POOL;
+
+// config may be NULL for defaults.
+CMD_POOL *cmd_pool_create(const CMD_POOL_CONFIG *config);
+// Destroy the pool; queued requests fail with CMD_POOL_E_NO_TOKEN, those
+// being signed complete. Returns once every caller has left cmd_pool_sign.
+void cmd_pool_destroy(CMD_POOL *pool);
+
+// Add a token and start its worker. free_fn (may be NULL) releases token_ctx
+// on destroy. Returns the token id, or -1.
+int cmd_pool_add_token(CMD_POOL *pool, CMD_POOL_SIGN_FN sign_fn, CMD_POOL_FREE_FN free_fn, void *token_ctx);
+
+// Put an ejected token back into rotation, e.g. after it was re-inserted.
+void cmd_pool_readmit_token(CMD_POOL *pool, int token);
+
+// Sign synchronously; may be called from any number of threads.
+uint32_t cmd_pool_sign(CMD_POOL *pool, const uint8_t *digest, size_t digest_len, uint8_t *sig, size_t *sig_len);
+
+int cmd_pool_token_stats(CMD_POOL *pool, int token, CMD_POOL_TOKEN_STATS *stats);
+
+#endif // __POOL__H__
@@ -0,0 +1,197 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_CACHE
+
+#include "prefetch.h"
+#include "apdu.h"
+#include "context.h"
+#include "logging.h"
+#include "stamps.h"
+
+// Start a transaction for one unit of work once no caller wants the card.
+// cmd_begin_transaction turns the worker away with SCARD_E_TIMEOUT meanwhile.
+static BOOL begin_unit(PCARD_DATA pCardData) {
+  PCMD_PREFETCH pPrefetch = &CMD_CONTEXT_OF(pCardData)->prefetch;
+  DWORD dwRet;
+
+  while ((dwRet = cmd_begin_transaction(pCardData)) == SCARD_E_TIMEOUT) {
+    if (pPrefetch->lCancel) {
+      return FALSE;
+    }
+    Sleep(1);
+  }
+  if (dwRet != SCARD_S_SUCCESS) {
+    return FALSE;
+  }
+  if (pPrefetch->lCancel || cmd_piv_select(pCardData) != SCARD_S_SUCCESS) {
+    cmd_end_transaction(pCardData);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static DWORD WINAPI prefetch_worker(LPVOID pvParam) {
+  PCARD_DATA pCardData = (PCARD_DATA)pvParam;
+  PCMD_PREFETCH pPrefetch = &CMD_CONTEXT_OF(pCardData)->prefetch;
+  BOOL fNoMetadata = !CMD_CONTEXT_OF(pCardData)->pProfile->fMetadata, fStamped = TRUE;
+  DWORD dwTransaction = 0;
+  CMD_PUBKEY key;
+  BYTE bDefault = CMD_PIV_NUM_SLOTS;
+  PBYTE pbCert;
+  DWORD dwStamp, cbCert;
+
+  // the whole prefetch is one call of the context
+  CMD_BEGIN_CALL(pCardData);
+
+  // stamp each container together with reading its key, so that the
+  // foreground can tell whether the key is still current; with GET METADATA
+  // the key comes out of the response the stamp is taken from
+  for (BYTE i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    if (!begin_unit(pCardData)) {
+      return 0;
+    }
+    if (i == 0) {
+      // the stamps hold only if every unit runs in this one transaction
+      dwTransaction = CMD_CONTEXT_OF(pCardData)->dwTransactionsBegun;
+    }
+    DWORD dwRet = cmd_stamps_read_container(pCardData, i, &fNoMetadata, &dwStamp, &key);
+    if (dwRet == SCARD_S_SUCCESS && !key.fValid) {
+      dwRet = cmd_pubkey_read(pCardData, i, &key, &fNoMetadata);
+    }
+    cmd_end_transaction(pCardData);
+    if (dwRet != SCARD_S_SUCCESS) {
+      fStamped = FALSE;
+      continue;
+    }
+    if (key.fPresent && bDefault == CMD_PIV_NUM_SLOTS) {
+      bDefault = i;
+    }
+    AcquireSRWLockExclusive(&pPrefetch->lock);
+    key.fValid = TRUE;
+    pPrefetch->rgPubKeys[i] = key;
+    pPrefetch->stamps.rgdwContainers[i] = dwStamp;
+    ReleaseSRWLockExclusive(&pPrefetch->lock);
+  }
+
+  if (fStamped && begin_unit(pCardData)) {
+    DWORD dwRet = cmd_stamps_read_files(pCardData, &dwStamp);
+    cmd_end_transaction(pCardData);
+    if (dwRet == SCARD_S_SUCCESS) {
+      AcquireSRWLockExclusive(&pPrefetch->lock);
+      pPrefetch->stamps.dwFiles = dwStamp;
+      pPrefetch->stamps.dwTransaction = dwTransaction;
+      pPrefetch->stamps.fValid = TRUE;
+      ReleaseSRWLockExclusive(&pPrefetch->lock);
+    }
+  }
+
+  if (bDefault == CMD_PIV_NUM_SLOTS || !begin_unit(pCardData)) {
+    return 0;
+  }
+  BYTE bSlot;
+  cmd_piv_container_to_slot(bDefault, &bSlot);
+  DWORD dwRet = cmd_piv_read_cert(pCardData, bSlot, &pbCert, &cbCert);
+  cmd_end_transaction(pCardData);
+  if (dwRet == SCARD_S_SUCCESS) {
+    AcquireSRWLockExclusive(&pPrefetch->lock);
+    pPrefetch->bCertIndex = bDefault;
+    pPrefetch->pbCert = pbCert;
+    pPrefetch->cbCert = cbCert;
+    ReleaseSRWLockExclusive(&pPrefetch->lock);
+  }
+  CMD_DEBUG("Prefetch done for pCardData %p\n", pCardData);
+  return 0;
+}
+
+void cmd_prefetch_start(PCARD_DATA pCardData) {
+#ifdef CMD_BACKGROUND_PREFETCH
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  PCMD_PREFETCH pPrefetch = &pContext->prefetch;
+
+  InitializeSRWLock(&pPrefetch->lock);
+  pPrefetch->hThread = CreateThread(NULL, 0, prefetch_worker, pCardData, CREATE_SUSPENDED, &pPrefetch->dwThreadId);
+  if (pPrefetch->hThread == NULL) {
+    CMD_WARN("Failed to start the prefetch worker: %x\n", GetLastError());
+    return;
+  }
+  ResumeThread(pPrefetch->hThread);
+#else
+  (void)pCardData;
+#endif
+}
+
+void cmd_prefetch_stop(PCARD_DATA pCardData) {
+  PCMD_PREFETCH pPrefetch = &CMD_CONTEXT_OF(pCardData)->prefetch;
+
+  if (pPrefetch->hThread == NULL) {
+    return;
+  }
+  InterlockedExchange(&pPrefetch->lCancel, 1);
+  WaitForSingleObject(pPrefetch->hThread, INFINITE);
+  CloseHandle(pPrefetch->hThread);
+  pPrefetch->hThread = NULL;
+  pPrefetch->dwThreadId = 0;
+  if (pPrefetch->pbCert) {
+    pCardData->pfnCspFree(pPrefetch->pbCert);
+    pPrefetch->pbCert = NULL;
+  }
+}
+
+// Whether the container was stamped by the worker as it is now. Must be
+// called with the lock held.
+static BOOL staged_current(PCMD_CONTEXT pContext, BYTE bContainerIndex) {
+  const CMD_PREFETCH *pPrefetch = &pContext->prefetch;
+  return pContext->stamps.fValid && pPrefetch->rgPubKeys[bContainerIndex].fValid &&
+         pPrefetch->stamps.rgdwContainers[bContainerIndex] == pContext->stamps.rgdwContainers[bContainerIndex];
+}
+
+BOOL cmd_prefetch_take_pubkey(PCARD_DATA pCardData, BYTE bContainerIndex, PCMD_PUBKEY pKey) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  PCMD_PREFETCH pPrefetch = &pContext->prefetch;
+  BOOL fTaken = FALSE;
+
+  if (pPrefetch->hThread == NULL || bContainerIndex >= CMD_PIV_NUM_SLOTS) {
+    return FALSE;
+  }
+  AcquireSRWLockShared(&pPrefetch->lock);
+  if (staged_current(pContext, bContainerIndex)) {
+    *pKey = pPrefetch->rgPubKeys[bContainerIndex];
+    pKey->wFreshness = pContext->cardcf.wContainersFreshness;
+    fTaken = TRUE;
+  }
+  ReleaseSRWLockShared(&pPrefetch->lock);
+  return fTaken;
+}
+
+BOOL cmd_prefetch_take_cert(PCARD_DATA pCardData, BYTE bContainerIndex, PBYTE *ppbCert, DWORD *pcbCert) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  PCMD_PREFETCH pPrefetch = &pContext->prefetch;
+  BOOL fTaken = FALSE;
+
+  if (pPrefetch->hThread == NULL) {
+    return FALSE;
+  }
+  AcquireSRWLockExclusive(&pPrefetch->lock);
+  if (pPrefetch->pbCert && pPrefetch->bCertIndex == bContainerIndex && staged_current(pContext, bContainerIndex)) {
+    *ppbCert = pPrefetch->pbCert;
+    *pcbCert = pPrefetch->cbCert;
+    pPrefetch->pbCert = NULL;
+    fTaken = TRUE;
+  }
+  ReleaseSRWLockExclusive(&pPrefetch->lock);
+  return fTaken;
+}
+
+BOOL cmd_prefetch_take_stamps(PCARD_DATA pCardData, PCMD_STAMPS pStamps) {
+  PCMD_PREFETCH pPrefetch = &CMD_CONTEXT_OF(pCardData)->prefetch;
+  BOOL fTaken;
+
+  if (pPrefetch->hThread == NULL) {
+    return FALSE;
+  }
+  AcquireSRWLockShared(&pPrefetch->lock);
+  fTaken = pPrefetch->stamps.fValid;
+  if (fTaken) {
+    *pStamps = pPrefetch->stamps;
+  }
+  ReleaseSRWLockShared(&pPrefetch->lock);
+  return fTaken;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#ifndef __PREFETCH__H__
+#define __PREFETCH__H__
+
+#include "cardmod.h"
+#include "piv.h"
+#include "pubkey.h"
+#include "stamps.h"
+
+// Results of the background prefetch started by CardAcquireContext. The
+// worker stages what it reads here, and the foreground adopts staged entries
+// on its cache misses. Of the rest of the context it only uses the transport
+// state, under csCard like every caller: the transaction and cbRespChunk,
+// which the calibration of its certificate read may set. It keeps its own
+// copy of fNoMetadata.
+typedef struct _CMD_PREFETCH {
+  HANDLE hThread;
+  DWORD dwThreadId;
+  volatile LONG lCancel;
+  // Guards the staged results below
+  SRWLOCK lock;
+  // Content stamps the results were read at; a key or the certificate is
+  // adopted only if the stamp of its container matches the context's.
+  // fValid once every container and the files have been stamped.
+  CMD_STAMPS stamps;
+  CMD_PUBKEY rgPubKeys[CMD_PIV_NUM_SLOTS];
+  BYTE bCertIndex;
+  PBYTE pbCert; // certificate of the default container, allocated with pfnCspAlloc
+  DWORD cbCert;
+} CMD_PREFETCH, *PCMD_PREFETCH;
+
+// Start reading the public keys (from which cmapfile is built) and the
+// default container's certificate in the background. A no-op unless the
+// driver is built with CMD_BACKGROUND_PREFETCH.
+void cmd_prefetch_start(PCARD_DATA pCardData);
+// Cancel the worker, wait for it and free what it staged.
+void cmd_prefetch_stop(PCARD_DATA pCardData);
+
+// Take a staged public key or certificate if its container still has the
+// stamp it was read at. The certificate buffer is handed over to the caller.
+BOOL cmd_prefetch_take_pubkey(PCARD_DATA pCardData, BYTE bContainerIndex, PCMD_PUBKEY pKey);
+BOOL cmd_prefetch_take_cert(PCARD_DATA pCardData, BYTE bContainerIndex, PBYTE *ppbCert, DWORD *pcbCert);
+// Copy the staged stamps, once the worker has read all of them.
+BOOL cmd_prefetch_take_stamps(PCARD_DATA pCardData, PCMD_STAMPS pStamps);
+
+#endif // __PREFETCH__H__
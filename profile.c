@@ -0,0 +1,49 @@
+#include "profile.h"
+#include "piv.h"
+
+#define CMD_MAX_ATR_LEN 33
+
+typedef struct _ATR_ENTRY {
+  BYTE cbAtr;
+  BYTE rgbAtr[CMD_MAX_ATR_LEN];
+  BYTE rgbMask[CMD_MAX_ATR_LEN];
+  const CMD_CARD_PROFILE *pProfile;
+} ATR_ENTRY;
+
+static const CMD_CARD_PROFILE PROFILE_CANOKEY = {
+    .pszName = "CanoKey",
+    .fExtendedApdu = TRUE,
+    .cbMaxApdu = 1280,
+    .cbRespChunk = 1024,
+    .fMetadata = TRUE,
+    .dwAlgorithms = CMD_PROFILE_ALG_RSA2048 | CMD_PROFILE_ALG_RSA3072 | CMD_PROFILE_ALG_RSA4096 |
+                    CMD_PROFILE_ALG_P256 | CMD_PROFILE_ALG_P384,
+    .cSlots = CMD_PIV_NUM_SLOTS,
+};
+
+// Keep in sync with the ATRs registered in canokey-minidriver.inf.in.
+static const ATR_ENTRY ATR_TABLE[] = {
+    {
+        17,
+        {0x3B, 0xF7, 0x11, 0x00, 0x00, 0x81, 0x31, 0xFE, 0x65, 0x43, 0x61, 0x6E, 0x6F, 0x6B, 0x65, 0x79, 0x99},
+        {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+        &PROFILE_CANOKEY,
+    },
+};
+
+const CMD_CARD_PROFILE *cmd_profile_from_atr(const BYTE *pbAtr, DWORD cbAtr) {
+  for (DWORD i = 0; i < ARRAYSIZE(ATR_TABLE); i++) {
+    const ATR_ENTRY *pEntry = &ATR_TABLE[i];
+    BYTE bDiff = 0;
+    if (cbAtr != pEntry->cbAtr) {
+      continue;
+    }
+    for (DWORD j = 0; j < cbAtr; j++) {
+      bDiff |= (BYTE)((pbAtr[j] ^ pEntry->rgbAtr[j]) & pEntry->rgbMask[j]);
+    }
+    if (bDiff == 0) {
+      return pEntry->pProfile;
+    }
+  }
+  return NULL;
+}
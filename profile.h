@@ -0,0 +1,28 @@
+#pragma once
+#ifndef __PROFILE__H__
+#define __PROFILE__H__
+
+#include "cardmod.h"
+
+#define CMD_PROFILE_ALG_RSA2048 0x01
+#define CMD_PROFILE_ALG_RSA3072 0x02
+#define CMD_PROFILE_ALG_RSA4096 0x04
+#define CMD_PROFILE_ALG_P256 0x08
+#define CMD_PROFILE_ALG_P384 0x10
+
+// What a family of cards can do, so that code paths pick a strategy up front
+// instead of probing the card.
+typedef struct _CMD_CARD_PROFILE {
+  LPCSTR pszName;
+  BOOL fExtendedApdu;  // accepts extended length APDUs
+  DWORD cbMaxApdu;     // largest command data field / response the firmware buffers
+  DWORD cbRespChunk;   // response chunk when timing cannot tell the sizes apart
+  BOOL fMetadata;      // implements GET METADATA
+  DWORD dwAlgorithms;  // CMD_PROFILE_ALG_*
+  BYTE cSlots;         // key slots, counted as containers
+} CMD_CARD_PROFILE, *PCMD_CARD_PROFILE;
+
+// Match an ATR against the table of known cards. Returns NULL for other cards.
+const CMD_CARD_PROFILE *cmd_profile_from_atr(const BYTE *pbAtr, DWORD cbAtr);
+
+#endif // __PROFILE__H__
@@ -0,0 +1,71 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_TRANSPORT
+
+#include "program.h"
+#include "apdu.h"
+#include "logging.h"
+#include "ticks.h"
+
+static BYTE step_action(const CMD_APDU_STEP *pStep, WORD wSw, DWORD *pdwResult) {
+  if (wSw == CMD_SW_OK) {
+    *pdwResult = SCARD_S_SUCCESS;
+    return CMD_APDU_SW_NEXT;
+  }
+  for (DWORD i = 0; i < pStep->cRules; i++) {
+    const CMD_APDU_SW_RULE *pRule = &pStep->pRules[i];
+    if ((wSw & pRule->wMask) == pRule->wSw) {
+      *pdwResult = pRule->dwResult;
+      return pRule->bAction;
+    }
+  }
+  *pdwResult = cmd_sw_to_error(wSw);
+  return CMD_APDU_SW_FAIL;
+}
+
+DWORD cmd_apdu_run(PCARD_DATA pCardData, const CMD_APDU_PROGRAM *pProgram, PCMD_APDU_RUN pRun) {
+  uint64_t t0, t1;
+
+  DWORD dwRet = cmd_begin_transaction(pCardData);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  for (DWORD i = 0; i < pProgram->cSteps; i++) {
+    const CMD_APDU_STEP *pStep = &pProgram->pSteps[i];
+    const BYTE *pbData = pStep->pbData;
+    DWORD cbData = pStep->cbData;
+    BYTE *pbResp = NULL;
+    DWORD *pcbResp = NULL;
+    BYTE bP1 = pStep->iP1Arg == CMD_APDU_NO_BINDING ? pStep->bP1 : pRun->rgbArgs[pStep->iP1Arg];
+    BYTE bP2 = pStep->iP2Arg == CMD_APDU_NO_BINDING ? pStep->bP2 : pRun->rgbArgs[pStep->iP2Arg];
+
+    if (pStep->iData != CMD_APDU_NO_BINDING) {
+      pbData = pRun->rgBindings[pStep->iData].pbIn;
+      cbData = pRun->rgBindings[pStep->iData].cbIn;
+    }
+    if (pStep->iResp != CMD_APDU_NO_BINDING) {
+      pbResp = pRun->rgBindings[pStep->iResp].pbOut;
+      pcbResp = &pRun->rgBindings[pStep->iResp].cbOut;
+    }
+
+    pRun->iStep = i;
+    t0 = cmd_ticks();
+    dwRet = cmd_apdu_transmit(pCardData, pStep->bCla, pStep->bIns, bP1, bP2, pbData, cbData, pbResp, pcbResp,
+                              &pRun->wSw);
+    t1 = cmd_ticks();
+    if (dwRet != SCARD_S_SUCCESS) {
+      break;
+    }
+    CMD_DEBUG("%s: %s returned SW %04X after %llu us\n", pProgram->pszName, pStep->pszName, pRun->wSw,
+              (unsigned long long)cmd_ticks_to_us(t1 - t0));
+    BYTE bAction = step_action(pStep, pRun->wSw, &dwRet);
+    if (bAction == CMD_APDU_SW_FAIL) {
+      CMD_ERROR("%s: %s failed with SW %04X\n", pProgram->pszName, pStep->pszName, pRun->wSw);
+    }
+    if (bAction != CMD_APDU_SW_NEXT) {
+      break;
+    }
+  }
+
+  cmd_end_transaction(pCardData);
+  return dwRet;
+}
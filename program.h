@@ -0,0 +1,71 @@
+#pragma once
+#ifndef __PROGRAM__H__
+#define __PROGRAM__H__
+
+#include "cardmod.h"
+
+// Multi-APDU operations (SELECT, VERIFY, GENERAL AUTHENTICATE, ...) are
+// described as static tables of steps and run by cmd_apdu_run inside a
+// single card transaction, so that they share status word handling and
+// tracing. Buffers are bound by index at run time.
+
+#define CMD_APDU_NO_BINDING 0xFF
+#define CMD_APDU_MAX_BINDINGS 4
+#define CMD_APDU_MAX_ARGS 4
+
+// What a step does on a status word
+#define CMD_APDU_SW_NEXT 0 // run the next step
+#define CMD_APDU_SW_DONE 1 // stop, the program succeeded with dwResult
+#define CMD_APDU_SW_FAIL 2 // stop, the program failed with dwResult
+
+typedef struct _CMD_APDU_SW_RULE {
+  WORD wSw;
+  WORD wMask; // the rule matches if (sw & wMask) == wSw
+  BYTE bAction;
+  DWORD dwResult;
+} CMD_APDU_SW_RULE;
+
+typedef struct _CMD_APDU_STEP {
+  LPCSTR pszName; // for traces
+  BYTE bCla;
+  BYTE bIns;
+  BYTE bP1;
+  BYTE bP2;
+  BYTE iP1Arg; // index of an argument replacing bP1, or CMD_APDU_NO_BINDING
+  BYTE iP2Arg;
+  // Command data: a binding, or the constant below if iData is CMD_APDU_NO_BINDING
+  BYTE iData;
+  const BYTE *pbData;
+  DWORD cbData;
+  BYTE iResp; // binding receiving the response data, or CMD_APDU_NO_BINDING
+  // Checked for any status word other than 9000, which always runs the next
+  // step. Without a matching rule the step fails with cmd_sw_to_error.
+  const CMD_APDU_SW_RULE *pRules;
+  DWORD cRules;
+} CMD_APDU_STEP;
+
+typedef struct _CMD_APDU_PROGRAM {
+  LPCSTR pszName;
+  const CMD_APDU_STEP *pSteps;
+  DWORD cSteps;
+} CMD_APDU_PROGRAM;
+
+typedef struct _CMD_APDU_BINDING {
+  const BYTE *pbIn;
+  DWORD cbIn;
+  BYTE *pbOut;
+  DWORD cbOut; // capacity on input, length on output
+} CMD_APDU_BINDING;
+
+// Arguments and buffers of one run, and where it stopped.
+typedef struct _CMD_APDU_RUN {
+  BYTE rgbArgs[CMD_APDU_MAX_ARGS];
+  CMD_APDU_BINDING rgBindings[CMD_APDU_MAX_BINDINGS];
+  DWORD iStep; // last step sent
+  WORD wSw;    // its status word
+} CMD_APDU_RUN, *PCMD_APDU_RUN;
+
+// Run a program in one card transaction (joining the caller's, if any).
+DWORD cmd_apdu_run(PCARD_DATA pCardData, const CMD_APDU_PROGRAM *pProgram, PCMD_APDU_RUN pRun);
+
+#endif // __PROGRAM__H__
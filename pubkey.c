@@ -0,0 +1,437 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_CACHE
+
+#include "pubkey.h"
+#include "apdu.h"
+#include "arena.h"
+#include "cache.h"
+#include "context.h"
+#include "logging.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "tlv.h"
+
+#include <string.h>
+
+static const BYTE OID_RSA_ENCRYPTION[] = {0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01};
+static const BYTE OID_EC_PUBLIC_KEY[] = {0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01};
+
+// Read the next DER element and check its tag.
+static BOOL der_next(const BYTE **ppb, DWORD *pcb, DWORD dwTag, const BYTE **ppbValue, DWORD *pcbValue) {
+  DWORD tag, n = cmd_tlv_parse(*ppb, *pcb, &tag, ppbValue, pcbValue);
+  if (n == 0 || (dwTag && tag != dwTag)) {
+    return FALSE;
+  }
+  *ppb += n;
+  *pcb -= n;
+  return TRUE;
+}
+
+DWORD cmd_pubkey_from_rsa(const BYTE *pbModulus, DWORD cbModulus, const BYTE *pbExponent, DWORD cbExponent,
+                          BOOL fKeyExchange, PCMD_PUBKEY pKey) {
+  while (cbModulus > 0 && *pbModulus == 0) {
+    pbModulus++;
+    cbModulus--;
+  }
+  while (cbExponent > 0 && *pbExponent == 0) {
+    pbExponent++;
+    cbExponent--;
+  }
+  if (cbModulus == 0 || cbModulus > CMD_PUBKEY_MAX_RSA_BYTES || cbExponent == 0 || cbExponent > sizeof(DWORD)) {
+    return SCARD_E_UNEXPECTED;
+  }
+
+  BLOBHEADER *pHeader = (BLOBHEADER *)pKey->rgbBlob;
+  RSAPUBKEY *pRsa = (RSAPUBKEY *)(pHeader + 1);
+  BYTE *pbOut = (BYTE *)(pRsa + 1);
+
+  pHeader->bType = PUBLICKEYBLOB;
+  pHeader->bVersion = CUR_BLOB_VERSION;
+  pHeader->reserved = 0;
+  pHeader->aiKeyAlg = fKeyExchange ? CALG_RSA_KEYX : CALG_RSA_SIGN;
+  pRsa->magic = BCRYPT_RSAPUBLIC_MAGIC; // "RSA1", same value as CAPI
+  pRsa->bitlen = cbModulus * 8;
+  pRsa->pubexp = 0;
+  for (DWORD i = 0; i < cbExponent; i++) {
+    pRsa->pubexp = (pRsa->pubexp << 8) | pbExponent[i];
+  }
+  // CAPI blobs store the modulus little-endian
+  for (DWORD i = 0; i < cbModulus; i++) {
+    pbOut[i] = pbModulus[cbModulus - 1 - i];
+  }
+
+  switch (cbModulus * 8) {
+  case 1024:
+    pKey->bAlg = CMD_PIV_ALG_RSA1024;
+    break;
+  case 2048:
+    pKey->bAlg = CMD_PIV_ALG_RSA2048;
+    break;
+  case 3072:
+    pKey->bAlg = CMD_PIV_ALG_RSA3072;
+    break;
+  case 4096:
+    pKey->bAlg = CMD_PIV_ALG_RSA4096;
+    break;
+  default:
+    CMD_ERROR("Unsupported RSA modulus of %d bytes\n", cbModulus);
+    return SCARD_E_UNEXPECTED;
+  }
+  pKey->fEcc = FALSE;
+  pKey->fKeyExchange = fKeyExchange;
+  pKey->dwBits = cbModulus * 8;
+  pKey->cbBlob = sizeof(BLOBHEADER) + sizeof(RSAPUBKEY) + cbModulus;
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_pubkey_from_ec_point(const BYTE *pbPoint, DWORD cbPoint, BOOL fKeyExchange, PCMD_PUBKEY pKey) {
+  PBCRYPT_ECCKEY_BLOB pBlob = (PBCRYPT_ECCKEY_BLOB)pKey->rgbBlob;
+  DWORD cbField = (cbPoint - 1) / 2;
+
+  if (cbPoint < 1 || pbPoint[0] != 0x04) {
+    return SCARD_E_UNEXPECTED;
+  }
+  if (cbField == 32) {
+    pBlob->dwMagic = fKeyExchange ? BCRYPT_ECDH_PUBLIC_P256_MAGIC : BCRYPT_ECDSA_PUBLIC_P256_MAGIC;
+    pKey->bAlg = CMD_PIV_ALG_ECC_P256;
+  } else if (cbField == 48) {
+    pBlob->dwMagic = fKeyExchange ? BCRYPT_ECDH_PUBLIC_P384_MAGIC : BCRYPT_ECDSA_PUBLIC_P384_MAGIC;
+    pKey->bAlg = CMD_PIV_ALG_ECC_P384;
+  } else {
+    CMD_ERROR("Unsupported EC point of %d bytes\n", cbPoint);
+    return SCARD_E_UNEXPECTED;
+  }
+  pBlob->cbKey = cbField;
+  memcpy(pBlob + 1, pbPoint + 1, 2 * cbField);
+
+  pKey->fEcc = TRUE;
+  pKey->fKeyExchange = fKeyExchange;
+  pKey->dwBits = cbField * 8;
+  pKey->cbBlob = sizeof(BCRYPT_ECCKEY_BLOB) + 2 * cbField;
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_pubkey_from_spki(const BYTE *pbSpki, DWORD cbSpki, BOOL fKeyExchange, PCMD_PUBKEY pKey) {
+  const BYTE *pbContent, *pbAlg, *pbOid, *pbBits;
+  DWORD cbContent, cbAlg, cbOid, cbBits;
+
+  // SubjectPublicKeyInfo ::= SEQUENCE { algorithm AlgorithmIdentifier, subjectPublicKey BIT STRING }
+  if (!der_next(&pbSpki, &cbSpki, 0x30, &pbContent, &cbContent) ||
+      !der_next(&pbContent, &cbContent, 0x30, &pbAlg, &cbAlg) ||
+      !der_next(&pbContent, &cbContent, 0x03, &pbBits, &cbBits) || !der_next(&pbAlg, &cbAlg, 0x06, &pbOid, &cbOid) ||
+      cbBits < 1 || pbBits[0] != 0) {
+    return SCARD_E_UNEXPECTED;
+  }
+  pbBits++;
+  cbBits--;
+
+  if (cbOid == sizeof(OID_RSA_ENCRYPTION) && memcmp(pbOid, OID_RSA_ENCRYPTION, cbOid) == 0) {
+    // RSAPublicKey ::= SEQUENCE { modulus INTEGER, publicExponent INTEGER }
+    const BYTE *pbSeq, *pbN, *pbE;
+    DWORD cbSeq, cbN, cbE;
+    if (!der_next(&pbBits, &cbBits, 0x30, &pbSeq, &cbSeq) || !der_next(&pbSeq, &cbSeq, 0x02, &pbN, &cbN) ||
+        !der_next(&pbSeq, &cbSeq, 0x02, &pbE, &cbE)) {
+      return SCARD_E_UNEXPECTED;
+    }
+    return cmd_pubkey_from_rsa(pbN, cbN, pbE, cbE, fKeyExchange, pKey);
+  }
+  if (cbOid == sizeof(OID_EC_PUBLIC_KEY) && memcmp(pbOid, OID_EC_PUBLIC_KEY, cbOid) == 0) {
+    // the curve follows from the point size
+    return cmd_pubkey_from_ec_point(pbBits, cbBits, fKeyExchange, pKey);
+  }
+
+  CMD_ERROR("Unsupported public key algorithm\n");
+  return SCARD_E_UNEXPECTED;
+}
+
+// Locate the SubjectPublicKeyInfo in a possibly truncated certificate. Only
+// the headers of the enclosing sequences need to be present.
+static BOOL cert_find_spki(const BYTE *pbCert, DWORD cbCert, const BYTE **ppbSpki, DWORD *pcbSpki) {
+  const BYTE *pbSkip;
+  DWORD cbSkip, tag, n;
+
+  // Certificate ::= SEQUENCE { tbsCertificate SEQUENCE { [0] version OPTIONAL, serialNumber, signature, issuer,
+  //                                                      validity, subject, subjectPublicKeyInfo, ... }, ... }
+  for (int i = 0; i < 2; i++) {
+    n = cmd_tlv_parse_header(pbCert, cbCert, &tag, &cbSkip);
+    if (n == 0 || tag != 0x30) {
+      return FALSE;
+    }
+    pbCert += n;
+    cbCert -= n;
+  }
+  if (cmd_tlv_parse_header(pbCert, cbCert, &tag, &cbSkip) && tag == 0xA0 &&
+      !der_next(&pbCert, &cbCert, 0, &pbSkip, &cbSkip)) {
+    return FALSE;
+  }
+  for (int i = 0; i < 5; i++) {
+    if (!der_next(&pbCert, &cbCert, 0, &pbSkip, &cbSkip)) {
+      return FALSE;
+    }
+  }
+  *ppbSpki = pbCert;
+  if (!der_next(&pbCert, &cbCert, 0x30, &pbSkip, &cbSkip)) {
+    return FALSE;
+  }
+  *pcbSpki = (DWORD)(pbCert - *ppbSpki);
+  return TRUE;
+}
+
+DWORD cmd_pubkey_from_cert(const BYTE *pbCert, DWORD cbCert, BOOL fKeyExchange, PCMD_PUBKEY pKey) {
+  const BYTE *pbSpki;
+  DWORD cbSpki;
+
+  if (!cert_find_spki(pbCert, cbCert, &pbSpki, &cbSpki)) {
+    return SCARD_E_UNEXPECTED;
+  }
+  return cmd_pubkey_from_spki(pbSpki, cbSpki, fKeyExchange, pKey);
+}
+
+// Locate the certificate inside a possibly truncated 53 { 70 { cert } ... }
+// certificate object.
+static BOOL object_find_spki(const BYTE *pb, DWORD cb, const BYTE **ppbSpki, DWORD *pcbSpki) {
+  static const DWORD rgTags[] = {CMD_PIV_TAG_DATA, CMD_PIV_TAG_CERTIFICATE};
+  DWORD tag, cbValue, n;
+
+  for (DWORD i = 0; i < ARRAYSIZE(rgTags); i++) {
+    n = cmd_tlv_parse_header(pb, cb, &tag, &cbValue);
+    if (n == 0 || tag != rgTags[i]) {
+      return FALSE;
+    }
+    pb += n;
+    cb -= n;
+  }
+  return cert_find_spki(pb, cb, ppbSpki, pcbSpki);
+}
+
+static BOOL spki_received(const BYTE *pbResp, DWORD cbResp, void *pvArg) {
+  const BYTE *pbSpki;
+  DWORD cbSpki;
+  return object_find_spki(pbResp, cbResp, &pbSpki, &cbSpki);
+}
+
+DWORD cmd_pubkey_from_metadata(BYTE bSlot, const BYTE *pbMeta, DWORD cbMeta, PCMD_PUBKEY pKey) {
+  DWORD cbAlg, cbPub, cbN, cbE, cbPoint, dwRet;
+  const BYTE *pbAlg, *pbPub, *pbN, *pbE, *pbPoint;
+  BOOL fKeyExchange = cmd_piv_slot_is_key_exchange(bSlot);
+
+  if (!cmd_tlv_find(pbMeta, cbMeta, CMD_PIV_TAG_META_ALGORITHM, &pbAlg, &cbAlg) || cbAlg != 1 ||
+      !cmd_tlv_find(pbMeta, cbMeta, CMD_PIV_TAG_META_PUBLIC_KEY, &pbPub, &cbPub)) {
+    return SCARD_E_UNEXPECTED;
+  }
+  if (cmd_tlv_find(pbPub, cbPub, CMD_PIV_TAG_META_EC_POINT, &pbPoint, &cbPoint)) {
+    dwRet = cmd_pubkey_from_ec_point(pbPoint, cbPoint, fKeyExchange, pKey);
+  } else if (cmd_tlv_find(pbPub, cbPub, CMD_PIV_TAG_META_RSA_MODULUS, &pbN, &cbN) &&
+             cmd_tlv_find(pbPub, cbPub, CMD_PIV_TAG_META_RSA_EXPONENT, &pbE, &cbE)) {
+    dwRet = cmd_pubkey_from_rsa(pbN, cbN, pbE, cbE, fKeyExchange, pKey);
+  } else {
+    return SCARD_E_UNEXPECTED;
+  }
+  if (dwRet == SCARD_S_SUCCESS && pKey->bAlg != pbAlg[0]) {
+    CMD_ERROR("Slot %02X reports algorithm %02X for a key of %d bits\n", bSlot, pbAlg[0], pKey->dwBits);
+    return SCARD_E_UNEXPECTED;
+  }
+  return dwRet;
+}
+
+// Discover the key in a slot with GET METADATA.
+static DWORD load_from_metadata(PCARD_DATA pCardData, BYTE bSlot, PCMD_PUBKEY pKey) {
+  BYTE rgbResp[CMD_PUBKEY_MAX_META];
+  DWORD cbResp = sizeof(rgbResp);
+
+  DWORD dwRet = cmd_piv_get_metadata(pCardData, bSlot, rgbResp, &cbResp);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  return cmd_pubkey_from_metadata(bSlot, rgbResp, cbResp, pKey);
+}
+
+// Discover the key in a slot from its certificate, reading only as much of
+// the certificate object as needed to reach the SubjectPublicKeyInfo.
+static DWORD load_from_cert(PCARD_DATA pCardData, BYTE bSlot, PCMD_PUBKEY pKey) {
+  PCMD_ARENA pArena = cmd_arena_of(pCardData);
+  DWORD dwMark = cmd_arena_mark(pArena), cbResp = CMD_PIV_MAX_OBJECT_LEN, cbSpki;
+  const BYTE *pbSpki;
+
+  PBYTE pbResp = (PBYTE)cmd_arena_alloc(pArena, cbResp);
+  if (!pbResp) {
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  DWORD dwRet =
+      cmd_piv_get_data_prefix(pCardData, cmd_piv_cert_object(bSlot), pbResp, &cbResp, spki_received, NULL);
+  if (dwRet != SCARD_S_SUCCESS) {
+    goto out;
+  }
+  if (object_find_spki(pbResp, cbResp, &pbSpki, &cbSpki)) {
+    dwRet = cmd_pubkey_from_spki(pbSpki, cbSpki, cmd_piv_slot_is_key_exchange(bSlot), pKey);
+    goto out;
+  }
+
+  // The prefix did not parse, so the whole object has been read: it is
+  // empty (53 00) or holds a compressed certificate.
+  const BYTE *pbObject, *pbCert;
+  DWORD cbObject, cbCert;
+  if (!cmd_tlv_find(pbResp, cbResp, CMD_PIV_TAG_DATA, &pbObject, &cbObject)) {
+    dwRet = SCARD_E_UNEXPECTED;
+    goto out;
+  }
+  dwRet = cmd_piv_cert_from_object_scratch(pCardData, pbObject, cbObject, &pbCert, &cbCert);
+  if (dwRet != SCARD_S_SUCCESS) {
+    goto out;
+  }
+  dwRet = cmd_pubkey_from_cert(pbCert, cbCert, cmd_piv_slot_is_key_exchange(bSlot), pKey);
+  if (dwRet != SCARD_S_SUCCESS) {
+    CMD_ERROR("Failed to parse the certificate in slot %02X\n", bSlot);
+  }
+
+out:
+  cmd_arena_release(pArena, dwMark);
+  return dwRet;
+}
+
+DWORD cmd_pubkey_read(PCARD_DATA pCardData, BYTE bContainerIndex, PCMD_PUBKEY pKey, BOOL *pfNoMetadata) {
+  DWORD dwRet = SCARD_E_UNSUPPORTED_FEATURE;
+  BYTE bSlot;
+
+  if (!cmd_piv_container_to_slot(bContainerIndex, &bSlot)) {
+    return SCARD_E_NO_KEY_CONTAINER;
+  }
+  memset(pKey, 0, sizeof(*pKey));
+  if (!*pfNoMetadata) {
+    dwRet = load_from_metadata(pCardData, bSlot, pKey);
+    if (dwRet == SCARD_E_UNSUPPORTED_FEATURE) {
+      CMD_INFO("GET METADATA is not supported, falling back to certificates\n");
+      *pfNoMetadata = TRUE;
+    }
+  }
+  if (dwRet == SCARD_E_UNSUPPORTED_FEATURE) {
+    dwRet = load_from_cert(pCardData, bSlot, pKey);
+  }
+
+  if (dwRet == SCARD_E_FILE_NOT_FOUND) {
+    pKey->fPresent = FALSE;
+  } else if (dwRet == SCARD_S_SUCCESS) {
+    pKey->fPresent = TRUE;
+  } else {
+    return dwRet;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+// Look up one container. Must be called inside a card transaction with the
+// PIV application selected.
+static DWORD load_slot(PCARD_DATA pCardData, BYTE bContainerIndex) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  PCMD_PUBKEY pKey = &pContext->rgPubKeys[bContainerIndex];
+
+  DWORD dwRet = cmd_pubkey_read(pCardData, bContainerIndex, pKey, &pContext->fNoMetadata);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  pKey->fValid = TRUE;
+  pKey->wFreshness = pContext->cardcf.wContainersFreshness;
+  return SCARD_S_SUCCESS;
+}
+
+static BOOL is_cached(PCMD_CONTEXT pContext, BYTE bContainerIndex) {
+  const CMD_PUBKEY *pKey = &pContext->rgPubKeys[bContainerIndex];
+  return pKey->fValid && pKey->wFreshness == pContext->cardcf.wContainersFreshness;
+}
+
+// Take the slot from the cache shared with other processes.
+static BOOL load_shared(PCARD_DATA pCardData, BYTE bContainerIndex) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  CMD_PUBKEY key;
+  DWORD cbKey = sizeof(key);
+
+  if (!cmd_cache_get(pCardData, CMD_CACHE_TYPE_PUBKEY, bContainerIndex, (BYTE *)&key, &cbKey) ||
+      cbKey != sizeof(key)) {
+    return FALSE;
+  }
+  key.fValid = TRUE;
+  key.wFreshness = pContext->cardcf.wContainersFreshness;
+  pContext->rgPubKeys[bContainerIndex] = key;
+  return TRUE;
+}
+
+static void store_shared(PCARD_DATA pCardData, BYTE bContainerIndex) {
+  const CMD_PUBKEY *pKey = &CMD_CONTEXT_OF(pCardData)->rgPubKeys[bContainerIndex];
+  cmd_cache_put(pCardData, CMD_CACHE_TYPE_PUBKEY, bContainerIndex, (const BYTE *)pKey, sizeof(*pKey));
+}
+
+// Adopt what the background prefetch read for the slot, and share it.
+static BOOL load_prefetched(PCARD_DATA pCardData, BYTE bContainerIndex) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+
+  if (!cmd_prefetch_take_pubkey(pCardData, bContainerIndex, &pContext->rgPubKeys[bContainerIndex])) {
+    return FALSE;
+  }
+  store_shared(pCardData, bContainerIndex);
+  return TRUE;
+}
+
+DWORD cmd_pubkey_get(PCARD_DATA pCardData, BYTE bContainerIndex, const CMD_PUBKEY **ppKey) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  BYTE bSlot;
+
+  if (!cmd_piv_container_to_slot(bContainerIndex, &bSlot)) {
+    return SCARD_E_NO_KEY_CONTAINER;
+  }
+
+  if (!is_cached(pContext, bContainerIndex) && !load_shared(pCardData, bContainerIndex) &&
+      !load_prefetched(pCardData, bContainerIndex)) {
+    DWORD dwRet = cmd_begin_transaction(pCardData);
+    if (dwRet != SCARD_S_SUCCESS) {
+      return dwRet;
+    }
+    dwRet = cmd_piv_select(pCardData);
+    if (dwRet == SCARD_S_SUCCESS) {
+      dwRet = load_slot(pCardData, bContainerIndex);
+    }
+    cmd_end_transaction(pCardData);
+    if (dwRet != SCARD_S_SUCCESS) {
+      return dwRet;
+    }
+    store_shared(pCardData, bContainerIndex);
+  }
+
+  if (!pContext->rgPubKeys[bContainerIndex].fPresent) {
+    return SCARD_E_NO_KEY_CONTAINER;
+  }
+  *ppKey = &pContext->rgPubKeys[bContainerIndex];
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_pubkey_refresh_all(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  BOOL rgfLoaded[CMD_PIV_NUM_SLOTS] = {FALSE};
+  BYTE i, cMissing = 0;
+
+  for (i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    if (!is_cached(pContext, i) && !load_shared(pCardData, i) && !load_prefetched(pCardData, i)) {
+      cMissing++;
+    }
+  }
+  if (cMissing == 0) {
+    return SCARD_S_SUCCESS;
+  }
+
+  DWORD dwRet = cmd_begin_transaction(pCardData);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  dwRet = cmd_piv_select(pCardData);
+  for (i = 0; i < CMD_PIV_NUM_SLOTS && dwRet == SCARD_S_SUCCESS; i++) {
+    if (!is_cached(pContext, i)) {
+      dwRet = load_slot(pCardData, i);
+      rgfLoaded[i] = dwRet == SCARD_S_SUCCESS;
+    }
+  }
+  cmd_end_transaction(pCardData);
+
+  for (i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    if (rgfLoaded[i]) {
+      store_shared(pCardData, i);
+    }
+  }
+  return dwRet;
+}
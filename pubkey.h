@@ -0,0 +1,50 @@
+#pragma once
+#ifndef __PUBKEY__H__
+#define __PUBKEY__H__
+
+#include "cardmod.h"
+
+#define CMD_PUBKEY_MAX_RSA_BYTES 512
+#define CMD_PUBKEY_MAX_BLOB (sizeof(BLOBHEADER) + sizeof(RSAPUBKEY) + CMD_PUBKEY_MAX_RSA_BYTES)
+// GET METADATA response of the largest key
+#define CMD_PUBKEY_MAX_META (CMD_PUBKEY_MAX_RSA_BYTES + 64)
+
+// Public key of a container in the format CardGetContainerInfo returns:
+// a CAPI PUBLICKEYBLOB for RSA, a BCRYPT_ECCKEY_BLOB for ECC.
+typedef struct _CMD_PUBKEY {
+  // The slot has been looked up; fPresent tells whether it holds a key
+  BOOL fValid;
+  BOOL fPresent;
+  BYTE bAlg; // PIV algorithm ID
+  BOOL fEcc;
+  BOOL fKeyExchange;
+  DWORD dwBits;
+  // wContainersFreshness of cardcf when the key was read
+  WORD wFreshness;
+  DWORD cbBlob;
+  BYTE rgbBlob[CMD_PUBKEY_MAX_BLOB];
+} CMD_PUBKEY, *PCMD_PUBKEY;
+
+DWORD cmd_pubkey_from_rsa(const BYTE *pbModulus, DWORD cbModulus, const BYTE *pbExponent, DWORD cbExponent,
+                          BOOL fKeyExchange, PCMD_PUBKEY pKey);
+// pbPoint is an uncompressed point 04 || X || Y
+DWORD cmd_pubkey_from_ec_point(const BYTE *pbPoint, DWORD cbPoint, BOOL fKeyExchange, PCMD_PUBKEY pKey);
+DWORD cmd_pubkey_from_spki(const BYTE *pbSpki, DWORD cbSpki, BOOL fKeyExchange, PCMD_PUBKEY pKey);
+DWORD cmd_pubkey_from_cert(const BYTE *pbCert, DWORD cbCert, BOOL fKeyExchange, PCMD_PUBKEY pKey);
+// Parse the public key out of the GET METADATA response of a slot.
+DWORD cmd_pubkey_from_metadata(BYTE bSlot, const BYTE *pbMeta, DWORD cbMeta, PCMD_PUBKEY pKey);
+
+// Read the public key of a container from the card, bypassing the caches;
+// fValid and wFreshness are left for the caller. *pfNoMetadata tells whether
+// the firmware lacks GET METADATA and is set if it turns out to. Must be
+// called inside a card transaction with the PIV application selected.
+DWORD cmd_pubkey_read(PCARD_DATA pCardData, BYTE bContainerIndex, PCMD_PUBKEY pKey, BOOL *pfNoMetadata);
+// Return the public key of a container, reading it from the card only if
+// it is not cached for the current container freshness. Slot contents are
+// discovered with GET METADATA when the firmware supports it; otherwise only
+// the certificate prefix up to its SubjectPublicKeyInfo is read.
+DWORD cmd_pubkey_get(PCARD_DATA pCardData, BYTE bContainerIndex, const CMD_PUBKEY **ppKey);
+// Look up every slot that is not cached, in a single card transaction.
+DWORD cmd_pubkey_refresh_all(PCARD_DATA pCardData);
+
+#endif // __PUBKEY__H__
@@ -0,0 +1,107 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_TRANSPORT
+
+#include "recovery.h"
+#include "cardid.h"
+#include "context.h"
+#include "logging.h"
+#include "piv.h"
+#include "stamps.h"
+#include "ticks.h"
+
+#include <string.h>
+
+#include <winscard.h>
+
+BOOL cmd_recovery_needed(DWORD dwErr) {
+  return dwErr == (DWORD)SCARD_W_RESET_CARD || dwErr == (DWORD)SCARD_W_REMOVED_CARD;
+}
+
+DWORD cmd_recovery_reconnect(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  DWORD dwProtocol;
+
+  CMD_INFO("Card was reset or removed, reconnecting\n");
+  // the reset ended any transaction we held
+  pContext->fTransactionHeld = FALSE;
+  LONG lRet = SCardReconnect(pCardData->hScard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwProtocol);
+  if (lRet != SCARD_S_SUCCESS) {
+    CMD_ERROR("SCardReconnect failed with %x\n", lRet);
+    return (DWORD)lRet;
+  }
+  pContext->fReconnected = TRUE;
+  if (pContext->dwTransactionDepth > 0) {
+    lRet = SCardBeginTransaction(pCardData->hScard);
+    if (lRet != SCARD_S_SUCCESS) {
+      CMD_ERROR("SCardBeginTransaction failed with %x\n", lRet);
+      return (DWORD)lRet;
+    }
+    pContext->fTransactionHeld = TRUE;
+    pContext->ullTransactionBegun = cmd_ticks();
+    pContext->dwTransactionsBegun++;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+// Forget everything read from the card the context was acquired for.
+static void forget_card(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  CMD_STAMPS unknown;
+
+  memset(pContext->rgPubKeys, 0, sizeof(pContext->rgPubKeys));
+  memset(&pContext->negCache, 0, sizeof(pContext->negCache));
+  memset(&pContext->cardId, 0, sizeof(pContext->cardId));
+  pContext->fNoMetadata = !pContext->pProfile->fMetadata;
+  // unknown stamps move the cardcf counters, so the CSP drops its caches too
+  memset(&unknown, 0, sizeof(unknown));
+  cmd_stamps_apply(pCardData, &unknown);
+}
+
+static BOOL same_card(const CMD_CARD_ID *pOld, const CMD_CARD_ID *pNew) {
+  // an identity that cannot tell cards apart proves nothing
+  return pOld->fValid && pOld->cbSerial > 0 && pNew->cbSerial > 0 && pOld->dwChuidCrc == pNew->dwChuidCrc &&
+         memcmp(pOld->rgbGuid, pNew->rgbGuid, sizeof(pOld->rgbGuid)) == 0;
+}
+
+DWORD cmd_recovery_verify(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  CMD_CARD_ID id;
+  CMD_STAMPS stamps;
+
+  if (!pContext->fReconnected || pContext->fRecovering) {
+    return SCARD_S_SUCCESS;
+  }
+  // the commands below must not recover again
+  pContext->fRecovering = TRUE;
+  DWORD dwRet = cmd_piv_select(pCardData);
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_card_id_read(pCardData, &id);
+  }
+  if (dwRet == SCARD_S_SUCCESS && same_card(&pContext->cardId, &id) &&
+      cmd_stamps_read(pCardData, &pContext->fNoMetadata, &stamps) != SCARD_S_SUCCESS) {
+    memset(&stamps, 0, sizeof(stamps)); // unknown, nothing cached survives
+  }
+  pContext->fRecovering = FALSE;
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  pContext->fReconnected = FALSE;
+
+  if (!pContext->cardId.fValid) {
+    // the identity is read lazily, so there is nothing to compare with; keep
+    // the new one, but nothing read before it can be trusted
+    CMD_DEBUG("Card identity not read before the reset, taking the current one\n");
+    pContext->cardId = id;
+    memset(&stamps, 0, sizeof(stamps));
+    cmd_stamps_apply(pCardData, &stamps);
+    return SCARD_S_SUCCESS;
+  }
+  if (!same_card(&pContext->cardId, &id)) {
+    CMD_WARN("The card after the reset cannot be shown to be the same one\n");
+    forget_card(pCardData);
+    return SCARD_W_REMOVED_CARD;
+  }
+  // only the containers whose content changed are read again
+  cmd_stamps_apply(pCardData, &stamps);
+  CMD_DEBUG("Same card after reconnect, content %s\n", stamps.fValid ? "checked" : "unknown");
+  return SCARD_S_SUCCESS;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#ifndef __RECOVERY__H__
+#define __RECOVERY__H__
+
+#include "cardmod.h"
+
+// Whether an SCard error means the card was reset or pulled since the last
+// call, so the handle must be reconnected before it can be used again.
+BOOL cmd_recovery_needed(DWORD dwErr);
+
+// Reconnect the card handle after a reset or removal and, if a transaction
+// was open, open it again. Must be called in csCard.
+DWORD cmd_recovery_reconnect(PCARD_DATA pCardData);
+
+// After a reconnect, make sure the card is still the one the context has
+// cached data for: select PIV, compare the identity and read the content
+// stamps. Cached data of unchanged containers is kept. A card whose identity
+// differs or cannot be verified counts as a different one: everything is
+// dropped and the call fails with SCARD_W_REMOVED_CARD. If the context never
+// read the identity, the new one is taken and the stamps become unknown, so
+// that every cache is stale but the call goes on. A no-op unless
+// cmd_recovery_reconnect ran. Must be called inside a card transaction.
+DWORD cmd_recovery_verify(PCARD_DATA pCardData);
+
+#endif // __RECOVERY__H__
@@ -0,0 +1,308 @@
+#include "ringlog.h"
+#include "ticks.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define ringlog_load(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define ringlog_cas(p, expected, desired)                                                                             \
+  ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(desired), (LONG64)(expected)) ==         \
+   (expected))
+#define ringlog_store(p, v) InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v))
+#define ringlog_pid() ((uint32_t)GetCurrentProcessId())
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ringlog_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ringlog_cas(p, expected, desired)                                                                             \
+  ({                                                                                                                  \
+    uint64_t _e = (expected);                                                                                         \
+    __atomic_compare_exchange_n(p, &_e, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);                               \
+  })
+#define ringlog_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ringlog_pid() ((uint32_t)getpid())
+#endif
+
+// The ring must hold the largest record with room to spare
+#define RINGLOG_MIN_SIZE 4096
+#define RINGLOG_ALIGN_UP(n) (((n) + CMD_RINGLOG_ALIGN - 1) & ~(uint64_t)(CMD_RINGLOG_ALIGN - 1))
+
+struct _CMD_RINGLOG {
+  CMD_RINGLOG_HEADER *header;
+  uint8_t *data;
+  uint64_t size;
+  size_t map_len;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+};
+
+static void *map_file(CMD_RINGLOG *log, const char *path) {
+#ifdef _WIN32
+  LARGE_INTEGER len;
+  len.QuadPart = (LONGLONG)log->map_len;
+  // FILE_SHARE_DELETE lets the file be deleted while a process still logs;
+  // without FILE_SHARE_WRITE, a second writer fails before truncating it
+  log->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (log->file == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+  // the mapping extends the new, empty file to its full size
+  log->mapping = CreateFileMappingA(log->file, NULL, PAGE_READWRITE, (DWORD)(len.QuadPart >> 32),
+                                    (DWORD)len.QuadPart, NULL);
+  void *p = log->mapping ? MapViewOfFile(log->mapping, FILE_MAP_ALL_ACCESS, 0, 0, log->map_len) : NULL;
+  if (!p) {
+    if (log->mapping) {
+      CloseHandle(log->mapping);
+    }
+    CloseHandle(log->file);
+  }
+  return p;
+#else
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  // the lock lives as long as the mapping, which keeps the open file
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)log->map_len) != 0) {
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, log->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static void unmap_file(CMD_RINGLOG *log) {
+#ifdef _WIN32
+  UnmapViewOfFile(log->header);
+  CloseHandle(log->mapping);
+  CloseHandle(log->file);
+#else
+  munmap(log->header, log->map_len);
+#endif
+}
+
+CMD_RINGLOG *cmd_ringlog_open(const char *path, size_t data_size) {
+  if (data_size < RINGLOG_MIN_SIZE) {
+    return NULL;
+  }
+  CMD_RINGLOG *log = (CMD_RINGLOG *)calloc(1, sizeof(CMD_RINGLOG));
+  if (!log) {
+    return NULL;
+  }
+  log->size = RINGLOG_ALIGN_UP((uint64_t)data_size);
+  log->map_len = sizeof(CMD_RINGLOG_HEADER) + (size_t)log->size;
+  log->header = (CMD_RINGLOG_HEADER *)map_file(log, path);
+  if (!log->header) {
+    free(log);
+    return NULL;
+  }
+  log->data = (uint8_t *)(log->header + 1);
+  log->header->version = CMD_RINGLOG_VERSION;
+  log->header->data_size = log->size;
+  log->header->cursor = 0;
+  log->header->pid = ringlog_pid();
+  log->header->ticks_per_second = cmd_ticks_per_second();
+  log->header->base_ticks = cmd_ticks();
+  log->header->base_unix_us = cmd_wallclock_us();
+  // a decoder ignores the file until the header is complete
+  log->header->magic = CMD_RINGLOG_MAGIC;
+  return log;
+}
+
+// Last write time of path in the platform's units, or INT64_MIN if it does
+// not exist.
+static int64_t last_written(const char *path) {
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attrs;
+  if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attrs)) {
+    return INT64_MIN;
+  }
+  return (int64_t)(((uint64_t)attrs.ftLastWriteTime.dwHighDateTime << 32) | attrs.ftLastWriteTime.dwLowDateTime);
+#else
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return INT64_MIN;
+  }
+  return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+CMD_RINGLOG *cmd_ringlog_open_slot(const char *prefix, unsigned slots, size_t data_size, char *path,
+                                   size_t path_len) {
+  int64_t written[CMD_RINGLOG_MAX_SLOTS];
+  unsigned order[CMD_RINGLOG_MAX_SLOTS];
+
+  if (slots > CMD_RINGLOG_MAX_SLOTS) {
+    slots = CMD_RINGLOG_MAX_SLOTS;
+  }
+  // oldest first, by insertion
+  for (unsigned i = 0; i < slots; i++) {
+    snprintf(path, path_len, "%s%u.ring", prefix, i);
+    written[i] = last_written(path);
+    unsigned j = i;
+    for (; j > 0 && written[order[j - 1]] > written[i]; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+  for (unsigned i = 0; i < slots; i++) {
+    snprintf(path, path_len, "%s%u.ring", prefix, order[i]);
+    CMD_RINGLOG *log = cmd_ringlog_open(path, data_size);
+    if (log) {
+      return log;
+    }
+  }
+  return NULL;
+}
+
+void cmd_ringlog_close(CMD_RINGLOG *log) {
+  if (!log) {
+    return;
+  }
+  unmap_file(log);
+  free(log);
+}
+
+// The first word goes in last, with one store, so that a decoder never takes
+// a half-written record for a whole one.
+static void put_record(uint8_t *at, const CMD_RINGLOG_RECORD *stamp, uint16_t len, uint16_t flags, const char *text,
+                       size_t cb) {
+  CMD_RINGLOG_RECORD rec = *stamp;
+  uint64_t word;
+
+  rec.len = len;
+  rec.flags = flags;
+  ringlog_store((volatile uint64_t *)at, 0);
+  memcpy(at + sizeof(word), (const uint8_t *)&rec + sizeof(word), sizeof(rec) - sizeof(word));
+  if (cb) {
+    memcpy(at + sizeof(rec), text, cb);
+  }
+  memcpy(&word, &rec, sizeof(word));
+  ringlog_store((volatile uint64_t *)at, word);
+}
+
+void cmd_ringlog_write(CMD_RINGLOG *log, int level, uint64_t ticks, uint32_t context, uint32_t op, const char *text,
+                       size_t len) {
+  CMD_RINGLOG_RECORD stamp = {CMD_RINGLOG_SYNC, 0, (uint16_t)level, 0, ticks, context, op};
+  uint64_t cur, off, pad, need;
+
+  if (len > CMD_RINGLOG_MAX_TEXT) {
+    len = CMD_RINGLOG_MAX_TEXT;
+  }
+  need = RINGLOG_ALIGN_UP(sizeof(CMD_RINGLOG_RECORD) + len);
+  // reserve the record, and the tail of the ring if it does not fit there
+  do {
+    cur = ringlog_load(&log->header->cursor);
+    off = cur % log->size;
+    pad = off + need > log->size ? log->size - off : 0;
+  } while (!ringlog_cas(&log->header->cursor, cur, cur + pad + need));
+
+  if (pad) {
+    if (pad >= sizeof(CMD_RINGLOG_RECORD)) {
+      // Clear what older laps left in the padding: a decoder that starts
+      // inside it would otherwise take their stale headers for records.
+      memset(log->data + off + sizeof(CMD_RINGLOG_RECORD), 0, (size_t)pad - sizeof(CMD_RINGLOG_RECORD));
+      put_record(log->data + off, &stamp, (uint16_t)pad, CMD_RINGLOG_FLAG_PAD, NULL, 0);
+    }
+    off = 0;
+  }
+  put_record(log->data + off, &stamp, (uint16_t)(sizeof(CMD_RINGLOG_RECORD) + len), 0, text, len);
+}
+
+// Converted by the decoder rather than by the writer for every line
+int64_t cmd_ringlog_unix_us(const CMD_RINGLOG_HEADER *header, uint64_t ticks) {
+  int64_t delta = (int64_t)(ticks - header->base_ticks);
+  uint64_t freq = header->ticks_per_second ? header->ticks_per_second : 1;
+  uint64_t mag = delta < 0 ? (uint64_t)-delta : (uint64_t)delta;
+  int64_t delta_us = (int64_t)(mag / freq * 1000000 + mag % freq * 1000000 / freq);
+  return header->base_unix_us + (delta < 0 ? -delta_us : delta_us);
+}
+
+void cmd_ringlog_print_time(const CMD_RINGLOG_HEADER *header, uint64_t ticks, FILE *out) {
+  int64_t us = cmd_ringlog_unix_us(header, ticks);
+  time_t seconds = (time_t)(us / 1000000);
+  struct tm tm;
+  char buf[32];
+
+#ifdef _WIN32
+  gmtime_s(&tm, &seconds);
+#else
+  gmtime_r(&seconds, &tm);
+#endif
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+  fprintf(out, "%s.%06d", buf, (int)(us % 1000000));
+}
+
+long cmd_ringlog_walk(const char *path, CMD_RINGLOG_VISIT_FN visit, void *arg) {
+  CMD_RINGLOG_HEADER header;
+  long records = 0;
+
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CMD_RINGLOG_MAGIC ||
+      header.version != CMD_RINGLOG_VERSION || header.data_size < RINGLOG_MIN_SIZE ||
+      header.data_size % CMD_RINGLOG_ALIGN != 0) {
+    fclose(f);
+    return -1;
+  }
+  uint8_t *data = (uint8_t *)malloc((size_t)header.data_size);
+  if (!data || fread(data, 1, (size_t)header.data_size, f) != header.data_size) {
+    free(data);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  // The oldest bytes may be the end of a record that was overwritten;
+  // skip ahead to the next sync word.
+  uint64_t pos = header.cursor > header.data_size ? header.cursor - header.data_size : 0;
+  while (pos < header.cursor) {
+    uint64_t off = pos % header.data_size;
+    CMD_RINGLOG_RECORD rec;
+    if (off + sizeof(rec) > header.data_size) {
+      // a tail too short for a record; the next one is at the start
+      pos += header.data_size - off;
+      continue;
+    }
+    memcpy(&rec, data + off, sizeof(rec));
+    uint64_t span = RINGLOG_ALIGN_UP((uint64_t)rec.len);
+    if (rec.sync != CMD_RINGLOG_SYNC || rec.len < sizeof(rec) || off + span > header.data_size ||
+        pos + span > header.cursor) {
+      pos += CMD_RINGLOG_ALIGN;
+      continue;
+    }
+    if (!(rec.flags & CMD_RINGLOG_FLAG_PAD)) {
+      visit(&header, &rec, (const char *)data + off + sizeof(rec), rec.len - sizeof(rec), arg);
+      records++;
+    }
+    pos += span;
+  }
+  free(data);
+  return records;
+}
+
+static void print_record(const CMD_RINGLOG_HEADER *header, const CMD_RINGLOG_RECORD *rec, const char *text,
+                         size_t len, void *arg) {
+  FILE *out = (FILE *)arg;
+
+  cmd_ringlog_print_time(header, rec->ticks, out);
+  fprintf(out, " [%u:%u] - ", (unsigned)rec->context, (unsigned)rec->op);
+  fwrite(text, 1, len, out);
+}
+
+long cmd_ringlog_decode(const char *path, FILE *out) {
+  return cmd_ringlog_walk(path, print_record, out);
+}
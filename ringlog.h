@@ -0,0 +1,97 @@
+#pragma once
+#ifndef __RINGLOG__H__
+#define __RINGLOG__H__
+
+/*
+ * Log file of a fixed size, written as a ring through a shared mapping: a
+ * line costs a copy into the mapping and no system call, and the file never
+ * grows. The header keeps the write cursor so that the file can be decoded
+ * after the process is gone, including after a crash. Like pool.c, this
+ * file only depends on the C runtime and the platform mapping API, so it
+ * builds on Linux (mmap) as well.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CMD_RINGLOG_MAGIC 0x4C524D43U // "CMRL"
+#define CMD_RINGLOG_VERSION 3
+// Records start with this word, so that a decoder can find the first whole
+// record after the ring has wrapped.
+#define CMD_RINGLOG_SYNC 0xC0DEU
+#define CMD_RINGLOG_ALIGN 8
+#define CMD_RINGLOG_MAX_TEXT 1024
+
+typedef struct _CMD_RINGLOG_HEADER {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t data_size;
+  // Bytes ever reserved; the ring holds the last data_size of them
+  volatile uint64_t cursor;
+  uint32_t pid;
+  uint32_t reserved;
+  // Records carry raw ticks (see ticks.h); the decoder turns them into
+  // wall-clock time with this pair, taken when the file was created.
+  uint64_t ticks_per_second;
+  uint64_t base_ticks;
+  int64_t base_unix_us;
+} CMD_RINGLOG_HEADER;
+
+// A record is padded to CMD_RINGLOG_ALIGN and never wraps: the space left
+// before the end of the ring is filled with a padding record instead, or
+// left alone if it is too short to hold one.
+typedef struct _CMD_RINGLOG_RECORD {
+  uint16_t sync;
+  uint16_t len; // header and text, before padding
+  uint16_t level;
+  uint16_t flags;
+  uint64_t ticks;
+  // Correlation IDs of the statement, see corr.h
+  uint32_t context;
+  uint32_t op;
+} CMD_RINGLOG_RECORD;
+
+#define CMD_RINGLOG_FLAG_PAD 1
+
+typedef struct _CMD_RINGLOG CMD_RINGLOG;
+
+// Create or overwrite path with a ring of data_size bytes (rounded up to
+// CMD_RINGLOG_ALIGN) and map it. Returns NULL on failure, including while
+// another ring log, of this or another process, has the file open.
+CMD_RINGLOG *cmd_ringlog_open(const char *path, size_t data_size);
+
+#define CMD_RINGLOG_MAX_SLOTS 64
+// Open the least recently written of the files <prefix>0.ring up to
+// <prefix><slots - 1>.ring that no other ring log has open, so that a
+// directory shared by many processes holds at most slots files and keeps the
+// logs of the last ones. The chosen file name is left in path. Returns NULL
+// when every slot is in use.
+CMD_RINGLOG *cmd_ringlog_open_slot(const char *prefix, unsigned slots, size_t data_size, char *path,
+                                   size_t path_len);
+void cmd_ringlog_close(CMD_RINGLOG *log);
+
+// Append a record stamped with ticks from cmd_ticks and the correlation IDs
+// of the statement; text longer than CMD_RINGLOG_MAX_TEXT is cut. Lock-free,
+// may be called from any number of threads.
+void cmd_ringlog_write(CMD_RINGLOG *log, int level, uint64_t ticks, uint32_t context, uint32_t op, const char *text,
+                       size_t len);
+
+// Called for each record of a ring file from oldest to newest. text is not
+// terminated.
+typedef void (*CMD_RINGLOG_VISIT_FN)(const CMD_RINGLOG_HEADER *header, const CMD_RINGLOG_RECORD *rec,
+                                     const char *text, size_t len, void *arg);
+// Returns the number of records, or -1 if the file is not a ring log.
+long cmd_ringlog_walk(const char *path, CMD_RINGLOG_VISIT_FN visit, void *arg);
+
+// Wall-clock time of a record, in microseconds since the Unix epoch (UTC).
+int64_t cmd_ringlog_unix_us(const CMD_RINGLOG_HEADER *header, uint64_t ticks);
+// Print the UTC time of a record as "YYYY-MM-DD HH:MM:SS.uuuuuu".
+void cmd_ringlog_print_time(const CMD_RINGLOG_HEADER *header, uint64_t ticks, FILE *out);
+
+// Print the records of a ring file from oldest to newest, each prefixed with
+// its UTC time and correlation IDs. Returns the number of records, or -1 if
+// the file is not a ring log.
+long cmd_ringlog_decode(const char *path, FILE *out);
+
+#endif // __RINGLOG__H__
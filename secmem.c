@@ -0,0 +1,197 @@
+#include "secmem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define secmem_load(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define secmem_cas(p, expected, desired)                                                                              \
+  ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(desired), (LONG64)(expected)) ==         \
+   (expected))
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#define secmem_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define secmem_cas(p, expected, desired)                                                                              \
+  ({                                                                                                                  \
+    uint64_t _e = (expected);                                                                                         \
+    __atomic_compare_exchange_n(p, &_e, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);                               \
+  })
+#endif
+
+struct _CMD_SECMEM {
+  // Bit i is set while slot i is acquired
+  volatile uint64_t used;
+  unsigned slots;
+  int locked;
+  size_t page;
+  // Guard page, data pages, guard page
+  uint8_t *base;
+  size_t data_len;
+};
+
+static size_t page_size(void) {
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwPageSize;
+#else
+  return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Map the pages and fence the data with guard pages. Sets pool->locked if
+// the data pages could be locked.
+static int map_pages(CMD_SECMEM *pool) {
+  size_t total = pool->data_len + 2 * pool->page;
+#ifdef _WIN32
+  DWORD old;
+  pool->base = (uint8_t *)VirtualAlloc(NULL, total, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (!pool->base) {
+    return 0;
+  }
+  if (!VirtualProtect(pool->base, pool->page, PAGE_NOACCESS, &old) ||
+      !VirtualProtect(pool->base + pool->page + pool->data_len, pool->page, PAGE_NOACCESS, &old)) {
+    VirtualFree(pool->base, 0, MEM_RELEASE);
+    return 0;
+  }
+  // fails once the process exceeds its minimum working set
+  pool->locked = VirtualLock(pool->base + pool->page, pool->data_len) != 0;
+#else
+  void *p = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  pool->base = (uint8_t *)p;
+  if (mprotect(pool->base + pool->page, pool->data_len, PROT_READ | PROT_WRITE) != 0) {
+    munmap(p, total);
+    return 0;
+  }
+#ifdef MADV_DONTDUMP
+  madvise(pool->base + pool->page, pool->data_len, MADV_DONTDUMP);
+#endif
+  // fails beyond RLIMIT_MEMLOCK
+  pool->locked = mlock(pool->base + pool->page, pool->data_len) == 0;
+#endif
+  return 1;
+}
+
+static void unmap_pages(CMD_SECMEM *pool) {
+#ifdef _WIN32
+  if (pool->locked) {
+    VirtualUnlock(pool->base + pool->page, pool->data_len);
+  }
+  VirtualFree(pool->base, 0, MEM_RELEASE);
+#else
+  if (pool->locked) {
+    munlock(pool->base + pool->page, pool->data_len);
+  }
+  munmap(pool->base, pool->data_len + 2 * pool->page);
+#endif
+}
+
+void cmd_secmem_wipe(void *p, size_t len) {
+#ifdef _WIN32
+  SecureZeroMemory(p, len);
+#else
+  volatile uint8_t *v = (volatile uint8_t *)p;
+  while (len--) {
+    *v++ = 0;
+  }
+#endif
+}
+
+CMD_SECMEM *cmd_secmem_create(unsigned slots) {
+  if (slots == 0 || slots > CMD_SECMEM_MAX_SLOTS) {
+    return NULL;
+  }
+  CMD_SECMEM *pool = (CMD_SECMEM *)calloc(1, sizeof(CMD_SECMEM));
+  if (!pool) {
+    return NULL;
+  }
+  pool->slots = slots;
+  pool->page = page_size();
+  pool->data_len = ((size_t)slots * CMD_SECMEM_SLOT_SIZE + pool->page - 1) / pool->page * pool->page;
+  if (!map_pages(pool)) {
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void cmd_secmem_destroy(CMD_SECMEM *pool) {
+  if (!pool) {
+    return;
+  }
+  cmd_secmem_wipe(pool->base + pool->page, pool->data_len);
+  unmap_pages(pool);
+  free(pool);
+}
+
+int cmd_secmem_locked(const CMD_SECMEM *pool) {
+  return pool->locked;
+}
+
+void *cmd_secmem_acquire(CMD_SECMEM *pool) {
+  for (;;) {
+    uint64_t used = secmem_load(&pool->used);
+    unsigned i = 0;
+    while (i < pool->slots && (used & ((uint64_t)1 << i))) {
+      i++;
+    }
+    if (i == pool->slots) {
+      return NULL;
+    }
+    if (secmem_cas(&pool->used, used, used | ((uint64_t)1 << i))) {
+      // released slots are already wiped
+      return pool->base + pool->page + (size_t)i * CMD_SECMEM_SLOT_SIZE;
+    }
+  }
+}
+
+// Mask of n slots starting at slot i
+static uint64_t run_mask(unsigned i, unsigned n) {
+  return (n >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << i;
+}
+
+void cmd_secmem_release(CMD_SECMEM *pool, void *slot) {
+  cmd_secmem_release_span(pool, slot, CMD_SECMEM_SLOT_SIZE);
+}
+
+void *cmd_secmem_acquire_span(CMD_SECMEM *pool, size_t len) {
+  size_t n = CMD_SECMEM_SLOTS(len);
+
+  if (n == 0 || n > pool->slots) {
+    return NULL;
+  }
+  for (;;) {
+    uint64_t used = secmem_load(&pool->used);
+    int i = (int)(pool->slots - n);
+    while (i >= 0 && (used & run_mask((unsigned)i, (unsigned)n))) {
+      i--;
+    }
+    if (i < 0) {
+      return NULL;
+    }
+    if (secmem_cas(&pool->used, used, used | run_mask((unsigned)i, (unsigned)n))) {
+      return pool->base + pool->page + (size_t)i * CMD_SECMEM_SLOT_SIZE;
+    }
+  }
+}
+
+void cmd_secmem_release_span(CMD_SECMEM *pool, void *span, size_t len) {
+  if (!span) {
+    return;
+  }
+  size_t i = ((uint8_t *)span - (pool->base + pool->page)) / CMD_SECMEM_SLOT_SIZE;
+  size_t n = CMD_SECMEM_SLOTS(len);
+  // wipe before the slots can be handed out again
+  cmd_secmem_wipe(span, n * CMD_SECMEM_SLOT_SIZE);
+  for (;;) {
+    uint64_t used = secmem_load(&pool->used);
+    if (secmem_cas(&pool->used, used, used & ~run_mask((unsigned)i, (unsigned)n))) {
+      return;
+    }
+  }
+}
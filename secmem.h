@@ -0,0 +1,51 @@
+#pragma once
+#ifndef __SECMEM__H__
+#define __SECMEM__H__
+
+/*
+ * Pool of fixed-size slots for PINs and key material. The slots share pages
+ * that are locked in memory (never written to the page file or a core dump)
+ * and fenced by inaccessible guard pages, so an overrun faults instead of
+ * reaching the neighbouring heap. Slots are zeroed on acquire and wiped on
+ * release. Like pool.c, this file only depends on the C runtime and the
+ * platform virtual-memory API, so it builds on Linux as well.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_SECMEM_SLOT_SIZE 64
+// Slots a buffer of len bytes spans
+#define CMD_SECMEM_SLOTS(len) (((len) + CMD_SECMEM_SLOT_SIZE - 1) / CMD_SECMEM_SLOT_SIZE)
+// Slots are tracked in a 64-bit mask
+#define CMD_SECMEM_MAX_SLOTS 64
+
+typedef struct _CMD_SECMEM CMD_SECMEM;
+
+// Returns NULL if the pages cannot be mapped. Failing to lock them is not
+// fatal, see cmd_secmem_locked.
+CMD_SECMEM *cmd_secmem_create(unsigned slots);
+// Wipe every slot, acquired or not, and unmap the pool.
+void cmd_secmem_destroy(CMD_SECMEM *pool);
+// Nonzero if the pages are locked in memory.
+int cmd_secmem_locked(const CMD_SECMEM *pool);
+
+// Take a zeroed slot of CMD_SECMEM_SLOT_SIZE bytes. Lock-free; returns NULL
+// when every slot is in use.
+void *cmd_secmem_acquire(CMD_SECMEM *pool);
+// Wipe a slot and give it back. slot may be NULL.
+void cmd_secmem_release(CMD_SECMEM *pool, void *slot);
+
+// Take a zeroed buffer of len bytes made of consecutive slots, for staging
+// buffers larger than a slot. Spans are taken from the top of the pool and
+// single slots from the bottom, so that neither fragments the other as long
+// as spans are released in the reverse order they were taken. Lock-free;
+// returns NULL when no run of free slots is long enough.
+void *cmd_secmem_acquire_span(CMD_SECMEM *pool, size_t len);
+// Wipe a span and give it back. span may be NULL.
+void cmd_secmem_release_span(CMD_SECMEM *pool, void *span, size_t len);
+
+// Zero memory in a way the compiler cannot drop as a dead store.
+void cmd_secmem_wipe(void *p, size_t len);
+
+#endif // __SECMEM__H__
@@ -0,0 +1,280 @@
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <aclapi.h>
+#include <sddl.h>
+#define shm_load_acquire(p) InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define shm_store_release(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define shm_cas(p, expected, desired)                                                                                 \
+  (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#define shm_fence() MemoryBarrier()
+#define shm_fetch_add64(p) ((uint64_t)InterlockedIncrement64((volatile LONG64 *)(p)))
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define shm_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define shm_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define shm_cas(p, expected, desired)                                                                                 \
+  ({                                                                                                                  \
+    uint32_t _e = (expected);                                                                                         \
+    __atomic_compare_exchange_n(p, &_e, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);                               \
+  })
+#define shm_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define shm_fetch_add64(p) (__atomic_add_fetch(p, 1, __ATOMIC_RELAXED))
+#endif
+
+// Bump when the layout below changes; another version's section is ignored.
+#define SHM_MAGIC 0x434D5302U // "CMS" v2
+// Linear probing window
+#define SHM_WAYS 4
+// Attempts to read an entry that keeps changing under the reader
+#define SHM_READ_RETRIES 3
+
+typedef struct _SHM_ENTRY {
+  // Even when stable, odd while a writer owns the entry. A writer that dies
+  // mid-update leaves it odd, which only retires this one entry.
+  volatile uint32_t seq;
+  uint32_t len;
+  uint64_t stamp;
+  CMD_SHM_KEY key;
+  uint8_t data[CMD_SHM_ENTRY_DATA];
+} SHM_ENTRY;
+
+typedef struct _SHM_TABLE {
+  volatile uint32_t magic;
+  uint32_t reserved;
+  volatile uint64_t clock;
+  SHM_ENTRY entries[CMD_SHM_ENTRIES];
+} SHM_TABLE;
+
+struct _CMD_SHM_CACHE {
+  SHM_TABLE *table;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+};
+
+static uint32_t key_hash(const CMD_SHM_KEY *key) {
+  const uint8_t *p = (const uint8_t *)key;
+  uint32_t h = 2166136261U; // FNV-1a
+  for (size_t i = 0; i < sizeof(*key); i++) {
+    h = (h ^ p[i]) * 16777619U;
+  }
+  return h;
+}
+
+#ifdef _WIN32
+typedef struct _SHM_USER {
+  TOKEN_USER user;
+  BYTE sid[SECURITY_MAX_SID_SIZE];
+} SHM_USER;
+
+// The user the process runs as. The section is mapped once per process, so
+// a thread impersonating someone else does not count.
+static int process_user(SHM_USER *user) {
+  HANDLE token;
+  DWORD len;
+
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+    return 0;
+  }
+  BOOL ok = GetTokenInformation(token, TokenUser, user, sizeof(*user), &len);
+  CloseHandle(token);
+  return ok;
+}
+
+static int owned_by(HANDLE object, PSID sid) {
+  PSECURITY_DESCRIPTOR sd;
+  PSID owner;
+
+  if (GetSecurityInfo(object, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL, &sd) !=
+      ERROR_SUCCESS) {
+    return 0;
+  }
+  int same = EqualSid(owner, sid) != 0;
+  LocalFree(sd);
+  return same;
+}
+#endif
+
+static SHM_TABLE *map_table(CMD_SHM_CACHE *cache, const char *name) {
+#ifdef _WIN32
+  SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, FALSE};
+  PSECURITY_DESCRIPTOR sd = NULL;
+  SHM_TABLE *table = NULL;
+  char section[MAX_PATH], sddl[256];
+  char *sid = NULL;
+  SHM_USER user;
+
+  if (!process_user(&user) || !ConvertSidToStringSidA(user.user.User.Sid, &sid)) {
+    return NULL;
+  }
+  // Local\ is per logon session, but all services run in session 0 and share
+  // it, so the name carries the user as well. Only that user and SYSTEM may
+  // open the section, and one that someone else created first is not used.
+  snprintf(section, sizeof(section), "Local\\%s-%s", name, sid);
+  snprintf(sddl, sizeof(sddl), "O:%sD:P(A;;GA;;;%s)(A;;GA;;;SY)", sid, sid);
+  if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl, SDDL_REVISION_1, &sd, NULL)) {
+    goto out;
+  }
+  sa.lpSecurityDescriptor = sd;
+  cache->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0, sizeof(SHM_TABLE), section);
+  if (cache->mapping == NULL) {
+    goto out;
+  }
+  if (GetLastError() == ERROR_ALREADY_EXISTS && !owned_by(cache->mapping, user.user.User.Sid)) {
+    CloseHandle(cache->mapping);
+    goto out;
+  }
+  table = (SHM_TABLE *)MapViewOfFile(cache->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SHM_TABLE));
+  if (table == NULL) {
+    CloseHandle(cache->mapping);
+  }
+out:
+  LocalFree(sd);
+  LocalFree(sid);
+  return table;
+#else
+  char path[256];
+  (void)cache;
+  snprintf(path, sizeof(path), "/%s-%u", name, (unsigned)getuid());
+  int fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  // a new section is zero-filled, which is a valid empty table; one that
+  // another user created first under this name is not used
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_uid != getuid() ||
+      (st.st_size < (off_t)sizeof(SHM_TABLE) && ftruncate(fd, sizeof(SHM_TABLE)) != 0)) {
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, sizeof(SHM_TABLE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : (SHM_TABLE *)p;
+#endif
+}
+
+static void unmap_table(CMD_SHM_CACHE *cache) {
+#ifdef _WIN32
+  UnmapViewOfFile(cache->table);
+  CloseHandle(cache->mapping);
+#else
+  munmap(cache->table, sizeof(SHM_TABLE));
+#endif
+}
+
+CMD_SHM_CACHE *cmd_shm_open(const char *name) {
+  CMD_SHM_CACHE *cache = (CMD_SHM_CACHE *)calloc(1, sizeof(CMD_SHM_CACHE));
+  if (!cache) {
+    return NULL;
+  }
+  cache->table = map_table(cache, name);
+  if (!cache->table) {
+    free(cache);
+    return NULL;
+  }
+  // the first process stamps the zero-filled section
+  shm_cas(&cache->table->magic, 0, SHM_MAGIC);
+  if (shm_load_acquire(&cache->table->magic) != SHM_MAGIC) {
+    cmd_shm_close(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void cmd_shm_close(CMD_SHM_CACHE *cache) {
+  if (!cache) {
+    return;
+  }
+  unmap_table(cache);
+  free(cache);
+}
+
+// Copy an entry out under its sequence counter. Returns 1 if the copy is
+// consistent.
+static int read_entry(SHM_ENTRY *entry, CMD_SHM_KEY *key, uint8_t *data, size_t cap, size_t *len) {
+  for (int attempt = 0; attempt < SHM_READ_RETRIES; attempt++) {
+    uint32_t seq = shm_load_acquire(&entry->seq);
+    if (seq & 1) {
+      continue;
+    }
+    memcpy(key, &entry->key, sizeof(*key));
+    *len = entry->len;
+    if (data && *len <= cap) {
+      memcpy(data, entry->data, *len);
+    }
+    shm_fence();
+    if (shm_load_acquire(&entry->seq) == seq) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int cmd_shm_get(CMD_SHM_CACHE *cache, const CMD_SHM_KEY *key, uint8_t *data, size_t *len) {
+  uint32_t h = key_hash(key);
+  for (int way = 0; way < SHM_WAYS; way++) {
+    SHM_ENTRY *entry = &cache->table->entries[(h + way) % CMD_SHM_ENTRIES];
+    CMD_SHM_KEY found;
+    size_t found_len;
+    if (!read_entry(entry, &found, data, *len, &found_len) || memcmp(&found, key, sizeof(found)) != 0) {
+      continue;
+    }
+    if (found_len > *len || found_len > CMD_SHM_ENTRY_DATA) {
+      return 0;
+    }
+    *len = found_len;
+    return 1;
+  }
+  return 0;
+}
+
+void cmd_shm_put(CMD_SHM_CACHE *cache, const CMD_SHM_KEY *key, const uint8_t *data, size_t len) {
+  SHM_ENTRY *victim = NULL;
+  uint64_t oldest = UINT64_MAX;
+
+  if (len > CMD_SHM_ENTRY_DATA) {
+    return;
+  }
+
+  uint32_t h = key_hash(key);
+  for (int way = 0; way < SHM_WAYS; way++) {
+    SHM_ENTRY *entry = &cache->table->entries[(h + way) % CMD_SHM_ENTRIES];
+    CMD_SHM_KEY found;
+    size_t found_len;
+    if (!read_entry(entry, &found, NULL, 0, &found_len)) {
+      continue;
+    }
+    if (memcmp(&found, key, sizeof(found)) == 0) {
+      victim = entry;
+      break;
+    }
+    if (entry->stamp < oldest) {
+      oldest = entry->stamp;
+      victim = entry;
+    }
+  }
+  if (!victim) {
+    return;
+  }
+
+  uint32_t seq = shm_load_acquire(&victim->seq);
+  if ((seq & 1) || !shm_cas(&victim->seq, seq, seq + 1)) {
+    return; // another writer owns the entry
+  }
+  memcpy(&victim->key, key, sizeof(*key));
+  victim->len = (uint32_t)len;
+  memcpy(victim->data, data, len);
+  victim->stamp = shm_fetch_add64(&cache->table->clock);
+  shm_fence();
+  shm_store_release(&victim->seq, seq + 2);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#ifndef __SHM__H__
+#define __SHM__H__
+
+/*
+ * Cache of card metadata shared by the processes of one user that load the
+ * driver in one logon session. The table lives in a named shared-memory section; each
+ * entry is guarded by a sequence counter so readers never take a lock and
+ * never block a writer. On Windows the section is created in the Local\
+ * namespace of the session under a name that includes the SID of the process
+ * user, with a DACL that only admits that user and SYSTEM; a section of that
+ * name owned by anyone else is not used. Session 0 is shared by all services,
+ * so without this a low-privilege service could plant entries that LSASS
+ * trusts. Like pool.c, this file only depends on the C runtime and the
+ * platform shared-memory API, so it builds on Linux (POSIX shm, per user)
+ * as well.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_SHM_ENTRIES 64
+#define CMD_SHM_ENTRY_DATA 4096
+#define CMD_SHM_MAX_SERIAL 32
+#define CMD_SHM_MAX_ATR 36
+
+// Lookup key. Zero-initialize before filling so that padding and unused
+// bytes compare equal.
+typedef struct _CMD_SHM_KEY {
+  uint8_t serial[CMD_SHM_MAX_SERIAL];
+  uint8_t atr[CMD_SHM_MAX_ATR];
+  uint8_t serial_len;
+  uint8_t atr_len;
+  uint8_t type; // nonzero
+  uint8_t index;
+  uint32_t stamp; // digest of the card content the data was read from
+} CMD_SHM_KEY;
+
+typedef struct _CMD_SHM_CACHE CMD_SHM_CACHE;
+
+// Open or create the named section. Returns NULL if it cannot be mapped or
+// was created by an incompatible driver version.
+CMD_SHM_CACHE *cmd_shm_open(const char *name);
+void cmd_shm_close(CMD_SHM_CACHE *cache);
+
+// Copy the entry for key into data. *len is the capacity on input and the
+// entry size on output. Returns 1 on a hit, 0 on a miss or when the entry
+// is being written concurrently; data is clobbered on a miss too.
+int cmd_shm_get(CMD_SHM_CACHE *cache, const CMD_SHM_KEY *key, uint8_t *data, size_t *len);
+
+// Store an entry, replacing the one for the same key or the least recently
+// written one. Silently skipped if the slot is being written by someone else
+// or len exceeds CMD_SHM_ENTRY_DATA.
+void cmd_shm_put(CMD_SHM_CACHE *cache, const CMD_SHM_KEY *key, const uint8_t *data, size_t len);
+
+#endif // __SHM__H__
@@ -0,0 +1,176 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_CRYPTO
+
+#include "sign.h"
+#include "logging.h"
+#include "piv.h"
+#include "pubkey.h"
+#include "tlv.h"
+
+#include <string.h>
+
+typedef struct _DIGEST_INFO {
+  ALG_ID aiHashAlg;
+  LPCWSTR pwszHashAlg;
+  DWORD cbDigest;
+  DWORD cbPrefix;
+  BYTE rgbPrefix[19];
+} DIGEST_INFO;
+
+static const DIGEST_INFO g_digest_infos[] = {
+    {CALG_MD5, BCRYPT_MD5_ALGORITHM, 16, 18,
+     {0x30, 0x20, 0x30, 0x0c, 0x06, 0x08, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x02, 0x05, 0x05, 0x00, 0x04, 0x10}},
+    {CALG_SHA1, BCRYPT_SHA1_ALGORITHM, 20, 15,
+     {0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14}},
+    {CALG_SHA_256, BCRYPT_SHA256_ALGORITHM, 32, 19,
+     {0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04,
+      0x20}},
+    {CALG_SHA_384, BCRYPT_SHA384_ALGORITHM, 48, 19,
+     {0x30, 0x41, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04,
+      0x30}},
+    {CALG_SHA_512, BCRYPT_SHA512_ALGORITHM, 64, 19,
+     {0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04,
+      0x40}},
+};
+
+static const DIGEST_INFO *find_digest_info(ALG_ID aiHashAlg, LPCWSTR pwszHashAlg) {
+  for (DWORD i = 0; i < ARRAYSIZE(g_digest_infos); i++) {
+    if ((aiHashAlg && g_digest_infos[i].aiHashAlg == aiHashAlg) ||
+        (pwszHashAlg && wcscmp(g_digest_infos[i].pwszHashAlg, pwszHashAlg) == 0)) {
+      return &g_digest_infos[i];
+    }
+  }
+  return NULL;
+}
+
+DWORD cmd_sign_resolve_key(PCARD_DATA pCardData, BYTE bContainerIndex, DWORD dwKeySpec, PCMD_SIGN_KEY pKey) {
+  const CMD_PUBKEY *pPubKey;
+
+  if (!cmd_piv_container_to_slot(bContainerIndex, &pKey->bSlot)) {
+    return SCARD_E_NO_KEY_CONTAINER;
+  }
+  DWORD dwRet = cmd_pubkey_get(pCardData, bContainerIndex, &pPubKey);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  switch (dwKeySpec) {
+  case AT_ECDSA_P256:
+  case AT_ECDSA_P384:
+    if (!pPubKey->fEcc || pPubKey->dwBits != (dwKeySpec == AT_ECDSA_P256 ? 256 : 384)) {
+      return SCARD_E_INVALID_PARAMETER;
+    }
+    break;
+  case AT_SIGNATURE:
+  case AT_KEYEXCHANGE:
+    if (pPubKey->fEcc) {
+      return SCARD_E_INVALID_PARAMETER;
+    }
+    break;
+  default:
+    return SCARD_E_INVALID_PARAMETER;
+  }
+  pKey->bAlg = pPubKey->bAlg;
+  pKey->fEcc = pPubKey->fEcc;
+  pKey->cbKey = pPubKey->dwBits / 8;
+  return SCARD_S_SUCCESS;
+}
+
+// Convert a DER ECDSA-Sig-Value into fixed-size r || s.
+static DWORD ecdsa_der_to_raw(const BYTE *pbDer, DWORD cbDer, DWORD cbField, BYTE *pbRaw) {
+  const BYTE *pbSeq, *pbInt;
+  DWORD cbSeq, cbInt, tag, n;
+
+  if (!cmd_tlv_find(pbDer, cbDer, 0x30, &pbSeq, &cbSeq)) {
+    return SCARD_E_UNEXPECTED;
+  }
+  memset(pbRaw, 0, 2 * cbField);
+  for (DWORD i = 0; i < 2; i++) {
+    n = cmd_tlv_parse(pbSeq, cbSeq, &tag, &pbInt, &cbInt);
+    if (n == 0 || tag != 0x02) {
+      return SCARD_E_UNEXPECTED;
+    }
+    while (cbInt > 0 && *pbInt == 0) {
+      pbInt++;
+      cbInt--;
+    }
+    if (cbInt > cbField) {
+      return SCARD_E_UNEXPECTED;
+    }
+    memcpy(pbRaw + i * cbField + cbField - cbInt, pbInt, cbInt);
+    pbSeq += n;
+    cbSeq -= n;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_sign_digest(PCARD_DATA pCardData, const CMD_SIGN_KEY *pKey, ALG_ID aiHashAlg, LPCWSTR pwszHashAlg,
+                      const BYTE *pbDigest, DWORD cbDigest, BYTE *pbSignature, DWORD *pcbSignature) {
+  BYTE input[CMD_SIGN_MAX_KEY_LEN], output[CMD_SIGN_MAX_KEY_LEN + 16];
+  DWORD cbInput, cbOutput = sizeof(output);
+  DWORD dwRet;
+
+  if (*pcbSignature < CMD_SIGN_SIGNATURE_LEN(pKey)) {
+    return SCARD_E_INSUFFICIENT_BUFFER;
+  }
+
+  if (pKey->fEcc) {
+    // ECDSA uses the leftmost field-size bytes of the digest
+    cbInput = pKey->cbKey;
+    memset(input, 0, cbInput);
+    if (cbDigest >= cbInput) {
+      memcpy(input, pbDigest, cbInput);
+    } else {
+      memcpy(input + cbInput - cbDigest, pbDigest, cbDigest);
+    }
+  } else {
+    // EMSA-PKCS1-v1_5: 00 01 FF .. FF 00 || DigestInfo || digest
+    const DIGEST_INFO *pInfo = NULL;
+    DWORD cbPrefix = 0;
+    if (aiHashAlg || pwszHashAlg) {
+      pInfo = find_digest_info(aiHashAlg, pwszHashAlg);
+      if (!pInfo && aiHashAlg != CALG_SSL3_SHAMD5) {
+        CMD_ERROR("Unsupported hash algorithm %x / %S\n", aiHashAlg, pwszHashAlg ? pwszHashAlg : L"");
+        return SCARD_E_UNSUPPORTED_FEATURE;
+      }
+      if (pInfo && pInfo->cbDigest != cbDigest) {
+        return SCARD_E_INVALID_PARAMETER;
+      }
+      cbPrefix = pInfo ? pInfo->cbPrefix : 0;
+    }
+    cbInput = pKey->cbKey;
+    if (cbPrefix + cbDigest + 11 > cbInput) {
+      return SCARD_E_INVALID_PARAMETER;
+    }
+    DWORD cbPad = cbInput - cbPrefix - cbDigest - 3;
+    input[0] = 0x00;
+    input[1] = 0x01;
+    memset(input + 2, 0xFF, cbPad);
+    input[2 + cbPad] = 0x00;
+    if (cbPrefix) {
+      memcpy(input + 3 + cbPad, pInfo->rgbPrefix, cbPrefix);
+    }
+    memcpy(input + 3 + cbPad + cbPrefix, pbDigest, cbDigest);
+  }
+
+  dwRet = cmd_piv_general_authenticate(pCardData, pKey->bAlg, pKey->bSlot, CMD_PIV_TAG_CHALLENGE, input, cbInput,
+                                       output, &cbOutput);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+
+  if (pKey->fEcc) {
+    dwRet = ecdsa_der_to_raw(output, cbOutput, pKey->cbKey, pbSignature);
+    *pcbSignature = 2 * pKey->cbKey;
+    return dwRet;
+  }
+
+  if (cbOutput != pKey->cbKey) {
+    return SCARD_E_UNEXPECTED;
+  }
+  // CAPI expects RSA signatures in little-endian order
+  for (DWORD i = 0; i < cbOutput; i++) {
+    pbSignature[i] = output[cbOutput - 1 - i];
+  }
+  *pcbSignature = cbOutput;
+  return SCARD_S_SUCCESS;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#ifndef __SIGN__H__
+#define __SIGN__H__
+
+#include "cardmod.h"
+
+#define CMD_SIGN_MAX_KEY_LEN 512
+
+// Key referenced by a signing request, resolved from the container index and
+// key spec against the key discovered in the slot.
+typedef struct _CMD_SIGN_KEY {
+  BYTE bSlot;
+  BYTE bAlg;
+  BOOL fEcc;
+  DWORD cbKey; // modulus or field size in bytes
+} CMD_SIGN_KEY, *PCMD_SIGN_KEY;
+
+DWORD cmd_sign_resolve_key(PCARD_DATA pCardData, BYTE bContainerIndex, DWORD dwKeySpec, PCMD_SIGN_KEY pKey);
+
+// Size of the signature returned to the CSP.
+#define CMD_SIGN_SIGNATURE_LEN(pKey) ((pKey)->fEcc ? 2 * (pKey)->cbKey : (pKey)->cbKey)
+
+// Sign one digest with the resolved key. Must be called inside a card
+// transaction with the PIV application selected. For RSA keys, the digest is
+// padded with PKCS #1 v1.5 using the DigestInfo of either aiHashAlg or
+// pwszHashAlg (NULL and 0 for no DigestInfo). The signature is written in
+// the format the CSP expects: little-endian for RSA, r || s for ECDSA.
+DWORD cmd_sign_digest(PCARD_DATA pCardData, const CMD_SIGN_KEY *pKey, ALG_ID aiHashAlg, LPCWSTR pwszHashAlg,
+                      const BYTE *pbDigest, DWORD cbDigest, BYTE *pbSignature, DWORD *pcbSignature);
+
+#endif // __SIGN__H__
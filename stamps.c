@@ -0,0 +1,174 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_CACHE
+
+#include "stamps.h"
+#include "apdu.h"
+#include "arena.h"
+#include "context.h"
+#include "crc32.h"
+#include "freshness.h"
+#include "logging.h"
+#include "prefetch.h"
+#include "pubkey.h"
+
+#include <string.h>
+
+// Stop a certificate object read after its first response chunk.
+static BOOL first_chunk(const BYTE *pbResp, DWORD cbResp, void *pvArg) {
+  return TRUE;
+}
+
+// A container is stamped by its metadata, then the prefix of its certificate
+// object. A regenerated key changes the former, a renewed certificate the
+// serial number in the latter.
+DWORD cmd_stamps_read_container(PCARD_DATA pCardData, BYTE bContainerIndex, BOOL *pfNoMetadata, DWORD *pdwStamp,
+                                PCMD_PUBKEY pKey) {
+  BYTE rgbDigest[CMD_PUBKEY_MAX_META + CMD_APDU_MAX_SHORT_RESP];
+  DWORD cbMeta = CMD_PUBKEY_MAX_META, cbCert = CMD_APDU_MAX_SHORT_RESP, dwRet;
+  BYTE bSlot;
+
+  if (!cmd_piv_container_to_slot(bContainerIndex, &bSlot)) {
+    return SCARD_E_NO_KEY_CONTAINER;
+  }
+  *pdwStamp = 0;
+  if (pKey) {
+    memset(pKey, 0, sizeof(*pKey));
+  }
+  if (!*pfNoMetadata) {
+    dwRet = cmd_piv_get_metadata(pCardData, bSlot, rgbDigest, &cbMeta);
+    if (dwRet == SCARD_E_FILE_NOT_FOUND) {
+      if (pKey) {
+        pKey->fValid = TRUE; // an empty slot
+      }
+      return SCARD_S_SUCCESS; // no key, so the certificate does not matter
+    }
+    if (dwRet == SCARD_E_UNSUPPORTED_FEATURE) {
+      *pfNoMetadata = TRUE;
+    } else if (dwRet != SCARD_S_SUCCESS) {
+      return dwRet;
+    }
+    // parsed now, before the certificate prefix is appended
+    if (dwRet == SCARD_S_SUCCESS && pKey) {
+      pKey->fValid = cmd_pubkey_from_metadata(bSlot, rgbDigest, cbMeta, pKey) == SCARD_S_SUCCESS;
+      pKey->fPresent = pKey->fValid;
+    }
+  }
+  if (*pfNoMetadata) {
+    cbMeta = 0;
+  }
+  dwRet = cmd_piv_get_data_prefix(pCardData, cmd_piv_cert_object(bSlot), rgbDigest + cbMeta, &cbCert, first_chunk,
+                                  NULL);
+  if (dwRet == SCARD_E_FILE_NOT_FOUND) {
+    cbCert = 0;
+  } else if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (cbMeta + cbCert > 0) {
+    *pdwStamp = cmd_crc32(rgbDigest, cbMeta + cbCert);
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD cmd_stamps_read_files(PCARD_DATA pCardData, DWORD *pdwStamp) {
+  PCMD_ARENA pArena = cmd_arena_of(pCardData);
+  DWORD dwMark = cmd_arena_mark(pArena), cbChuid = CMD_PIV_MAX_OBJECT_LEN;
+
+  *pdwStamp = 0;
+  BYTE *pbChuid = (BYTE *)cmd_arena_alloc(pArena, cbChuid);
+  if (!pbChuid) {
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  DWORD dwRet = cmd_piv_get_data(pCardData, CMD_PIV_OBJ_CHUID, pbChuid, &cbChuid);
+  if (dwRet == SCARD_S_SUCCESS) {
+    *pdwStamp = cmd_crc32(pbChuid, cbChuid);
+  } else if (dwRet == SCARD_E_FILE_NOT_FOUND) {
+    dwRet = SCARD_S_SUCCESS;
+  }
+  cmd_arena_release(pArena, dwMark);
+  return dwRet;
+}
+
+DWORD cmd_stamps_read(PCARD_DATA pCardData, BOOL *pfNoMetadata, PCMD_STAMPS pStamps) {
+  DWORD dwRet = SCARD_S_SUCCESS;
+
+  memset(pStamps, 0, sizeof(*pStamps));
+  pStamps->dwTransaction = CMD_CONTEXT_OF(pCardData)->dwTransactionsBegun;
+  for (BYTE i = 0; i < CMD_PIV_NUM_SLOTS && dwRet == SCARD_S_SUCCESS; i++) {
+    dwRet = cmd_stamps_read_container(pCardData, i, pfNoMetadata, &pStamps->rgdwContainers[i], NULL);
+  }
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_stamps_read_files(pCardData, &pStamps->dwFiles);
+  }
+  pStamps->fValid = dwRet == SCARD_S_SUCCESS;
+  return dwRet;
+}
+
+BOOL cmd_stamps_fresh(PCARD_DATA pCardData, const CMD_STAMPS *pStamps) {
+  return pStamps->fValid && pStamps->dwTransaction == CMD_CONTEXT_OF(pCardData)->dwTransactionsBegun;
+}
+
+void cmd_stamps_apply(PCARD_DATA pCardData, const CMD_STAMPS *pStamps) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  const CMD_STAMPS *pOld = &pContext->stamps;
+  WORD wOld = pContext->cardcf.wContainersFreshness;
+  CMD_FRESHNESS freshness = {wOld, pContext->cardcf.wFilesFreshness};
+
+  if (!pStamps->fValid) {
+    CMD_DEBUG("Card content unknown, treating every cache as stale\n");
+  }
+  DWORD dwChanged = cmd_freshness_update(&freshness, pOld->fValid ? (const uint32_t *)pOld->rgdwContainers : NULL,
+                                         pOld->dwFiles,
+                                         pStamps->fValid ? (const uint32_t *)pStamps->rgdwContainers : NULL,
+                                         pStamps->dwFiles, CMD_PIV_NUM_SLOTS);
+  WORD wNew = freshness.containers;
+
+  if (pOld->fValid && pStamps->fValid && dwChanged) {
+    for (DWORD i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+      PCMD_PUBKEY pKey = &pContext->rgPubKeys[i];
+      if (!pKey->fValid || pKey->wFreshness != wOld) {
+        continue;
+      }
+      if (!(dwChanged & (1UL << i))) {
+        pKey->wFreshness = wNew;
+      } else {
+        CMD_DEBUG("Container %d changed, will be read again\n", i);
+      }
+    }
+    cmd_negcache_rekey(&pContext->negCache, wOld, wNew, dwChanged);
+  }
+  pContext->cardcf.wContainersFreshness = wNew;
+  pContext->cardcf.wFilesFreshness = freshness.files;
+  pContext->stamps = *pStamps;
+}
+
+DWORD cmd_stamps_refresh(PCARD_DATA pCardData) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  CMD_STAMPS stamps;
+
+  // free while the transaction is held, and nobody else can change the card
+  // until it ends
+  DWORD dwRet = cmd_begin_transaction(pCardData);
+  if (dwRet != SCARD_S_SUCCESS) {
+    return dwRet;
+  }
+  if (cmd_stamps_fresh(pCardData, &pContext->stamps)) {
+    cmd_end_transaction(pCardData);
+    return SCARD_S_SUCCESS;
+  }
+  if (cmd_prefetch_take_stamps(pCardData, &stamps) && cmd_stamps_fresh(pCardData, &stamps)) {
+    cmd_stamps_apply(pCardData, &stamps);
+    cmd_end_transaction(pCardData);
+    return SCARD_S_SUCCESS;
+  }
+  dwRet = cmd_piv_select(pCardData);
+  if (dwRet == SCARD_S_SUCCESS) {
+    dwRet = cmd_stamps_read(pCardData, &pContext->fNoMetadata, &stamps);
+    if (dwRet != SCARD_S_SUCCESS) {
+      CMD_WARN("Failed to read the card content stamps: %x\n", dwRet);
+      memset(&stamps, 0, sizeof(stamps));
+      dwRet = SCARD_S_SUCCESS;
+    }
+    cmd_stamps_apply(pCardData, &stamps);
+  }
+  cmd_end_transaction(pCardData);
+  return dwRet;
+}
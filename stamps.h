@@ -0,0 +1,54 @@
+#pragma once
+#ifndef __STAMPS__H__
+#define __STAMPS__H__
+
+#include "cardmod.h"
+#include "piv.h"
+#include "pubkey.h"
+
+// Digests of what the card holds, from which the cardcf freshness counters
+// are derived. The driver never writes to the card, so changes come from
+// other PIV tools and can only be noticed by reading the content again.
+typedef struct _CMD_STAMPS {
+  // FALSE while the content could not be read; every cache is then stale
+  BOOL fValid;
+  // CRC-32 of the key metadata and the first chunk of the certificate object
+  // (which carries the certificate serial number), 0 for an empty slot
+  DWORD rgdwContainers[CMD_PIV_NUM_SLOTS];
+  DWORD dwFiles; // CRC-32 of the CHUID, 0 without one
+  // dwTransactionsBegun of the context when read; the stamps hold until the
+  // card transaction they were read in ends
+  DWORD dwTransaction;
+} CMD_STAMPS, *PCMD_STAMPS;
+
+// Read the stamps from the card: about one command per slot, plus one per
+// key found. *pfNoMetadata tells whether the firmware lacks GET METADATA and
+// is set if it turns out to.
+// These must be called inside a card transaction with the PIV application
+// selected.
+DWORD cmd_stamps_read(PCARD_DATA pCardData, BOOL *pfNoMetadata, PCMD_STAMPS pStamps);
+// The parts of cmd_stamps_read, for callers that spread them over several
+// transactions. If pKey is not NULL, the public key is taken from the
+// metadata read for the stamp; pKey->fValid tells whether that was possible
+// (it is not without GET METADATA), otherwise cmd_pubkey_read must read it.
+DWORD cmd_stamps_read_container(PCARD_DATA pCardData, BYTE bContainerIndex, BOOL *pfNoMetadata, DWORD *pdwStamp,
+                                PCMD_PUBKEY pKey);
+DWORD cmd_stamps_read_files(PCARD_DATA pCardData, DWORD *pdwStamp);
+
+// Switch the context to new stamps. Cached public keys of containers whose
+// stamp did not change are carried over to the new counters; only the
+// changed ones are read again on next use. Unknown stamps move both counters,
+// so that nothing cached before is used again.
+void cmd_stamps_apply(PCARD_DATA pCardData, const CMD_STAMPS *pStamps);
+
+// Whether the stamps were read in the current card transaction, so that no
+// other process can have changed the card since. Must be called inside it.
+BOOL cmd_stamps_fresh(PCARD_DATA pCardData, const CMD_STAMPS *pStamps);
+
+// Read the stamps unless they are from the current card transaction, which
+// this begins or reuses, and apply them, taking those of the background
+// prefetch if it read them in the same transaction. A failed read leaves the
+// stamps unknown rather than failing.
+DWORD cmd_stamps_refresh(PCARD_DATA pCardData);
+
+#endif // __STAMPS__H__
@@ -0,0 +1,617 @@
+/*
+ * The simulated card of sim_card.h. It stands in for winscard.dll, whose
+ * functions the driver tests link against instead. SCardStatusA fails, so the
+ * driver does not calibrate its response chunks and keeps to short APDUs.
+ */
+
+#include "sim_card.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <winscard.h>
+
+#define MAX_OBJECTS 32
+#define MAX_OBJECT_LEN 4096
+#define MAX_COUNTED_OBJECTS 64
+#define MAX_SCRIPT 16
+// 53 82 LL LL <object>
+#define MAX_RESP (4 + MAX_OBJECT_LEN)
+
+#define INS_VERIFY 0x20
+#define INS_GENERAL_AUTHENTICATE 0x87
+#define INS_SELECT 0xA4
+#define INS_GET_RESPONSE 0xC0
+#define INS_GET_DATA 0xCB
+#define INS_GET_METADATA 0xF7
+#define INS_GET_SERIAL 0xF8
+
+#define ALG_ECC_P256 0x11
+#define SLOT_CARD_AUTHENTICATION 0x9E
+
+const uint8_t SIM_ATR[17] = {0x3B, 0xF7, 0x11, 0x00, 0x00, 0x81, 0x31, 0xFE, 0x65,
+                             0x43, 0x61, 0x6E, 0x6F, 0x6B, 0x65, 0x79, 0x99};
+
+static const uint8_t PIV_AID[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+
+const SCARD_IO_REQUEST g_rgSCardT1Pci = {SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST)};
+
+typedef struct {
+  uint32_t tag;
+  size_t len;
+  uint8_t data[MAX_OBJECT_LEN];
+} OBJECT;
+
+typedef struct {
+  uint8_t ins;
+  uint16_t sw;
+  size_t len;
+  uint8_t data[256];
+} SCRIPTED;
+
+static struct {
+  OBJECT objects[MAX_OBJECTS];
+  unsigned n_objects;
+  uint8_t key_seeds[256]; // by slot, 0 for none
+  uint8_t serial[4];
+  int has_serial;
+  int metadata;
+  int retries;
+  int verified;
+  int selected;
+
+  // command chaining
+  uint8_t chain_ins;
+  size_t chain_len;
+  uint8_t chain[MAX_OBJECT_LEN];
+  // response left for GET RESPONSE
+  size_t resp_len, resp_off;
+  uint8_t resp[MAX_RESP];
+
+  SCRIPTED script[MAX_SCRIPT];
+  unsigned n_script;
+  int reset_ins; // -1 for none
+  int reset_pending;
+
+  unsigned commands[256];
+  unsigned get_responses;
+  struct {
+    uint32_t tag;
+    unsigned count;
+  } object_reads[MAX_COUNTED_OBJECTS];
+  unsigned metadata_reads[256];
+  unsigned transactions;
+  unsigned reconnects;
+  unsigned allocs;
+  SIM_COMMAND last;
+} g_card;
+
+void sim_clear_counts(void) {
+  memset(g_card.commands, 0, sizeof(g_card.commands));
+  g_card.get_responses = 0;
+  memset(g_card.object_reads, 0, sizeof(g_card.object_reads));
+  memset(g_card.metadata_reads, 0, sizeof(g_card.metadata_reads));
+  g_card.transactions = 0;
+  g_card.reconnects = 0;
+}
+
+void sim_reset(void) {
+  memset(&g_card, 0, sizeof(g_card));
+  g_card.serial[0] = 0x01;
+  g_card.serial[1] = 0x02;
+  g_card.serial[2] = 0x03;
+  g_card.serial[3] = 0x04;
+  g_card.has_serial = 1;
+  g_card.metadata = 1;
+  g_card.retries = SIM_PIN_RETRIES;
+  g_card.reset_ins = -1;
+}
+
+static LPVOID WINAPI sim_alloc(SIZE_T size) {
+  g_card.allocs++;
+  return malloc(size);
+}
+
+static LPVOID WINAPI sim_realloc(LPVOID p, SIZE_T size) {
+  g_card.allocs++;
+  return realloc(p, size);
+}
+
+static void WINAPI sim_free(LPVOID p) {
+  free(p);
+}
+
+void sim_card_data(PCARD_DATA pCardData) {
+  memset(pCardData, 0, sizeof(*pCardData));
+  pCardData->dwVersion = CARD_DATA_CURRENT_VERSION;
+  pCardData->pbAtr = (PBYTE)SIM_ATR;
+  pCardData->cbAtr = sizeof(SIM_ATR);
+  pCardData->pwszCardName = (LPWSTR)L"CanoKey";
+  pCardData->pfnCspAlloc = sim_alloc;
+  pCardData->pfnCspReAlloc = sim_realloc;
+  pCardData->pfnCspFree = sim_free;
+  pCardData->hSCardCtx = 1;
+  pCardData->hScard = 1;
+}
+
+unsigned sim_allocs(void) {
+  return g_card.allocs;
+}
+
+static OBJECT *find_object(uint32_t tag) {
+  for (unsigned i = 0; i < g_card.n_objects; i++) {
+    if (g_card.objects[i].tag == tag) {
+      return &g_card.objects[i];
+    }
+  }
+  return NULL;
+}
+
+void sim_set_object(uint32_t tag, const uint8_t *data, size_t len) {
+  OBJECT *object = find_object(tag);
+
+  if (!data) {
+    if (object) {
+      *object = g_card.objects[--g_card.n_objects];
+    }
+    return;
+  }
+  if (!object && g_card.n_objects < MAX_OBJECTS && len <= MAX_OBJECT_LEN) {
+    object = &g_card.objects[g_card.n_objects++];
+  }
+  if (object && len <= MAX_OBJECT_LEN) {
+    object->tag = tag;
+    object->len = len;
+    memcpy(object->data, data, len);
+  }
+}
+
+void sim_set_ec_key(uint8_t slot, uint8_t seed) {
+  g_card.key_seeds[slot] = seed;
+}
+
+void sim_ec_point(uint8_t seed, uint8_t point[65]) {
+  point[0] = 0x04;
+  for (int i = 0; i < 64; i++) {
+    point[1 + i] = (uint8_t)(seed * 31 + i);
+  }
+}
+
+void sim_ec_signature(uint8_t seed, const uint8_t *digest, size_t len, uint8_t rs[64]) {
+  // a leading byte below 0x80 keeps both integers positive and unpadded
+  for (size_t i = 0; i < 32; i++) {
+    uint8_t d = len ? digest[i % len] : 0;
+    rs[i] = (uint8_t)(i == 0 ? 0x01 : d ^ seed);
+    rs[32 + i] = (uint8_t)(i == 0 ? 0x02 : d + seed);
+  }
+}
+
+void sim_set_serial(const uint8_t *serial) {
+  g_card.has_serial = serial != NULL;
+  if (serial) {
+    memcpy(g_card.serial, serial, sizeof(g_card.serial));
+  }
+}
+
+void sim_set_metadata(int supported) {
+  g_card.metadata = supported;
+}
+
+void sim_script(uint8_t ins, uint16_t sw, const uint8_t *data, size_t len) {
+  if (g_card.n_script < MAX_SCRIPT && len <= sizeof(g_card.script[0].data)) {
+    SCRIPTED *entry = &g_card.script[g_card.n_script++];
+    entry->ins = ins;
+    entry->sw = sw;
+    entry->len = len;
+    if (len) {
+      memcpy(entry->data, data, len);
+    }
+  }
+}
+
+void sim_inject_reset(uint8_t ins) {
+  g_card.reset_ins = ins;
+}
+
+unsigned sim_commands(uint8_t ins) {
+  return g_card.commands[ins];
+}
+
+unsigned sim_get_responses(void) {
+  return g_card.get_responses;
+}
+
+unsigned sim_object_reads(uint32_t tag) {
+  for (unsigned i = 0; i < MAX_COUNTED_OBJECTS; i++) {
+    if (g_card.object_reads[i].tag == tag) {
+      return g_card.object_reads[i].count;
+    }
+  }
+  return 0;
+}
+
+static void count_object_read(uint32_t tag) {
+  for (unsigned i = 0; i < MAX_COUNTED_OBJECTS; i++) {
+    if (g_card.object_reads[i].tag == tag || g_card.object_reads[i].count == 0) {
+      g_card.object_reads[i].tag = tag;
+      g_card.object_reads[i].count++;
+      return;
+    }
+  }
+}
+
+unsigned sim_metadata_reads(uint8_t slot) {
+  return g_card.metadata_reads[slot];
+}
+
+unsigned sim_transactions(void) {
+  return g_card.transactions;
+}
+
+unsigned sim_reconnects(void) {
+  return g_card.reconnects;
+}
+
+const SIM_COMMAND *sim_last_command(void) {
+  return &g_card.last;
+}
+
+static size_t put_len(uint8_t *p, size_t len) {
+  if (len < 0x80) {
+    p[0] = (uint8_t)len;
+    return 1;
+  }
+  if (len < 0x100) {
+    p[0] = 0x81;
+    p[1] = (uint8_t)len;
+    return 2;
+  }
+  p[0] = 0x82;
+  p[1] = (uint8_t)(len >> 8);
+  p[2] = (uint8_t)len;
+  return 3;
+}
+
+// Find a BER-TLV by its one-byte tag among siblings.
+static const uint8_t *find_tlv(const uint8_t *p, size_t n, uint8_t tag, size_t *len) {
+  size_t i = 0;
+  while (i + 2 <= n) {
+    uint8_t t = p[i++];
+    size_t l = p[i++];
+    if (l == 0x81 && i < n) {
+      l = p[i++];
+    } else if (l == 0x82 && i + 1 < n) {
+      l = (size_t)p[i] << 8 | p[i + 1];
+      i += 2;
+    } else if (l > 0x80) {
+      return NULL;
+    }
+    if (i + l > n) {
+      return NULL;
+    }
+    if (t == tag) {
+      *len = l;
+      return p + i;
+    }
+    i += l;
+  }
+  return NULL;
+}
+
+static uint16_t get_data(const uint8_t *data, size_t len, uint8_t *resp, size_t *resp_len) {
+  if (len != 5 || data[0] != 0x5C || data[1] != 3) {
+    return 0x6A80;
+  }
+  uint32_t tag = (uint32_t)data[2] << 16 | (uint32_t)data[3] << 8 | data[4];
+  count_object_read(tag);
+  const OBJECT *object = find_object(tag);
+  if (!object) {
+    return 0x6A82;
+  }
+  resp[0] = 0x53;
+  *resp_len = 1 + put_len(resp + 1, object->len);
+  memcpy(resp + *resp_len, object->data, object->len);
+  *resp_len += object->len;
+  return 0x9000;
+}
+
+static uint16_t get_metadata(uint8_t slot, uint8_t *resp, size_t *resp_len) {
+  g_card.metadata_reads[slot]++;
+  if (!g_card.metadata) {
+    return 0x6D00;
+  }
+  if (!g_card.key_seeds[slot]) {
+    return 0x6A88;
+  }
+  // 01 01 <alg> 04 43 { 86 41 <point> }
+  resp[0] = 0x01;
+  resp[1] = 0x01;
+  resp[2] = ALG_ECC_P256;
+  resp[3] = 0x04;
+  resp[4] = 0x43;
+  resp[5] = 0x86;
+  resp[6] = 0x41;
+  sim_ec_point(g_card.key_seeds[slot], resp + 7);
+  *resp_len = 7 + 65;
+  return 0x9000;
+}
+
+static uint16_t verify(uint8_t p2, const uint8_t *data, size_t len) {
+  uint8_t padded[8];
+
+  if (p2 != 0x80) {
+    return 0x6A88;
+  }
+  if (len == 0) {
+    if (g_card.verified) {
+      return 0x9000;
+    }
+    return g_card.retries ? (uint16_t)(0x63C0 | g_card.retries) : 0x6983;
+  }
+  if (len != sizeof(padded)) {
+    return 0x6A80;
+  }
+  if (g_card.retries == 0) {
+    return 0x6983;
+  }
+  memset(padded, 0xFF, sizeof(padded));
+  memcpy(padded, SIM_PIN, strlen(SIM_PIN));
+  if (memcmp(data, padded, sizeof(padded)) != 0) {
+    g_card.verified = 0;
+    g_card.retries--;
+    return (uint16_t)(0x63C0 | g_card.retries);
+  }
+  g_card.verified = 1;
+  g_card.retries = SIM_PIN_RETRIES;
+  return 0x9000;
+}
+
+static uint16_t general_authenticate(uint8_t alg, uint8_t slot, const uint8_t *data, size_t len, uint8_t *resp,
+                                     size_t *resp_len) {
+  const uint8_t *dyn_auth, *challenge;
+  size_t dyn_auth_len, challenge_len;
+  uint8_t rs[64];
+
+  if (!g_card.key_seeds[slot]) {
+    return 0x6A88;
+  }
+  if (alg != ALG_ECC_P256) {
+    return 0x6A80;
+  }
+  if (slot != SLOT_CARD_AUTHENTICATION && !g_card.verified) {
+    return 0x6982;
+  }
+  dyn_auth = find_tlv(data, len, 0x7C, &dyn_auth_len);
+  challenge = dyn_auth ? find_tlv(dyn_auth, dyn_auth_len, 0x81, &challenge_len) : NULL;
+  if (!challenge || challenge_len > 32) {
+    return 0x6A80;
+  }
+  sim_ec_signature(g_card.key_seeds[slot], challenge, challenge_len, rs);
+  // 7C 48 { 82 46 { 30 44 { 02 20 <r> 02 20 <s> } } }
+  static const uint8_t header[] = {0x7C, 0x48, 0x82, 0x46, 0x30, 0x44, 0x02, 0x20};
+  memcpy(resp, header, sizeof(header));
+  memcpy(resp + 8, rs, 32);
+  resp[40] = 0x02;
+  resp[41] = 0x20;
+  memcpy(resp + 42, rs + 32, 32);
+  *resp_len = 74;
+  return 0x9000;
+}
+
+static uint16_t process(uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *data, size_t len, uint8_t *resp,
+                        size_t *resp_len) {
+  *resp_len = 0;
+  if (ins == INS_SELECT) {
+    g_card.selected = p1 == 0x04 && len >= sizeof(PIV_AID) && memcmp(data, PIV_AID, sizeof(PIV_AID)) == 0;
+    return g_card.selected ? 0x9000 : 0x6A82;
+  }
+  if (!g_card.selected) {
+    return 0x6985;
+  }
+  switch (ins) {
+  case INS_GET_DATA:
+    return get_data(data, len, resp, resp_len);
+  case INS_GET_METADATA:
+    return get_metadata(p2, resp, resp_len);
+  case INS_GET_SERIAL:
+    if (!g_card.has_serial) {
+      return 0x6D00;
+    }
+    memcpy(resp, g_card.serial, sizeof(g_card.serial));
+    *resp_len = sizeof(g_card.serial);
+    return 0x9000;
+  case INS_VERIFY:
+    return verify(p2, data, len);
+  case INS_GENERAL_AUTHENTICATE:
+    return general_authenticate(p1, p2, data, len, resp, resp_len);
+  default:
+    return 0x6D00;
+  }
+}
+
+// Parse a short or extended length command. Without Le the card answers as
+// if it were 256.
+static int parse_command(const uint8_t *cmd, size_t n, const uint8_t **data, size_t *lc, size_t *le) {
+  *data = NULL;
+  *lc = 0;
+  *le = 256;
+  if (n < 4) {
+    return 0;
+  }
+  if (n == 4) {
+    return 1;
+  }
+  if (n == 5) {
+    *le = cmd[4] ? cmd[4] : 256;
+    return 1;
+  }
+  if (cmd[4] != 0) {
+    *lc = cmd[4];
+    *data = cmd + 5;
+    if (n == 6 + *lc) {
+      *le = cmd[5 + *lc] ? cmd[5 + *lc] : 256;
+    }
+    return n == 5 + *lc || n == 6 + *lc;
+  }
+  if (n < 7) {
+    return 0;
+  }
+  if (n == 7) {
+    *le = (size_t)cmd[5] << 8 | cmd[6];
+    *le = *le ? *le : 65536;
+    return 1;
+  }
+  *lc = (size_t)cmd[5] << 8 | cmd[6];
+  *data = cmd + 7;
+  if (n == 9 + *lc) {
+    *le = (size_t)cmd[7 + *lc] << 8 | cmd[8 + *lc];
+    *le = *le ? *le : 65536;
+  }
+  return n == 7 + *lc || n == 9 + *lc;
+}
+
+// Send the next part of the pending response, at most le bytes of it.
+static LONG respond(size_t le, uint16_t sw, uint8_t *out, DWORD *out_len) {
+  size_t left = g_card.resp_len - g_card.resp_off;
+  size_t chunk = left < le ? left : le;
+
+  if (*out_len < chunk + 2) {
+    return SCARD_E_INSUFFICIENT_BUFFER;
+  }
+  memcpy(out, g_card.resp + g_card.resp_off, chunk);
+  g_card.resp_off += chunk;
+  left -= chunk;
+  if (left > 0) {
+    sw = (uint16_t)(0x6100 | (left >= 256 ? 0 : left));
+  } else {
+    g_card.resp_len = g_card.resp_off = 0;
+  }
+  out[chunk] = (uint8_t)(sw >> 8);
+  out[chunk + 1] = (uint8_t)sw;
+  *out_len = (DWORD)(chunk + 2);
+  return SCARD_S_SUCCESS;
+}
+
+static LONG status_only(uint16_t sw, uint8_t *out, DWORD *out_len) {
+  g_card.resp_len = g_card.resp_off = 0;
+  return respond(0, sw, out, out_len);
+}
+
+LONG WINAPI SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength,
+                          LPSCARD_IO_REQUEST pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength) {
+  const uint8_t *data;
+  size_t lc, le, resp_len;
+  uint8_t cla, ins;
+  uint16_t sw;
+
+  (void)hCard;
+  (void)pioSendPci;
+  (void)pioRecvPci;
+  if (g_card.reset_pending) {
+    return SCARD_W_RESET_CARD;
+  }
+  if (!parse_command(pbSendBuffer, cbSendLength, &data, &lc, &le)) {
+    return status_only(0x6700, pbRecvBuffer, pcbRecvLength);
+  }
+  cla = pbSendBuffer[0];
+  ins = pbSendBuffer[1];
+
+  if (ins == INS_GET_RESPONSE) {
+    g_card.get_responses++;
+    if (g_card.resp_off == 0 || g_card.resp_len == 0) {
+      return status_only(0x6985, pbRecvBuffer, pcbRecvLength);
+    }
+    return respond(le, 0x9000, pbRecvBuffer, pcbRecvLength);
+  }
+  // any other command drops what GET RESPONSE did not collect
+  g_card.resp_len = g_card.resp_off = 0;
+
+  if (g_card.chain_len > 0 && g_card.chain_ins != ins) {
+    g_card.chain_len = 0;
+  }
+  if (g_card.chain_len + lc > sizeof(g_card.chain)) {
+    g_card.chain_len = 0;
+    return status_only(0x6700, pbRecvBuffer, pcbRecvLength);
+  }
+  if (lc) {
+    memcpy(g_card.chain + g_card.chain_len, data, lc);
+  }
+  g_card.chain_len += lc;
+  if (cla & 0x10) {
+    g_card.chain_ins = ins;
+    return status_only(0x9000, pbRecvBuffer, pcbRecvLength);
+  }
+
+  if (g_card.reset_ins == ins) {
+    g_card.reset_ins = -1;
+    g_card.reset_pending = 1;
+    g_card.verified = 0;
+    g_card.selected = 0;
+    g_card.chain_len = 0;
+    return SCARD_W_RESET_CARD;
+  }
+  g_card.commands[ins]++;
+  g_card.last.cla = (uint8_t)(cla & ~0x10);
+  g_card.last.ins = ins;
+  g_card.last.p1 = pbSendBuffer[2];
+  g_card.last.p2 = pbSendBuffer[3];
+  g_card.last.len = g_card.chain_len;
+  memcpy(g_card.last.data, g_card.chain, g_card.chain_len);
+  g_card.chain_len = 0;
+
+  for (unsigned i = 0; i < g_card.n_script; i++) {
+    if (g_card.script[i].ins == ins) {
+      SCRIPTED entry = g_card.script[i];
+      memmove(&g_card.script[i], &g_card.script[i + 1], (g_card.n_script - i - 1) * sizeof(entry));
+      g_card.n_script--;
+      memcpy(g_card.resp, entry.data, entry.len);
+      g_card.resp_len = entry.len;
+      return respond(le, entry.sw, pbRecvBuffer, pcbRecvLength);
+    }
+  }
+
+  sw = process(ins, g_card.last.p1, g_card.last.p2, g_card.last.data, g_card.last.len, g_card.resp, &resp_len);
+  g_card.resp_len = resp_len;
+  return respond(le, sw, pbRecvBuffer, pcbRecvLength);
+}
+
+LONG WINAPI SCardBeginTransaction(SCARDHANDLE hCard) {
+  (void)hCard;
+  if (g_card.reset_pending) {
+    return SCARD_W_RESET_CARD;
+  }
+  g_card.transactions++;
+  return SCARD_S_SUCCESS;
+}
+
+LONG WINAPI SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition) {
+  (void)hCard;
+  (void)dwDisposition;
+  return g_card.reset_pending ? SCARD_W_RESET_CARD : SCARD_S_SUCCESS;
+}
+
+LONG WINAPI SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization,
+                           LPDWORD pdwActiveProtocol) {
+  (void)hCard;
+  (void)dwShareMode;
+  (void)dwPreferredProtocols;
+  (void)dwInitialization;
+  g_card.reset_pending = 0;
+  g_card.reconnects++;
+  if (pdwActiveProtocol) {
+    *pdwActiveProtocol = SCARD_PROTOCOL_T1;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+LONG WINAPI SCardStatusA(SCARDHANDLE hCard, LPSTR mszReaderNames, LPDWORD pcchReaderLen, LPDWORD pdwState,
+                         LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen) {
+  (void)hCard;
+  (void)mszReaderNames;
+  (void)pcchReaderLen;
+  (void)pdwState;
+  (void)pdwProtocol;
+  (void)pbAtr;
+  (void)pcbAtrLen;
+  return SCARD_E_READER_UNAVAILABLE;
+}
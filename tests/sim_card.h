@@ -0,0 +1,74 @@
+#pragma once
+#ifndef __SIM_CARD__H__
+#define __SIM_CARD__H__
+
+/*
+ * A simulated CanoKey behind the SCard* functions the driver calls, so that
+ * the driver tests run its entry points without a reader. It answers SELECT,
+ * GET DATA, GET METADATA, GET SERIAL, VERIFY and GENERAL AUTHENTICATE (P-256
+ * only) with command chaining and 61xx continuations, and counts what it is
+ * sent. The driver serializes its commands in card transactions, so the card
+ * keeps no lock of its own; tests change it while no call is running.
+ */
+
+#include "cardmod.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_PIN "123456"
+#define SIM_PIN_RETRIES 3
+
+extern const uint8_t SIM_ATR[17];
+
+// A blank card: no data objects or keys, PIN SIM_PIN with SIM_PIN_RETRIES
+// tries, GET METADATA and GET SERIAL implemented, serial 0x01020304, and all
+// counters, scripts and pending resets cleared.
+void sim_reset(void);
+
+// A CARD_DATA the CSP would pass for the card, with counting allocators.
+void sim_card_data(PCARD_DATA pCardData);
+// Calls of pfnCspAlloc and pfnCspReAlloc since sim_reset.
+unsigned sim_allocs(void);
+
+// Store the content of a data object (without its 53 wrapper), or remove
+// it with NULL.
+void sim_set_object(uint32_t tag, const uint8_t *data, size_t len);
+// Generate a P-256 key in a slot, its point derived from seed; seed 0 empties
+// the slot.
+void sim_set_ec_key(uint8_t slot, uint8_t seed);
+// The uncompressed point of the key generated for seed, and the r || s the
+// key signs a digest with.
+void sim_ec_point(uint8_t seed, uint8_t point[65]);
+void sim_ec_signature(uint8_t seed, const uint8_t *digest, size_t len, uint8_t rs[64]);
+// Set the serial number (4 bytes), or make GET SERIAL unsupported with NULL.
+void sim_set_serial(const uint8_t *serial);
+void sim_set_metadata(int supported);
+
+// Answer the next command with INS ins by sw and data, instead of what the
+// card would do. Scripted answers queue up in order.
+void sim_script(uint8_t ins, uint16_t sw, const uint8_t *data, size_t len);
+// Reset the card when the next command with INS ins arrives: it fails, like
+// every later call on the handle, with SCARD_W_RESET_CARD until SCardReconnect.
+// The PIN state and selection are lost.
+void sim_inject_reset(uint8_t ins);
+
+// What the card was sent since the last sim_reset or sim_clear_counts.
+// Chained blocks and GET RESPONSE are not counted as commands of their own.
+void sim_clear_counts(void);
+unsigned sim_commands(uint8_t ins);
+unsigned sim_get_responses(void);
+unsigned sim_object_reads(uint32_t tag);
+unsigned sim_metadata_reads(uint8_t slot);
+unsigned sim_transactions(void); // SCardBeginTransaction calls that succeeded
+unsigned sim_reconnects(void);
+
+// The last command, with the data of all its chained blocks.
+typedef struct {
+  uint8_t cla, ins, p1, p2;
+  size_t len;
+  uint8_t data[4096];
+} SIM_COMMAND;
+const SIM_COMMAND *sim_last_command(void);
+
+#endif // __SIM_CARD__H__
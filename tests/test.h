@@ -0,0 +1,44 @@
+#pragma once
+#ifndef __TEST__H__
+#define __TEST__H__
+
+/*
+ * Checks shared by the unit tests of the portable modules. A test is a plain
+ * program that exits with a non-zero status on the first failed check;
+ * CTest runs one per module.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE test_thread_t;
+#define TEST_THREAD_FN(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define test_thread_start(t, fn, arg) ((*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL)) != NULL)
+#define test_thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define test_sleep_ms(ms) Sleep(ms)
+#else
+#include <pthread.h>
+#include <time.h>
+typedef pthread_t test_thread_t;
+#define TEST_THREAD_FN(name, arg) static void *name(void *arg)
+#define test_thread_start(t, fn, arg) (pthread_create(t, NULL, fn, arg) == 0)
+#define test_thread_join(t) pthread_join(t, NULL)
+static inline void test_sleep_ms(unsigned ms) {
+  struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+  nanosleep(&ts, NULL);
+}
+#endif
+
+#define CHECK(cond)                                                                                                    \
+  do {                                                                                                                 \
+    if (!(cond)) {                                                                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                         \
+      exit(1);                                                                                                         \
+    }                                                                                                                  \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+
+#endif // __TEST__H__
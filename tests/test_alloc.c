@@ -0,0 +1,133 @@
+/*
+ * Allocation benchmark against the simulated card: once the caches are warm,
+ * CardGetProperty allocates nothing and CardGetContainerInfo and CardSignData
+ * allocate only what they return, with pfnCspAlloc; their scratch buffers
+ * come from the thread's arena, which is empty again after every call. Debug
+ * builds with MSVC count CRT heap allocations as well. Reports the time per
+ * call and the arena allocations behind it.
+ */
+
+#include "arena.h"
+#include "cardmod.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "sim_card.h"
+#include "test.h"
+#include "ticks.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+
+static volatile LONG g_cCrtAllocs;
+
+static int crt_alloc_hook(int nAllocType, void *pvData, size_t nSize, int nBlockUse, long lRequest,
+                          const unsigned char *szFileName, int nLine) {
+  (void)pvData, (void)nSize, (void)nBlockUse, (void)lRequest, (void)szFileName, (void)nLine;
+  if (nAllocType != _HOOK_FREE) {
+    InterlockedIncrement(&g_cCrtAllocs);
+  }
+  return TRUE;
+}
+#define CRT_ALLOCS() ((unsigned)g_cCrtAllocs)
+#else
+#define CRT_ALLOCS() 0U
+#endif
+
+#define ROUNDS 2000
+// The authentication key in container 0, the signature key in container 1.
+#define SEED_AUTH 1
+#define SEED_SIGN 2
+
+static const uint8_t CHUID[] = {0x34, 0x10, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+                                0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F, 0x3E, 0x00};
+
+typedef void (*CALL_FN)(PCARD_DATA pCardData);
+
+static void get_properties(PCARD_DATA pCardData) {
+  BYTE rgb[32];
+  DWORD cb;
+
+  CHECK_EQ(CardGetProperty(pCardData, CP_CARD_GUID, rgb, sizeof(rgb), &cb, 0), SCARD_S_SUCCESS);
+  CHECK_EQ(CardGetProperty(pCardData, CP_CARD_SERIAL_NO, rgb, sizeof(rgb), &cb, 0), SCARD_S_SUCCESS);
+  CHECK_EQ(CardGetProperty(pCardData, CP_CARD_READ_ONLY, rgb, sizeof(rgb), &cb, 0), SCARD_S_SUCCESS);
+  CHECK_EQ(CardGetProperty(pCardData, CP_CARD_CACHE_MODE, rgb, sizeof(rgb), &cb, 0), SCARD_S_SUCCESS);
+}
+
+static void get_container_info(PCARD_DATA pCardData) {
+  CONTAINER_INFO info;
+
+  memset(&info, 0, sizeof(info));
+  info.dwVersion = CONTAINER_INFO_CURRENT_VERSION;
+  CHECK_EQ(CardGetContainerInfo(pCardData, 0, 0, &info), SCARD_S_SUCCESS);
+  pCardData->pfnCspFree(info.pbSigPublicKey);
+  pCardData->pfnCspFree(info.pbKeyExPublicKey);
+}
+
+static void sign_data(PCARD_DATA pCardData) {
+  CARD_SIGNING_INFO info;
+  BYTE digest[32];
+
+  memset(digest, 0x5A, sizeof(digest));
+  memset(&info, 0, sizeof(info));
+  info.dwVersion = CARD_SIGNING_INFO_BASIC_VERSION;
+  info.bContainerIndex = 1;
+  info.dwKeySpec = AT_ECDSA_P256;
+  info.dwSigningFlags = CRYPT_NOHASHOID;
+  info.pbData = digest;
+  info.cbData = sizeof(digest);
+  CHECK_EQ(CardSignData(pCardData, &info), SCARD_S_SUCCESS);
+  CHECK_EQ(info.cbSignedData, 64);
+  pCardData->pfnCspFree(info.pbSignedData);
+}
+
+// Run a warm call ROUNDS times and check that it makes cspAllocs calls of
+// pfnCspAlloc each and no other heap allocation.
+static void bench(PCARD_DATA pCardData, const char *pszName, CALL_FN pfnCall, unsigned cspAllocs) {
+  PCMD_ARENA pArena = cmd_arena_of(pCardData);
+  CHECK(pArena != NULL);
+
+  pfnCall(pCardData);
+  unsigned csp = sim_allocs(), crt = CRT_ALLOCS();
+  DWORD cArena = pArena->cAllocs;
+  uint64_t start = cmd_ticks();
+  for (int i = 0; i < ROUNDS; i++) {
+    pfnCall(pCardData);
+    CHECK_EQ(pArena->cbUsed, 0);
+  }
+  uint64_t us = cmd_ticks_to_us(cmd_ticks() - start);
+  CHECK_EQ(sim_allocs() - csp, cspAllocs * ROUNDS);
+  CHECK_EQ(CRT_ALLOCS() - crt, 0);
+  printf("%s: %.2f us per call, %u pfnCspAlloc, %.1f arena allocations\n", pszName, (double)us / ROUNDS, cspAllocs,
+         (double)(pArena->cAllocs - cArena) / ROUNDS);
+}
+
+int main(void) {
+  CARD_DATA cardData;
+  DWORD cAttempts;
+
+  sim_reset();
+  sim_set_object(CMD_PIV_OBJ_CHUID, CHUID, sizeof(CHUID));
+  sim_set_ec_key(CMD_PIV_SLOT_AUTHENTICATION, SEED_AUTH);
+  sim_set_ec_key(CMD_PIV_SLOT_SIGNATURE, SEED_SIGN);
+  sim_card_data(&cardData);
+  CHECK_EQ(CardAcquireContext(&cardData, 0), SCARD_S_SUCCESS);
+  cmd_prefetch_stop(&cardData);
+  CHECK_EQ(CardAuthenticatePin(&cardData, wszCARD_USER_USER, (PBYTE)SIM_PIN, sizeof(SIM_PIN) - 1, &cAttempts),
+           SCARD_S_SUCCESS);
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+  _CrtSetAllocHook(crt_alloc_hook);
+#endif
+  bench(&cardData, "CardGetProperty x4", get_properties, 0);
+  bench(&cardData, "CardGetContainerInfo", get_container_info, 1);
+  bench(&cardData, "CardSignData", sign_data, 1);
+#if defined(_MSC_VER) && defined(_DEBUG)
+  _CrtSetAllocHook(NULL);
+#endif
+
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+  return 0;
+}
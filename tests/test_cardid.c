@@ -0,0 +1,197 @@
+/*
+ * Tests of the card identity against the simulated card: the cardid file,
+ * CP_CARD_GUID and CP_CARD_SERIAL_NO read the CHUID once per context however
+ * often they are asked, and the identity comes from the CHUID GUID, else its
+ * FASC-N, else the serial number, else is all zero.
+ */
+
+#include "apdu.h"
+#include "cardmod.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "sim_card.h"
+#include "test.h"
+
+#include <string.h>
+
+#define QUERIES 5
+
+static const uint8_t GUID[CMD_PIV_GUID_LEN] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+                                               0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F};
+static const uint8_t SERIAL[CMD_PIV_SERIAL_LEN] = {0xCA, 0xFE, 0x00, 0x42};
+
+// A CHUID with a FASC-N of fascn_byte and the given GUID, which may be NULL
+// to leave it out.
+static size_t make_chuid(uint8_t *chuid, uint8_t fascn_byte, const uint8_t *guid) {
+  size_t len = 0;
+
+  chuid[len++] = CMD_PIV_TAG_CHUID_FASCN;
+  chuid[len++] = CMD_PIV_FASCN_LEN;
+  memset(chuid + len, fascn_byte, CMD_PIV_FASCN_LEN);
+  len += CMD_PIV_FASCN_LEN;
+  if (guid) {
+    chuid[len++] = CMD_PIV_TAG_CHUID_GUID;
+    chuid[len++] = CMD_PIV_GUID_LEN;
+    memcpy(chuid + len, guid, CMD_PIV_GUID_LEN);
+    len += CMD_PIV_GUID_LEN;
+  }
+  // expiration date and an empty signature
+  static const uint8_t rest[] = {0x35, 0x08, '2', '0', '3', '0', '1', '2', '3', '1', 0x3E, 0x00};
+  memcpy(chuid + len, rest, sizeof(rest));
+  return len + sizeof(rest);
+}
+
+static void acquire(PCARD_DATA pCardData) {
+  sim_card_data(pCardData);
+  CHECK_EQ(CardAcquireContext(pCardData, 0), SCARD_S_SUCCESS);
+  // the background reads are not what is counted here, nor the transaction
+  // they left open
+  cmd_prefetch_stop(pCardData);
+  cmd_release_transaction(pCardData);
+  sim_clear_counts();
+}
+
+// The identity as the CSP sees it, asked for QUERIES times in every way.
+static void query(PCARD_DATA pCardData, uint8_t guid[CMD_PIV_GUID_LEN], uint8_t *serial, DWORD *serial_len) {
+  for (int i = 0; i < QUERIES; i++) {
+    PBYTE pbData = NULL;
+    DWORD cbData = 0, cbOut;
+    uint8_t buf[CMD_PIV_FASCN_LEN];
+
+    CHECK_EQ(CardReadFile(pCardData, NULL, szCARD_IDENTIFIER_FILE, 0, &pbData, &cbData), SCARD_S_SUCCESS);
+    CHECK_EQ(cbData, CMD_PIV_GUID_LEN);
+    CHECK(i == 0 || memcmp(pbData, guid, CMD_PIV_GUID_LEN) == 0);
+    memcpy(guid, pbData, CMD_PIV_GUID_LEN);
+    pCardData->pfnCspFree(pbData);
+
+    CHECK_EQ(CardGetProperty(pCardData, CP_CARD_GUID, buf, sizeof(buf), &cbOut, 0), SCARD_S_SUCCESS);
+    CHECK_EQ(cbOut, CMD_PIV_GUID_LEN);
+    CHECK(memcmp(buf, guid, CMD_PIV_GUID_LEN) == 0);
+
+    CHECK_EQ(CardGetProperty(pCardData, CP_CARD_SERIAL_NO, buf, sizeof(buf), &cbOut, 0), SCARD_S_SUCCESS);
+    CHECK(i == 0 || (cbOut == *serial_len && memcmp(buf, serial, cbOut) == 0));
+    memcpy(serial, buf, cbOut);
+    *serial_len = cbOut;
+  }
+}
+
+static void test_once_per_context(void) {
+  uint8_t chuid[128], guid[CMD_PIV_GUID_LEN], serial[CMD_PIV_FASCN_LEN];
+  DWORD serial_len;
+  CARD_DATA cardData;
+
+  sim_reset();
+  sim_set_object(CMD_PIV_OBJ_CHUID, chuid, make_chuid(chuid, 0x55, GUID));
+  for (int context = 0; context < 2; context++) {
+    acquire(&cardData);
+    query(&cardData, guid, serial, &serial_len);
+    CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+    CHECK_EQ(sim_commands(CMD_PIV_INS_GET_SERIAL), 0);
+    CHECK_EQ(sim_transactions(), 1);
+
+    // a short buffer gets the size, without reading again
+    DWORD cbOut = 0;
+    BYTE small[4];
+    CHECK_EQ(CardGetProperty(&cardData, CP_CARD_SERIAL_NO, small, sizeof(small), &cbOut, 0),
+             ERROR_INSUFFICIENT_BUFFER);
+    CHECK_EQ(cbOut, CMD_PIV_GUID_LEN);
+    CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+    CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+  }
+}
+
+static void test_guid(void) {
+  uint8_t chuid[128], guid[CMD_PIV_GUID_LEN], serial[CMD_PIV_FASCN_LEN];
+  DWORD serial_len;
+  CARD_DATA cardData;
+
+  // the GUID wins over the FASC-N and serves as the serial number as well
+  sim_reset();
+  sim_set_object(CMD_PIV_OBJ_CHUID, chuid, make_chuid(chuid, 0x55, GUID));
+  acquire(&cardData);
+  query(&cardData, guid, serial, &serial_len);
+  CHECK(memcmp(guid, GUID, sizeof(GUID)) == 0);
+  CHECK_EQ(serial_len, CMD_PIV_GUID_LEN);
+  CHECK(memcmp(serial, GUID, sizeof(GUID)) == 0);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_fascn(void) {
+  static const uint8_t zero_guid[CMD_PIV_GUID_LEN] = {0};
+  uint8_t chuid[128], guid[CMD_PIV_GUID_LEN], serial[CMD_PIV_FASCN_LEN], folded[CMD_PIV_GUID_LEN];
+  DWORD serial_len;
+  CARD_DATA cardData;
+
+  // an all-zero GUID is not set; the FASC-N is folded into 16 bytes instead
+  memset(folded, 0, sizeof(folded));
+  for (int i = 0; i < CMD_PIV_FASCN_LEN; i++) {
+    folded[i % CMD_PIV_GUID_LEN] ^= 0x5A;
+  }
+  for (int with_guid = 0; with_guid < 2; with_guid++) {
+    sim_reset();
+    sim_set_object(CMD_PIV_OBJ_CHUID, chuid, make_chuid(chuid, 0x5A, with_guid ? zero_guid : NULL));
+    acquire(&cardData);
+    query(&cardData, guid, serial, &serial_len);
+    CHECK(memcmp(guid, folded, sizeof(folded)) == 0);
+    CHECK_EQ(serial_len, CMD_PIV_FASCN_LEN);
+    for (int i = 0; i < CMD_PIV_FASCN_LEN; i++) {
+      CHECK_EQ(serial[i], 0x5A);
+    }
+    CHECK_EQ(sim_commands(CMD_PIV_INS_GET_SERIAL), 0);
+    CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+  }
+}
+
+static void test_serial(void) {
+  uint8_t chuid[128], guid[CMD_PIV_GUID_LEN], serial[CMD_PIV_FASCN_LEN];
+  DWORD serial_len;
+  CARD_DATA cardData;
+
+  // without a CHUID, or with neither a GUID nor a FASC-N in it, the serial
+  // number is used, behind a prefix of its own
+  for (int with_chuid = 0; with_chuid < 2; with_chuid++) {
+    sim_reset();
+    sim_set_serial(SERIAL);
+    if (with_chuid) {
+      size_t len = make_chuid(chuid, 0x00, NULL);
+      sim_set_object(CMD_PIV_OBJ_CHUID, chuid, len);
+    }
+    acquire(&cardData);
+    query(&cardData, guid, serial, &serial_len);
+    CHECK(memcmp(guid, "CanoKey PIV ", 12) == 0);
+    CHECK(memcmp(guid + 12, SERIAL, sizeof(SERIAL)) == 0);
+    CHECK_EQ(serial_len, CMD_PIV_SERIAL_LEN);
+    CHECK(memcmp(serial, SERIAL, sizeof(SERIAL)) == 0);
+    CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+    CHECK_EQ(sim_commands(CMD_PIV_INS_GET_SERIAL), 1);
+    CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+  }
+}
+
+static void test_nothing(void) {
+  static const uint8_t zero[CMD_PIV_GUID_LEN] = {0};
+  uint8_t guid[CMD_PIV_GUID_LEN], serial[CMD_PIV_FASCN_LEN];
+  DWORD serial_len;
+  CARD_DATA cardData;
+
+  // neither a CHUID nor GET SERIAL: an all-zero identity without a serial
+  // number, still read only once
+  sim_reset();
+  sim_set_serial(NULL);
+  acquire(&cardData);
+  query(&cardData, guid, serial, &serial_len);
+  CHECK(memcmp(guid, zero, sizeof(zero)) == 0);
+  CHECK_EQ(serial_len, 0);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+  CHECK_EQ(sim_commands(CMD_PIV_INS_GET_SERIAL), 1);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+int main(void) {
+  test_once_per_context();
+  test_guid();
+  test_fascn();
+  test_serial();
+  test_nothing();
+  return 0;
+}
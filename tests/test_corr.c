@@ -0,0 +1,71 @@
+/*
+ * Unit tests of corr.c: IDs are unique across threads and never 0, and the
+ * current operation is per thread.
+ */
+
+#include "corr.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 4
+#define OPS 10000
+
+static uint32_t g_ops[THREADS][OPS];
+
+TEST_THREAD_FN(run, arg) {
+  size_t thread = (size_t)arg;
+  uint32_t context = cmd_corr_new_context();
+
+  CHECK(context != 0);
+  CHECK_EQ(g_corr.op, 0); // a fresh thread has not entered the driver
+  for (int i = 0; i < OPS; i++) {
+    cmd_corr_begin(context);
+    CHECK_EQ(g_corr.context, context);
+    CHECK(g_corr.op != 0);
+    g_ops[thread][i] = g_corr.op;
+  }
+  return 0;
+}
+
+static int compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void test_unique_ops(void) {
+  test_thread_t threads[THREADS];
+
+  for (size_t i = 0; i < THREADS; i++) {
+    CHECK(test_thread_start(&threads[i], run, (void *)i));
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    test_thread_join(threads[i]);
+  }
+  uint32_t *ops = &g_ops[0][0];
+  qsort(ops, THREADS * OPS, sizeof(uint32_t), compare);
+  for (size_t i = 1; i < THREADS * OPS; i++) {
+    CHECK(ops[i] != ops[i - 1]);
+  }
+  // the threads' operations did not touch this one's
+  CHECK_EQ(g_corr.context, 0);
+  CHECK_EQ(g_corr.op, 0);
+}
+
+static void test_contexts(void) {
+  uint32_t a = cmd_corr_new_context(), b = cmd_corr_new_context();
+
+  CHECK(a != 0 && b != 0 && a != b);
+  cmd_corr_begin(a);
+  uint32_t op = g_corr.op;
+  cmd_corr_begin(b);
+  CHECK_EQ(g_corr.context, b);
+  CHECK(g_corr.op != op);
+}
+
+int main(void) {
+  test_unique_ops();
+  test_contexts();
+  return 0;
+}
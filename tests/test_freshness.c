@@ -0,0 +1,112 @@
+/*
+ * Unit tests of freshness.c: the cardcf counters follow the card content
+ * stamps, stay put while the card is unchanged, and move whenever it
+ * changed or is unknown.
+ */
+
+#include "freshness.h"
+#include "test.h"
+
+#include <string.h>
+
+#define SLOTS 24
+#define ALL ((1U << SLOTS) - 1)
+
+// A simulated card: what stamps.c would read from each slot and the CHUID.
+typedef struct {
+  uint32_t containers[SLOTS];
+  uint32_t files;
+} CARD;
+
+static void test_unchanged(void) {
+  CARD card = {{0x11111111, 0x22222222}, 0x33333333};
+  CMD_FRESHNESS freshness = {0, 0};
+
+  CHECK_EQ(cmd_freshness_update(&freshness, NULL, 0, card.containers, card.files, SLOTS), ALL);
+  CMD_FRESHNESS first = freshness;
+  for (int i = 0; i < 3; i++) {
+    CHECK_EQ(cmd_freshness_update(&freshness, card.containers, card.files, card.containers, card.files, SLOTS), 0);
+    CHECK_EQ(freshness.containers, first.containers);
+    CHECK_EQ(freshness.files, first.files);
+  }
+}
+
+static void test_changed_container(void) {
+  CARD card = {{0x11111111, 0x22222222}, 0x33333333}, old;
+  CMD_FRESHNESS freshness = {0, 0};
+
+  cmd_freshness_update(&freshness, NULL, 0, card.containers, card.files, SLOTS);
+  for (unsigned slot = 0; slot < SLOTS; slot++) {
+    CMD_FRESHNESS before = freshness;
+    old = card;
+    card.containers[slot] += 0x01000193; // a key regenerated or a certificate renewed
+    CHECK_EQ(cmd_freshness_update(&freshness, old.containers, old.files, card.containers, card.files, SLOTS),
+             1U << slot);
+    CHECK(freshness.containers != before.containers);
+    CHECK_EQ(freshness.files, before.files);
+  }
+}
+
+static void test_changed_files(void) {
+  CARD card = {{0x11111111}, 0x33333333}, old;
+  CMD_FRESHNESS freshness = {0, 0};
+
+  cmd_freshness_update(&freshness, NULL, 0, card.containers, card.files, SLOTS);
+  CMD_FRESHNESS before = freshness;
+  old = card;
+  card.files = 0; // CHUID deleted
+  CHECK_EQ(cmd_freshness_update(&freshness, old.containers, old.files, card.containers, card.files, SLOTS), 0);
+  CHECK_EQ(freshness.containers, before.containers);
+  CHECK(freshness.files != before.files);
+}
+
+static void test_unknown(void) {
+  CARD card = {{0x11111111}, 0x33333333};
+  CMD_FRESHNESS freshness = {0, 0};
+
+  cmd_freshness_update(&freshness, NULL, 0, card.containers, card.files, SLOTS);
+  CMD_FRESHNESS before = freshness;
+  // the card could not be read: nothing cached before may be used again
+  CHECK_EQ(cmd_freshness_update(&freshness, card.containers, card.files, NULL, 0, SLOTS), ALL);
+  CHECK(freshness.containers != before.containers);
+  CHECK(freshness.files != before.files);
+  // once readable again, the counters move once more, away from the unknown
+  CMD_FRESHNESS unknown = freshness;
+  CHECK_EQ(cmd_freshness_update(&freshness, NULL, 0, card.containers, card.files, SLOTS), ALL);
+  CHECK(freshness.containers != unknown.containers);
+  CHECK(freshness.files != unknown.files);
+}
+
+// Counters that would fold to the same value must still move on a change.
+static void test_fold_collision(void) {
+  CARD card, old;
+  CMD_FRESHNESS freshness;
+
+  memset(&card, 0, sizeof(card));
+  card.files = 0x00010001; // folds to 0
+  freshness.containers = 0;
+  freshness.files = 0;
+  old = card;
+  old.files = 0;
+  cmd_freshness_update(&freshness, old.containers, old.files, card.containers, card.files, SLOTS);
+  CHECK(freshness.files != 0);
+
+  // an empty card, as the counters already stand
+  memset(&card, 0, sizeof(card));
+  CMD_FRESHNESS empty = {0, 0};
+  cmd_freshness_update(&empty, NULL, 0, card.containers, card.files, SLOTS);
+  freshness = empty;
+  old = card;
+  old.containers[5] = 1;
+  CHECK_EQ(cmd_freshness_update(&freshness, old.containers, old.files, card.containers, card.files, SLOTS), 1U << 5);
+  CHECK(freshness.containers != empty.containers);
+}
+
+int main(void) {
+  test_unchanged();
+  test_changed_container();
+  test_changed_files();
+  test_unknown();
+  test_fold_collision();
+  return 0;
+}
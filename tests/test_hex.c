@@ -0,0 +1,56 @@
+/*
+ * Unit tests of hex.c against a byte-at-a-time reference, at every length
+ * around the 16-byte vector width and every alignment, so that both the
+ * vector loop and the scalar tail are covered.
+ */
+
+#include "hex.h"
+#include "test.h"
+
+#include <string.h>
+
+static void reference(char *out, const uint8_t *in, size_t len) {
+  static const char digits[] = "0123456789ABCDEF";
+
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = digits[in[i] >> 4];
+    out[2 * i + 1] = digits[in[i] & 0xF];
+  }
+}
+
+static void test_every_byte(void) {
+  uint8_t in[256];
+  char out[512], expected[512];
+
+  for (int i = 0; i < 256; i++) {
+    in[i] = (uint8_t)i;
+  }
+  CHECK_EQ(cmd_hex_encode(out, in, sizeof(in)), sizeof(out));
+  reference(expected, in, sizeof(in));
+  CHECK(memcmp(out, expected, sizeof(out)) == 0);
+}
+
+static void test_lengths(void) {
+  static uint8_t in[300 + 16];
+  static char out[2 * sizeof(in) + 1], expected[2 * sizeof(in) + 1];
+
+  for (size_t i = 0; i < sizeof(in); i++) {
+    in[i] = (uint8_t)(i * 37 + 11);
+  }
+  for (size_t offset = 0; offset < 16; offset++) {
+    for (size_t len = 0; len <= 300; len++) {
+      memset(out, '#', sizeof(out));
+      CHECK_EQ(cmd_hex_encode(out, in + offset, len), 2 * len);
+      reference(expected, in + offset, len);
+      CHECK(memcmp(out, expected, 2 * len) == 0);
+      // nothing is written past the digits, not even a terminator
+      CHECK_EQ(out[2 * len], '#');
+    }
+  }
+}
+
+int main(void) {
+  test_every_byte();
+  test_lengths();
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Unit tests of image.c, on an image directory created under the working
+ * directory of the test.
+ */
+
+#include "image.h"
+#include "test.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#define remove_dir(path) _rmdir(path)
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define make_dir(path) mkdir(path, 0700)
+#define remove_dir(path) rmdir(path)
+#endif
+
+#define DIR_NAME "image-test"
+#define FILE_NAME DIR_NAME "/010203.img"
+#define RECORDS 24
+#define THREADS 4
+
+static CMD_IMAGE_ID make_id(uint32_t chuid_crc) {
+  CMD_IMAGE_ID id;
+
+  memset(&id, 0, sizeof(id));
+  memcpy(id.serial, "\x01\x02\x03", 3);
+  id.serial_len = 3;
+  id.chuid_crc = chuid_crc;
+  return id;
+}
+
+static int read_record(const CMD_IMAGE_ID *id, uint8_t index, uint32_t stamp, uint8_t *out, size_t *len) {
+  *len = 4096;
+  return cmd_image_read(DIR_NAME, id, 2, index, stamp, out, len);
+}
+
+static void test_records(void) {
+  CMD_IMAGE_ID id = make_id(42), other = make_id(43);
+  uint8_t data[2000], out[4096];
+  size_t len;
+
+  for (int i = 0; i < RECORDS; i++) {
+    memset(data, i, sizeof(data));
+    CHECK(cmd_image_update(DIR_NAME, &id, 2, (uint8_t)i, 100 + i, data, 1000 + i));
+  }
+  for (int i = 0; i < RECORDS; i++) {
+    CHECK(read_record(&id, (uint8_t)i, 100 + i, out, &len));
+    CHECK_EQ(len, (size_t)(1000 + i));
+    CHECK(out[0] == i && out[len - 1] == i);
+  }
+  // read at another content stamp, or for a card with another CHUID
+  CHECK(!read_record(&id, 0, 99, out, &len));
+  CHECK(!read_record(&other, 0, 100, out, &len));
+  // a record that does not fit is a miss
+  len = 999;
+  CHECK(!cmd_image_read(DIR_NAME, &id, 2, 0, 100, out, &len));
+}
+
+// A record whose data no longer matches its checksum is dropped by the next
+// update instead of being carried over; the intact ones are kept.
+static void test_corrupted_record(void) {
+  CMD_IMAGE_ID id = make_id(42);
+  uint8_t data[500], out[4096];
+  size_t len;
+
+  FILE *f = fopen(FILE_NAME, "r+b");
+  CHECK(f);
+  // the data of the last record ends the file
+  CHECK(fseek(f, -10, SEEK_END) == 0);
+  CHECK(fputc(0x55, f) != EOF);
+  CHECK(fclose(f) == 0);
+  CHECK(!read_record(&id, RECORDS - 1, 100 + RECORDS - 1, out, &len));
+
+  memset(data, 0xAA, sizeof(data));
+  CHECK(cmd_image_update(DIR_NAME, &id, 2, 0, 7, data, sizeof(data)));
+  CHECK(read_record(&id, 0, 7, out, &len));
+  CHECK(len == sizeof(data) && out[0] == 0xAA);
+  CHECK(read_record(&id, RECORDS - 2, 100 + RECORDS - 2, out, &len));
+  CHECK(!read_record(&id, RECORDS - 1, 100 + RECORDS - 1, out, &len));
+
+  // an image of another card is replaced as a whole
+  CMD_IMAGE_ID other = make_id(43);
+  CHECK(cmd_image_update(DIR_NAME, &other, 2, 1, 8, data, 10));
+  CHECK(read_record(&other, 1, 8, out, &len));
+  CHECK(!read_record(&other, RECORDS - 2, 100 + RECORDS - 2, out, &len));
+}
+
+// Concurrent updates write their own temporary files, so every one of them
+// lands (the last rename wins) and the image stays valid.
+TEST_THREAD_FN(updater, arg) {
+  CMD_IMAGE_ID id = make_id(44);
+  uint8_t data[300];
+  size_t index = (size_t)arg;
+
+  memset(data, (int)index, sizeof(data));
+  for (int i = 0; i < 50; i++) {
+    CHECK(cmd_image_update(DIR_NAME, &id, 2, (uint8_t)index, (uint32_t)i, data, sizeof(data)));
+  }
+  return 0;
+}
+
+static void test_concurrent_updates(void) {
+  CMD_IMAGE_ID id = make_id(44);
+  test_thread_t threads[THREADS];
+  uint8_t out[4096];
+  size_t len;
+  int hits = 0;
+
+  for (size_t i = 0; i < THREADS; i++) {
+    CHECK(test_thread_start(&threads[i], updater, (void *)i));
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    test_thread_join(threads[i]);
+  }
+  for (uint8_t i = 0; i < THREADS; i++) {
+    if (read_record(&id, i, 49, out, &len)) {
+      CHECK(len == 300 && out[0] == i);
+      hits++;
+    }
+  }
+  CHECK(hits > 0);
+}
+
+int main(void) {
+  remove(FILE_NAME);
+  remove_dir(DIR_NAME);
+  CHECK(make_dir(DIR_NAME) == 0);
+  test_records();
+  test_corrupted_record();
+  test_concurrent_updates();
+  CHECK(remove(FILE_NAME) == 0);
+  // fails if an update left a temporary file behind
+  CHECK(remove_dir(DIR_NAME) == 0);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Unit tests of inflate.c: one gzip member per DEFLATE block type, then the
+ * malformed inputs a card could hand back. The members were made with zlib.
+ */
+
+#include "inflate.h"
+#include "test.h"
+
+#include <string.h>
+
+// "CanoKey PIV certificate " three times, in a fixed Huffman block
+static const uint8_t g_fixed[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x73, 0x4e, 0xcc, 0xcb, 0xf7, 0x4e, 0xad, 0x54, 0x08,
+    0xf0, 0x0c, 0x53, 0x48, 0x4e, 0x2d, 0x2a, 0xc9, 0x4c, 0xcb, 0x4c, 0x4e, 0x2c, 0x49, 0x55, 0x70, 0x26, 0x51, 0x1c,
+    0x00, 0x9a, 0xb0, 0xac, 0x69, 0x48, 0x00, 0x00, 0x00
+};
+
+// A pangram paragraph, in a dynamic Huffman block
+static const uint8_t g_dynamic[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x2d, 0x8d, 0xc9, 0x11, 0xc3, 0x20, 0x10, 0x04, 0x53,
+    0x19, 0x27, 0x40, 0x1c, 0x7e, 0xfa, 0xa1, 0x04, 0xc0, 0x1c, 0xc2, 0x46, 0xac, 0xc5, 0x29, 0x88, 0x5e, 0x5b, 0x92,
+    0xdf, 0xdd, 0xd3, 0xb3, 0xac, 0x06, 0x7b, 0xf5, 0xef, 0x2f, 0x54, 0xa2, 0x1e, 0x61, 0xe9, 0xc0, 0xa7, 0x6e, 0xbf,
+    0x0c, 0x6a, 0x26, 0xa1, 0x30, 0x0e, 0x72, 0x0e, 0x68, 0x72, 0x02, 0x2f, 0xc9, 0xde, 0x36, 0xa0, 0x58, 0xea, 0xbe,
+    0xac, 0xb0, 0xbe, 0x19, 0x46, 0xd3, 0x44, 0x04, 0xbf, 0x57, 0x4a, 0xbc, 0x75, 0x59, 0xe0, 0x49, 0x1d, 0xcd, 0x1c,
+    0x3e, 0xba, 0x30, 0xfe, 0x79, 0x2d, 0x6d, 0xc1, 0x34, 0x2a, 0xc9, 0x7c, 0x1d, 0x3c, 0xb0, 0x70, 0xfb, 0x0a, 0x70,
+    0x8e, 0x4d, 0x2e, 0x4e, 0x99, 0xf4, 0x4d, 0xef, 0x51, 0x18, 0x02, 0x27, 0xa2, 0x51, 0x7d, 0xf0, 0xa1, 0x00, 0x00,
+    0x00
+};
+
+// "stored block", in a stored block
+static const uint8_t g_stored[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x01, 0x0c, 0x00, 0xf3, 0xff, 0x73, 0x74, 0x6f, 0x72,
+    0x65, 0x64, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x94, 0xa3, 0x24, 0x3d, 0x0c, 0x00, 0x00, 0x00
+};
+
+// A fixed block whose first code copies from distance 1 of empty output
+static const uint8_t g_bad_distance[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x03, 0x02, 0x00, 0xc2, 0x41, 0x24, 0x35, 0x03, 0x00,
+    0x00, 0x00
+};
+
+static const char g_pangrams[] = "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs. "
+                                 "How vexingly quick daft zebras jump! The five boxing wizards jump quickly. ";
+
+static uint8_t g_out[1024];
+
+static void check_member(const uint8_t *in, uint32_t in_len, const void *expected, uint32_t expected_len) {
+  uint32_t out_len = sizeof(g_out);
+
+  CHECK_EQ(cmd_gzip_size(in, in_len, sizeof(g_out)), expected_len);
+  CHECK_EQ(cmd_gzip_inflate(in, in_len, g_out, &out_len), 0);
+  CHECK_EQ(out_len, expected_len);
+  CHECK(memcmp(g_out, expected, expected_len) == 0);
+
+  // exactly enough room is fine, one byte less is not
+  out_len = expected_len;
+  CHECK_EQ(cmd_gzip_inflate(in, in_len, g_out, &out_len), 0);
+  out_len = expected_len - 1;
+  CHECK_EQ(cmd_gzip_inflate(in, in_len, g_out, &out_len), CMD_INFLATE_E_SPACE);
+}
+
+static void test_block_types(void) {
+  static const char certificate[] = "CanoKey PIV certificate CanoKey PIV certificate CanoKey PIV certificate ";
+
+  check_member(g_fixed, sizeof(g_fixed), certificate, sizeof(certificate) - 1);
+  check_member(g_dynamic, sizeof(g_dynamic), g_pangrams, sizeof(g_pangrams) - 1);
+  check_member(g_stored, sizeof(g_stored), "stored block", 12);
+}
+
+// Every prefix of a member must be rejected, whatever its trailer reads as.
+static void test_truncated(void) {
+  for (uint32_t len = 0; len < sizeof(g_dynamic); len++) {
+    uint32_t out_len = sizeof(g_out);
+    CHECK(cmd_gzip_inflate(g_dynamic, len, g_out, &out_len) != 0);
+  }
+}
+
+static void test_bad_distance(void) {
+  uint32_t out_len = sizeof(g_out);
+
+  CHECK_EQ(cmd_gzip_inflate(g_bad_distance, sizeof(g_bad_distance), g_out, &out_len), CMD_INFLATE_E_DATA);
+}
+
+static void test_bad_crc(void) {
+  uint8_t in[sizeof(g_dynamic)];
+  uint32_t out_len = sizeof(g_out);
+
+  memcpy(in, g_dynamic, sizeof(in));
+  in[sizeof(in) - 8] ^= 0x01;
+  CHECK_EQ(cmd_gzip_inflate(in, sizeof(in), g_out, &out_len), CMD_INFLATE_E_DATA);
+}
+
+// ISIZE comes from the card and must not size an allocation on its own.
+static void test_oversized_isize(void) {
+  uint8_t in[sizeof(g_dynamic)];
+  uint32_t len = sizeof(g_pangrams) - 1, out_len = sizeof(g_out);
+
+  CHECK_EQ(cmd_gzip_size(g_dynamic, sizeof(g_dynamic), len), len);
+  CHECK_EQ(cmd_gzip_size(g_dynamic, sizeof(g_dynamic), len - 1), 0);
+
+  memcpy(in, g_dynamic, sizeof(in));
+  memset(in + sizeof(in) - 4, 0xFF, 4);
+  CHECK_EQ(cmd_gzip_size(in, sizeof(in), sizeof(g_out)), 0);
+  CHECK_EQ(cmd_gzip_size(in, sizeof(in), UINT32_MAX), UINT32_MAX);
+  // the trailer is checked against what was actually inflated
+  CHECK_EQ(cmd_gzip_inflate(in, sizeof(in), g_out, &out_len), CMD_INFLATE_E_DATA);
+}
+
+static void test_not_gzip(void) {
+  uint8_t in[sizeof(g_fixed)];
+  uint32_t out_len = sizeof(g_out);
+
+  memcpy(in, g_fixed, sizeof(in));
+  in[2] = 0; // compression method other than DEFLATE
+  CHECK_EQ(cmd_gzip_inflate(in, sizeof(in), g_out, &out_len), CMD_INFLATE_E_DATA);
+  in[0] = 0;
+  CHECK_EQ(cmd_gzip_size(in, sizeof(in), sizeof(g_out)), 0);
+}
+
+int main(void) {
+  test_block_types();
+  test_truncated();
+  test_bad_distance();
+  test_bad_crc();
+  test_oversized_isize();
+  test_not_gzip();
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Unit tests of logcfg.c: parsing of level specs and, where the
+ * configuration comes from a file (not the registry), reloading it.
+ */
+
+#include "logcfg.h"
+#include "test.h"
+
+#include <string.h>
+
+#define LEVEL(levels, sub) CMD_LOGCFG_LEVEL(levels, sub)
+
+static void test_pack(void) {
+  uint32_t levels = cmd_logcfg_pack(3);
+
+  for (int sub = 0; sub < CMD_LOG_SUB_COUNT; sub++) {
+    CHECK_EQ(LEVEL(levels, sub), 3);
+  }
+  CHECK(!(levels & CMD_LOGCFG_UNRESOLVED));
+}
+
+static void test_parse(void) {
+  uint32_t levels = cmd_logcfg_pack(2);
+
+  // blanks and the newline of a config file are ignored
+  CHECK_EQ(cmd_logcfg_parse(" debug , transport=trace,pin=none\n", &levels), 0);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_GENERAL), 1);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_TRANSPORT), 0);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_CACHE), 1);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_CRYPTO), 1);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_PIN), 6);
+
+  // overrides apply on top of what is there
+  CHECK_EQ(cmd_logcfg_parse("crypto=4", &levels), 0);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_CRYPTO), 4);
+  CHECK_EQ(LEVEL(levels, CMD_LOG_SUB_PIN), 6);
+
+  // a global level resets every subsystem, digits name levels too
+  CHECK_EQ(cmd_logcfg_parse("5", &levels), 0);
+  CHECK_EQ(levels, cmd_logcfg_pack(5));
+  CHECK_EQ(cmd_logcfg_parse("", &levels), 0);
+  CHECK_EQ(levels, cmd_logcfg_pack(5));
+}
+
+// A malformed spec leaves the levels as they were.
+static void test_malformed(void) {
+  static const char *const specs[] = {"bogus", "cache=bogus", "nosuch=info", "7", "info,=debug", "info,pin"};
+  uint32_t levels = cmd_logcfg_pack(2);
+
+  for (size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+    CHECK(cmd_logcfg_parse(specs[i], &levels) != 0);
+    CHECK_EQ(levels, cmd_logcfg_pack(2));
+  }
+}
+
+#ifndef _WIN32
+#define CONFIG_FILE "logcfg-test.cfg"
+
+static void write_config(const char *spec) {
+  FILE *f = fopen(CONFIG_FILE ".tmp", "w");
+  CHECK(f);
+  CHECK(fputs(spec, f) >= 0);
+  CHECK(fclose(f) == 0);
+  // a new file, so that its change is seen whatever the mtime resolution
+  CHECK(rename(CONFIG_FILE ".tmp", CONFIG_FILE) == 0);
+}
+
+static void test_reload(void) {
+  CHECK(g_log_levels & CMD_LOGCFG_UNRESOLVED);
+  write_config("warn\n");
+  CHECK(setenv("CMD_LOG_LEVELS", "pin=none", 1) == 0);
+  CHECK(setenv("CMD_LOG_CONFIG", CONFIG_FILE, 1) == 0);
+  cmd_logcfg_resolve(1);
+  CHECK_EQ(g_log_levels, cmd_logcfg_pack(3));
+
+  // polled every second
+  test_sleep_ms(1100);
+  write_config("info,pin=error\n");
+  for (int i = 0; i < 50 && LEVEL(g_log_levels, CMD_LOG_SUB_PIN) != 4; i++) {
+    test_sleep_ms(100);
+  }
+  CHECK_EQ(LEVEL(g_log_levels, CMD_LOG_SUB_GENERAL), 2);
+  CHECK_EQ(LEVEL(g_log_levels, CMD_LOG_SUB_PIN), 4);
+
+  // the environment spec applies below the file
+  write_config("bogus\n");
+  for (int i = 0; i < 50 && LEVEL(g_log_levels, CMD_LOG_SUB_PIN) != 6; i++) {
+    test_sleep_ms(100);
+  }
+  CHECK_EQ(LEVEL(g_log_levels, CMD_LOG_SUB_GENERAL), 1);
+  CHECK_EQ(LEVEL(g_log_levels, CMD_LOG_SUB_PIN), 6);
+
+  cmd_logcfg_shutdown();
+  remove(CONFIG_FILE);
+}
+#endif
+
+int main(void) {
+  test_pack();
+  test_parse();
+  test_malformed();
+#ifndef _WIN32
+  test_reload();
+#endif
+  return 0;
+}
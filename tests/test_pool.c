@@ -0,0 +1,229 @@
+/*
+ * Unit tests of pool.c with simulated tokens: load spreading, ejection of
+ * failing and slow tokens, readmission after the cool-down, and the status
+ * a request that failed everywhere returns, and destroying the pool under
+ * callers. Also reports how throughput scales from one to eight tokens.
+ */
+
+#include "pool.h"
+#include "test.h"
+#include "ticks.h"
+
+#include <string.h>
+
+#define SW_REMOVED 0x80100069U // SCARD_W_REMOVED_CARD
+
+typedef struct {
+  unsigned delay_ms;
+  uint32_t status; // returned by every request, 0 to sign
+} TOKEN;
+
+// Signs by echoing the first byte of the digest.
+static uint32_t sign(void *ctx, const uint8_t *digest, size_t digest_len, uint8_t *sig, size_t *sig_len) {
+  TOKEN *token = (TOKEN *)ctx;
+
+  if (token->delay_ms) {
+    test_sleep_ms(token->delay_ms);
+  }
+  if (token->status) {
+    return token->status;
+  }
+  CHECK(digest_len > 0 && *sig_len > 0);
+  sig[0] = digest[0];
+  *sig_len = 1;
+  return 0;
+}
+
+static CMD_POOL *g_pool;
+
+TEST_THREAD_FN(client, arg) {
+  int requests = *(int *)arg;
+
+  for (int i = 0; i < requests; i++) {
+    uint8_t digest[32] = {(uint8_t)i}, sig[8];
+    size_t sig_len = sizeof(sig);
+    CHECK_EQ(cmd_pool_sign(g_pool, digest, sizeof(digest), sig, &sig_len), 0);
+    CHECK_EQ(sig_len, 1);
+    CHECK_EQ(sig[0], (uint8_t)i);
+  }
+  return 0;
+}
+
+static void run_clients(int clients, int requests) {
+  test_thread_t threads[8];
+
+  CHECK(clients <= 8);
+  for (int i = 0; i < clients; i++) {
+    CHECK(test_thread_start(&threads[i], client, &requests));
+  }
+  for (int i = 0; i < clients; i++) {
+    test_thread_join(threads[i]);
+  }
+}
+
+static CMD_POOL_TOKEN_STATS stats_of(int token) {
+  CMD_POOL_TOKEN_STATS stats;
+  CHECK_EQ(cmd_pool_token_stats(g_pool, token, &stats), 0);
+  return stats;
+}
+
+static void test_spread(void) {
+  TOKEN tokens[3] = {{1, 0}, {1, 0}, {1, 0}};
+  uint64_t total = 0;
+
+  g_pool = cmd_pool_create(NULL);
+  for (int i = 0; i < 3; i++) {
+    CHECK_EQ(cmd_pool_add_token(g_pool, sign, NULL, &tokens[i]), i);
+  }
+  run_clients(6, 20);
+  for (int i = 0; i < 3; i++) {
+    CMD_POOL_TOKEN_STATS stats = stats_of(i);
+    CHECK(stats.healthy);
+    CHECK(stats.completed > 0);
+    total += stats.completed;
+  }
+  CHECK_EQ(total, 6 * 20);
+  cmd_pool_destroy(g_pool);
+}
+
+// A token failing every request is ejected; its requests are retried on the
+// healthy one.
+static void test_failing_token(void) {
+  CMD_POOL_CONFIG config = {.max_failures = 2, .min_samples = 4, .max_retries = 2};
+  TOKEN tokens[2] = {{0, 0}, {0, SW_REMOVED}};
+
+  g_pool = cmd_pool_create(&config);
+  for (int i = 0; i < 2; i++) {
+    CHECK_EQ(cmd_pool_add_token(g_pool, sign, NULL, &tokens[i]), i);
+  }
+  run_clients(4, 20);
+  CHECK(stats_of(0).healthy);
+  CHECK(!stats_of(1).healthy);
+  CHECK_EQ(stats_of(1).failed, 2);
+  cmd_pool_destroy(g_pool);
+}
+
+// A request every token failed returns the error of its last attempt, not
+// CMD_POOL_E_NO_TOKEN.
+static void test_last_status(void) {
+  CMD_POOL_CONFIG config = {.max_failures = 3, .min_samples = 4, .max_retries = 2};
+  TOKEN tokens[2] = {{0, SW_REMOVED}, {0, SW_REMOVED}};
+  uint8_t digest[32] = {0}, sig[8];
+  size_t sig_len = sizeof(sig);
+
+  g_pool = cmd_pool_create(&config);
+  for (int i = 0; i < 2; i++) {
+    CHECK_EQ(cmd_pool_add_token(g_pool, sign, NULL, &tokens[i]), i);
+  }
+  CHECK_EQ(cmd_pool_sign(g_pool, digest, sizeof(digest), sig, &sig_len), SW_REMOVED);
+  CHECK_EQ(stats_of(0).failed + stats_of(1).failed, 2);
+  cmd_pool_destroy(g_pool);
+
+  // without any token there is nothing to report but the lack of one
+  g_pool = cmd_pool_create(NULL);
+  CHECK_EQ(cmd_pool_sign(g_pool, digest, sizeof(digest), sig, &sig_len), CMD_POOL_E_NO_TOKEN);
+  cmd_pool_destroy(g_pool);
+}
+
+// A slow token is ejected, then readmitted once the cool-down is over.
+static void test_slow_token(void) {
+  CMD_POOL_CONFIG config = {
+      .max_failures = 3, .slow_factor = 4.0, .min_samples = 4, .slow_cooldown_ms = 200, .max_retries = 2};
+  TOKEN tokens[2] = {{1, 0}, {40, 0}};
+
+  g_pool = cmd_pool_create(&config);
+  for (int i = 0; i < 2; i++) {
+    CHECK_EQ(cmd_pool_add_token(g_pool, sign, NULL, &tokens[i]), i);
+  }
+  for (int round = 0; round < 50 && stats_of(1).healthy; round++) {
+    run_clients(8, 4);
+  }
+  CHECK(!stats_of(1).healthy);
+
+  test_sleep_ms(300);
+  run_clients(1, 1);
+  CHECK(stats_of(1).healthy);
+  cmd_pool_destroy(g_pool);
+}
+
+typedef struct {
+  CMD_POOL *pool;
+  uint32_t status;
+  int returned;
+} CALL;
+
+TEST_THREAD_FN(single_call, arg) {
+  CALL *call = (CALL *)arg;
+  uint8_t digest[32] = {1}, sig[8];
+  size_t sig_len = sizeof(sig);
+
+  call->status = cmd_pool_sign(call->pool, digest, sizeof(digest), sig, &sig_len);
+  call->returned = 1;
+  return 0;
+}
+
+// Destroying the pool while callers wait: the request being signed completes,
+// the queued ones fail, and the pool is only freed once all callers are done
+// with it.
+static void test_destroy_under_callers(void) {
+  TOKEN token = {30, 0};
+  test_thread_t threads[4];
+  CALL calls[4];
+
+  for (int round = 0; round < 5; round++) {
+    CMD_POOL *pool = cmd_pool_create(NULL);
+    CHECK_EQ(cmd_pool_add_token(pool, sign, NULL, &token), 0);
+    for (int i = 0; i < 4; i++) {
+      calls[i].pool = pool;
+      calls[i].returned = 0;
+      CHECK(test_thread_start(&threads[i], single_call, &calls[i]));
+    }
+    test_sleep_ms(10);
+    cmd_pool_destroy(pool);
+    int done = 0;
+    for (int i = 0; i < 4; i++) {
+      test_thread_join(threads[i]);
+      CHECK(calls[i].returned);
+      CHECK(calls[i].status == 0 || calls[i].status == CMD_POOL_E_NO_TOKEN);
+      done += calls[i].status == 0;
+    }
+    CHECK(done <= 1);
+  }
+}
+
+// Throughput with 1, 2, 4 and 8 tokens of the same latency under 8 clients.
+static void bench_scaling(void) {
+  TOKEN tokens[8];
+  double base = 0;
+
+  for (int n = 1; n <= 8; n *= 2) {
+    g_pool = cmd_pool_create(NULL);
+    for (int i = 0; i < n; i++) {
+      tokens[i].delay_ms = 2;
+      tokens[i].status = 0;
+      CHECK_EQ(cmd_pool_add_token(g_pool, sign, NULL, &tokens[i]), i);
+    }
+    uint64_t start = cmd_ticks();
+    run_clients(8, 16);
+    double per_second = 8 * 16 * 1e6 / (double)cmd_ticks_to_us(cmd_ticks() - start);
+    cmd_pool_destroy(g_pool);
+    if (n == 1) {
+      base = per_second;
+    }
+    printf("%d token%s: %.0f signatures/s, %.1fx\n", n, n > 1 ? "s" : "", per_second, per_second / base);
+    // loose, so that a busy machine does not fail it
+    if (n == 8) {
+      CHECK(per_second > 3 * base);
+    }
+  }
+}
+
+int main(void) {
+  test_spread();
+  test_failing_token();
+  test_last_status();
+  test_slow_token();
+  test_destroy_under_callers();
+  bench_scaling();
+  return 0;
+}
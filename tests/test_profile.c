@@ -0,0 +1,135 @@
+/*
+ * Tests of the ATR table: every ATR the INF template registers, with the
+ * bits its mask ignores flipped, gets the CanoKey profile; a bit the mask
+ * covers, a truncated or an overlong ATR, and the ATRs of other cards get
+ * none. CMD_INF_TEMPLATE names the template.
+ */
+
+#include "piv.h"
+#include "profile.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ATR 33
+#define MAX_ENTRIES 8
+
+typedef struct {
+  BYTE rgbAtr[MAX_ATR];
+  BYTE rgbMask[MAX_ATR];
+  DWORD cbAtr;
+  DWORD cbMask;
+} INF_ENTRY;
+
+// Parse the hex bytes after the REG_BINARY type of an AddReg line.
+static DWORD parse_bytes(const char *line, BYTE *pb) {
+  const char *p = strstr(line, "0x00000001,");
+  DWORD cb = 0;
+
+  CHECK(p != NULL);
+  p += strlen("0x00000001,");
+  while (*p && *p != '\r' && *p != '\n') {
+    char *end;
+    unsigned long b = strtoul(p, &end, 16);
+    CHECK(end == p + 2 && b <= 0xFF && cb < MAX_ATR);
+    pb[cb++] = (BYTE)b;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cb;
+}
+
+// The ATR and ATRMask pairs of the template, in order.
+static int read_inf(INF_ENTRY *entries) {
+  char line[512];
+  int n = 0;
+
+  FILE *f = fopen(CMD_INF_TEMPLATE, "r");
+  CHECK(f != NULL);
+  while (fgets(line, sizeof(line), f)) {
+    if (strstr(line, "\"ATR\",")) {
+      CHECK(n < MAX_ENTRIES);
+      entries[n].cbAtr = parse_bytes(line, entries[n].rgbAtr);
+      entries[n].cbMask = 0;
+      n++;
+    } else if (strstr(line, "\"ATRMask\",")) {
+      CHECK(n > 0 && entries[n - 1].cbMask == 0);
+      entries[n - 1].cbMask = parse_bytes(line, entries[n - 1].rgbMask);
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+static void check_profile(const CMD_CARD_PROFILE *pProfile) {
+  CHECK(pProfile != NULL);
+  CHECK(strcmp(pProfile->pszName, "CanoKey") == 0);
+  CHECK(pProfile->fExtendedApdu);
+  CHECK(pProfile->fMetadata);
+  CHECK(pProfile->cbRespChunk <= pProfile->cbMaxApdu);
+  CHECK(pProfile->dwAlgorithms & CMD_PROFILE_ALG_P256);
+  CHECK_EQ(pProfile->cSlots, CMD_PIV_NUM_SLOTS);
+}
+
+static void test_inf(void) {
+  INF_ENTRY entries[MAX_ENTRIES];
+  BYTE rgbAtr[MAX_ATR + 1];
+
+  // the default and the WOW64 registration
+  int n = read_inf(entries);
+  CHECK(n >= 2);
+  for (int i = 0; i < n; i++) {
+    const INF_ENTRY *pEntry = &entries[i];
+    CHECK(pEntry->cbAtr > 0);
+    CHECK_EQ(pEntry->cbMask, pEntry->cbAtr);
+    check_profile(cmd_profile_from_atr(pEntry->rgbAtr, pEntry->cbAtr));
+
+    for (DWORD j = 0; j < pEntry->cbAtr; j++) {
+      for (int bit = 0; bit < 8; bit++) {
+        memcpy(rgbAtr, pEntry->rgbAtr, pEntry->cbAtr);
+        rgbAtr[j] ^= (BYTE)(1 << bit);
+        const CMD_CARD_PROFILE *pProfile = cmd_profile_from_atr(rgbAtr, pEntry->cbAtr);
+        if (pEntry->rgbMask[j] & (1 << bit)) {
+          CHECK(pProfile == NULL);
+        } else {
+          check_profile(pProfile);
+        }
+      }
+    }
+
+    // every prefix, and one byte more
+    for (DWORD cb = 0; cb < pEntry->cbAtr; cb++) {
+      CHECK(cmd_profile_from_atr(pEntry->rgbAtr, cb) == NULL);
+    }
+    memcpy(rgbAtr, pEntry->rgbAtr, pEntry->cbAtr);
+    rgbAtr[pEntry->cbAtr] = 0x00;
+    CHECK(cmd_profile_from_atr(rgbAtr, pEntry->cbAtr + 1) == NULL);
+  }
+}
+
+static void test_foreign(void) {
+  static const BYTE yubikey[] = {0x3B, 0xF8, 0x13, 0x00, 0x00, 0x81, 0x31, 0xFE, 0x15,
+                                 0x59, 0x75, 0x62, 0x69, 0x6B, 0x65, 0x79, 0x34, 0xD4};
+  static const BYTE piv[] = {0x3B, 0x88, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09};
+  // the CanoKey ATR with another check byte
+  static const BYTE bad_tck[] = {0x3B, 0xF7, 0x11, 0x00, 0x00, 0x81, 0x31, 0xFE, 0x65,
+                                 0x43, 0x61, 0x6E, 0x6F, 0x6B, 0x65, 0x79, 0x98};
+  BYTE zero[17], ones[MAX_ATR];
+
+  memset(zero, 0x00, sizeof(zero));
+  memset(ones, 0xFF, sizeof(ones));
+  CHECK(cmd_profile_from_atr(yubikey, sizeof(yubikey)) == NULL);
+  CHECK(cmd_profile_from_atr(piv, sizeof(piv)) == NULL);
+  CHECK(cmd_profile_from_atr(bad_tck, sizeof(bad_tck)) == NULL);
+  CHECK(cmd_profile_from_atr(zero, sizeof(zero)) == NULL);
+  for (DWORD cb = 0; cb <= MAX_ATR; cb++) {
+    CHECK(cmd_profile_from_atr(ones, cb) == NULL);
+  }
+}
+
+int main(void) {
+  test_inf();
+  test_foreign();
+  return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Tests of the APDU programs against the simulated card: arguments and
+ * bindings reach the commands, responses sent in 61xx parts are collected
+ * into the response binding, status word rules stop, continue or fail a
+ * program in the order they are listed, and VERIFY PIN maps what the card
+ * says to the errors and remaining attempts the CSP expects.
+ */
+
+#include "apdu.h"
+#include "cardmod.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "program.h"
+#include "sim_card.h"
+#include "test.h"
+
+#include <string.h>
+
+#define LARGE_LEN 1500
+
+static const BYTE PIV_AID[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+static const BYTE GET_CHUID[] = {0x5C, 0x03, 0x5F, 0xC1, 0x02};
+static const BYTE GET_LARGE[] = {0x5C, 0x03, 0x5F, 0xC1, 0x05};
+static const BYTE GET_MISSING[] = {0x5C, 0x03, 0x5F, 0xC1, 0x0A};
+
+static uint8_t g_rgbChuid[40], g_rgbLarge[LARGE_LEN];
+
+static void acquire(PCARD_DATA pCardData) {
+  sim_reset();
+  for (size_t i = 0; i < sizeof(g_rgbChuid); i++) {
+    g_rgbChuid[i] = (uint8_t)(0x10 + i);
+  }
+  for (size_t i = 0; i < sizeof(g_rgbLarge); i++) {
+    g_rgbLarge[i] = (uint8_t)(i * 7);
+  }
+  sim_set_object(CMD_PIV_OBJ_CHUID, g_rgbChuid, sizeof(g_rgbChuid));
+  sim_set_object(0x5FC105, g_rgbLarge, sizeof(g_rgbLarge));
+  sim_set_ec_key(CMD_PIV_SLOT_SIGNATURE, 5);
+  sim_card_data(pCardData);
+  CHECK_EQ(CardAcquireContext(pCardData, 0), SCARD_S_SUCCESS);
+  cmd_prefetch_stop(pCardData);
+  // the programs below, but for the first, leave SELECT out
+  CHECK_EQ(cmd_begin_transaction(pCardData), SCARD_S_SUCCESS);
+  CHECK_EQ(cmd_piv_select(pCardData), SCARD_S_SUCCESS);
+  cmd_end_transaction(pCardData);
+  cmd_release_transaction(pCardData);
+  sim_clear_counts();
+}
+
+// A step with constant P1 and P2, no data and no response binding.
+static CMD_APDU_STEP step(LPCSTR pszName, BYTE bIns, BYTE bP1, BYTE bP2) {
+  CMD_APDU_STEP s;
+
+  memset(&s, 0, sizeof(s));
+  s.pszName = pszName;
+  s.bIns = bIns;
+  s.bP1 = bP1;
+  s.bP2 = bP2;
+  s.iP1Arg = CMD_APDU_NO_BINDING;
+  s.iP2Arg = CMD_APDU_NO_BINDING;
+  s.iData = CMD_APDU_NO_BINDING;
+  s.iResp = CMD_APDU_NO_BINDING;
+  return s;
+}
+
+static CMD_APDU_STEP get_data(const BYTE *pbTag, DWORD cbTag) {
+  CMD_APDU_STEP s = step("GET DATA", CMD_PIV_INS_GET_DATA, 0x3F, 0xFF);
+  s.pbData = pbTag;
+  s.cbData = cbTag;
+  return s;
+}
+
+static DWORD run(PCARD_DATA pCardData, const CMD_APDU_STEP *pSteps, DWORD cSteps, PCMD_APDU_RUN pRun) {
+  CMD_APDU_PROGRAM program = {"TEST", pSteps, cSteps};
+  return cmd_apdu_run(pCardData, &program, pRun);
+}
+
+static void test_bindings(void) {
+  CARD_DATA cardData;
+  CMD_APDU_STEP steps[3];
+  CMD_APDU_RUN r;
+  BYTE rgbResp[256], rgbMeta[128];
+
+  acquire(&cardData);
+  // SELECT with constant data, GET DATA with bound data and response, GET
+  // METADATA with the slot from an argument
+  steps[0] = step("SELECT", CMD_PIV_INS_SELECT, 0x04, 0x00);
+  steps[0].pbData = PIV_AID;
+  steps[0].cbData = sizeof(PIV_AID);
+  steps[1] = step("GET DATA", CMD_PIV_INS_GET_DATA, 0x3F, 0xFF);
+  steps[1].iData = 2;
+  steps[1].iResp = 0;
+  steps[2] = step("GET METADATA", CMD_PIV_INS_GET_METADATA, 0x00, 0x00);
+  steps[2].iP2Arg = 3;
+  steps[2].iResp = 1;
+  memset(&r, 0, sizeof(r));
+  r.rgbArgs[3] = CMD_PIV_SLOT_SIGNATURE;
+  r.rgBindings[0].pbOut = rgbResp;
+  r.rgBindings[0].cbOut = sizeof(rgbResp);
+  r.rgBindings[1].pbOut = rgbMeta;
+  r.rgBindings[1].cbOut = sizeof(rgbMeta);
+  r.rgBindings[2].pbIn = GET_CHUID;
+  r.rgBindings[2].cbIn = sizeof(GET_CHUID);
+  CHECK_EQ(run(&cardData, steps, 3, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(r.iStep, 2);
+  CHECK_EQ(r.wSw, CMD_SW_OK);
+  CHECK_EQ(r.rgBindings[0].cbOut, 2 + sizeof(g_rgbChuid));
+  CHECK_EQ(rgbResp[0], 0x53);
+  CHECK(memcmp(rgbResp + 2, g_rgbChuid, sizeof(g_rgbChuid)) == 0);
+  CHECK(r.rgBindings[1].cbOut > 0);
+  CHECK_EQ(sim_last_command()->ins, CMD_PIV_INS_GET_METADATA);
+  CHECK_EQ(sim_last_command()->p1, 0x00);
+  CHECK_EQ(sim_last_command()->p2, CMD_PIV_SLOT_SIGNATURE);
+  CHECK_EQ(sim_metadata_reads(CMD_PIV_SLOT_SIGNATURE), 1);
+  CHECK_EQ(sim_transactions(), 1);
+
+  // P1 from an argument as well
+  steps[2].iP1Arg = 0;
+  r.rgbArgs[0] = 0x12;
+  r.rgBindings[1].cbOut = sizeof(rgbMeta);
+  r.rgBindings[0].cbOut = sizeof(rgbResp);
+  CHECK_EQ(run(&cardData, steps, 3, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(sim_last_command()->p1, 0x12);
+  CHECK_EQ(sim_last_command()->p2, CMD_PIV_SLOT_SIGNATURE);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_response_parts(void) {
+  static BYTE rgbResp[LARGE_LEN + 16];
+  CARD_DATA cardData;
+  CMD_APDU_STEP s;
+  CMD_APDU_RUN r;
+
+  acquire(&cardData);
+  s = get_data(GET_LARGE, sizeof(GET_LARGE));
+  s.iResp = 0;
+  memset(&r, 0, sizeof(r));
+  r.rgBindings[0].pbOut = rgbResp;
+  r.rgBindings[0].cbOut = sizeof(rgbResp);
+  CHECK_EQ(run(&cardData, &s, 1, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(r.rgBindings[0].cbOut, 4 + LARGE_LEN);
+  CHECK(memcmp(rgbResp + 4, g_rgbLarge, LARGE_LEN) == 0);
+  CHECK_EQ(sim_commands(CMD_PIV_INS_GET_DATA), 1);
+  CHECK(sim_get_responses() > 0);
+
+  // a response binding too small for it
+  r.rgBindings[0].cbOut = LARGE_LEN;
+  CHECK_EQ(run(&cardData, &s, 1, &r), SCARD_E_INSUFFICIENT_BUFFER);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_rules(void) {
+  static const CMD_APDU_SW_RULE done[] = {{0x6A82, 0xFFFF, CMD_APDU_SW_DONE, SCARD_S_SUCCESS}};
+  static const CMD_APDU_SW_RULE next[] = {{0x6A00, 0xFF00, CMD_APDU_SW_NEXT, SCARD_S_SUCCESS}};
+  static const CMD_APDU_SW_RULE fail_first[] = {{0x6A82, 0xFFFF, CMD_APDU_SW_FAIL, SCARD_E_NO_SUCH_CERTIFICATE},
+                                                {0x6A00, 0xFF00, CMD_APDU_SW_DONE, SCARD_S_SUCCESS}};
+  static const CMD_APDU_SW_RULE done_first[] = {{0x6A00, 0xFF00, CMD_APDU_SW_DONE, SCARD_E_NO_KEY_CONTAINER},
+                                                {0x6A82, 0xFFFF, CMD_APDU_SW_FAIL, SCARD_E_NO_SUCH_CERTIFICATE}};
+  static const CMD_APDU_SW_RULE other[] = {{0x6982, 0xFFFF, CMD_APDU_SW_DONE, SCARD_S_SUCCESS}};
+  static const CMD_APDU_SW_RULE any[] = {{0x0000, 0x0000, CMD_APDU_SW_FAIL, SCARD_E_UNEXPECTED}};
+  CARD_DATA cardData;
+  CMD_APDU_STEP steps[2];
+  CMD_APDU_RUN r;
+
+  acquire(&cardData);
+  memset(&r, 0, sizeof(r));
+  steps[0] = get_data(GET_MISSING, sizeof(GET_MISSING));
+  steps[1] = get_data(GET_CHUID, sizeof(GET_CHUID));
+
+  // without rules, the status word decides the error
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_E_FILE_NOT_FOUND);
+  CHECK_EQ(r.iStep, 0);
+  CHECK_EQ(r.wSw, CMD_SW_FILE_NOT_FOUND);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 0);
+
+  // rules that do not match change nothing
+  steps[0].pRules = other;
+  steps[0].cRules = ARRAYSIZE(other);
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_E_FILE_NOT_FOUND);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 0);
+
+  // stop with success
+  steps[0].pRules = done;
+  steps[0].cRules = ARRAYSIZE(done);
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(r.iStep, 0);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 0);
+
+  // go on with the next step
+  steps[0].pRules = next;
+  steps[0].cRules = ARRAYSIZE(next);
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(r.iStep, 1);
+  CHECK_EQ(r.wSw, CMD_SW_OK);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+
+  // the first rule that matches wins
+  steps[0].pRules = fail_first;
+  steps[0].cRules = ARRAYSIZE(fail_first);
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_E_NO_SUCH_CERTIFICATE);
+  steps[0].pRules = done_first;
+  steps[0].cRules = ARRAYSIZE(done_first);
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_E_NO_KEY_CONTAINER);
+  CHECK_EQ(r.iStep, 0);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+
+  // 9000 runs the next step whatever the rules say
+  steps[1].pRules = any;
+  steps[1].cRules = ARRAYSIZE(any);
+  steps[0] = steps[1];
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(r.iStep, 1);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 3);
+
+  // ... and a scripted status word meets the rule matching any
+  sim_script(CMD_PIV_INS_GET_DATA, 0x6F00, NULL, 0);
+  CHECK_EQ(run(&cardData, steps, 2, &r), SCARD_E_UNEXPECTED);
+  CHECK_EQ(r.iStep, 0);
+  CHECK_EQ(r.wSw, 0x6F00);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_transaction(void) {
+  CARD_DATA cardData;
+  CMD_APDU_STEP s = get_data(GET_CHUID, sizeof(GET_CHUID));
+  CMD_APDU_RUN r;
+
+  // programs join the transaction of their caller
+  acquire(&cardData);
+  memset(&r, 0, sizeof(r));
+  CHECK_EQ(cmd_begin_transaction(&cardData), SCARD_S_SUCCESS);
+  CHECK_EQ(run(&cardData, &s, 1, &r), SCARD_S_SUCCESS);
+  CHECK_EQ(run(&cardData, &s, 1, &r), SCARD_S_SUCCESS);
+  cmd_end_transaction(&cardData);
+  CHECK_EQ(sim_transactions(), 1);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 2);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static DWORD verify(PCARD_DATA pCardData, const char *pszPin, DWORD *pcAttempts) {
+  *pcAttempts = 0xDEADBEEF;
+  return CardAuthenticatePin(pCardData, wszCARD_USER_USER, (PBYTE)pszPin, (DWORD)strlen(pszPin), pcAttempts);
+}
+
+static void test_verify_pin(void) {
+  CARD_DATA cardData;
+  DWORD cAttempts;
+
+  acquire(&cardData);
+  CHECK_EQ(verify(&cardData, SIM_PIN, &cAttempts), SCARD_S_SUCCESS);
+  CHECK_EQ(sim_last_command()->ins, CMD_PIV_INS_VERIFY);
+  CHECK_EQ(sim_last_command()->len, CMD_PIV_PIN_MAX_LEN);
+  CHECK(memcmp(sim_last_command()->data, SIM_PIN "\xFF\xFF", CMD_PIV_PIN_MAX_LEN) == 0);
+
+  // wrong PINs count down to a blocked one, which stays blocked
+  for (DWORD left = SIM_PIN_RETRIES - 1; left > 0; left--) {
+    CHECK_EQ(verify(&cardData, "000000", &cAttempts), SCARD_W_WRONG_CHV);
+    CHECK_EQ(cAttempts, left);
+  }
+  CHECK_EQ(verify(&cardData, "000000", &cAttempts), SCARD_W_CHV_BLOCKED);
+  CHECK_EQ(cAttempts, 0);
+  CHECK_EQ(verify(&cardData, SIM_PIN, &cAttempts), SCARD_W_CHV_BLOCKED);
+  CHECK_EQ(cAttempts, 0);
+
+  // a failed SELECT stops before VERIFY, without a count
+  sim_clear_counts();
+  sim_script(CMD_PIV_INS_SELECT, CMD_SW_FILE_NOT_FOUND, NULL, 0);
+  CHECK_EQ(verify(&cardData, SIM_PIN, &cAttempts), SCARD_E_CARD_UNSUPPORTED);
+  CHECK_EQ(cAttempts, (DWORD)-1);
+  CHECK_EQ(sim_commands(CMD_PIV_INS_VERIFY), 0);
+
+  // PINs of no length or over 8 bytes are not sent
+  CHECK_EQ(verify(&cardData, "", &cAttempts), SCARD_W_WRONG_CHV);
+  CHECK_EQ(verify(&cardData, "123456789", &cAttempts), SCARD_W_WRONG_CHV);
+  CHECK_EQ(sim_commands(CMD_PIV_INS_VERIFY), 0);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+int main(void) {
+  test_bindings();
+  test_response_parts();
+  test_rules();
+  test_transaction();
+  test_verify_pin();
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Tests of the recovery from a card reset against the simulated card: a
+ * reset in the middle of a signature reconnects once, keeps what was cached
+ * for the same card and fails with SCARD_W_SECURITY_VIOLATION, so that the
+ * CSP authenticates again and signs; a context that never read the identity
+ * takes the new one and goes on; another card after the reset fails with
+ * SCARD_W_REMOVED_CARD. The time the recovery takes is printed.
+ */
+
+#include "apdu.h"
+#include "cardmod.h"
+#include "piv.h"
+#include "prefetch.h"
+#include "sim_card.h"
+#include "test.h"
+#include "ticks.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The signature key, in container 1.
+#define CONTAINER 1
+#define SEED 7
+
+static const uint8_t CHUID[] = {0x34, 0x10, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+                                0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x3E, 0x00};
+static const uint8_t OTHER_CHUID[] = {0x34, 0x10, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+                                      0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F, 0x3E, 0x00};
+
+static void acquire(PCARD_DATA pCardData) {
+  sim_reset();
+  sim_set_object(CMD_PIV_OBJ_CHUID, CHUID, sizeof(CHUID));
+  sim_set_ec_key(CMD_PIV_SLOT_SIGNATURE, SEED);
+  sim_card_data(pCardData);
+  CHECK_EQ(CardAcquireContext(pCardData, 0), SCARD_S_SUCCESS);
+  cmd_prefetch_stop(pCardData);
+  cmd_release_transaction(pCardData);
+  sim_clear_counts();
+}
+
+static DWORD authenticate(PCARD_DATA pCardData) {
+  DWORD cAttempts;
+  return CardAuthenticatePin(pCardData, wszCARD_USER_USER, (PBYTE)SIM_PIN, sizeof(SIM_PIN) - 1, &cAttempts);
+}
+
+static DWORD sign(PCARD_DATA pCardData) {
+  CARD_SIGNING_INFO info;
+  uint8_t digest[32], rs[64];
+
+  for (int i = 0; i < (int)sizeof(digest); i++) {
+    digest[i] = (uint8_t)(0xA0 + i);
+  }
+  memset(&info, 0, sizeof(info));
+  info.dwVersion = CARD_SIGNING_INFO_BASIC_VERSION;
+  info.bContainerIndex = CONTAINER;
+  info.dwKeySpec = AT_ECDSA_P256;
+  info.dwSigningFlags = CRYPT_NOHASHOID;
+  info.pbData = digest;
+  info.cbData = sizeof(digest);
+  DWORD dwRet = CardSignData(pCardData, &info);
+  if (dwRet == SCARD_S_SUCCESS) {
+    sim_ec_signature(SEED, digest, sizeof(digest), rs);
+    CHECK_EQ(info.cbSignedData, sizeof(rs));
+    CHECK(memcmp(info.pbSignedData, rs, sizeof(rs)) == 0);
+    pCardData->pfnCspFree(info.pbSignedData);
+  } else {
+    CHECK(info.pbSignedData == NULL);
+  }
+  return dwRet;
+}
+
+static void read_card_id(PCARD_DATA pCardData) {
+  PBYTE pbData;
+  DWORD cbData;
+
+  CHECK_EQ(CardReadFile(pCardData, NULL, szCARD_IDENTIFIER_FILE, 0, &pbData, &cbData), SCARD_S_SUCCESS);
+  pCardData->pfnCspFree(pbData);
+}
+
+static void test_reset_mid_sign(void) {
+  CARD_DATA cardData;
+
+  acquire(&cardData);
+  read_card_id(&cardData);
+  CHECK_EQ(authenticate(&cardData), SCARD_S_SUCCESS);
+  CHECK_EQ(sign(&cardData), SCARD_S_SUCCESS);
+  CHECK_EQ(sim_metadata_reads(CMD_PIV_SLOT_SIGNATURE), 1);
+
+  // the card resets on GENERAL AUTHENTICATE, which is sent again after the
+  // reconnect and finds the PIN no longer verified
+  sim_clear_counts();
+  sim_inject_reset(CMD_PIV_INS_GENERAL_AUTHENTICATE);
+  uint64_t ullStart = cmd_ticks();
+  CHECK_EQ(sign(&cardData), SCARD_W_SECURITY_VIOLATION);
+  uint64_t ullFailed = cmd_ticks();
+  CHECK_EQ(sim_reconnects(), 1);
+  CHECK_EQ(sim_commands(CMD_PIV_INS_GENERAL_AUTHENTICATE), 1); // the one sent again
+  CHECK_EQ(authenticate(&cardData), SCARD_S_SUCCESS);
+  CHECK_EQ(sign(&cardData), SCARD_S_SUCCESS);
+  uint64_t ullSigned = cmd_ticks();
+  CHECK_EQ(sim_reconnects(), 1);
+  // the same card: the identity and the stamps are read, the key stays cached
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 2);
+  CHECK_EQ(sim_metadata_reads(CMD_PIV_SLOT_SIGNATURE), 1);
+  printf("reset mid-sign: %.1f us to fail, %.1f us to a signature\n", (double)cmd_ticks_to_us(ullFailed - ullStart),
+         (double)cmd_ticks_to_us(ullSigned - ullStart));
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_identity_not_read(void) {
+  CARD_DATA cardData;
+
+  // nothing to compare with: the identity after the reset is taken and
+  // VERIFY, sent again, succeeds
+  acquire(&cardData);
+  sim_inject_reset(CMD_PIV_INS_VERIFY);
+  CHECK_EQ(authenticate(&cardData), SCARD_S_SUCCESS);
+  CHECK_EQ(sim_reconnects(), 1);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+  CHECK_EQ(sign(&cardData), SCARD_S_SUCCESS);
+  read_card_id(&cardData);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_other_card(void) {
+  CARD_DATA cardData;
+
+  acquire(&cardData);
+  read_card_id(&cardData);
+  CHECK_EQ(authenticate(&cardData), SCARD_S_SUCCESS);
+  cmd_release_transaction(&cardData);
+
+  // a card with another identity comes back from the reset
+  sim_set_object(CMD_PIV_OBJ_CHUID, OTHER_CHUID, sizeof(OTHER_CHUID));
+  sim_inject_reset(CMD_PIV_INS_GENERAL_AUTHENTICATE);
+  sim_clear_counts();
+  CHECK_EQ(sign(&cardData), SCARD_W_REMOVED_CARD);
+  CHECK_EQ(sim_reconnects(), 1);
+  CHECK_EQ(sim_commands(CMD_PIV_INS_GENERAL_AUTHENTICATE), 0); // not sent to another card
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+int main(void) {
+  test_reset_mid_sign();
+  test_identity_not_read();
+  test_other_card();
+  return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Unit tests of ringlog.c: concurrent writers on a ring small enough to wrap
+ * many times, then decoding what is left, and the reuse of a fixed set of
+ * ring files.
+ */
+
+#include "ringlog.h"
+#include "test.h"
+#include "ticks.h"
+
+#include <string.h>
+
+#define RING_FILE "ringlog-test.ring"
+#define RING_SIZE 65536
+#define THREADS 4
+#define LINES 20000
+#define SLOT_PREFIX "ringlog-test-"
+#define SLOTS 3
+
+static CMD_RINGLOG *g_log;
+
+// Lines of varying length; the record carries the thread as context and
+// the line number as operation, so both can be checked against the text.
+TEST_THREAD_FN(writer, arg) {
+  unsigned thread = (unsigned)(size_t)arg;
+  char text[160];
+
+  for (unsigned i = 0; i < LINES; i++) {
+    int n = snprintf(text, sizeof(text), "thread %u line %u %.*s\n", thread, i, (int)(i % 97),
+                     "................................................................................................."
+                     "...");
+    cmd_ringlog_write(g_log, 2, cmd_ticks(), thread + 1, i, text, (size_t)n);
+  }
+  return 0;
+}
+
+typedef struct {
+  long records;
+  long last_line[THREADS];
+  uint64_t last_ticks[THREADS];
+  int saw_final;
+} SEEN;
+
+static void visit(const CMD_RINGLOG_HEADER *header, const CMD_RINGLOG_RECORD *rec, const char *text, size_t len,
+                  void *arg) {
+  SEEN *seen = (SEEN *)arg;
+  char line[CMD_RINGLOG_MAX_TEXT + 1];
+  unsigned thread, i;
+
+  CHECK_EQ(header->magic, CMD_RINGLOG_MAGIC);
+  CHECK(len <= CMD_RINGLOG_MAX_TEXT);
+  memcpy(line, text, len);
+  line[len] = '\0';
+  seen->records++;
+  if (strcmp(line, "final\n") == 0) {
+    seen->saw_final = 1;
+    return;
+  }
+  if (len == CMD_RINGLOG_MAX_TEXT) {
+    return; // the line that was cut
+  }
+  CHECK(sscanf(line, "thread %u line %u", &thread, &i) == 2);
+  CHECK(thread < THREADS);
+  CHECK_EQ(rec->context, thread + 1);
+  CHECK_EQ(rec->op, i);
+  CHECK_EQ(rec->level, 2);
+  // each thread's lines stay in order, however the writers interleaved
+  CHECK((long)i > seen->last_line[thread]);
+  CHECK(rec->ticks >= seen->last_ticks[thread]);
+  seen->last_line[thread] = (long)i;
+  seen->last_ticks[thread] = rec->ticks;
+}
+
+static void test_concurrent_writers(void) {
+  test_thread_t threads[THREADS];
+  char long_text[2 * CMD_RINGLOG_MAX_TEXT];
+  SEEN seen;
+
+  g_log = cmd_ringlog_open(RING_FILE, RING_SIZE);
+  CHECK(g_log);
+  for (size_t i = 0; i < THREADS; i++) {
+    CHECK(test_thread_start(&threads[i], writer, (void *)i));
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    test_thread_join(threads[i]);
+  }
+  memset(long_text, 'x', sizeof(long_text));
+  cmd_ringlog_write(g_log, 2, cmd_ticks(), 0, 0, long_text, sizeof(long_text));
+  cmd_ringlog_write(g_log, 2, cmd_ticks(), 0, 0, "final\n", 6);
+  cmd_ringlog_close(g_log);
+
+  memset(&seen, 0, sizeof(seen));
+  for (int i = 0; i < THREADS; i++) {
+    seen.last_line[i] = -1;
+  }
+  long records = cmd_ringlog_walk(RING_FILE, visit, &seen);
+  CHECK_EQ(records, seen.records);
+  // the ring wrapped, so only its newest part is left, ending with the
+  // last line written
+  CHECK(records > 100 && records < THREADS * LINES);
+  CHECK(seen.saw_final);
+  // threads that finished early may have been overwritten, not the last one
+  long newest = -1;
+  for (int i = 0; i < THREADS; i++) {
+    newest = seen.last_line[i] > newest ? seen.last_line[i] : newest;
+  }
+  CHECK_EQ(newest, LINES - 1);
+}
+
+static void test_not_a_ring(void) {
+  FILE *f = fopen(RING_FILE, "wb");
+
+  CHECK(f);
+  CHECK(fputs("plain text log\n", f) >= 0);
+  CHECK(fclose(f) == 0);
+  CHECK_EQ(cmd_ringlog_walk(RING_FILE, visit, NULL), -1);
+  CHECK_EQ(cmd_ringlog_walk("no-such-file.ring", visit, NULL), -1);
+}
+
+// A file being logged to is never taken over; the others are reused
+// oldest first, so the directory holds at most SLOTS files.
+static void test_slots(void) {
+  CMD_RINGLOG *logs[SLOTS];
+  char path[64], names[SLOTS][64];
+
+  for (int i = 0; i < SLOTS; i++) {
+    logs[i] = cmd_ringlog_open_slot(SLOT_PREFIX, SLOTS, RING_SIZE, names[i], sizeof(names[i]));
+    CHECK(logs[i]);
+    for (int j = 0; j < i; j++) {
+      CHECK(strcmp(names[i], names[j]) != 0);
+    }
+  }
+  CHECK(cmd_ringlog_open(names[0], RING_SIZE) == NULL);
+  CHECK(cmd_ringlog_open_slot(SLOT_PREFIX, SLOTS, RING_SIZE, path, sizeof(path)) == NULL);
+
+  // the only free slot is taken again, and keeps nothing of its old content
+  cmd_ringlog_write(logs[1], 2, cmd_ticks(), 0, 0, "old\n", 4);
+  cmd_ringlog_close(logs[1]);
+  logs[1] = cmd_ringlog_open_slot(SLOT_PREFIX, SLOTS, RING_SIZE, path, sizeof(path));
+  CHECK(logs[1]);
+  CHECK(strcmp(path, names[1]) == 0);
+  for (int i = 0; i < SLOTS; i++) {
+    cmd_ringlog_close(logs[i]);
+  }
+  CHECK_EQ(cmd_ringlog_walk(names[1], visit, NULL), 0);
+
+  // a slot never written to comes before all others
+  remove(names[2]);
+  CHECK(logs[0] = cmd_ringlog_open_slot(SLOT_PREFIX, SLOTS, RING_SIZE, path, sizeof(path)));
+  CHECK(strcmp(path, names[2]) == 0);
+  cmd_ringlog_close(logs[0]);
+  for (int i = 0; i < SLOTS; i++) {
+    CHECK(remove(names[i]) == 0);
+  }
+}
+
+int main(void) {
+  test_concurrent_writers();
+  test_not_a_ring();
+  test_slots();
+  remove(RING_FILE);
+  return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Unit tests of secmem.c: a pool sized like that of a context runs out at
+ * exactly its slot count, spans and single slots stay apart, released
+ * memory comes back zeroed, and concurrent users never share a slot. Also
+ * reports the cost of an acquire/release pair.
+ */
+
+#include "secmem.h"
+#include "test.h"
+#include "ticks.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "context.h"
+#define SLOTS CMD_SECURE_SLOTS
+#else
+// CMD_SECURE_SLOTS of context.h, which needs the Windows headers
+#define SLOTS 56
+#endif
+
+#define THREADS 8
+
+static int is_zero(const uint8_t *p, size_t len) {
+  uint8_t acc = 0;
+  for (size_t i = 0; i < len; i++) {
+    acc |= p[i];
+  }
+  return acc == 0;
+}
+
+static void test_limits(void) {
+  CHECK(cmd_secmem_create(0) == NULL);
+  CHECK(cmd_secmem_create(CMD_SECMEM_MAX_SLOTS + 1) == NULL);
+
+  CMD_SECMEM *pool = cmd_secmem_create(CMD_SECMEM_MAX_SLOTS);
+  CHECK(pool != NULL);
+  for (int i = 0; i < CMD_SECMEM_MAX_SLOTS; i++) {
+    CHECK(cmd_secmem_acquire(pool) != NULL);
+  }
+  CHECK(cmd_secmem_acquire(pool) == NULL);
+  cmd_secmem_destroy(pool);
+}
+
+static void test_exhaustion(void) {
+  static uint8_t *slots[SLOTS];
+  CMD_SECMEM *pool = cmd_secmem_create(SLOTS);
+
+  CHECK(pool != NULL);
+  for (int i = 0; i < SLOTS; i++) {
+    slots[i] = (uint8_t *)cmd_secmem_acquire(pool);
+    CHECK(slots[i] != NULL);
+    CHECK(is_zero(slots[i], CMD_SECMEM_SLOT_SIZE));
+    // taken bottom up, each its own
+    CHECK(i == 0 || slots[i] == slots[i - 1] + CMD_SECMEM_SLOT_SIZE);
+  }
+  CHECK(cmd_secmem_acquire(pool) == NULL);
+  CHECK(cmd_secmem_acquire_span(pool, 1) == NULL);
+
+  // a slot given back is the one handed out next
+  cmd_secmem_release(pool, slots[SLOTS / 2]);
+  CHECK(cmd_secmem_acquire(pool) == slots[SLOTS / 2]);
+  CHECK(cmd_secmem_acquire(pool) == NULL);
+  cmd_secmem_release(pool, NULL);
+  cmd_secmem_destroy(pool);
+}
+
+static void test_spans(void) {
+  CMD_SECMEM *pool = cmd_secmem_create(SLOTS);
+  CHECK(pool != NULL);
+
+  uint8_t *first = (uint8_t *)cmd_secmem_acquire(pool);
+  uint8_t *top = first + SLOTS * CMD_SECMEM_SLOT_SIZE;
+  CHECK(cmd_secmem_acquire_span(pool, 0) == NULL);
+  CHECK(cmd_secmem_acquire_span(pool, SLOTS * CMD_SECMEM_SLOT_SIZE + 1) == NULL);
+
+  // spans come from the top, a partial slot counting as a whole one
+  uint8_t *a = (uint8_t *)cmd_secmem_acquire_span(pool, 3 * CMD_SECMEM_SLOT_SIZE);
+  uint8_t *b = (uint8_t *)cmd_secmem_acquire_span(pool, 2 * CMD_SECMEM_SLOT_SIZE + 1);
+  CHECK(a == top - 3 * CMD_SECMEM_SLOT_SIZE);
+  CHECK(b == a - 3 * CMD_SECMEM_SLOT_SIZE);
+  CHECK(is_zero(a, 3 * CMD_SECMEM_SLOT_SIZE) && is_zero(b, 3 * CMD_SECMEM_SLOT_SIZE));
+  // single slots keep coming from the bottom meanwhile
+  CHECK(cmd_secmem_acquire(pool) == first + CMD_SECMEM_SLOT_SIZE);
+
+  // SLOTS - 2 - 6 free slots in one run; one more does not fit
+  size_t run = (size_t)(SLOTS - 8) * CMD_SECMEM_SLOT_SIZE;
+  CHECK(cmd_secmem_acquire_span(pool, run + 1) == NULL);
+  uint8_t *c = (uint8_t *)cmd_secmem_acquire_span(pool, run);
+  CHECK(c == first + 2 * CMD_SECMEM_SLOT_SIZE);
+  CHECK(cmd_secmem_acquire(pool) == NULL);
+
+  // released in reverse order, the whole run is available again
+  cmd_secmem_release_span(pool, c, run);
+  cmd_secmem_release_span(pool, b, 2 * CMD_SECMEM_SLOT_SIZE + 1);
+  cmd_secmem_release_span(pool, a, 3 * CMD_SECMEM_SLOT_SIZE);
+  cmd_secmem_release_span(pool, NULL, 1);
+  CHECK(cmd_secmem_acquire_span(pool, (size_t)(SLOTS - 2) * CMD_SECMEM_SLOT_SIZE) ==
+        first + 2 * CMD_SECMEM_SLOT_SIZE);
+  cmd_secmem_destroy(pool);
+}
+
+static void test_wipe(void) {
+  CMD_SECMEM *pool = cmd_secmem_create(SLOTS);
+  CHECK(pool != NULL);
+
+  uint8_t *slot = (uint8_t *)cmd_secmem_acquire(pool);
+  memset(slot, 0xA5, CMD_SECMEM_SLOT_SIZE);
+  cmd_secmem_release(pool, slot);
+  // released memory is wiped at once, not when it is handed out again
+  CHECK(is_zero(slot, CMD_SECMEM_SLOT_SIZE));
+  CHECK(cmd_secmem_acquire(pool) == slot);
+
+  // a span is wiped whole, including the tail of its last slot
+  size_t len = 2 * CMD_SECMEM_SLOT_SIZE + 10;
+  uint8_t *span = (uint8_t *)cmd_secmem_acquire_span(pool, len);
+  memset(span, 0x5A, 3 * CMD_SECMEM_SLOT_SIZE);
+  cmd_secmem_release_span(pool, span, len);
+  CHECK(is_zero(span, 3 * CMD_SECMEM_SLOT_SIZE));
+
+  uint8_t buf[100];
+  memset(buf, 0xFF, sizeof(buf));
+  cmd_secmem_wipe(buf, sizeof(buf));
+  CHECK(is_zero(buf, sizeof(buf)));
+  cmd_secmem_destroy(pool);
+}
+
+static CMD_SECMEM *g_pool;
+
+// Fills what it takes with its own byte and checks nobody else wrote to it.
+TEST_THREAD_FN(user, arg) {
+  uint8_t mark = (uint8_t)(uintptr_t)arg;
+
+  for (int i = 0; i < 20000; i++) {
+    size_t len = i % 4 == 0 ? 4 * CMD_SECMEM_SLOT_SIZE : CMD_SECMEM_SLOT_SIZE;
+    uint8_t *p = (uint8_t *)(len == CMD_SECMEM_SLOT_SIZE ? cmd_secmem_acquire(g_pool)
+                                                            : cmd_secmem_acquire_span(g_pool, len));
+    if (!p) {
+      continue; // spans may not fit while other threads hold slots
+    }
+    CHECK(is_zero(p, len));
+    memset(p, mark, len);
+    for (size_t j = 0; j < len; j++) {
+      CHECK_EQ(p[j], mark);
+    }
+    cmd_secmem_release_span(g_pool, p, len);
+  }
+  return 0;
+}
+
+static void test_concurrent(void) {
+  test_thread_t threads[THREADS];
+
+  g_pool = cmd_secmem_create(SLOTS);
+  CHECK(g_pool != NULL);
+  for (uintptr_t i = 0; i < THREADS; i++) {
+    CHECK(test_thread_start(&threads[i], user, (void *)(i + 1)));
+  }
+  for (int i = 0; i < THREADS; i++) {
+    test_thread_join(threads[i]);
+  }
+  // everything came back
+  CHECK(cmd_secmem_acquire_span(g_pool, SLOTS * CMD_SECMEM_SLOT_SIZE) != NULL);
+  cmd_secmem_destroy(g_pool);
+}
+
+static void bench(void) {
+  const int rounds = 200000;
+  CMD_SECMEM *pool = cmd_secmem_create(SLOTS);
+  CHECK(pool != NULL);
+
+  uint64_t start = cmd_ticks();
+  for (int i = 0; i < rounds; i++) {
+    cmd_secmem_release(pool, cmd_secmem_acquire(pool));
+  }
+  uint64_t slot_us = cmd_ticks_to_us(cmd_ticks() - start);
+  start = cmd_ticks();
+  for (int i = 0; i < rounds; i++) {
+    cmd_secmem_release_span(pool, cmd_secmem_acquire_span(pool, 2050), 2050);
+  }
+  uint64_t span_us = cmd_ticks_to_us(cmd_ticks() - start);
+  printf("acquire/release: %.1f ns per slot, %.1f ns per 2050-byte span\n", slot_us * 1000.0 / rounds,
+         span_us * 1000.0 / rounds);
+  cmd_secmem_destroy(pool);
+}
+
+int main(void) {
+  test_limits();
+  test_exhaustion();
+  test_spans();
+  test_wipe();
+  test_concurrent();
+  bench();
+  return 0;
+}
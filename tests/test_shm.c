@@ -0,0 +1,153 @@
+/*
+ * Unit tests of shm.c. Every handle maps the section on its own, as the
+ * processes sharing it would; threads with their own handles stand in for
+ * those processes in the concurrency test. A section someone else created
+ * under the name is refused.
+ */
+
+#include "shm.h"
+#include "test.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define THREADS 4
+#define ITERATIONS 20000
+
+static char g_name[64];
+
+static CMD_SHM_KEY make_key(uint8_t index, uint32_t stamp) {
+  CMD_SHM_KEY key;
+
+  memset(&key, 0, sizeof(key));
+  memcpy(key.serial, "\x12\x34\x56\x78", 4);
+  key.serial_len = 4;
+  key.type = 1;
+  key.index = index;
+  key.stamp = stamp;
+  return key;
+}
+
+static void test_put_get(void) {
+  CMD_SHM_CACHE *writer = cmd_shm_open(g_name), *reader = cmd_shm_open(g_name);
+  CMD_SHM_KEY key = make_key(1, 100), other = make_key(1, 101);
+  uint8_t data[CMD_SHM_ENTRY_DATA + 1], out[CMD_SHM_ENTRY_DATA];
+  size_t len = sizeof(out);
+
+  CHECK(writer && reader);
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 7);
+  }
+  CHECK(!cmd_shm_get(reader, &key, out, &len));
+  cmd_shm_put(writer, &key, data, 1000);
+  len = sizeof(out);
+  CHECK(cmd_shm_get(reader, &key, out, &len));
+  CHECK_EQ(len, 1000);
+  CHECK(memcmp(out, data, len) == 0);
+
+  // another content stamp is another entry
+  len = sizeof(out);
+  CHECK(!cmd_shm_get(reader, &other, out, &len));
+  // an entry that does not fit is a miss
+  len = 999;
+  CHECK(!cmd_shm_get(reader, &key, out, &len));
+  // replacing keeps one entry per key
+  cmd_shm_put(writer, &key, data + 1, 10);
+  len = sizeof(out);
+  CHECK(cmd_shm_get(reader, &key, out, &len));
+  CHECK_EQ(len, 10);
+  CHECK(memcmp(out, data + 1, len) == 0);
+  // too large to store at all
+  cmd_shm_put(writer, &other, data, sizeof(data));
+  len = sizeof(out);
+  CHECK(!cmd_shm_get(reader, &other, out, &len));
+
+  cmd_shm_close(reader);
+  cmd_shm_close(writer);
+}
+
+// Entries are filled with a sequence derived from their first byte and key,
+// so a reader can tell a torn copy from a consistent one.
+TEST_THREAD_FN(hammer, arg) {
+  CMD_SHM_CACHE *cache = cmd_shm_open(g_name);
+  uint32_t rng = (uint32_t)(size_t)arg * 2654435761U + 1;
+  static uint8_t buffers[THREADS][2][CMD_SHM_ENTRY_DATA];
+  uint8_t *data = buffers[(size_t)arg][0], *out = buffers[(size_t)arg][1];
+
+  CHECK(cache);
+  for (int i = 0; i < ITERATIONS; i++) {
+    rng = rng * 1103515245U + 12345U;
+    CMD_SHM_KEY key = make_key((uint8_t)((rng >> 8) % 100), 7);
+    if ((rng >> 16) % 4 == 0) {
+      size_t len = 16 + (rng >> 4) % (CMD_SHM_ENTRY_DATA - 16);
+      data[0] = (uint8_t)(rng >> 24);
+      for (size_t k = 1; k < len; k++) {
+        data[k] = (uint8_t)(data[0] + k + key.index);
+      }
+      cmd_shm_put(cache, &key, data, len);
+    } else {
+      size_t len = CMD_SHM_ENTRY_DATA;
+      if (cmd_shm_get(cache, &key, out, &len)) {
+        for (size_t k = 1; k < len; k++) {
+          CHECK_EQ(out[k], (uint8_t)(out[0] + k + key.index));
+        }
+      }
+    }
+  }
+  cmd_shm_close(cache);
+  return 0;
+}
+
+static void test_concurrent(void) {
+  test_thread_t threads[THREADS];
+
+  for (size_t i = 0; i < THREADS; i++) {
+    CHECK(test_thread_start(&threads[i], hammer, (void *)i));
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    test_thread_join(threads[i]);
+  }
+}
+
+#ifndef _WIN32
+// A section of the name that another user created first is not used. Only
+// root can hand one over to another user, so the check needs to run as root.
+static void test_foreign_owner(void) {
+  char name[96], path[128];
+
+  if (getuid() != 0) {
+    return;
+  }
+  snprintf(name, sizeof(name), "%s-foreign", g_name);
+  snprintf(path, sizeof(path), "/%s-%u", name, (unsigned)getuid());
+  int fd = shm_open(path, O_RDWR | O_CREAT, 0666);
+  CHECK(fd >= 0);
+  CHECK(fchown(fd, 65534, 65534) == 0);
+  close(fd);
+  CHECK(cmd_shm_open(name) == NULL);
+  shm_unlink(path);
+}
+#endif
+
+int main(void) {
+#ifdef _WIN32
+  snprintf(g_name, sizeof(g_name), "cmd-test-shm-%lu", (unsigned long)GetCurrentProcessId());
+#else
+  snprintf(g_name, sizeof(g_name), "cmd-test-shm-%ld", (long)getpid());
+#endif
+  test_put_get();
+  test_concurrent();
+#ifndef _WIN32
+  test_foreign_owner();
+  // POSIX sections outlive their last handle
+  char path[96];
+  snprintf(path, sizeof(path), "/%s-%u", g_name, (unsigned)getuid());
+  shm_unlink(path);
+#endif
+  return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Tests of the content stamps against the simulated card: applying new
+ * stamps keeps the public keys of unchanged containers and drops only those
+ * of changed ones, a key changed on the card moves the cardcf container
+ * counter and is the only one read again, and the stamps are read once per
+ * card transaction.
+ */
+
+#include "apdu.h"
+#include "cardmod.h"
+#include "context.h"
+#include "prefetch.h"
+#include "sim_card.h"
+#include "stamps.h"
+#include "test.h"
+#include "ticks.h"
+
+#include <string.h>
+
+// Containers 0, 1, 2 and 4 hold keys, 3 (9E) and the rest are empty.
+static const BYTE SLOTS[] = {CMD_PIV_SLOT_AUTHENTICATION, CMD_PIV_SLOT_SIGNATURE, CMD_PIV_SLOT_KEY_MANAGEMENT,
+                             CMD_PIV_SLOT_CARD_AUTHENTICATION, CMD_PIV_SLOT_RETIRED_FIRST};
+static const uint8_t SEEDS[] = {1, 2, 3, 0, 4};
+
+static void acquire(PCARD_DATA pCardData) {
+  uint8_t chuid[] = {0x34, 0x10, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+                     0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x3E, 0x00};
+
+  // a GUID of its own, so that the public key cache shared between processes
+  // holds nothing for the card from other runs
+  uint64_t ullNow = cmd_ticks();
+  memcpy(chuid + 2 + 8, &ullNow, sizeof(ullNow));
+  sim_reset();
+  sim_set_object(CMD_PIV_OBJ_CHUID, chuid, sizeof(chuid));
+  for (size_t i = 0; i < sizeof(SLOTS); i++) {
+    sim_set_ec_key(SLOTS[i], SEEDS[i]);
+  }
+  sim_card_data(pCardData);
+  CHECK_EQ(CardAcquireContext(pCardData, 0), SCARD_S_SUCCESS);
+  cmd_prefetch_stop(pCardData);
+  cmd_release_transaction(pCardData);
+}
+
+static CARD_CACHE_FILE_FORMAT read_cardcf(PCARD_DATA pCardData) {
+  CARD_CACHE_FILE_FORMAT cardcf;
+  PBYTE pbData;
+  DWORD cbData;
+
+  CHECK_EQ(CardReadFile(pCardData, NULL, szCACHE_FILE, 0, &pbData, &cbData), SCARD_S_SUCCESS);
+  CHECK_EQ(cbData, sizeof(cardcf));
+  memcpy(&cardcf, pbData, sizeof(cardcf));
+  pCardData->pfnCspFree(pbData);
+  return cardcf;
+}
+
+// Check the key CardGetContainerInfo returns against the one on the card.
+static void check_key(PCARD_DATA pCardData, BYTE bContainerIndex, uint8_t seed) {
+  CONTAINER_INFO info;
+  uint8_t point[65];
+
+  memset(&info, 0, sizeof(info));
+  info.dwVersion = CONTAINER_INFO_CURRENT_VERSION;
+  CHECK_EQ(CardGetContainerInfo(pCardData, bContainerIndex, 0, &info), SCARD_S_SUCCESS);
+  PBYTE pbKey = info.pbSigPublicKey ? info.pbSigPublicKey : info.pbKeyExPublicKey;
+  DWORD cbKey = info.pbSigPublicKey ? info.cbSigPublicKey : info.cbKeyExPublicKey;
+  sim_ec_point(seed, point);
+  CHECK_EQ(cbKey, sizeof(BCRYPT_ECCKEY_BLOB) + 64);
+  CHECK(memcmp(pbKey + sizeof(BCRYPT_ECCKEY_BLOB), point + 1, 64) == 0);
+  pCardData->pfnCspFree(pbKey);
+}
+
+static void test_apply(void) {
+  CARD_DATA cardData;
+  CMD_STAMPS stamps;
+
+  acquire(&cardData);
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(&cardData);
+  memset(&stamps, 0, sizeof(stamps));
+  stamps.fValid = TRUE;
+  for (int i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    stamps.rgdwContainers[i] = 0x1000 + i;
+  }
+  stamps.dwFiles = 0x2000;
+  cmd_stamps_apply(&cardData, &stamps);
+  WORD wFirst = pContext->cardcf.wContainersFreshness, wFiles = pContext->cardcf.wFilesFreshness;
+  for (int i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    pContext->rgPubKeys[i].fValid = TRUE;
+    pContext->rgPubKeys[i].wFreshness = wFirst;
+  }
+
+  // the same stamps again move nothing
+  cmd_stamps_apply(&cardData, &stamps);
+  CHECK_EQ(pContext->cardcf.wContainersFreshness, wFirst);
+  CHECK_EQ(pContext->cardcf.wFilesFreshness, wFiles);
+
+  // one changed container: the counter moves, the other keys move with it
+  stamps.rgdwContainers[1]++;
+  cmd_stamps_apply(&cardData, &stamps);
+  WORD wSecond = pContext->cardcf.wContainersFreshness;
+  CHECK(wSecond != wFirst);
+  CHECK_EQ(pContext->cardcf.wFilesFreshness, wFiles);
+  for (int i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    CHECK_EQ(pContext->rgPubKeys[i].wFreshness, i == 1 ? wFirst : wSecond);
+  }
+
+  // unknown stamps leave nothing current
+  memset(&stamps, 0, sizeof(stamps));
+  cmd_stamps_apply(&cardData, &stamps);
+  CHECK(pContext->cardcf.wContainersFreshness != wSecond);
+  CHECK(pContext->cardcf.wFilesFreshness != wFiles);
+  for (int i = 0; i < CMD_PIV_NUM_SLOTS; i++) {
+    CHECK(pContext->rgPubKeys[i].wFreshness != pContext->cardcf.wContainersFreshness);
+  }
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_changed_slot(void) {
+  CARD_DATA cardData;
+
+  acquire(&cardData);
+  CARD_CACHE_FILE_FORMAT before = read_cardcf(&cardData);
+  for (BYTE i = 0; i < sizeof(SLOTS); i++) {
+    if (SEEDS[i]) {
+      check_key(&cardData, i, SEEDS[i]);
+    }
+  }
+
+  // another process regenerates the signature key once the driver lets go
+  cmd_release_transaction(&cardData);
+  sim_set_ec_key(CMD_PIV_SLOT_SIGNATURE, 9);
+  sim_clear_counts();
+  CARD_CACHE_FILE_FORMAT after = read_cardcf(&cardData);
+  CHECK(after.wContainersFreshness != before.wContainersFreshness);
+  CHECK_EQ(after.wFilesFreshness, before.wFilesFreshness);
+  for (BYTE i = 0; i < sizeof(SLOTS); i++) {
+    CHECK_EQ(sim_metadata_reads(SLOTS[i]), 1); // the stamp
+  }
+
+  // only the changed key is read again
+  for (BYTE i = 0; i < sizeof(SLOTS); i++) {
+    if (SEEDS[i]) {
+      check_key(&cardData, i, SLOTS[i] == CMD_PIV_SLOT_SIGNATURE ? 9 : SEEDS[i]);
+    }
+  }
+  for (BYTE i = 0; i < sizeof(SLOTS); i++) {
+    CHECK_EQ(sim_metadata_reads(SLOTS[i]), SLOTS[i] == CMD_PIV_SLOT_SIGNATURE ? 2U : 1U);
+  }
+
+  // nothing changed: the counters stay and no key is read again
+  cmd_release_transaction(&cardData);
+  sim_clear_counts();
+  CARD_CACHE_FILE_FORMAT same = read_cardcf(&cardData);
+  CHECK_EQ(same.wContainersFreshness, after.wContainersFreshness);
+  CHECK_EQ(same.wFilesFreshness, after.wFilesFreshness);
+  for (BYTE i = 0; i < sizeof(SLOTS); i++) {
+    if (SEEDS[i]) {
+      check_key(&cardData, i, SLOTS[i] == CMD_PIV_SLOT_SIGNATURE ? 9 : SEEDS[i]);
+    }
+  }
+  CHECK_EQ(sim_commands(CMD_PIV_INS_GET_METADATA), CMD_PIV_NUM_SLOTS);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+static void test_once_per_transaction(void) {
+  CARD_DATA cardData;
+
+  acquire(&cardData);
+  sim_clear_counts();
+  // within one card transaction nobody else can change the card
+  CHECK_EQ(cmd_begin_transaction(&cardData), SCARD_S_SUCCESS);
+  CARD_CACHE_FILE_FORMAT first = read_cardcf(&cardData);
+  CARD_CACHE_FILE_FORMAT second = read_cardcf(&cardData);
+  cmd_end_transaction(&cardData);
+  CHECK_EQ(first.wContainersFreshness, second.wContainersFreshness);
+  CHECK_EQ(sim_transactions(), 1);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 1);
+  CHECK_EQ(sim_metadata_reads(CMD_PIV_SLOT_AUTHENTICATION), 1);
+
+  // a new transaction reads them again
+  cmd_release_transaction(&cardData);
+  read_cardcf(&cardData);
+  CHECK_EQ(sim_transactions(), 2);
+  CHECK_EQ(sim_object_reads(CMD_PIV_OBJ_CHUID), 2);
+  CHECK_EQ(sim_metadata_reads(CMD_PIV_SLOT_AUTHENTICATION), 2);
+  CHECK_EQ(CardDeleteContext(&cardData), SCARD_S_SUCCESS);
+}
+
+int main(void) {
+  test_apply();
+  test_changed_slot();
+  test_once_per_transaction();
+  return 0;
+}
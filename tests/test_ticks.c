@@ -0,0 +1,58 @@
+/*
+ * Unit tests of ticks.c: monotonic ticks, their conversion to microseconds
+ * (including past the point where ticks * 1000000 overflows), and the
+ * wall clock used to date ring logs.
+ */
+
+#include "test.h"
+#include "ticks.h"
+
+static void test_monotonic(void) {
+  uint64_t last = cmd_ticks();
+
+  for (int i = 0; i < 100000; i++) {
+    uint64_t now = cmd_ticks();
+    CHECK(now >= last);
+    last = now;
+  }
+}
+
+static void test_elapsed(void) {
+  uint64_t start = cmd_ticks();
+
+  test_sleep_ms(50);
+  uint64_t us = cmd_ticks_to_us(cmd_ticks() - start);
+  // sleeps never end early; the upper bound only catches a wrong unit
+  CHECK(us >= 49000);
+  CHECK(us < 5000000);
+}
+
+static void test_to_us(void) {
+  uint64_t freq = cmd_ticks_per_second();
+
+  CHECK(freq >= 1000);
+  CHECK_EQ(cmd_ticks_to_us(0), 0);
+  CHECK_EQ(cmd_ticks_to_us(freq), 1000000);
+  CHECK_EQ(cmd_ticks_to_us(3 * freq), 3000000);
+  // truncated, never rounded up to the next second
+  CHECK_EQ(cmd_ticks_to_us(freq - 1), 1000000 - (1000000 + freq - 1) / freq);
+  // a year of uptime, where ticks * 1000000 no longer fits in 64 bits
+  uint64_t year = 365ULL * 24 * 3600;
+  CHECK_EQ(cmd_ticks_to_us(year * freq), year * 1000000);
+}
+
+static void test_wallclock(void) {
+  int64_t now = cmd_wallclock_us();
+
+  // between 2020 and 2100
+  CHECK(now > 1577836800LL * 1000000);
+  CHECK(now < 4102444800LL * 1000000);
+}
+
+int main(void) {
+  test_monotonic();
+  test_elapsed();
+  test_to_us();
+  test_wallclock();
+  return 0;
+}
@@ -0,0 +1,175 @@
+#define CMD_LOG_SUBSYSTEM CMD_LOG_SUB_TRANSPORT
+
+#include "throughput.h"
+#include "apdu.h"
+#include "context.h"
+#include "logging.h"
+#include "piv.h"
+#include "ticks.h"
+#include "tlv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <winscard.h>
+
+#define MAX_READERS 8
+#define MAX_READER_NAME 128
+#define RUNS_PER_SIZE 5
+// Runs of one size further apart than this, relative to their median, are
+// too noisy to compare sizes by.
+#define MAX_SPREAD 0.5
+
+// Followed by the largest response the profile allows.
+static const DWORD CHUNK_SIZES[] = {CMD_APDU_MAX_SHORT_RESP, 1024};
+
+typedef struct _READER_CHOICE {
+  char szReader[MAX_READER_NAME];
+  const CMD_CARD_PROFILE *pProfile;
+  DWORD cbChunk;
+} READER_CHOICE;
+
+static SRWLOCK g_lock = SRWLOCK_INIT;
+static READER_CHOICE g_rgChoices[MAX_READERS];
+static DWORD g_cChoices;
+
+static BOOL first_chunk(const BYTE *pbResp, DWORD cbResp, void *pvArg) {
+  (void)pbResp;
+  (void)cbResp;
+  (void)pvArg;
+  return TRUE;
+}
+
+static BOOL lookup_choice(const char *szReader, const CMD_CARD_PROFILE *pProfile, DWORD *pcbChunk) {
+  BOOL fFound = FALSE;
+  AcquireSRWLockShared(&g_lock);
+  for (DWORD i = 0; i < g_cChoices; i++) {
+    if (g_rgChoices[i].pProfile == pProfile && strcmp(g_rgChoices[i].szReader, szReader) == 0) {
+      *pcbChunk = g_rgChoices[i].cbChunk;
+      fFound = TRUE;
+      break;
+    }
+  }
+  ReleaseSRWLockShared(&g_lock);
+  return fFound;
+}
+
+static void remember_choice(const char *szReader, const CMD_CARD_PROFILE *pProfile, DWORD cbChunk) {
+  AcquireSRWLockExclusive(&g_lock);
+  if (g_cChoices == MAX_READERS) {
+    // the oldest reader makes room
+    memmove(g_rgChoices, g_rgChoices + 1, sizeof(g_rgChoices) - sizeof(g_rgChoices[0]));
+    g_cChoices--;
+  }
+  DWORD i = g_cChoices++;
+  strcpy_s(g_rgChoices[i].szReader, sizeof(g_rgChoices[i].szReader), szReader);
+  g_rgChoices[i].pProfile = pProfile;
+  g_rgChoices[i].cbChunk = cbChunk;
+  ReleaseSRWLockExclusive(&g_lock);
+}
+
+static int compare_rates(const void *pvA, const void *pvB) {
+  double a = *(const double *)pvA, b = *(const double *)pvB;
+  return a < b ? -1 : a > b;
+}
+
+// Median bytes per second of RUNS_PER_SIZE round trips of GET DATA with
+// cbChunk, after one more that warms up the reader, or 0 if the reader or the
+// card cannot carry it. *pfNoisy tells whether the runs spread too far.
+static double measure(PCARD_DATA pCardData, DWORD dwObject, DWORD cbChunk, DWORD *pcbReceived, BOOL *pfNoisy) {
+  BYTE cmd[5], rgbResp[CMD_APDU_MAX_EXT_RESP];
+  double rgRates[RUNS_PER_SIZE];
+  uint64_t t0, t1;
+  DWORD cbCmd = 0;
+  WORD sw;
+
+  cmd[cbCmd++] = CMD_PIV_TAG_TAG_LIST;
+  cmd[cbCmd++] = 3;
+  cbCmd += cmd_tlv_put_tag(cmd + cbCmd, dwObject);
+
+  for (int i = -1; i < RUNS_PER_SIZE; i++) {
+    DWORD cbResp = sizeof(rgbResp);
+    t0 = cmd_ticks();
+    DWORD dwRet = cmd_apdu_transmit_sized(pCardData, cbChunk, 0x00, CMD_PIV_INS_GET_DATA, 0x3F, 0xFF, cmd, cbCmd,
+                                          rgbResp, &cbResp, &sw, first_chunk, NULL);
+    t1 = cmd_ticks();
+    if (dwRet != SCARD_S_SUCCESS || sw != CMD_SW_OK || cbResp == 0 || cbResp > cbChunk) {
+      return 0;
+    }
+    if (i >= 0) {
+      rgRates[i] = (double)cbResp * (double)cmd_ticks_per_second() / (double)(t1 - t0 + 1);
+    }
+    *pcbReceived = cbResp;
+  }
+  qsort(rgRates, RUNS_PER_SIZE, sizeof(rgRates[0]), compare_rates);
+  double median = rgRates[RUNS_PER_SIZE / 2];
+  *pfNoisy = rgRates[RUNS_PER_SIZE - 1] - rgRates[0] > median * MAX_SPREAD;
+  return median;
+}
+
+void cmd_throughput_calibrate(PCARD_DATA pCardData, DWORD dwObject) {
+  PCMD_CONTEXT pContext = CMD_CONTEXT_OF(pCardData);
+  const CMD_CARD_PROFILE *pProfile = pContext->pProfile;
+  char szReader[MAX_READER_NAME];
+  DWORD cchReader = sizeof(szReader), dwState, dwProtocol, cbChunk = CMD_APDU_MAX_SHORT_RESP;
+  BYTE rgbAtr[36];
+  DWORD cbAtr = sizeof(rgbAtr);
+  DWORD rgcbSizes[ARRAYSIZE(CHUNK_SIZES) + 1], cSizes = 0;
+  BOOL fNoisy = FALSE, fDefaultWorks = FALSE;
+  double bestRate = 0;
+
+  if (pContext->cbRespChunk != 0) {
+    return;
+  }
+  // short APDUs until proven otherwise
+  pContext->cbRespChunk = CMD_APDU_MAX_SHORT_RESP;
+  if (!pProfile->fExtendedApdu ||
+      SCardStatusA(pCardData->hScard, szReader, &cchReader, &dwState, &dwProtocol, rgbAtr, &cbAtr) !=
+          SCARD_S_SUCCESS) {
+    return;
+  }
+  if (lookup_choice(szReader, pProfile, &pContext->cbRespChunk)) {
+    return;
+  }
+
+  DWORD cbMax = min(pProfile->cbMaxApdu, CMD_APDU_MAX_EXT_RESP);
+  for (DWORD i = 0; i < ARRAYSIZE(CHUNK_SIZES) && CHUNK_SIZES[i] < cbMax; i++) {
+    rgcbSizes[cSizes++] = CHUNK_SIZES[i];
+  }
+  rgcbSizes[cSizes++] = cbMax;
+
+  for (DWORD i = 0; i < cSizes; i++) {
+    DWORD cbReceived = 0;
+    BOOL fSizeNoisy = FALSE;
+    double rate = measure(pCardData, dwObject, rgcbSizes[i], &cbReceived, &fSizeNoisy);
+    CMD_DEBUG("Reader %s moves %.0f B/s with %d byte chunks%s\n", szReader, rate, rgcbSizes[i],
+              fSizeNoisy ? " (noisy)" : "");
+    if (rate == 0 && i == 0) {
+      // the object is missing or empty; try again on the next read
+      pContext->cbRespChunk = 0;
+      return;
+    }
+    if (rate == 0) {
+      break; // larger chunks will not work either
+    }
+    fNoisy |= fSizeNoisy;
+    fDefaultWorks |= rgcbSizes[i] == pProfile->cbRespChunk;
+    // larger chunks must pay off clearly to be worth the reader risk
+    if (rate > bestRate * 1.1) {
+      bestRate = rate;
+      cbChunk = rgcbSizes[i];
+    }
+    if (cbReceived < rgcbSizes[i]) {
+      break; // the object fits, larger chunks cannot be told apart
+    }
+  }
+  if (fNoisy) {
+    // the reader was busy or the timer coarse; trust the profile over the
+    // numbers, as far as the reader was seen to carry it
+    cbChunk = fDefaultWorks ? pProfile->cbRespChunk : CMD_APDU_MAX_SHORT_RESP;
+    CMD_INFO("Timings on reader %s too noisy to compare\n", szReader);
+  }
+  CMD_INFO("Using %d byte response chunks on reader %s\n", cbChunk, szReader);
+  pContext->cbRespChunk = cbChunk;
+  remember_choice(szReader, pProfile, cbChunk);
+}
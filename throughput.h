@@ -0,0 +1,20 @@
+#pragma once
+#ifndef __THROUGHPUT__H__
+#define __THROUGHPUT__H__
+
+#include "cardmod.h"
+
+// Readers differ in how well they carry large APDUs. On first use of a
+// reader, time several response round trips of a GET DATA at each chunk size
+// up to the largest response the card profile allows, and read objects with
+// the one moving the most bytes per second from then on. When the runs of a
+// size spread too far to compare, the profile's default chunk is used
+// instead. The choice is remembered per reader name for the life of the
+// process.
+//
+// Must be called inside a card transaction with the PIV application selected;
+// dwObject should be a large object, such as a certificate. Failures leave
+// the context at short APDUs.
+void cmd_throughput_calibrate(PCARD_DATA pCardData, DWORD dwObject);
+
+#endif // __THROUGHPUT__H__
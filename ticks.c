@@ -0,0 +1,56 @@
+#include "ticks.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t cmd_ticks(void) {
+#ifdef _WIN32
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)counter.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t cmd_ticks_per_second(void) {
+#ifdef _WIN32
+  // fixed at boot, so a racing first call stores the same value
+  static uint64_t freq;
+  if (freq == 0) {
+    LARGE_INTEGER li;
+    QueryPerformanceFrequency(&li);
+    freq = (uint64_t)li.QuadPart;
+  }
+  return freq;
+#else
+  return 1000000000;
+#endif
+}
+
+uint64_t cmd_ticks_to_us(uint64_t ticks) {
+  uint64_t freq = cmd_ticks_per_second();
+  // split to avoid overflowing ticks * 1000000 after a few days of uptime
+  return ticks / freq * 1000000 + ticks % freq * 1000000 / freq;
+}
+
+int64_t cmd_wallclock_us(void) {
+#ifdef _WIN32
+  FILETIME ft;
+  ULARGE_INTEGER li;
+  GetSystemTimePreciseAsFileTime(&ft);
+  li.u.LowPart = ft.dwLowDateTime;
+  li.u.HighPart = ft.dwHighDateTime;
+  // 100 ns units since 1601-01-01
+  return (int64_t)(li.QuadPart / 10) - 11644473600LL * 1000000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef __TICKS__H__
+#define __TICKS__H__
+
+/*
+ * Raw monotonic timestamps for log records and measurements. Reading one is
+ * a single QueryPerformanceCounter (clock_gettime on Linux); conversion to
+ * time units or wall-clock time is left to whoever prints it. Like pool.c,
+ * this file builds on Linux as well.
+ */
+
+#include <stdint.h>
+
+// Monotonic ticks, comparable within the machine until the next boot.
+uint64_t cmd_ticks(void);
+uint64_t cmd_ticks_per_second(void);
+uint64_t cmd_ticks_to_us(uint64_t ticks);
+// Wall-clock time in microseconds since the Unix epoch (UTC), for pairing
+// with cmd_ticks once, not for every record.
+int64_t cmd_wallclock_us(void);
+
+#endif // __TICKS__H__
@@ -0,0 +1,100 @@
+#include "tlv.h"
+
+DWORD cmd_tlv_parse_header(const BYTE *pb, DWORD cb, DWORD *pdwTag, DWORD *pcbValue) {
+  DWORD pos = 0, tag, len;
+
+  if (cb < 2) {
+    return 0;
+  }
+
+  // tag: multi-byte form when the low five bits are all set
+  tag = pb[pos++];
+  if ((tag & 0x1F) == 0x1F) {
+    do {
+      if (pos >= cb || pos > 3) {
+        return 0;
+      }
+      tag = (tag << 8) | pb[pos];
+    } while (pb[pos++] & 0x80);
+  }
+
+  // length: short form or 0x81/0x82 long form
+  if (pos >= cb) {
+    return 0;
+  }
+  len = pb[pos++];
+  if (len == 0x81 || len == 0x82) {
+    DWORD n = len & 0x7F;
+    if (pos + n > cb) {
+      return 0;
+    }
+    len = 0;
+    while (n--) {
+      len = (len << 8) | pb[pos++];
+    }
+  } else if (len >= 0x80) {
+    return 0;
+  }
+
+  *pdwTag = tag;
+  *pcbValue = len;
+  return pos;
+}
+
+DWORD cmd_tlv_parse(const BYTE *pb, DWORD cb, DWORD *pdwTag, const BYTE **ppbValue, DWORD *pcbValue) {
+  DWORD len, pos = cmd_tlv_parse_header(pb, cb, pdwTag, &len);
+
+  if (pos == 0 || len > cb - pos) {
+    return 0;
+  }
+  *ppbValue = pb + pos;
+  *pcbValue = len;
+  return pos + len;
+}
+
+BOOL cmd_tlv_find(const BYTE *pb, DWORD cb, DWORD dwTag, const BYTE **ppbValue, DWORD *pcbValue) {
+  while (cb > 0) {
+    DWORD tag, len;
+    const BYTE *value;
+    DWORD n = cmd_tlv_parse(pb, cb, &tag, &value, &len);
+    if (n == 0) {
+      return FALSE;
+    }
+    if (tag == dwTag) {
+      *ppbValue = value;
+      *pcbValue = len;
+      return TRUE;
+    }
+    pb += n;
+    cb -= n;
+  }
+  return FALSE;
+}
+
+DWORD cmd_tlv_put_tag(BYTE *pb, DWORD dwTag) {
+  DWORD n = 0;
+  if (dwTag > 0xFFFF) {
+    pb[n++] = (BYTE)(dwTag >> 16);
+  }
+  if (dwTag > 0xFF) {
+    pb[n++] = (BYTE)(dwTag >> 8);
+  }
+  pb[n++] = (BYTE)dwTag;
+  return n;
+}
+
+DWORD cmd_tlv_put_len(BYTE *pb, DWORD cbLen) {
+  if (cbLen < 0x80) {
+    pb[0] = (BYTE)cbLen;
+    return 1;
+  }
+  if (cbLen < 0x100) {
+    pb[0] = 0x81;
+    pb[1] = (BYTE)cbLen;
+    return 2;
+  }
+  pb[0] = 0x82;
+  pb[1] = (BYTE)(cbLen >> 8);
+  pb[2] = (BYTE)cbLen;
+  return 3;
+}
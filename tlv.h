@@ -0,0 +1,29 @@
+#pragma once
+#ifndef __TLV__H__
+#define __TLV__H__
+
+#include <windows.h>
+
+// Minimal BER-TLV helpers for the PIV data objects exchanged with the card.
+// Tags are handled as up to three raw bytes packed big-endian into a DWORD,
+// e.g. 0x7C, 0x5FC105.
+
+// Parse one TLV starting at pb. On success, *pdwTag, *ppbValue and *pcbValue
+// describe the element and the total encoded size is returned; 0 on error.
+DWORD cmd_tlv_parse(const BYTE *pb, DWORD cb, DWORD *pdwTag, const BYTE **ppbValue, DWORD *pcbValue);
+
+// Parse only the tag and length of a TLV whose value may be truncated.
+// Return the header size, or 0 on error.
+DWORD cmd_tlv_parse_header(const BYTE *pb, DWORD cb, DWORD *pdwTag, DWORD *pcbValue);
+
+// Find the first top-level element with the given tag.
+BOOL cmd_tlv_find(const BYTE *pb, DWORD cb, DWORD dwTag, const BYTE **ppbValue, DWORD *pcbValue);
+
+// Encode tag and length headers. Return the number of bytes written to pb.
+DWORD cmd_tlv_put_tag(BYTE *pb, DWORD dwTag);
+DWORD cmd_tlv_put_len(BYTE *pb, DWORD cbLen);
+
+// Size of the encoded length field for cbLen.
+#define CMD_TLV_LEN_SIZE(cbLen) ((cbLen) < 0x80 ? 1 : (cbLen) < 0x100 ? 2 : 3)
+
+#endif // __TLV__H__
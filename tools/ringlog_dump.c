@@ -0,0 +1,149 @@
+/*
+ * Print ring log files written by the driver, oldest line first.
+ *
+ *   ringlog_dump [-s] [-o op] canokey_minidriver_0.ring [...]
+ *
+ *   -s     split the log into one timeline per operation, each line with
+ *          its offset from the first line of the operation
+ *   -o op  only print the lines of operation op
+ *
+ * Every line carries [context:operation], the correlation IDs of the call
+ * that logged it (see corr.h). Builds on Windows with -DCMD_BUILD_TOOLS=ON,
+ * or anywhere with
+ *   cc -I.. ringlog_dump.c ../ringlog.c ../ticks.c
+ */
+
+#include "ringlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint64_t ticks;
+  uint32_t context;
+  uint32_t op;
+  long seq; // keeps the order of the file within an operation
+  char *text;
+  size_t len;
+} LINE;
+
+typedef struct {
+  CMD_RINGLOG_HEADER header;
+  LINE *lines;
+  long count;
+  long cap;
+  int failed;
+} LINES;
+
+static void collect(const CMD_RINGLOG_HEADER *header, const CMD_RINGLOG_RECORD *rec, const char *text, size_t len,
+                    void *arg) {
+  LINES *all = (LINES *)arg;
+
+  all->header = *header;
+  if (all->count == all->cap) {
+    long cap = all->cap ? 2 * all->cap : 1024;
+    LINE *lines = (LINE *)realloc(all->lines, (size_t)cap * sizeof(LINE));
+    if (!lines) {
+      all->failed = 1;
+      return;
+    }
+    all->lines = lines;
+    all->cap = cap;
+  }
+  LINE *line = &all->lines[all->count];
+  line->text = (char *)malloc(len ? len : 1);
+  if (!line->text) {
+    all->failed = 1;
+    return;
+  }
+  memcpy(line->text, text, len);
+  line->ticks = rec->ticks;
+  line->context = rec->context;
+  line->op = rec->op;
+  line->seq = all->count++;
+  line->len = len;
+}
+
+static int by_op(const void *a, const void *b) {
+  const LINE *x = (const LINE *)a, *y = (const LINE *)b;
+  if (x->op != y->op) {
+    return x->op < y->op ? -1 : 1;
+  }
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void print_line(const LINES *all, const LINE *line, const LINE *first) {
+  cmd_ringlog_print_time(&all->header, line->ticks, stdout);
+  if (first) {
+    uint64_t us = cmd_ringlog_unix_us(&all->header, line->ticks) - cmd_ringlog_unix_us(&all->header, first->ticks);
+    printf(" +%llu.%03llu ms", (unsigned long long)(us / 1000), (unsigned long long)(us % 1000));
+  }
+  printf(" [%u:%u] - ", (unsigned)line->context, (unsigned)line->op);
+  fwrite(line->text, 1, line->len, stdout);
+}
+
+// Operations are numbered in the order they started, so sorting by ID keeps
+// the timelines in order too. Operation 0 holds what was logged outside of
+// any call.
+static int dump(const char *path, int split, int filter, uint32_t op) {
+  LINES all = {0};
+  const LINE *first = NULL;
+  int ret = 0;
+
+  if (cmd_ringlog_walk(path, collect, &all) < 0) {
+    fprintf(stderr, "%s: not a ring log file\n", path);
+    return 1;
+  }
+  if (all.failed) {
+    fprintf(stderr, "%s: out of memory\n", path);
+    ret = 1;
+  }
+  if (split) {
+    qsort(all.lines, (size_t)all.count, sizeof(LINE), by_op);
+  }
+  for (long i = 0; i < all.count; i++) {
+    const LINE *line = &all.lines[i];
+    if (filter && line->op != op) {
+      continue;
+    }
+    if (split && (!first || first->op != line->op)) {
+      printf("%s== operation %u of context %u ==\n", first ? "\n" : "", (unsigned)line->op,
+             (unsigned)line->context);
+      first = line;
+    }
+    print_line(&all, line, first);
+  }
+  for (long i = 0; i < all.count; i++) {
+    free(all.lines[i].text);
+  }
+  free(all.lines);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  int split = 0, filter = 0, ret = 0, i;
+  uint32_t op = 0;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      split = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      filter = 1;
+      op = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if (i >= argc || argv[i][0] == '-') {
+    fprintf(stderr, "usage: %s [-s] [-o op] file.ring [...]\n", argv[0]);
+    return 2;
+  }
+  for (int files = argc - i; i < argc; i++) {
+    if (files > 1) {
+      printf("==> %s <==\n", argv[i]);
+    }
+    ret |= dump(argv[i], split, filter, op);
+  }
+  return ret;
+}